@@ -17,6 +17,8 @@
 #include <digestgenerator.h>
 #include <env.h>
 #include <fileutils.h>
+#include <pathcanonicalizer.h>
+#include <pathprefixmatcher.h>
 #include <reccdefaults.h>
 #include <threadutils.h>
 
@@ -25,7 +27,7 @@
 #include <buildboxcommonmetrics_metricguard.h>
 
 #include <set>
-#include <thread>
+#include <vector>
 
 #define TIMER_NAME_COMPILER_DEPS "recc.compiler_deps"
 #define TIMER_NAME_BUILD_MERKLE_TREE "recc.build_merkle_tree"
@@ -33,9 +35,6 @@
 namespace BloombergLP {
 namespace recc {
 
-std::mutex ContainerWriteMutex;
-std::mutex LogWriteMutex;
-
 proto::Command ActionBuilder::populateCommandProto(
     const std::vector<std::string> &command,
     const std::set<std::string> &outputFiles,
@@ -101,6 +100,14 @@ ActionBuilder::commonAncestorPath(const DependencyPairs &dependencies,
                                  FileUtils::parentDirectoryLevels(dep.second));
     }
 
+    return commonAncestorPath(parentsNeeded, products, workingDirectory);
+}
+
+std::string
+ActionBuilder::commonAncestorPath(int parentsNeeded,
+                                  const std::set<std::string> &products,
+                                  const std::string &workingDirectory)
+{
     for (const auto &product : products) {
         parentsNeeded =
             std::max(parentsNeeded, FileUtils::parentDirectoryLevels(product));
@@ -120,10 +127,20 @@ ActionBuilder::prefixWorkingDirectory(const std::string &workingDirectory,
     return prefix + "/" + workingDirectory;
 }
 
-void addFileToMerkleTreeHelper(const PathRewritePair &dep_paths,
-                               const std::string &cwd,
-                               NestedDirectory *nestedDirectory,
-                               digest_string_umap *digest_to_filecontents)
+namespace {
+
+// A dependency resolved to the file to add to the Merkle tree and its path
+// there, filled in by the worker that reads it.
+struct MerkleTreeEntry {
+    std::string d_merklePath;
+    std::shared_ptr<ReccFile> d_file;
+    bool d_excluded = false;
+};
+
+void resolveMerkleTreeEntry(const PathRewritePair &dep_paths,
+                            const std::string &cwd,
+                            const PathPrefixMatcher &excludedPaths,
+                            MerkleTreeEntry *entry)
 {
     // If this path is relative, prepend the remote cwd to it
     // and normalize it, getting rid of any '../' present
@@ -131,37 +148,24 @@ void addFileToMerkleTreeHelper(const PathRewritePair &dep_paths,
     if (merklePath[0] != '/' && !cwd.empty()) {
         merklePath = cwd + "/" + merklePath;
     }
-    merklePath = buildboxcommon::FileUtils::normalizePath(merklePath.c_str());
+    entry->d_merklePath =
+        buildboxcommon::FileUtils::normalizePath(merklePath.c_str());
 
     // don't include a dependency if it's exclusion is requested
-    if (FileUtils::hasPathPrefixes(merklePath, RECC_DEPS_EXCLUDE_PATHS)) {
-        const std::lock_guard<std::mutex> lock(LogWriteMutex);
-        BUILDBOX_LOG_DEBUG("Skipping \"" << merklePath << "\"");
-        return;
-    }
-
-    std::shared_ptr<ReccFile> file =
-        ReccFileFactory::createFile(dep_paths.first.c_str());
-    if (!file) {
-        const std::lock_guard<std::mutex> lock(LogWriteMutex);
-        BUILDBOX_LOG_DEBUG("Encountered unsupported file \""
-                           << dep_paths.first << "\", skipping...");
+    if (excludedPaths.matches(entry->d_merklePath)) {
+        entry->d_excluded = true;
         return;
     }
 
-    {
-        const std::lock_guard<std::mutex> lock(ContainerWriteMutex);
-        // All necessary merkle path path transformations have already been
-        // applied, don't have nestedDirectory apply any additional ones.
-        nestedDirectory->add(file, merklePath.c_str(), true);
-        (*digest_to_filecontents)[file->getDigest().SerializeAsString()] = file->getFileContents();
-    }
+    entry->d_file = ReccFileFactory::createFile(dep_paths.first.c_str());
 }
 
+} // namespace
+
 void ActionBuilder::buildMerkleTree(DependencyPairs &dependency_paths,
                                     const std::string &cwd,
-                                    NestedDirectory *nestedDirectory,
-                                    digest_string_umap *digest_to_filecontents)
+                                    DirectoryTree *directoryTree,
+                                    digest_string_umap *digest_to_filepaths)
 { // Timed function
     buildboxcommon::buildboxcommonmetrics::MetricGuard<
         buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
@@ -169,16 +173,41 @@ void ActionBuilder::buildMerkleTree(DependencyPairs &dependency_paths,
 
     BUILDBOX_LOG_DEBUG("Building Merkle tree");
 
+    // Reading and hashing the files is done in parallel, with every worker
+    // writing only to the entries of its own dependencies, so that they
+    // don't contend for any lock. The tree is then built from the entries
+    // in a single pass, in the order of `dependency_paths`.
+    std::vector<MerkleTreeEntry> entries(dependency_paths.size());
     std::function<void(DependencyPairs::iterator, DependencyPairs::iterator)>
-        createMerkleTreeFromIterators = [&](DependencyPairs::iterator start,
-                                            DependencyPairs::iterator end) {
+        resolveEntriesFromIterators = [&](DependencyPairs::iterator start,
+                                          DependencyPairs::iterator end) {
             for (; start != end; ++start) {
-                addFileToMerkleTreeHelper(*start, cwd, nestedDirectory,
-                                          digest_to_filecontents);
+                resolveMerkleTreeEntry(
+                    *start, cwd, RECC_DEPS_EXCLUDE_PATHS_MATCHER,
+                    &entries[static_cast<size_t>(start -
+                                                 dependency_paths.begin())]);
             }
         };
     ThreadUtils::parallelizeContainerOperations(dependency_paths,
-                                                createMerkleTreeFromIterators);
+                                                resolveEntriesFromIterators);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const MerkleTreeEntry &entry = entries[i];
+        if (entry.d_excluded) {
+            BUILDBOX_LOG_DEBUG("Skipping \"" << entry.d_merklePath << "\"");
+            continue;
+        }
+        if (!entry.d_file) {
+            BUILDBOX_LOG_DEBUG("Encountered unsupported file \""
+                               << dependency_paths[i].first
+                               << "\", skipping...");
+            continue;
+        }
+
+        directoryTree->add(entry.d_file, entry.d_merklePath);
+        (*digest_to_filepaths)[entry.d_file->getDigest()] =
+            entry.d_file->getFilePath();
+    }
 }
 
 void ActionBuilder::getDependencies(const ParsedCommand &command,
@@ -214,7 +243,7 @@ void ActionBuilder::getDependencies(const ParsedCommand &command,
 std::shared_ptr<proto::Action>
 ActionBuilder::BuildAction(const ParsedCommand &command,
                            const std::string &cwd, digest_string_umap *blobs,
-                           digest_string_umap *digest_to_filecontents)
+                           digest_string_umap *digest_to_filepaths)
 {
 
     if (!command.is_compiler_command() && !RECC_FORCE_REMOTE) {
@@ -232,16 +261,18 @@ ActionBuilder::BuildAction(const ParsedCommand &command,
     }
 
     std::string commandWorkingDirectory;
+    const bool useDirectoryOverride = !RECC_DEPS_DIRECTORY_OVERRIDE.empty();
     NestedDirectory nestedDirectory;
+    DirectoryTree directoryTree;
 
     std::set<std::string> products = RECC_OUTPUT_FILES_OVERRIDE;
-    if (!RECC_DEPS_DIRECTORY_OVERRIDE.empty()) {
+    if (useDirectoryOverride) {
         BUILDBOX_LOG_DEBUG("Building Merkle tree using directory override");
         // when RECC_DEPS_DIRECTORY_OVERRIDE is set, we will not follow
         // symlinks to help us avoid getting into endless loop
         nestedDirectory =
             make_nesteddirectory(RECC_DEPS_DIRECTORY_OVERRIDE.c_str(),
-                                 digest_to_filecontents, false);
+                                 digest_to_filepaths, false);
         commandWorkingDirectory = RECC_WORKING_DIR_PREFIX;
     }
     else {
@@ -261,37 +292,48 @@ ActionBuilder::BuildAction(const ParsedCommand &command,
         // Go through all the dependencies and apply any required path
         // transformations, constructing DependencyParis
         // corresponding to filesystem path -> transformed merkle tree path
+        PathCanonicalizer canonicalizer(cwd, RECC_PREFIX_REPLACEMENT,
+                                        RECC_PROJECT_ROOT);
         DependencyPairs dep_path_pairs;
+        dep_path_pairs.reserve(deps.size());
+        int parentsNeeded = 0;
         for (const auto &dep : deps) {
-            std::string modifiedDep(dep);
-            if (modifiedDep[0] == '/') {
-                modifiedDep = FileUtils::resolvePathFromPrefixMap(modifiedDep);
-                if (FileUtils::hasPathPrefix(modifiedDep, RECC_PROJECT_ROOT)) {
-                    modifiedDep = buildboxcommon::FileUtils::makePathRelative(
-                        modifiedDep, cwd);
-                }
+            CanonicalPath modifiedDep = canonicalizer.canonicalize(dep);
+            if (dep[0] == '/') {
                 BUILDBOX_LOG_DEBUG("Mapping local path: ["
                                    << dep << "] to remote path: ["
-                                   << modifiedDep << "]");
+                                   << modifiedDep.d_path << "]");
             }
-            dep_path_pairs.push_back(std::make_pair(dep, modifiedDep));
+            parentsNeeded =
+                std::max(parentsNeeded, modifiedDep.d_parentLevels);
+            dep_path_pairs.emplace_back(dep, std::move(modifiedDep.d_path));
         }
+        BUILDBOX_LOG_DEBUG("Mapped " << deps.size() << " dependencies in "
+                                     << canonicalizer.directoriesProcessed()
+                                     << " directories");
 
         const auto commonAncestor =
-            commonAncestorPath(dep_path_pairs, products, cwd);
+            commonAncestorPath(parentsNeeded, products, cwd);
         commandWorkingDirectory =
             prefixWorkingDirectory(commonAncestor, RECC_WORKING_DIR_PREFIX);
 
         buildMerkleTree(dep_path_pairs, commandWorkingDirectory,
-                        &nestedDirectory, digest_to_filecontents);
+                        &directoryTree, digest_to_filepaths);
     }
 
     if (!commandWorkingDirectory.empty()) {
         commandWorkingDirectory = buildboxcommon::FileUtils::normalizePath(
             commandWorkingDirectory.c_str());
-        // All necessary merkle path path transformations have already been
-        // applied, don't have nestedDirectory apply any additional ones.
-        nestedDirectory.addDirectory(commandWorkingDirectory.c_str(), true);
+        if (useDirectoryOverride) {
+            // All necessary merkle path path transformations have already
+            // been applied, don't have nestedDirectory apply any additional
+            // ones.
+            nestedDirectory.addDirectory(commandWorkingDirectory.c_str(),
+                                         true);
+        }
+        else {
+            directoryTree.addDirectory(commandWorkingDirectory);
+        }
     }
 
     for (const auto &product : products) {
@@ -306,7 +348,9 @@ ActionBuilder::BuildAction(const ParsedCommand &command,
         }
     }
 
-    const auto directoryDigest = nestedDirectory.to_digest(blobs);
+    const auto directoryDigest = useDirectoryOverride
+                                     ? nestedDirectory.to_digest(blobs)
+                                     : directoryTree.to_digest(blobs);
 
     const proto::Command commandProto = generateCommandProto(
         command.get_command(), products, RECC_OUTPUT_DIRECTORIES_OVERRIDE,
@@ -314,7 +358,7 @@ ActionBuilder::BuildAction(const ParsedCommand &command,
     BUILDBOX_LOG_DEBUG("Command: " << commandProto.ShortDebugString());
 
     const auto commandDigest = DigestGenerator::make_digest(commandProto);
-    (*blobs)[commandDigest.SerializeAsString()] = commandProto.SerializeAsString();
+    (*blobs)[commandDigest] = commandProto.SerializeAsString();
 
     proto::Action action;
     action.mutable_command_digest()->CopyFrom(commandDigest);
@@ -25,9 +25,6 @@
 namespace BloombergLP {
 namespace recc {
 
-extern std::mutex ContainerWriteMutex;
-extern std::mutex LogWriteMutex;
-
 // Path to file on disk and it's associated location
 // to be placed in the input root merkle tree
 typedef std::pair<std::string, std::string> PathRewritePair;
@@ -42,13 +39,14 @@ struct ActionBuilder {
      * unrelated to the current working directory, or a command that does not
      * contain either a relative or absolute path to an executable.
      *
-     * `digest_to_filecontents` and `blobs` are used to store parsed input and
-     * output files, which will get uploaded to CAS by the caller.
+     * `blobs` is used to store the serialized `Command` and `Directory`
+     * messages, and `digest_to_filepaths` the paths of the input files, which
+     * will get uploaded to CAS by the caller.
      */
     static std::shared_ptr<proto::Action>
     BuildAction(const ParsedCommand &command, const std::string &cwd,
-                digest_string_umap *digest_to_filecontents,
-                digest_string_umap *blobs);
+                digest_string_umap *blobs,
+                digest_string_umap *digest_to_filepaths);
 
   protected: // for unit testing
     static proto::Command generateCommandProto(
@@ -78,14 +76,14 @@ struct ActionBuilder {
      * Given a vector of filesystem -> Merkle path pairs to dependency and
      * output files, builds a Merkle tree.
      *
-     * Adds the files to `NestedDirectory` and `digest_to_filecontents`.
+     * Adds the files to `directoryTree` and `digest_to_filepaths`.
      *
      * If necessary, modifies the contents of `commandWorkingDirectory`.
      */
     static void buildMerkleTree(DependencyPairs &deps_paths,
                                 const std::string &cwd,
-                                NestedDirectory *nestedDirectory,
-                                digest_string_umap *digest_to_filecontents);
+                                DirectoryTree *directoryTree,
+                                digest_string_umap *digest_to_filepaths);
 
     /**
      * Gathers the `CommandFileInfo` belonging to the given `command` and
@@ -105,6 +103,15 @@ struct ActionBuilder {
                        const std::set<std::string> &products,
                        const std::string &workingDirectory);
 
+    /**
+     * Likewise, given how many levels above `workingDirectory` the
+     * dependencies reach.
+     */
+    static std::string
+    commonAncestorPath(int parentsNeeded,
+                       const std::set<std::string> &products,
+                       const std::string &workingDirectory);
+
     /**
      * If prefix is not empty, prepends it to the working directory path.
      * Otherwise `workingDirectory` is return unmodified.
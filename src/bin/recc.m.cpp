@@ -17,37 +17,22 @@
 // Runs a build command remotely. If the given command is not a build command,
 // it's actually run locally.
 
-#include <actionbuilder.h>
-#include <deps.h>
+#include <commandrunner.h>
 #include <digestgenerator.h>
 #include <env.h>
 #include <fileutils.h>
-#include <grpcchannels.h>
-#include <grpccontext.h>
-#include <metricsconfig.h>
-#include <parsedcommandfactory.h>
+#include <protos.h>
+#include <reccdaemon.h>
 #include <reccdefaults.h>
-#include <remoteexecutionclient.h>
 #include <requestmetadata.h>
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <grpcpp/create_channel.h>
-#include <grpcpp/security/credentials.h>
 #include <iostream>
-#include <sys/stat.h>
 #include <unistd.h>
 
 #include <buildboxcommon_logging.h>
-#include <buildboxcommonmetrics_durationmetrictimer.h>
-#include <buildboxcommonmetrics_durationmetricvalue.h>
-#include <buildboxcommonmetrics_metricguard.h>
-#include <buildboxcommonmetrics_publisherguard.h>
-#include <buildboxcommonmetrics_statsdpublisher.h>
-#include <buildboxcommonmetrics_totaldurationmetricvalue.h>
-
-#define TIMER_NAME_EXECUTE_ACTION "recc.execute_action"
-#define TIMER_NAME_QUERY_ACTION_CACHE "recc.query_action_cache"
 
 using namespace BloombergLP::recc;
 
@@ -125,6 +110,12 @@ const std::string HELP(
     "RECC_DEPS_GLOBAL_PATHS - report all entries returned by the dependency\n"
     "                         command, even if they are absolute paths\n"
     "\n"
+    "RECC_DEPS_SCAN - find the dependencies of GCC and Clang commands by\n"
+    "                 reading the included files instead of running the\n"
+    "                 compiler, which is still run for includes that can\n"
+    "                 only be found by expanding macros (by default,\n"
+    "                 disabled)\n"
+    "\n"
     "RECC_DEPS_OVERRIDE - comma-separated list of files to send to the\n"
     "                     build server (by default, run `deps` to\n"
     "                     determine this)\n"
@@ -176,22 +167,43 @@ const std::string HELP(
     "RECC_MAX_THREADS -   Allow some operations to utilize multiple cores."
     "Default: 4 \n"
     "                     A value of -1 specifies use all available cores.\n"
+    "RECC_FILE_DIGEST_CACHE_DIR - directory for a table of file digests\n"
+    "                             shared between recc processes, so that\n"
+    "                             unchanged files are not hashed again\n"
+    "                             (by default, disabled)\n"
+    "RECC_FILE_DIGEST_CACHE_MAX_ENTRIES - number of entries in that table\n"
+    "                                     when it is created\n"
+    "                                     (default 65536)\n"
+    "RECC_DEPS_CACHE_DIR - directory in which to cache the dependencies\n"
+    "                      reported by the compiler, reused while none of\n"
+    "                      the files it read change (by default, disabled)\n"
+    "RECC_DIRECTORY_SNAPSHOT_DIR - directory in which to keep a snapshot\n"
+    "                              of each RECC_DEPS_DIRECTORY_OVERRIDE\n"
+    "                              tree, so that only what changed is read\n"
+    "                              and hashed again (by default, disabled)\n"
+    "RECC_DAEMON_SOCKET - Unix domain socket of a running reccd. When set\n"
+    "                     in the environment, commands are handed to that\n"
+    "                     daemon, which keeps its connections to the\n"
+    "                     servers open between commands. recc runs them\n"
+    "                     itself if the daemon can't be reached.\n"
+    "                     (by default, disabled)\n"
+    "RECC_DAEMON_WORKERS - number of commands reccd runs at once\n"
+    "                      (default -1, one per core)\n"
+    "RECC_SPECULATIVE_UPLOAD - upload the inputs of an action while the\n"
+    "                          action cache is queried\n"
+    "RECC_MAX_CONCURRENT_BATCH_UPLOADS - number of BatchUpdateBlobs\n"
+    "                          requests sent at once (default 4)\n"
+    "RECC_MAX_CONCURRENT_STREAM_UPLOADS - number of ByteStream writes\n"
+    "                          of large blobs sent at once (default 2)\n"
+    "                          Uploads get a thread each, in addition to\n"
+    "                          RECC_MAX_THREADS\n"
+    "RECC_MAX_UPLOAD_BYTES_IN_FLIGHT - bytes of blob data held by the\n"
+    "                          uploads in progress (default 64 MiB)\n"
     "RECC_REAPI_VERSION - Version of the Remote Execution API to use. "
     "(Default: \"" DEFAULT_RECC_REAPI_VERSION "\")\n"
     "                     Supported values: " +
     proto::reapiSupportedVersionsList());
 
-enum ReturnCode {
-    RC_OK = 0,
-    RC_USAGE = 100,
-    RC_EXEC_FAILURE = 101,
-    RC_INVALID_GRPC_CHANNELS = 102,
-    RC_INVALID_SERVER_CAPABILITIES = 103,
-    RC_EXEC_ACTIONS_FAILURE = 104,
-    RC_SAVING_OUTPUT_FAILURE = 105,
-    RC_METRICS_PUBLISHER_INIT_FAILURE = 106
-};
-
 } // namespace
 
 int exec_locally(char *argv[])
@@ -225,175 +237,29 @@ int main(int argc, char *argv[])
         return RC_OK;
     }
 
+    const char *daemonSocket = getenv("RECC_DAEMON_SOCKET");
+    if (daemonSocket != nullptr && daemonSocket[0] != '\0') {
+        bool runLocally;
+        int exitCode;
+        switch (DaemonClient::run(daemonSocket, &argv[1], &runLocally,
+                                  &exitCode)) {
+            case DaemonClient::REPLIED:
+                return runLocally ? exec_locally(argv) : exitCode;
+            case DaemonClient::FAILED:
+                return RC_DAEMON_FAILURE;
+            case DaemonClient::UNAVAILABLE:
+                break;
+        }
+    }
+
     Env::set_config_locations();
     Env::parse_config_variables();
 
     BUILDBOX_LOG_DEBUG("RECC_REAPI_VERSION == '" << RECC_REAPI_VERSION << "'");
 
-    std::shared_ptr<StatsDPublisherType> statsDPublisher;
-    try {
-        statsDPublisher = get_statsdpublisher_from_config();
-    }
-    catch (const std::runtime_error &e) {
-        BUILDBOX_LOG_ERROR(
-            "Could not initialize statsD publisher: " << e.what());
-        return RC_METRICS_PUBLISHER_INIT_FAILURE;
-    }
-
-    buildboxcommon::buildboxcommonmetrics::PublisherGuard<StatsDPublisherType>
-        statsDPublisherGuard(RECC_ENABLE_METRICS, *statsDPublisher);
-
     const std::string cwd = FileUtils::getCurrentWorkingDirectory();
-    const auto command =
-        ParsedCommandFactory::createParsedCommand(&argv[1], cwd.c_str());
-
-    digest_string_umap blobs;
-    digest_string_umap digest_to_filecontents;
-
-    std::shared_ptr<proto::Action> actionPtr;
-    if (command.is_compiler_command() || RECC_FORCE_REMOTE) {
-        // Trying to build an `Action`:
-        try {
-            actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                   &digest_to_filecontents);
-        }
-        catch (const std::invalid_argument &) {
-            BUILDBOX_LOG_ERROR(
-                "Invalid `argv[0]` value in command: \"" +
-                command.get_command().at(0) +
-                "\". The Remote Execution API requires it to specify "
-                "either a relative or absolute path to an executable.");
-            return RC_EXEC_FAILURE;
-        }
-    }
-    else {
-        BUILDBOX_LOG_INFO("Not a compiler command, so running locally. (Use "
-                          "RECC_FORCE_REMOTE=1 to force remote execution)");
-    }
-
-    // If we don't need to build an `Action` or if the process fails, we defer
-    // to running the command locally:
-    if (!actionPtr) {
-        return exec_locally(argv);
-    }
-
-    const proto::Action action = *actionPtr;
-    const proto::Digest actionDigest = DigestGenerator::make_digest(action);
-
-    BUILDBOX_LOG_DEBUG("Action Digest: " << actionDigest
-                                         << " Action Contents: "
-                                         << action.ShortDebugString());
-
-    // Setting up the gRPC connections:
-    std::unique_ptr<GrpcChannels> returnChannels;
-    try {
-        returnChannels = std::make_unique<GrpcChannels>(
-            GrpcChannels::get_channels_from_config());
-    }
-    catch (const std::runtime_error &e) {
-        BUILDBOX_LOG_ERROR("Invalid argument in channel config: " << e.what());
-        return RC_INVALID_GRPC_CHANNELS;
-    }
-
-    GrpcContext grpcContext;
-    grpcContext.set_action_id(actionDigest.hash_other());
-
-    RemoteExecutionClient client(
-        returnChannels->server(), returnChannels->cas(),
-        returnChannels->action_cache(), RECC_INSTANCE, &grpcContext);
-
-    bool action_in_cache = false;
-    ActionResult result;
-
-    // If allowed, we look in the action cache first:
-    if (!RECC_SKIP_CACHE) {
-        try {
-            { // Timed block
-                buildboxcommon::buildboxcommonmetrics::MetricGuard<
-                    buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
-                    mt(TIMER_NAME_QUERY_ACTION_CACHE);
-
-                action_in_cache = client.fetch_from_action_cache(
-                    actionDigest, command.get_products(), RECC_INSTANCE,
-                    &result);
-                if (action_in_cache) {
-                    BUILDBOX_LOG_INFO("Action Cache hit for [" << actionDigest
-                                                               << "]");
-                }
-            }
-        }
-        catch (const std::exception &e) {
-            BUILDBOX_LOG_ERROR("Error while querying action cache at \""
-                               << RECC_ACTION_CACHE_SERVER
-                               << "\": " << e.what());
-        }
-    }
-
-    // If the results for the action are not cached, we upload the
-    // necessary resources to CAS:
-    if (!action_in_cache) {
-        if (RECC_CACHE_ONLY) {
-            BUILDBOX_LOG_INFO(
-                "Action not cached and running in cache-only mode, "
-                "executing locally");
-            return exec_locally(argv);
-        }
-
-        blobs[actionDigest.SerializeAsString()] = action.SerializeAsString();
-
-        BUILDBOX_LOG_INFO("Executing action remotely... [actionDigest="
-                          << actionDigest << "]");
-
-        BUILDBOX_LOG_DEBUG("Uploading resources...");
-        try {
-            // We are going to make a batch request to the CAS, setting up
-            // the client's max. batch size according to what the server
-            // supports:
-            if (RECC_CAS_GET_CAPABILITIES) {
-                client.setUpFromServerCapabilities();
-            }
-
-            client.upload_resources(blobs, digest_to_filecontents);
-        }
-        catch (const std::exception &e) {
-            BUILDBOX_LOG_ERROR("Error while uploading resources to CAS at \""
-                               << RECC_CAS_SERVER << "\": " << e.what());
-            return RC_INVALID_SERVER_CAPABILITIES;
-        }
-
-        // And call `Execute()`:
-        try {
-            // Timed block
-            buildboxcommon::buildboxcommonmetrics::MetricGuard<
-                buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
-                mt(TIMER_NAME_EXECUTE_ACTION);
-
-            result = client.execute_action(actionDigest, RECC_SKIP_CACHE);
-            BUILDBOX_LOG_INFO("Remote execution finished with exit code "
-                              << result.d_exitCode);
-        }
-        catch (const std::exception &e) {
-            BUILDBOX_LOG_ERROR("Error while calling `Execute()` on \""
-                               << RECC_SERVER << "\": " << e.what());
-            return RC_EXEC_ACTIONS_FAILURE;
-        }
-    }
-
-    const int exitCode = result.d_exitCode;
-    try {
-        /* These don't use logging macros because they are compiler output
-         */
-        std::cout << client.get_outputblob(result.d_stdOut);
-        std::cerr << client.get_outputblob(result.d_stdErr);
-
-        if (!RECC_DONT_SAVE_OUTPUT) {
-            client.write_files_to_disk(result);
-        }
-
-        return exitCode;
-    }
-    catch (const std::exception &e) {
-        BUILDBOX_LOG_ERROR(e.what());
-        return (exitCode == 0 ? RC_SAVING_OUTPUT_FAILURE : exitCode);
-    }
+    CommandRunner runner;
+    bool runLocally;
+    const int exitCode = runner.run(&argv[1], cwd, &runLocally);
+    return runLocally ? exec_locally(argv) : exitCode;
 }
@@ -0,0 +1,80 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// bin/reccd.cpp
+//
+// Runs commands handed over by recc, keeping connections to the servers open
+// between them.
+
+#include <commandrunner.h>
+#include <env.h>
+#include <reccdaemon.h>
+
+#include <buildboxcommon_logging.h>
+
+#include <cstring>
+#include <thread>
+
+using namespace BloombergLP::recc;
+
+const std::string HELP(
+    "USAGE: reccd\n"
+    "\n"
+    "Listens on RECC_DAEMON_SOCKET for commands from recc processes that\n"
+    "have the same variable set, and runs them in the working directory and\n"
+    "environment of each recc. Runs in the foreground until it receives\n"
+    "SIGINT or SIGTERM.\n"
+    "\n"
+    "RECC_DAEMON_WORKERS sets how many commands run at once. The daemon's\n"
+    "own configuration decides RECC_FILE_DIGEST_CACHE_DIR; everything else\n"
+    "is taken from each command's environment and configuration files.");
+
+int main(int argc, char *argv[])
+{
+    buildboxcommon::logging::Logger::getLoggerInstance().initialize(argv[0]);
+
+    if (argc > 1) {
+        BUILDBOX_LOG_WARNING(HELP);
+        return (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)
+                   ? RC_OK
+                   : RC_USAGE;
+    }
+
+    Env::set_config_locations();
+    Env::parse_config_variables();
+
+    if (RECC_DAEMON_SOCKET.empty()) {
+        BUILDBOX_LOG_ERROR("RECC_DAEMON_SOCKET is not set");
+        return RC_USAGE;
+    }
+
+    int workers = RECC_DAEMON_WORKERS;
+    if (workers <= 0) {
+        workers = static_cast<int>(std::thread::hardware_concurrency());
+        if (workers <= 0) {
+            workers = 1;
+        }
+    }
+
+    try {
+        Daemon daemon(RECC_DAEMON_SOCKET, workers);
+        daemon.serve();
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_ERROR("Could not run daemon on \""
+                           << RECC_DAEMON_SOCKET << "\": " << e.what());
+        return RC_EXEC_FAILURE;
+    }
+    return RC_OK;
+}
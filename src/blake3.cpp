@@ -2,8 +2,15 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include <future>
+
 #include "blake3.h"
 #include "blake3_impl.h"
+#include "threadpool.h"
+
+// Subtrees smaller than this are never handed to another thread: below it the
+// cost of queueing a task outweighs the hashing work it would take over.
+#define BLAKE3_MIN_THREADED_SUBTREE_LEN (512 * BLAKE3_CHUNK_LEN)
 
 const char * blake3_version(void) {
   return BLAKE3_VERSION_STRING;
@@ -22,7 +29,9 @@ INLINE void chunk_state_init(blake3_chunk_state *self, const uint32_t key[8],
 INLINE void chunk_state_reset(blake3_chunk_state *self, const uint32_t key[8],
                               uint64_t chunk_counter) {
   memcpy(self->cv, key, BLAKE3_KEY_LEN);
-  self->chunk_counter = 0;
+  // The compression functions always see a zero counter, but the hasher still
+  // uses this one to track its position in the tree across update() calls.
+  self->chunk_counter = chunk_counter;
   self->blocks_compressed = 0;
   memset(self->buf, 0, BLAKE3_BLOCK_LEN);
   self->buf_len = 0;
@@ -263,11 +272,17 @@ INLINE size_t compress_parents_parallel(const uint8_t *child_chaining_values,
 // Why not just have the caller split the input on the first update(), instead
 // of implementing this special rule? Because we don't want to limit SIMD or
 // multi-threading parallelism for that update().
+//
+// `max_threads` is the number of threads this call may occupy, including the
+// calling one. Large enough subtrees split that budget between their two
+// halves and hash the left half on a new thread. The tree shape, and so the
+// result, does not depend on it.
 static size_t blake3_compress_subtree_wide(const uint8_t *input,
                                            size_t input_len,
                                            const uint32_t key[8],
                                            uint64_t chunk_counter,
-                                           uint8_t flags, uint8_t *out) {
+                                           uint8_t flags, uint8_t *out,
+                                           size_t max_threads) {
   // Note that the single chunk case does *not* bump the SIMD degree up to 2
   // when it is 1. If this implementation adds multi-threading in the future,
   // this gives us the option of multi-threading even the 2-chunk case, which
@@ -301,12 +316,31 @@ static size_t blake3_compress_subtree_wide(const uint8_t *input,
   }
   uint8_t *right_cvs = &cv_array[degree * BLAKE3_OUT_LEN];
 
-  // Recurse! If this implementation adds multi-threading support in the
-  // future, this is where it will go.
-  size_t left_n = blake3_compress_subtree_wide(input, left_input_len, key,
-                                               0, flags, cv_array);
-  size_t right_n = blake3_compress_subtree_wide(
-      right_input, right_input_len, key, 0, flags, right_cvs);
+  // Recurse! The left subtree is always a complete power-of-2 number of
+  // chunks, and at least as large as the right one, so it is the half that
+  // is handed to another thread.
+  size_t left_n = 0;
+  size_t right_n = 0;
+  if (max_threads > 1 && left_input_len >= BLAKE3_MIN_THREADED_SUBTREE_LEN) {
+    const size_t left_threads = max_threads / 2;
+    const size_t right_threads = max_threads - left_threads;
+    BloombergLP::recc::ThreadPool &pool =
+        BloombergLP::recc::ThreadPool::instance();
+    std::future<size_t> left = pool.submit([&]() {
+      return blake3_compress_subtree_wide(input, left_input_len, key, 0, flags,
+                                          cv_array, left_threads);
+    });
+    right_n = blake3_compress_subtree_wide(right_input, right_input_len, key,
+                                           0, flags, right_cvs, right_threads);
+    // If no pool thread has picked up the left subtree yet, this hashes it
+    // here.
+    left_n = pool.wait(left);
+  } else {
+    left_n = blake3_compress_subtree_wide(input, left_input_len, key, 0,
+                                          flags, cv_array, 1);
+    right_n = blake3_compress_subtree_wide(right_input, right_input_len, key,
+                                           0, flags, right_cvs, 1);
+  }
 
   // The special case again. If simd_degree=1, then we'll have left_n=1 and
   // right_n=1. Rather than compressing them into a single output, return
@@ -334,14 +368,16 @@ static size_t blake3_compress_subtree_wide(const uint8_t *input,
 // chunk or less. That's a different codepath.
 INLINE void compress_subtree_to_parent_node(
     const uint8_t *input, size_t input_len, const uint32_t key[8],
-    uint64_t chunk_counter, uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN]) {
+    uint64_t chunk_counter, uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN],
+    size_t max_threads) {
 #if defined(BLAKE3_TESTING)
   assert(input_len > BLAKE3_CHUNK_LEN);
 #endif
 
   uint8_t cv_array[MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN];
   size_t num_cvs = blake3_compress_subtree_wide(input, input_len, key,
-                                                0, flags, cv_array);
+                                                0, flags, cv_array,
+                                                max_threads);
 
   // If MAX_SIMD_DEGREE is greater than 2 and there's enough input,
   // compress_subtree_wide() returns more than 2 chaining values. Condense
@@ -448,8 +484,8 @@ INLINE void hasher_push_cv(blake3_hasher *self, uint8_t new_cv[BLAKE3_OUT_LEN],
   self->cv_stack_len += 1;
 }
 
-void blake3_hasher_update(blake3_hasher *self, const void *input,
-                          size_t input_len) {
+static void hasher_update_base(blake3_hasher *self, const void *input,
+                               size_t input_len, size_t max_threads) {
   // Explicitly checking for zero avoids causing UB by passing a null pointer
   // to memcpy. This comes up in practice with things like:
   //   std::vector<uint8_t> v;
@@ -485,8 +521,8 @@ void blake3_hasher_update(blake3_hasher *self, const void *input,
 
   // Now the chunk_state is clear, and we have more input. If there's more than
   // a single chunk (so, definitely not the root chunk), hash the largest whole
-  // subtree we can, with the full benefits of SIMD (and maybe in the future,
-  // multi-threading) parallelism. Two restrictions:
+  // subtree we can, with the full benefits of SIMD and multi-threading
+  // parallelism. Two restrictions:
   // - The subtree has to be a power-of-2 number of chunks. Only subtrees along
   //   the right edge can be incomplete, and we don't know where the right edge
   //   is going to be until we get to finalize().
@@ -535,7 +571,8 @@ void blake3_hasher_update(blake3_hasher *self, const void *input,
       uint8_t cv_pair[2 * BLAKE3_OUT_LEN];
       compress_subtree_to_parent_node(input_bytes, subtree_len, self->key,
                                       0,
-                                      self->chunk.flags, cv_pair);
+                                      self->chunk.flags, cv_pair,
+                                      max_threads);
       hasher_push_cv(self, cv_pair, self->chunk.chunk_counter);
       hasher_push_cv(self, &cv_pair[BLAKE3_OUT_LEN],
                      self->chunk.chunk_counter + (subtree_chunks / 2));
@@ -557,6 +594,16 @@ void blake3_hasher_update(blake3_hasher *self, const void *input,
   }
 }
 
+void blake3_hasher_update(blake3_hasher *self, const void *input,
+                          size_t input_len) {
+  hasher_update_base(self, input, input_len, 1);
+}
+
+void blake3_hasher_update_parallel(blake3_hasher *self, const void *input,
+                                   size_t input_len, size_t max_threads) {
+  hasher_update_base(self, input, input_len, max_threads ? max_threads : 1);
+}
+
 void blake3_hasher_finalize(const blake3_hasher *self, uint8_t *out,
                             size_t out_len) {
   blake3_hasher_finalize_seek(self, 0, out, out_len);
@@ -48,6 +48,10 @@ void blake3_hasher_init_derive_key_raw(blake3_hasher *self, const void *context,
                                        size_t context_len);
 void blake3_hasher_update(blake3_hasher *self, const void *input,
                           size_t input_len);
+// Same result as blake3_hasher_update(), but large inputs are split into
+// subtrees hashed on up to `max_threads` threads (including the caller's).
+void blake3_hasher_update_parallel(blake3_hasher *self, const void *input,
+                                   size_t input_len, size_t max_threads);
 void blake3_hasher_finalize(const blake3_hasher *self, uint8_t *out,
                             size_t out_len);
 void blake3_hasher_finalize_seek(const blake3_hasher *self, uint64_t seek,
@@ -84,81 +84,83 @@ static
     enum cpu_feature
     get_cpu_features() {
 
-  //if (g_cpu_features != UNDEFINED) {
-    //return g_cpu_features;
-  //} else {
-//#if defined(IS_X86)
-    //uint32_t regs[4] = {0};
-    //uint32_t *eax = &regs[0], *ebx = &regs[1], *ecx = &regs[2], *edx = &regs[3];
-    //(void)edx;
-    //enum cpu_feature features = (enum cpu_feature) 0;
-    //cpuid(regs, 0);
-    //const int max_id = *eax;
-    //cpuid(regs, 1);
-//#if defined(__amd64__) || defined(_M_X64)
-    //features |= SSE2;
-//#else
-    //if (*edx & (1UL << 26))
-      //features |= SSE2;
-//#endif
-    //if (*ecx & (1UL << 0))
-      //features |= SSSE3;
-    //if (*ecx & (1UL << 19))
-      //features |= SSE41;
+  if (g_cpu_features != UNDEFINED) {
+    return g_cpu_features;
+  } else {
+#if defined(IS_X86)
+    uint32_t regs[4] = {0};
+    uint32_t *eax = &regs[0], *ebx = &regs[1], *ecx = &regs[2], *edx = &regs[3];
+    (void)edx;
+    // Accumulate into an integer: unlike C, C++ has no implicit conversion
+    // from int back to the enum type.
+    uint32_t features = 0;
+    cpuid(regs, 0);
+    const int max_id = (int)*eax;
+    cpuid(regs, 1);
+#if defined(__amd64__) || defined(_M_X64)
+    features |= SSE2;
+#else
+    if (*edx & (1UL << 26))
+      features |= SSE2;
+#endif
+    if (*ecx & (1UL << 0))
+      features |= SSSE3;
+    if (*ecx & (1UL << 19))
+      features |= SSE41;
 
-    //if (*ecx & (1UL << 27)) { // OSXSAVE
-      //const uint64_t mask = xgetbv();
-      //if ((mask & 6) == 6) { // SSE and AVX states
-        //if (*ecx & (1UL << 28))
-          //features |= AVX;
-        //if (max_id >= 7) {
-          //cpuidex(regs, 7, 0);
-          //if (*ebx & (1UL << 5))
-            //features |= AVX2;
-          //if ((mask & 224) == 224) { // Opmask, ZMM_Hi256, Hi16_Zmm
-            //if (*ebx & (1UL << 31))
-              //features |= AVX512VL;
-            //if (*ebx & (1UL << 16))
-              //features |= AVX512F;
-          //}
-        //}
-      //}
-    //}
-    //g_cpu_features = features;
-    //return features;
-//#else
-    //[> How to detect NEON? <]
-    return UNDEFINED;
-//#endif
-  //}
+    if (*ecx & (1UL << 27)) { // OSXSAVE
+      const uint64_t mask = xgetbv();
+      if ((mask & 6) == 6) { // SSE and AVX states
+        if (*ecx & (1UL << 28))
+          features |= AVX;
+        if (max_id >= 7) {
+          cpuidex(regs, 7, 0);
+          if (*ebx & (1UL << 5))
+            features |= AVX2;
+          if ((mask & 224) == 224) { // Opmask, ZMM_Hi256, Hi16_Zmm
+            if (*ebx & (1UL << 31))
+              features |= AVX512VL;
+            if (*ebx & (1UL << 16))
+              features |= AVX512F;
+          }
+        }
+      }
+    }
+    g_cpu_features = (enum cpu_feature)features;
+    return g_cpu_features;
+#else
+    /* How to detect NEON? */
+    return (enum cpu_feature)0;
+#endif
+  }
 }
 
 void blake3_compress_in_place(uint32_t cv[8],
                               const uint8_t block[BLAKE3_BLOCK_LEN],
                               uint8_t block_len, uint64_t counter,
                               uint8_t flags) {
-//#if defined(IS_X86)
-  //const enum cpu_feature features = get_cpu_features();
-  //MAYBE_UNUSED(features);
-//#if !defined(BLAKE3_NO_AVX512)
-  //if (features & AVX512VL) {
-    //blake3_compress_in_place_avx512(cv, block, block_len, counter, flags);
-    //return;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE41)
-  //if (features & SSE41) {
-    //blake3_compress_in_place_sse41(cv, block, block_len, counter, flags);
-    //return;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE2)
-  //if (features & SSE2) {
-    //blake3_compress_in_place_sse2(cv, block, block_len, counter, flags);
-    //return;
-  //}
-//#endif
-//#endif
+#if defined(IS_X86)
+  const enum cpu_feature features = get_cpu_features();
+  MAYBE_UNUSED(features);
+#if !defined(BLAKE3_NO_AVX512)
+  if (features & AVX512VL) {
+    blake3_compress_in_place_avx512(cv, block, block_len, counter, flags);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE41)
+  if (features & SSE41) {
+    blake3_compress_in_place_sse41(cv, block, block_len, counter, flags);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    blake3_compress_in_place_sse2(cv, block, block_len, counter, flags);
+    return;
+  }
+#endif
+#endif
   blake3_compress_in_place_portable(cv, block, block_len, counter, flags);
 }
 
@@ -166,28 +168,28 @@ void blake3_compress_xof(const uint32_t cv[8],
                          const uint8_t block[BLAKE3_BLOCK_LEN],
                          uint8_t block_len, uint64_t counter, uint8_t flags,
                          uint8_t out[64]) {
-//#if defined(IS_X86)
-  //const enum cpu_feature features = get_cpu_features();
-  //MAYBE_UNUSED(features);
-//#if !defined(BLAKE3_NO_AVX512)
-  //if (features & AVX512VL) {
-    //blake3_compress_xof_avx512(cv, block, block_len, counter, flags, out);
-    //return;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE41)
-  //if (features & SSE41) {
-    //blake3_compress_xof_sse41(cv, block, block_len, counter, flags, out);
-    //return;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE2)
-  //if (features & SSE2) {
-    //blake3_compress_xof_sse2(cv, block, block_len, counter, flags, out);
-    //return;
-  //}
-//#endif
-//#endif
+#if defined(IS_X86)
+  const enum cpu_feature features = get_cpu_features();
+  MAYBE_UNUSED(features);
+#if !defined(BLAKE3_NO_AVX512)
+  if (features & AVX512VL) {
+    blake3_compress_xof_avx512(cv, block, block_len, counter, flags, out);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE41)
+  if (features & SSE41) {
+    blake3_compress_xof_sse41(cv, block, block_len, counter, flags, out);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    blake3_compress_xof_sse2(cv, block, block_len, counter, flags, out);
+    return;
+  }
+#endif
+#endif
   blake3_compress_xof_portable(cv, block, block_len, counter, flags, out);
 }
 
@@ -195,48 +197,48 @@ void blake3_hash_many(const uint8_t *const *inputs, size_t num_inputs,
                       size_t blocks, const uint32_t key[8], uint64_t counter,
                       bool increment_counter, uint8_t flags,
                       uint8_t flags_start, uint8_t flags_end, uint8_t *out) {
-//#if defined(IS_X86)
-  //const enum cpu_feature features = get_cpu_features();
-  //MAYBE_UNUSED(features);
-//#if !defined(BLAKE3_NO_AVX512)
-  //if ((features & (AVX512F|AVX512VL)) == (AVX512F|AVX512VL)) {
-    //blake3_hash_many_avx512(inputs, num_inputs, blocks, key, counter,
-                            //increment_counter, flags, flags_start, flags_end,
-                            //out);
-    //return;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_AVX2)
-  //if (features & AVX2) {
-    //blake3_hash_many_avx2(inputs, num_inputs, blocks, key, counter,
-                          //increment_counter, flags, flags_start, flags_end,
-                          //out);
-    //return;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE41)
-  //if (features & SSE41) {
-    //blake3_hash_many_sse41(inputs, num_inputs, blocks, key, counter,
-                           //increment_counter, flags, flags_start, flags_end,
-                           //out);
-    //return;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE2)
-  //if (features & SSE2) {
-    //blake3_hash_many_sse2(inputs, num_inputs, blocks, key, counter,
-                          //increment_counter, flags, flags_start, flags_end,
-                          //out);
-    //return;
-  //}
-//#endif
-//#endif
+#if defined(IS_X86)
+  const enum cpu_feature features = get_cpu_features();
+  MAYBE_UNUSED(features);
+#if !defined(BLAKE3_NO_AVX512)
+  if ((features & (AVX512F|AVX512VL)) == (AVX512F|AVX512VL)) {
+    blake3_hash_many_avx512(inputs, num_inputs, blocks, key, counter,
+                            increment_counter, flags, flags_start, flags_end,
+                            out);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_AVX2)
+  if (features & AVX2) {
+    blake3_hash_many_avx2(inputs, num_inputs, blocks, key, counter,
+                          increment_counter, flags, flags_start, flags_end,
+                          out);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE41)
+  if (features & SSE41) {
+    blake3_hash_many_sse41(inputs, num_inputs, blocks, key, counter,
+                           increment_counter, flags, flags_start, flags_end,
+                           out);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    blake3_hash_many_sse2(inputs, num_inputs, blocks, key, counter,
+                          increment_counter, flags, flags_start, flags_end,
+                          out);
+    return;
+  }
+#endif
+#endif
 
-//#if defined(BLAKE3_USE_NEON)
-  //blake3_hash_many_neon(inputs, num_inputs, blocks, key, counter,
-                        //increment_counter, flags, flags_start, flags_end, out);
-  //return;
-//#endif
+#if defined(BLAKE3_USE_NEON)
+  blake3_hash_many_neon(inputs, num_inputs, blocks, key, counter,
+                        increment_counter, flags, flags_start, flags_end, out);
+  return;
+#endif
 
   blake3_hash_many_portable(inputs, num_inputs, blocks, key, counter,
                             increment_counter, flags, flags_start, flags_end,
@@ -245,32 +247,32 @@ void blake3_hash_many(const uint8_t *const *inputs, size_t num_inputs,
 
 // The dynamically detected SIMD degree of the current platform.
 size_t blake3_simd_degree(void) {
-//#if defined(IS_X86)
-  //const enum cpu_feature features = get_cpu_features();
-  //MAYBE_UNUSED(features);
-//#if !defined(BLAKE3_NO_AVX512)
-  //if ((features & (AVX512F|AVX512VL)) == (AVX512F|AVX512VL)) {
-    //return 16;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_AVX2)
-  //if (features & AVX2) {
-    //return 8;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE41)
-  //if (features & SSE41) {
-    //return 4;
-  //}
-//#endif
-//#if !defined(BLAKE3_NO_SSE2)
-  //if (features & SSE2) {
-    //return 4;
-  //}
-//#endif
-//#endif
-//#if defined(BLAKE3_USE_NEON)
-  //return 4;
-//#endif
+#if defined(IS_X86)
+  const enum cpu_feature features = get_cpu_features();
+  MAYBE_UNUSED(features);
+#if !defined(BLAKE3_NO_AVX512)
+  if ((features & (AVX512F|AVX512VL)) == (AVX512F|AVX512VL)) {
+    return 16;
+  }
+#endif
+#if !defined(BLAKE3_NO_AVX2)
+  if (features & AVX2) {
+    return 8;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE41)
+  if (features & SSE41) {
+    return 4;
+  }
+#endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    return 4;
+  }
+#endif
+#endif
+#if defined(BLAKE3_USE_NEON)
+  return 4;
+#endif
   return 1;
 }
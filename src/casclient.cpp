@@ -14,19 +14,38 @@
 
 #include <casclient.h>
 #include <digestgenerator.h>
+#include <env.h>
 #include <hashtohex.h>
 
+#include <buildboxcommon_fileutils.h>
 #include <buildboxcommon_logging.h>
+#include <buildboxcommonmetrics_countingmetricutil.h>
 #include <buildboxcommonmetrics_durationmetrictimer.h>
 #include <buildboxcommonmetrics_metricguard.h>
 #include <grpcretry.h>
-
+#include <threadpool.h>
+#include <threadutils.h>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <random>
 #include <sstream>
+#include <system_error>
+#include <unistd.h>
 #include <unordered_set>
+#include <vector>
 
 #define TIMER_NAME_FIND_MISSING_BLOBS "recc.find_missing_blobs"
 #define TIMER_NAME_UPLOAD_MISSING_BLOBS "recc.upload_missing_blobs"
+#define COUNTER_NAME_UPLOAD_BATCHES "recc.upload_batches"
 
 namespace BloombergLP {
 namespace recc {
@@ -34,8 +53,56 @@ namespace recc {
 const std::string CASClient::s_guid = generate_guid();
 
 const int CASClient::s_byteStreamChunkSizeBytes = 1 * 1024 * 1024;
+const int CASClient::s_byteStreamMinChunkSizeBytes = 64 * 1024;
+// Leaves room for the rest of the request under gRPC's default limit of
+// 4 MiB per message.
+const int CASClient::s_byteStreamMaxChunkSizeBytes = 3 * 1024 * 1024;
+const int64_t CASClient::s_byteStreamMeasurementBytes = 16 * 1024 * 1024;
 const int CASClient::s_maxTotalBatchSizeBytes = 2 * 1024 * 1024;
 const int CASClient::s_maxMissingBlobsRequestItems = 16384;
+const int CASClient::s_maxMissingBlobsRequestBytes = 2 * 1024 * 1024;
+
+const std::chrono::milliseconds ChunkSizer::s_targetDuration(250);
+
+ChunkSizer::ChunkSizer(int64_t initial, int64_t minimum, int64_t maximum)
+    : d_size(initial), d_minimum(minimum), d_maximum(maximum),
+      d_bytesPerSecond(0)
+{
+}
+
+int64_t ChunkSizer::size() const
+{
+    const std::lock_guard<std::mutex> lock(d_mutex);
+    return d_size;
+}
+
+void ChunkSizer::recordProgress(int64_t bytes,
+                                std::chrono::steady_clock::duration elapsed)
+{
+    const double seconds =
+        std::max(std::chrono::duration<double>(elapsed).count(), 1e-9);
+    const double bytesPerSecond = static_cast<double>(bytes) / seconds;
+
+    const std::lock_guard<std::mutex> lock(d_mutex);
+    d_bytesPerSecond = d_bytesPerSecond > 0
+                           ? (d_bytesPerSecond + bytesPerSecond) / 2
+                           : bytesPerSecond;
+    resize(d_bytesPerSecond *
+           std::chrono::duration<double>(s_targetDuration).count());
+}
+
+void ChunkSizer::recordFailure()
+{
+    const std::lock_guard<std::mutex> lock(d_mutex);
+    d_bytesPerSecond /= 2;
+    resize(static_cast<double>(d_size) / 2);
+}
+
+void ChunkSizer::resize(double size)
+{
+    d_size = std::max(d_minimum, static_cast<int64_t>(std::min(
+                                     size, static_cast<double>(d_maximum))));
+}
 
 CASClient::CASClient(
     std::shared_ptr<proto::ContentAddressableStorage::StubInterface>
@@ -46,7 +113,10 @@ CASClient::CASClient(
     const std::string &instanceName, GrpcContext *grpcContext)
     : d_executionStub(executionStub), d_byteStreamStub(byteStreamStub),
       d_capabilitiesStub(capabilitiesStub), d_instanceName(instanceName),
-      d_grpcContext(grpcContext)
+      d_grpcContext(grpcContext),
+      d_chunkSizer(std::make_shared<ChunkSizer>(
+          s_byteStreamChunkSizeBytes, s_byteStreamMinChunkSizeBytes,
+          s_byteStreamMaxChunkSizeBytes))
 {
 }
 
@@ -55,7 +125,10 @@ CASClient::CASClient(std::shared_ptr<grpc::Channel> channel,
     : d_executionStub(proto::ContentAddressableStorage::NewStub(channel)),
       d_byteStreamStub(google::bytestream::ByteStream::NewStub(channel)),
       d_capabilitiesStub(proto::Capabilities::NewStub(channel)),
-      d_instanceName(instanceName), d_grpcContext(grpcContext)
+      d_instanceName(instanceName), d_grpcContext(grpcContext),
+      d_chunkSizer(std::make_shared<ChunkSizer>(
+          s_byteStreamChunkSizeBytes, s_byteStreamMinChunkSizeBytes,
+          s_byteStreamMaxChunkSizeBytes))
 {
 }
 
@@ -144,6 +217,21 @@ void CASClient::setUpFromServerCapabilities()
         BUILDBOX_LOG_ERROR(error_message);
         throw std::runtime_error(error_message);
     }
+
+    d_serverCapabilitiesKnown = true;
+}
+
+void CASClient::copyServerCapabilities(const CASClient &other)
+{
+    if (other.d_serverCapabilitiesKnown) {
+        d_maxTotalBatchSizeBytes = other.d_maxTotalBatchSizeBytes;
+        d_serverCapabilitiesKnown = true;
+    }
+}
+
+bool CASClient::serverCapabilitiesKnown() const
+{
+    return d_serverCapabilitiesKnown;
 }
 
 proto::ServerCapabilities CASClient::fetchServerCapabilities() const
@@ -162,17 +250,6 @@ proto::ServerCapabilities CASClient::fetchServerCapabilities() const
     return serverCapabilities;
 }
 
-//std::string hashToHex(const unsigned char *hash_buffer, unsigned int hash_size)
-//{
-    //std::ostringstream ss;
-    //for (unsigned int i = 0; i < hash_size; i++) {
-        //ss << std::hex << std::setw(2) << std::setfill('0')
-           //<< static_cast<int>(hash_buffer[i]);
-    //}
-    //return ss.str();
-//}
-
-
 std::string CASClient::uploadResourceName(const proto::Digest &digest) const
 {
     std::string resourceName = this->d_instanceName;
@@ -210,50 +287,124 @@ std::string CASClient::downloadResourceName(const proto::Digest &digest) const
 
 void CASClient::upload_blob(const proto::Digest &digest,
                             const std::string &blob) const
+{
+    uploadByteStream(digest, static_cast<int64_t>(blob.size()),
+                     [&blob](int64_t offset, size_t length, std::string *data) {
+                         data->assign(blob, static_cast<size_t>(offset),
+                                      length);
+                     });
+}
+
+void CASClient::uploadByteStream(
+    const proto::Digest &digest, int64_t size,
+    const std::function<void(int64_t, size_t, std::string *)> &readChunk) const
 {
     const auto resourceName = uploadResourceName(digest);
 
+    ChunkSizer &chunkSizer = *d_chunkSizer;
+    bool retrying = false;
+
     google::bytestream::WriteResponse response;
     auto write_lambda = [&](grpc::ClientContext &context) {
         response.Clear();
 
+        // A retry resumes from what the server has committed, which it may
+        // report to be the whole blob if it was the response that got lost.
+        int64_t offset = 0;
+        if (retrying) {
+            chunkSizer.recordFailure();
+
+            google::bytestream::QueryWriteStatusRequest statusRequest;
+            statusRequest.set_resource_name(resourceName);
+            google::bytestream::QueryWriteStatusResponse statusResponse;
+            const auto statusContext = d_grpcContext->new_client_context();
+            const grpc::Status status = d_byteStreamStub->QueryWriteStatus(
+                statusContext.get(), statusRequest, &statusResponse);
+            if (status.ok()) {
+                if (statusResponse.complete()) {
+                    response.set_committed_size(
+                        statusResponse.committed_size());
+                    return grpc::Status::OK;
+                }
+                offset = std::max<int64_t>(
+                    0, std::min(statusResponse.committed_size(), size));
+                BUILDBOX_LOG_DEBUG("Resuming upload of " << resourceName
+                                                         << " from byte "
+                                                         << offset);
+            }
+            else {
+                BUILDBOX_LOG_DEBUG("QueryWriteStatus for "
+                                   << resourceName << " failed, restarting: "
+                                   << status.error_message());
+            }
+        }
+        retrying = true;
+
+        // Progress is measured from here, so that the data gRPC takes in
+        // before the server has seen any of it is averaged over the stream.
+        const auto streamStart = std::chrono::steady_clock::now();
+        const int64_t streamOffset = offset;
+        int64_t nextMeasurement = offset + s_byteStreamMeasurementBytes;
+
         auto writer = d_byteStreamStub->Write(&context, &response);
 
         google::bytestream::WriteRequest initialRequest;
         initialRequest.set_resource_name(resourceName);
-        initialRequest.set_write_offset(0);
+        initialRequest.set_write_offset(offset);
+        initialRequest.set_finish_write(offset >= size);
 
+        // A failure to read the blob abandons the write, which is finished
+        // before the error is passed on.
+        std::exception_ptr readError;
         if (writer->Write(initialRequest)) {
-            for (unsigned int offset = 0; offset < blob.size();
-                 offset += s_byteStreamChunkSizeBytes) {
-                google::bytestream::WriteRequest request;
-
-                size_t bytesToWrite;
-                if ((offset + s_byteStreamChunkSizeBytes) >= blob.size()) {
-                    bytesToWrite = blob.size() - offset;
-                    request.set_finish_write(true);
+            // Reused for every chunk, so that its buffer is only allocated
+            // once.
+            google::bytestream::WriteRequest request;
+            while (offset < size) {
+                const size_t bytesToWrite = static_cast<size_t>(
+                    std::min<int64_t>(chunkSizer.size(), size - offset));
+                request.set_write_offset(offset);
+                request.set_finish_write(
+                    offset + static_cast<int64_t>(bytesToWrite) >= size);
+                try {
+                    readChunk(offset, bytesToWrite, request.mutable_data());
                 }
-                else {
-                    bytesToWrite = s_byteStreamChunkSizeBytes;
-                    request.set_finish_write(false);
+                catch (...) {
+                    readError = std::current_exception();
+                    context.TryCancel();
+                    break;
                 }
-                request.set_write_offset(offset);
-                request.set_data(blob.c_str() + offset, bytesToWrite);
 
                 if (!writer->Write(request)) {
                     break;
                 }
+                offset += static_cast<int64_t>(bytesToWrite);
+                if (offset >= nextMeasurement && offset < size) {
+                    chunkSizer.recordProgress(
+                        offset - streamOffset,
+                        std::chrono::steady_clock::now() - streamStart);
+                    nextMeasurement = offset + s_byteStreamMeasurementBytes;
+                }
             }
         }
 
         writer->WritesDone();
-        return writer->Finish();
+        const grpc::Status status = writer->Finish();
+        // Once the server has answered, everything sent was acknowledged.
+        if (status.ok() && !readError && offset > streamOffset) {
+            chunkSizer.recordProgress(offset - streamOffset,
+                                      std::chrono::steady_clock::now() -
+                                          streamStart);
+        }
+        if (readError) {
+            std::rethrow_exception(readError);
+        }
+        return status;
     };
 
     grpc_retry(write_lambda, d_grpcContext);
 
-    if (response.committed_size() !=
-        static_cast<google::protobuf::int64>(blob.size())) {
+    if (response.committed_size() != size) {
         throw std::runtime_error("ByteStream upload failed.");
     }
 }
@@ -261,7 +412,7 @@ void CASClient::upload_blob(const proto::Digest &digest,
 std::string CASClient::fetch_blob(const proto::Digest &digest) const
 {
     const auto resourceName = downloadResourceName(digest);
-    std::cout << resourceName << std::endl;
+    BUILDBOX_LOG_DEBUG("Reading " << resourceName << " with ByteStream");
 
     std::string result;
 
@@ -297,13 +448,7 @@ proto::FindMissingBlobsResponse CASClient::findMissingBlobs(
         return d_executionStub->FindMissingBlobs(&context, request, &response);
     };
 
-    { // Timed block
-        buildboxcommon::buildboxcommonmetrics::MetricGuard<
-            buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
-            mt(TIMER_NAME_FIND_MISSING_BLOBS);
-
-        grpc_retry(missing_blobs_lambda, d_grpcContext);
-    }
+    grpc_retry(missing_blobs_lambda, d_grpcContext);
 
     BUILDBOX_LOG_DEBUG(
         "Received FindMissingBlobsResponse with a total number of blobs: "
@@ -312,38 +457,55 @@ proto::FindMissingBlobsResponse CASClient::findMissingBlobs(
     return response;
 }
 
-std::unordered_set<std::string> CASClient::findMissingBlobs(
-    const std::unordered_set<std::string> &digests) const
+std::unordered_set<DigestKey> CASClient::findMissingBlobs(
+    const std::unordered_set<DigestKey> &digests) const
 {
-    std::unordered_set<std::string> missingDigests;
-
-    auto digestIter = digests.cbegin();
-    while (digestIter != digests.cend()) {
-        proto::FindMissingBlobsRequest missingBlobsRequest;
-        missingBlobsRequest.set_instance_name(d_instanceName);
-
-        // Filling the request with as many digests as possible...
-        while (missingBlobsRequest.blob_digests_size() <
-                   s_maxMissingBlobsRequestItems &&
-               digestIter != digests.cend()) {
-            proto::Digest d;
-            d.ParseFromString(*digestIter);
-            *missingBlobsRequest.add_blob_digests() = d;
-            ++digestIter;
+    // Timed block
+    buildboxcommon::buildboxcommonmetrics::MetricGuard<
+        buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
+        mt(TIMER_NAME_FIND_MISSING_BLOBS);
+
+    // Split the digests into requests of bounded encoded size, so that they
+    // stay under the message size the server accepts however long the
+    // hashes are, and send them in parallel.
+    const size_t maxRequestBytes = static_cast<size_t>(std::min<int64_t>(
+        s_maxMissingBlobsRequestBytes, d_maxTotalBatchSizeBytes));
+    std::vector<proto::FindMissingBlobsRequest> requests;
+    size_t requestBytes = 0;
+    for (const auto &digest : digests) {
+        proto::Digest d = digest.to_digest();
+        // The digest is a length-delimited field with a one-byte tag.
+        const size_t digestSize = d.ByteSizeLong();
+        const size_t digestBytes =
+            1 +
+            google::protobuf::io::CodedOutputStream::VarintSize64(digestSize) +
+            digestSize;
+
+        if (requests.empty() ||
+            requests.back().blob_digests_size() >=
+                s_maxMissingBlobsRequestItems ||
+            requestBytes + digestBytes > maxRequestBytes) {
+            requests.emplace_back();
+            requests.back().set_instance_name(d_instanceName);
+            requestBytes = requests.back().ByteSizeLong();
         }
+        *requests.back().add_blob_digests() = std::move(d);
+        requestBytes += digestBytes;
+    }
 
+    std::mutex missingDigestsMutex;
+    std::unordered_set<DigestKey> missingDigests;
+    const auto sendRequest = [&](size_t index) {
         const proto::FindMissingBlobsResponse missingBlobsResponse =
-            findMissingBlobs(missingBlobsRequest);
-
-        //missingDigests.insert(
-            //missingBlobsResponse.missing_blob_digests().cbegin(),
-            //missingBlobsResponse.missing_blob_digests().cend());
-        auto missingDigestIter = missingBlobsResponse.missing_blob_digests().cbegin();
-        while (missingDigestIter != missingBlobsResponse.missing_blob_digests().cend()) {
-          missingDigests.insert((*missingDigestIter).SerializeAsString());
-          ++missingDigestIter;
-        }
-    }
+            findMissingBlobs(requests[index]);
+
+        const std::lock_guard<std::mutex> lock(missingDigestsMutex);
+        missingDigests.insert(
+            missingBlobsResponse.missing_blob_digests().cbegin(),
+            missingBlobsResponse.missing_blob_digests().cend());
+    };
+    ThreadPool::instance().parallel(requests.size(), sendRequest,
+                                    ThreadUtils::maxThreads());
 
     return missingDigests;
 }
@@ -358,89 +520,481 @@ proto::BatchUpdateBlobsResponse CASClient::batchUpdateBlobs(
     };
 
     grpc_retry(batch_update_lambda, d_grpcContext);
+    return response;
+}
 
-    for (int j = 0; j < response.responses_size(); ++j) {
-        ensure_ok(response.responses(j).status());
+namespace {
+
+/**
+ * A file whose contents are to be uploaded, which are read straight into the
+ * buffers of the requests that send them rather than into a copy first.
+ */
+class UploadFile {
+  public:
+    explicit UploadFile(const std::string &path)
+        : d_path(path), d_fd(open(path.c_str(), O_RDONLY | O_CLOEXEC))
+    {
+        if (d_fd < 0) {
+            throw std::system_error(errno, std::system_category(),
+                                    "Failed to open \"" + path + "\"");
+        }
     }
 
-    return response;
+    ~UploadFile() { close(d_fd); }
+
+    UploadFile(const UploadFile &) = delete;
+    UploadFile &operator=(const UploadFile &) = delete;
+
+    /**
+     * Replace `data` with the `length` bytes at `offset`.
+     */
+    void read(int64_t offset, size_t length, std::string *data) const
+    {
+        data->resize(length);
+        size_t done = 0;
+        while (done < length) {
+            const ssize_t bytesRead =
+                pread(d_fd, &(*data)[done], length - done,
+                      static_cast<off_t>(offset) + static_cast<off_t>(done));
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(),
+                                        "Failed to read \"" + d_path + "\"");
+            }
+            if (bytesRead == 0) {
+                throw std::runtime_error("\"" + d_path +
+                                         "\" is shorter than its digest, it "
+                                         "changed since it was hashed");
+            }
+            done += static_cast<size_t>(bytesRead);
+        }
+    }
+
+  private:
+    const std::string d_path;
+    const int d_fd;
+};
+
+/**
+ * Bounds the uploads in progress at once: at most `batchLimit` batch
+ * requests and `streamLimit` ByteStream writes, holding no more than
+ * `byteBudget` bytes of blob data between them. A blob larger than the
+ * budget is let through once nothing else is in flight.
+ */
+class UploadWindow {
+  public:
+    enum Kind { BATCH, STREAM };
+
+    UploadWindow(int batchLimit, int streamLimit, int64_t byteBudget)
+        : d_limits{std::max(batchLimit, 1), std::max(streamLimit, 1)},
+          d_inFlight{0, 0}, d_byteBudget(byteBudget), d_bytesInFlight(0)
+    {
+    }
+
+    /**
+     * Block until an upload of `bytes` bytes of the given kind can start.
+     */
+    void acquire(Kind kind, int64_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_released.wait(lock, [&] {
+            return d_inFlight[kind] < d_limits[kind] &&
+                   (d_bytesInFlight == 0 ||
+                    d_bytesInFlight + bytes <= d_byteBudget);
+        });
+        d_inFlight[kind]++;
+        d_bytesInFlight += bytes;
+    }
+
+    void release(Kind kind, int64_t bytes)
+    {
+        {
+            const std::lock_guard<std::mutex> lock(d_mutex);
+            d_inFlight[kind]--;
+            d_bytesInFlight -= bytes;
+        }
+        d_released.notify_all();
+    }
+
+  private:
+    std::mutex d_mutex;
+    std::condition_variable d_released;
+    const int d_limits[2];
+    int d_inFlight[2];
+    const int64_t d_byteBudget;
+    int64_t d_bytesInFlight;
+};
+
+/**
+ * Return the encoded size of a length-delimited field of `length` bytes with
+ * a one-byte tag.
+ */
+int64_t fieldSize(int64_t length)
+{
+    return 1 +
+           static_cast<int64_t>(
+               google::protobuf::io::CodedOutputStream::VarintSize64(
+                   static_cast<uint64_t>(length))) +
+           length;
 }
 
+/**
+ * Return the number of bytes that the blob with `digest` adds to a
+ * BatchUpdateBlobsRequest or, with its status, to a BatchReadBlobsResponse.
+ */
+int64_t batchEntrySize(const proto::Digest &digest, bool withStatus = false)
+{
+    int64_t entrySize =
+        fieldSize(static_cast<int64_t>(digest.ByteSizeLong()));
+    // An empty blob's data is not encoded at all.
+    if (digest.size_bytes() > 0) {
+        entrySize += fieldSize(digest.size_bytes());
+    }
+    // An OK status is an empty message.
+    if (withStatus) {
+        entrySize += fieldSize(0);
+    }
+    return fieldSize(entrySize);
+}
+
+/**
+ * Divide items of the given sizes between as few batches of at most
+ * `capacity` bytes as possible, returning the indices of the items in each.
+ *
+ * This is best-fit decreasing: taking the largest items first, each goes in
+ * the fullest batch that still has room for it.
+ */
+std::vector<std::vector<size_t>> packBatches(const std::vector<int64_t> &sizes,
+                                             int64_t capacity)
+{
+    std::vector<size_t> order(sizes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return sizes[a] > sizes[b];
+    });
+
+    std::vector<std::vector<size_t>> batches;
+    // Batches with room left, by how much.
+    std::multimap<int64_t, size_t> room;
+    for (const size_t item : order) {
+        size_t batch = batches.size();
+        int64_t left = capacity;
+        const auto fit = room.lower_bound(sizes[item]);
+        if (fit != room.end()) {
+            batch = fit->second;
+            left = fit->first;
+            room.erase(fit);
+        }
+        else {
+            batches.emplace_back();
+        }
+
+        batches[batch].push_back(item);
+        left -= sizes[item];
+        if (left > 0) {
+            room.emplace(left, batch);
+        }
+    }
+    return batches;
+}
+
+} // namespace
+
 void CASClient::batchUpdateBlobs(
-    const std::unordered_set<std::string> &digests,
+    const std::unordered_set<DigestKey> &digests,
     const digest_string_umap &blobs,
-    const digest_string_umap &digest_to_filecontents) const
+    const digest_string_umap &digest_to_filepaths) const
 {
-    proto::BatchUpdateBlobsRequest batchUpdateRequest;
-    batchUpdateRequest.set_instance_name(d_instanceName);
     // Timed block
     buildboxcommon::buildboxcommonmetrics::MetricGuard<
         buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
         mt(TIMER_NAME_UPLOAD_MISSING_BLOBS);
 
-    size_t batchSize = 0;
-    for (const auto &digest : digests) {
-        // Finding the data in one of the source maps:
-        std::string blob;
-        if (blobs.count(digest)) {
-            blob = blobs.at(digest);
-        }
-        else if (digest_to_filecontents.count(digest)) {
-            blob = digest_to_filecontents.at(digest);
+    // Failures are collected per blob, so that one bad blob doesn't hide
+    // the others or abandon the uploads already in flight.
+    std::mutex errorsMutex;
+    std::vector<std::string> errors;
+    const auto addError = [&](const proto::Digest &digest,
+                              const std::string &error) {
+        std::ostringstream message;
+        message << digest << ": " << error;
+        const std::lock_guard<std::mutex> lock(errorsMutex);
+        errors.push_back(message.str());
+    };
+
+    UploadWindow window(RECC_MAX_CONCURRENT_BATCH_UPLOADS,
+                        RECC_MAX_CONCURRENT_STREAM_UPLOADS,
+                        RECC_MAX_UPLOAD_BYTES_IN_FLIGHT);
+    // Declared after `window`, so that the uploads are waited for before it
+    // goes away.
+    TaskGroup uploads(&ThreadPool::uploadInstance());
+
+    const auto sendBatch = [&](std::unique_ptr<proto::BatchUpdateBlobsRequest>
+                                   request,
+                               int64_t bytes) {
+        window.acquire(UploadWindow::BATCH, bytes);
+        BUILDBOX_LOG_DEBUG("Sending batch update request with "
+                           << request->requests_size() << " blobs");
+        std::shared_ptr<proto::BatchUpdateBlobsRequest> batch(
+            std::move(request));
+        uploads.submit([&, batch, bytes] {
+            try {
+                const auto response = batchUpdateBlobs(*batch);
+                for (const auto &blobResponse : response.responses()) {
+                    if (blobResponse.status().code() !=
+                        google::rpc::Code::OK) {
+                        addError(blobResponse.digest(),
+                                 blobResponse.status().ShortDebugString());
+                    }
+                }
+            }
+            catch (const std::exception &e) {
+                for (const auto &blobRequest : batch->requests()) {
+                    addError(blobRequest.digest(), e.what());
+                }
+            }
+            window.release(UploadWindow::BATCH, bytes);
+        });
+    };
+
+    // Blobs given in memory are copied once, into the request. Files are
+    // read straight into it.
+    const auto readBlob = [&](const DigestKey &digest, int64_t size,
+                              std::string *data) {
+        const auto blobIter = blobs.find(digest);
+        if (blobIter != blobs.cend()) {
+            data->assign(blobIter->second);
+            return;
         }
-        else {
-            throw std::runtime_error(
-                "CAS server requested non-existent digest");
+        const auto pathIter = digest_to_filepaths.find(digest);
+        if (pathIter != digest_to_filepaths.cend()) {
+            UploadFile(pathIter->second)
+                .read(0, static_cast<size_t>(size), data);
+            return;
         }
+        throw std::runtime_error("CAS server requested non-existent digest");
+    };
 
-        // If the blob is too large to batch we must upload it individually
-        // using the ByteStream API:
-        proto::Digest d;
-        d.ParseFromString(digest);
-        if (d.size_bytes() > s_maxTotalBatchSizeBytes) {
-            upload_blob(d, blob);
+    // Every byte of a batch request counts towards the server's limit,
+    // including the framing of each blob and the instance name.
+    int64_t batchCapacity = d_maxTotalBatchSizeBytes;
+    if (!d_instanceName.empty()) {
+        batchCapacity -=
+            fieldSize(static_cast<int64_t>(d_instanceName.size()));
+    }
+
+    // Once the upload is cancelled, no more blobs are read or sent. Those
+    // already sent fail quickly, as their calls are cancelled too.
+    std::vector<proto::Digest> batchDigests;
+    std::vector<int64_t> batchEntrySizes;
+    for (const auto &digest : digests) {
+        if (d_grpcContext->cancelled()) {
+            break;
+        }
+        const proto::Digest d = digest.to_digest();
+        const int64_t entrySize = batchEntrySize(d);
+        if (entrySize <= batchCapacity) {
+            batchDigests.push_back(d);
+            batchEntrySizes.push_back(entrySize);
             continue;
         }
 
-        if (d.size_bytes() + batchSize > s_maxTotalBatchSizeBytes) {
-            // Batch is full, flushing the request:
-            BUILDBOX_LOG_DEBUG("Sending batch update request");
-            batchUpdateBlobs(batchUpdateRequest);
+        // If the blob is too large to batch we must upload it individually
+        // using the ByteStream API, reading one chunk at a time. Only that
+        // chunk is held in memory, so the largest it can be is what counts
+        // towards the budget:
+        const int64_t chunkBytes =
+            std::min<int64_t>(d.size_bytes(), s_byteStreamMaxChunkSizeBytes);
+        window.acquire(UploadWindow::STREAM, chunkBytes);
+        uploads.submit([&, d, digest, chunkBytes] {
+            try {
+                const auto blobIter = blobs.find(digest);
+                const auto pathIter = digest_to_filepaths.find(digest);
+                if (blobIter != blobs.cend()) {
+                    upload_blob(d, blobIter->second);
+                }
+                else if (pathIter != digest_to_filepaths.cend()) {
+                    const UploadFile file(pathIter->second);
+                    uploadByteStream(d, d.size_bytes(),
+                                     [&file](int64_t offset, size_t length,
+                                             std::string *data) {
+                                         file.read(offset, length, data);
+                                     });
+                }
+                else {
+                    throw std::runtime_error(
+                        "CAS server requested non-existent digest");
+                }
+            }
+            catch (const std::exception &e) {
+                addError(d, e.what());
+            }
+            window.release(UploadWindow::STREAM, chunkBytes);
+        });
+    }
+
+    int64_t batchesSent = 0;
+    for (const auto &batch : packBatches(batchEntrySizes, batchCapacity)) {
+        if (d_grpcContext->cancelled()) {
+            break;
+        }
+        auto batchUpdateRequest =
+            std::make_unique<proto::BatchUpdateBlobsRequest>();
+        batchUpdateRequest->set_instance_name(d_instanceName);
+        int64_t batchBlobBytes = 0;
+        for (const size_t index : batch) {
+            if (d_grpcContext->cancelled()) {
+                break;
+            }
+            const proto::Digest &d = batchDigests[index];
+            proto::BatchUpdateBlobsRequest_Request *updateRequest =
+                batchUpdateRequest->add_requests();
+            try {
+                readBlob(DigestKey(d), d.size_bytes(),
+                         updateRequest->mutable_data());
+            }
+            catch (const std::exception &e) {
+                addError(d, e.what());
+                batchUpdateRequest->mutable_requests()->RemoveLast();
+                continue;
+            }
+            *updateRequest->mutable_digest() = d;
+            batchBlobBytes += d.size_bytes();
+        }
 
-            batchUpdateRequest.clear_requests();
-            batchSize = 0;
+        if (!batchUpdateRequest->requests().empty() &&
+            !d_grpcContext->cancelled()) {
+            sendBatch(std::move(batchUpdateRequest), batchBlobBytes);
+            ++batchesSent;
         }
+    }
+    buildboxcommon::buildboxcommonmetrics::CountingMetricUtil::
+        recordCounterMetric(COUNTER_NAME_UPLOAD_BATCHES, batchesSent);
 
-        proto::BatchUpdateBlobsRequest_Request *updateRequest =
-            batchUpdateRequest.add_requests();
-        *updateRequest->mutable_digest() = d;
-        updateRequest->set_data(blob);
+    uploads.wait();
 
-        batchSize += d.size_bytes();
-        batchSize += static_cast<size_t>(d.hash_other().size());
-        batchSize += static_cast<size_t>(d.hash_blake3zcc().size());
+    if (d_grpcContext->cancelled()) {
+        throw std::runtime_error("gRPC call cancelled");
+    }
+    if (!errors.empty()) {
+        for (const auto &error : errors) {
+            BUILDBOX_LOG_ERROR("Failed to upload " << error);
+        }
+        throw std::runtime_error("Failed to upload " +
+                                 std::to_string(errors.size()) +
+                                 " blob(s), first error: " + errors.front());
     }
+}
 
-    if (!batchUpdateRequest.requests().empty()) {
-        BUILDBOX_LOG_DEBUG("Sending final update request");
-        batchUpdateBlobs(batchUpdateRequest);
+proto::BatchReadBlobsResponse
+CASClient::batchReadBlobs(const proto::BatchReadBlobsRequest &request) const
+{
+    proto::BatchReadBlobsResponse response;
+
+    auto batch_read_lambda = [&](grpc::ClientContext &context) {
+        return d_executionStub->BatchReadBlobs(&context, request, &response);
+    };
+
+    grpc_retry(batch_read_lambda, d_grpcContext);
+    return response;
+}
+
+void CASClient::fetch_blobs(
+    const std::vector<proto::Digest> &digests,
+    const std::function<void(const proto::Digest &, const std::string &)>
+        &onBlob) const
+{
+    std::unordered_set<DigestKey> seen;
+    std::vector<proto::Digest> batchDigests;
+    std::vector<int64_t> batchEntrySizes;
+    std::vector<proto::Digest> streamDigests;
+    for (const auto &digest : digests) {
+        if (!seen.insert(DigestKey(digest)).second) {
+            continue;
+        }
+        // Without the server's batch limit, a batch might be too large for
+        // it, so everything is streamed.
+        const int64_t entrySize = batchEntrySize(digest, true);
+        if (d_serverCapabilitiesKnown &&
+            entrySize <= d_maxTotalBatchSizeBytes) {
+            batchDigests.push_back(digest);
+            batchEntrySizes.push_back(entrySize);
+        }
+        else {
+            streamDigests.push_back(digest);
+        }
     }
+    const auto batches = packBatches(batchEntrySizes, d_maxTotalBatchSizeBytes);
+
+    // Each large blob and each batch is a job, the large blobs first since
+    // they take longest.
+    const auto fetch = [&](size_t job) {
+        if (job < streamDigests.size()) {
+            const proto::Digest &digest = streamDigests[job];
+            onBlob(digest, fetch_blob(digest));
+            return;
+        }
+
+        proto::BatchReadBlobsRequest request;
+        request.set_instance_name(d_instanceName);
+        for (const size_t index : batches[job - streamDigests.size()]) {
+            *request.add_digests() = batchDigests[index];
+        }
+        BUILDBOX_LOG_DEBUG("Sending batch read request with "
+                           << request.digests_size() << " blobs");
+        const auto response = batchReadBlobs(request);
+        if (response.responses_size() != request.digests_size()) {
+            throw std::runtime_error("Expected " +
+                                     std::to_string(request.digests_size()) +
+                                     " blobs in BatchReadBlobsResponse, got " +
+                                     std::to_string(response.responses_size()));
+        }
+        for (const auto &blobResponse : response.responses()) {
+            if (blobResponse.status().code() != google::rpc::Code::OK) {
+                std::ostringstream message;
+                message << "Failed to fetch " << blobResponse.digest() << ": "
+                        << blobResponse.status().ShortDebugString();
+                throw std::runtime_error(message.str());
+            }
+            onBlob(blobResponse.digest(), blobResponse.data());
+        }
+    };
+    ThreadPool::instance().parallel(streamDigests.size() + batches.size(),
+                                    fetch, ThreadUtils::maxThreads());
 }
 
-void CASClient::upload_resources(
+std::unordered_set<DigestKey> CASClient::find_missing_resources(
     const digest_string_umap &blobs,
-    const digest_string_umap &digest_to_filecontents) const
+    const digest_string_umap &digest_to_filepaths) const
 {
-    std::unordered_set<std::string> digestsToUpload;
+    std::unordered_set<DigestKey> digestsToUpload;
     for (const auto &i : blobs) {
         digestsToUpload.insert(i.first);
     }
-    for (const auto &i : digest_to_filecontents) {
+    for (const auto &i : digest_to_filepaths) {
         digestsToUpload.insert(i.first);
     }
 
-    const auto missingDigests = findMissingBlobs(digestsToUpload);
-    batchUpdateBlobs(missingDigests, blobs, digest_to_filecontents);
+    return findMissingBlobs(digestsToUpload);
+}
+
+void CASClient::upload_missing_resources(
+    const std::unordered_set<DigestKey> &missingDigests,
+    const digest_string_umap &blobs,
+    const digest_string_umap &digest_to_filepaths) const
+{
+    batchUpdateBlobs(missingDigests, blobs, digest_to_filepaths);
+}
+
+void CASClient::upload_resources(
+    const digest_string_umap &blobs,
+    const digest_string_umap &digest_to_filepaths) const
+{
+    const auto missingDigests =
+        find_missing_resources(blobs, digest_to_filepaths);
+    upload_missing_resources(missingDigests, blobs, digest_to_filepaths);
 }
 
 } // namespace recc
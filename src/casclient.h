@@ -15,6 +15,7 @@
 #ifndef INCLUDED_CASCLIENT
 #define INCLUDED_CASCLIENT
 
+#include <digestkey.h>
 #include <grpccontext.h>
 #include <grpcpp/channel.h>
 #include <merklize.h>
@@ -22,12 +23,17 @@
 
 #include <google/bytestream/bytestream.grpc.pb.h>
 
+#include <chrono>
 #include <cstdint>
 #include <exception>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace BloombergLP {
 namespace recc {
@@ -53,6 +59,48 @@ class PreconditionFail : public std::exception {
     }
 };
 
+/**
+ * Sizes the chunks of the ByteStream writes on a channel so that each takes
+ * about `s_targetDuration` at the throughput the channel has shown: large
+ * chunks on fast links, to keep the cost per message low, and small ones on
+ * slow links, so that a stream keeps making progress that the server can
+ * commit.
+ *
+ * Throughput is measured over whole streams rather than single writes,
+ * since gRPC returns from a write as soon as the chunk fits in its
+ * flow-control window. Safe to share between the concurrent writes of a
+ * channel, so that it learns across blobs.
+ */
+class ChunkSizer {
+  public:
+    ChunkSizer(int64_t initial, int64_t minimum, int64_t maximum);
+
+    int64_t size() const;
+
+    /**
+     * Record that `bytes` bytes were written in `elapsed`, counted from the
+     * start of a stream.
+     */
+    void recordProgress(int64_t bytes,
+                        std::chrono::steady_clock::duration elapsed);
+
+    /**
+     * Record that a write failed, which makes the next chunks smaller.
+     */
+    void recordFailure();
+
+  private:
+    void resize(double size);
+
+    static const std::chrono::milliseconds s_targetDuration;
+
+    mutable std::mutex d_mutex;
+    int64_t d_size;
+    const int64_t d_minimum;
+    const int64_t d_maximum;
+    double d_bytesPerSecond;
+};
+
 class CASClient {
   private:
     std::shared_ptr<proto::ContentAddressableStorage::StubInterface>
@@ -61,12 +109,24 @@ class CASClient {
         d_byteStreamStub;
     std::shared_ptr<proto::Capabilities::StubInterface> d_capabilitiesStub;
 
+    // ByteStream writes start with chunks of `s_byteStreamChunkSizeBytes`,
+    // then size them to the throughput they see, within these bounds.
     static const int s_byteStreamChunkSizeBytes;
+    static const int s_byteStreamMinChunkSizeBytes;
+    static const int s_byteStreamMaxChunkSizeBytes;
+    // Within a stream, the throughput is measured again every this many
+    // bytes, once the data buffered by gRPC weighs little next to them.
+    static const int64_t s_byteStreamMeasurementBytes;
     static const int s_maxTotalBatchSizeBytes;
     static const int s_maxMissingBlobsRequestItems;
+    static const int s_maxMissingBlobsRequestBytes;
 
     // Unless overridden, we'll use the default batch size.
     int64_t d_maxTotalBatchSizeBytes = s_maxTotalBatchSizeBytes;
+    bool d_serverCapabilitiesKnown = false;
+
+    // Shared by every ByteStream write made through `d_byteStreamStub`.
+    std::shared_ptr<ChunkSizer> d_chunkSizer;
 
     static const std::string s_guid;
 
@@ -98,6 +158,19 @@ class CASClient {
      */
     std::string fetch_blob(const proto::Digest &digest) const;
 
+    /**
+     * Fetch the blobs with the given digests, calling `onBlob(digest, blob)`
+     * for each as it arrives. Once `setUpFromServerCapabilities()` has
+     * fetched the server's batch limit, blobs small enough are fetched in
+     * BatchReadBlobs requests filled up to it, and the others with the
+     * ByteStream API, all at the same time, so `onBlob` may be called from
+     * several threads at once.
+     */
+    void fetch_blobs(const std::vector<proto::Digest> &digests,
+                     const std::function<void(const proto::Digest &,
+                                              const std::string &)> &onBlob)
+        const;
+
     /**
      * Fetch a message using the ByteStream API.
      */
@@ -116,10 +189,32 @@ class CASClient {
      * FindMissingBlobsRequest to determine which resources need to be
      * uploaded, then uses the ByteStream and BatchUpdateBlobs APIs to upload
      * them.
+     *
+     * `blobs` maps digests to their contents, `digest_to_filepaths` maps
+     * digests to the paths of files with those contents. Files are only read
+     * if the server is missing them.
      */
     void
     upload_resources(const digest_string_umap &blobs,
-                     const digest_string_umap &digest_to_filecontents) const;
+                     const digest_string_umap &digest_to_filepaths) const;
+
+    /**
+     * Return the digests in `blobs` and `digest_to_filepaths` that the CAS
+     * server doesn't have. This is the first half of `upload_resources()`.
+     */
+    std::unordered_set<DigestKey> find_missing_resources(
+        const digest_string_umap &blobs,
+        const digest_string_umap &digest_to_filepaths) const;
+
+    /**
+     * Upload the resources with the given digests, as returned by
+     * `find_missing_resources()`. This is the second half of
+     * `upload_resources()`.
+     */
+    void upload_missing_resources(
+        const std::unordered_set<DigestKey> &missingDigests,
+        const digest_string_umap &blobs,
+        const digest_string_umap &digest_to_filepaths) const;
 
     int64_t maxTotalBatchSizeBytes() const;
 
@@ -129,24 +224,55 @@ class CASClient {
      */
     void setUpFromServerCapabilities();
 
+    /**
+     * Configure this instance with the `ServerCapabilities` that `other`
+     * has already fetched from the same remote, if any.
+     */
+    void copyServerCapabilities(const CASClient &other);
+
+    /**
+     * Whether the `ServerCapabilities` were fetched successfully.
+     */
+    bool serverCapabilitiesKnown() const;
+
   private:
     std::string uploadResourceName(const proto::Digest &digest) const;
+
+    /**
+     * Upload a blob of `size` bytes using the ByteStream API, calling
+     * `readChunk(offset, length, data)` to fill the data of each request in
+     * turn. A write that fails is retried from the offset the server reports
+     * to have committed, so `readChunk` may be asked for the same bytes more
+     * than once.
+     */
+    void uploadByteStream(
+        const proto::Digest &digest, int64_t size,
+        const std::function<void(int64_t, size_t, std::string *)> &readChunk)
+        const;
+
     std::string downloadResourceName(const proto::Digest &digest) const;
 
-    std::unordered_set<std::string>
-    findMissingBlobs(const std::unordered_set<std::string> &digests) const;
+    /**
+     * Return the digests the server doesn't have, asking for them in
+     * requests of bounded size that are sent in parallel.
+     */
+    std::unordered_set<DigestKey>
+    findMissingBlobs(const std::unordered_set<DigestKey> &digests) const;
 
     proto::FindMissingBlobsResponse
     findMissingBlobs(const proto::FindMissingBlobsRequest &request) const;
 
     void
-    batchUpdateBlobs(const std::unordered_set<std::string> &digests,
+    batchUpdateBlobs(const std::unordered_set<DigestKey> &digests,
                      const digest_string_umap &blobs,
-                     const digest_string_umap &digest_to_filecontents) const;
+                     const digest_string_umap &digest_to_filepaths) const;
 
     proto::BatchUpdateBlobsResponse
     batchUpdateBlobs(const proto::BatchUpdateBlobsRequest &request) const;
 
+    proto::BatchReadBlobsResponse
+    batchReadBlobs(const proto::BatchReadBlobsRequest &request) const;
+
     static std::string generate_guid();
 
     /**
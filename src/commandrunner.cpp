@@ -0,0 +1,431 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <commandrunner.h>
+
+#include <actionbuilder.h>
+#include <digestgenerator.h>
+#include <env.h>
+#include <grpccontext.h>
+#include <metricsconfig.h>
+#include <parsedcommandfactory.h>
+#include <remoteexecutionclient.h>
+#include <threadpool.h>
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+
+#include <buildboxcommon_logging.h>
+#include <buildboxcommonmetrics_countingmetricutil.h>
+#include <buildboxcommonmetrics_durationmetrictimer.h>
+#include <buildboxcommonmetrics_metricguard.h>
+#include <buildboxcommonmetrics_publisherguard.h>
+
+#define TIMER_NAME_EXECUTE_ACTION "recc.execute_action"
+#define TIMER_NAME_QUERY_ACTION_CACHE "recc.query_action_cache"
+#define COUNTER_NAME_THREAD_POOL_TASKS "recc.thread_pool_tasks"
+#define COUNTER_NAME_THREAD_POOL_TASKS_STOLEN "recc.thread_pool_tasks_stolen"
+#define COUNTER_NAME_THREAD_POOL_BUSY_MS "recc.thread_pool_busy_ms"
+#define COUNTER_NAME_THREAD_POOL_UTILIZATION "recc.thread_pool_utilization_pct"
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+/**
+ * Uploads the inputs of an action in the background, fetching the server
+ * capabilities at the same time, so that both overlap the action cache
+ * lookup. Destroying it cancels the upload and waits for it to stop.
+ */
+class BackgroundUpload {
+  public:
+    BackgroundUpload(
+        const std::function<std::unique_ptr<CASClient>(GrpcContext *)>
+            &makeClient,
+        const proto::Digest &actionDigest, const digest_string_umap &blobs,
+        const digest_string_umap &digest_to_filepaths)
+        : d_client(makeClient(&d_grpcContext))
+    {
+        d_grpcContext.set_action_id(actionDigest.hash_other());
+
+        if (RECC_CAS_GET_CAPABILITIES) {
+            d_capabilities = std::async(std::launch::async,
+                                        &CASClient::setUpFromServerCapabilities,
+                                        d_client.get())
+                                 .share();
+        }
+
+        d_upload = std::async(std::launch::async, &BackgroundUpload::upload,
+                              this, std::cref(blobs),
+                              std::cref(digest_to_filepaths), d_capabilities);
+    }
+
+    ~BackgroundUpload()
+    {
+        cancel();
+        try {
+            wait();
+        }
+        catch (const std::exception &) {
+        }
+    }
+
+    /**
+     * Abandon the upload.
+     */
+    void cancel() { d_grpcContext.cancel(); }
+
+    /**
+     * Wait for the upload to finish, rethrowing any error it ran into.
+     */
+    void wait()
+    {
+        if (d_capabilities.valid()) {
+            d_capabilities.get();
+        }
+        if (d_upload.valid()) {
+            d_upload.get();
+        }
+    }
+
+    /**
+     * The client used for the upload, which holds the server capabilities
+     * once `wait()` has returned.
+     */
+    const CASClient &casClient() const { return *d_client; }
+
+  private:
+    void upload(const digest_string_umap &blobs,
+                const digest_string_umap &digest_to_filepaths,
+                std::shared_future<void> capabilities)
+    {
+        const auto missingDigests =
+            d_client->find_missing_resources(blobs, digest_to_filepaths);
+        // The capabilities may change how blobs are uploaded.
+        if (capabilities.valid()) {
+            capabilities.wait();
+        }
+        d_client->upload_missing_resources(missingDigests, blobs,
+                                           digest_to_filepaths);
+    }
+
+    GrpcContext d_grpcContext;
+    std::unique_ptr<CASClient> d_client;
+    std::shared_future<void> d_capabilities;
+    std::future<void> d_upload;
+};
+
+/**
+ * Records how much work the thread pool did between its construction and
+ * destruction.
+ */
+class ThreadPoolMetricsGuard {
+  public:
+    ThreadPoolMetricsGuard()
+        : d_startStats(ThreadPool::instance().stats()),
+          d_startTime(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~ThreadPoolMetricsGuard()
+    {
+        using buildboxcommon::buildboxcommonmetrics::CountingMetricUtil;
+
+        const ThreadPool &pool = ThreadPool::instance();
+        const ThreadPool::Stats stats = pool.stats();
+        const uint64_t busyMicroseconds =
+            stats.d_busyMicroseconds - d_startStats.d_busyMicroseconds;
+        const auto elapsed =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - d_startTime);
+        const uint64_t availableMicroseconds =
+            static_cast<uint64_t>(elapsed.count()) * pool.size();
+
+        CountingMetricUtil::recordCounterMetric(
+            COUNTER_NAME_THREAD_POOL_TASKS,
+            static_cast<int64_t>(stats.d_tasksRun - d_startStats.d_tasksRun));
+        CountingMetricUtil::recordCounterMetric(
+            COUNTER_NAME_THREAD_POOL_TASKS_STOLEN,
+            static_cast<int64_t>(stats.d_tasksStolen -
+                                 d_startStats.d_tasksStolen));
+        CountingMetricUtil::recordCounterMetric(
+            COUNTER_NAME_THREAD_POOL_BUSY_MS,
+            static_cast<int64_t>(busyMicroseconds / 1000));
+        if (availableMicroseconds > 0) {
+            CountingMetricUtil::recordCounterMetric(
+                COUNTER_NAME_THREAD_POOL_UTILIZATION,
+                static_cast<int64_t>(busyMicroseconds * 100 /
+                                     availableMicroseconds));
+        }
+    }
+
+  private:
+    const ThreadPool::Stats d_startStats;
+    const std::chrono::steady_clock::time_point d_startTime;
+};
+
+} // namespace
+
+CommandRunner::~CommandRunner() {}
+
+std::unique_ptr<RemoteExecutionClient>
+CommandRunner::remoteExecutionClient(GrpcChannels *channels,
+                                     GrpcContext *grpcContext)
+{
+    return std::make_unique<RemoteExecutionClient>(
+        channels->server(), channels->cas(), channels->action_cache(),
+        RECC_INSTANCE, grpcContext);
+}
+
+std::unique_ptr<CASClient> CommandRunner::casClient(GrpcChannels *channels,
+                                                    GrpcContext *grpcContext)
+{
+    return std::make_unique<CASClient>(channels->cas(), RECC_INSTANCE,
+                                       grpcContext);
+}
+
+std::shared_ptr<GrpcChannels> CommandRunner::channels()
+{
+    // Everything `GrpcChannels::get_channels_from_config()` reads.
+    const std::string key =
+        RECC_SERVER + '\n' + RECC_CAS_SERVER + '\n' +
+        RECC_ACTION_CACHE_SERVER + '\n' + RECC_INSTANCE + '\n' +
+        std::to_string(RECC_RETRY_LIMIT) + '\n' +
+        std::to_string(RECC_RETRY_DELAY) + '\n' + RECC_ACCESS_TOKEN_PATH +
+        '\n' + (RECC_SERVER_AUTH_GOOGLEAPI ? "googleapi" : "");
+
+    auto &channels = d_channels[key];
+    if (!channels) {
+        channels = std::make_shared<GrpcChannels>(
+            GrpcChannels::get_channels_from_config());
+    }
+    return channels;
+}
+
+int CommandRunner::run(char *argv[], const std::string &cwd,
+                       bool *runLocally)
+{
+    *runLocally = false;
+
+    std::shared_ptr<StatsDPublisherType> statsDPublisher;
+    try {
+        statsDPublisher = get_statsdpublisher_from_config();
+    }
+    catch (const std::runtime_error &e) {
+        BUILDBOX_LOG_ERROR(
+            "Could not initialize statsD publisher: " << e.what());
+        return RC_METRICS_PUBLISHER_INIT_FAILURE;
+    }
+
+    buildboxcommon::buildboxcommonmetrics::PublisherGuard<StatsDPublisherType>
+        statsDPublisherGuard(RECC_ENABLE_METRICS, *statsDPublisher);
+    // Destroyed before the guard above, so that its metrics are published.
+    const ThreadPoolMetricsGuard threadPoolMetricsGuard;
+
+    const auto command =
+        ParsedCommandFactory::createParsedCommand(argv, cwd.c_str());
+
+    digest_string_umap blobs;
+    digest_string_umap digest_to_filepaths;
+
+    std::shared_ptr<proto::Action> actionPtr;
+    if (command.is_compiler_command() || RECC_FORCE_REMOTE) {
+        // Trying to build an `Action`:
+        try {
+            actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
+                                                   &digest_to_filepaths);
+        }
+        catch (const std::invalid_argument &) {
+            BUILDBOX_LOG_ERROR(
+                "Invalid `argv[0]` value in command: \"" +
+                command.get_command().at(0) +
+                "\". The Remote Execution API requires it to specify "
+                "either a relative or absolute path to an executable.");
+            return RC_EXEC_FAILURE;
+        }
+    }
+    else {
+        BUILDBOX_LOG_INFO("Not a compiler command, so running locally. (Use "
+                          "RECC_FORCE_REMOTE=1 to force remote execution)");
+    }
+
+    // If we don't need to build an `Action` or if the process fails, we defer
+    // to running the command locally:
+    if (!actionPtr) {
+        *runLocally = true;
+        return RC_OK;
+    }
+
+    const proto::Action action = *actionPtr;
+    const proto::Digest actionDigest = DigestGenerator::make_digest(action);
+
+    BUILDBOX_LOG_DEBUG("Action Digest: " << actionDigest
+                                         << " Action Contents: "
+                                         << action.ShortDebugString());
+
+    // Setting up the gRPC connections:
+    std::shared_ptr<GrpcChannels> returnChannels;
+    try {
+        returnChannels = channels();
+    }
+    catch (const std::runtime_error &e) {
+        BUILDBOX_LOG_ERROR("Invalid argument in channel config: " << e.what());
+        return RC_INVALID_GRPC_CHANNELS;
+    }
+
+    GrpcContext grpcContext;
+    grpcContext.set_action_id(actionDigest.hash_other());
+
+    const std::unique_ptr<RemoteExecutionClient> clientPtr =
+        remoteExecutionClient(returnChannels.get(), &grpcContext);
+    RemoteExecutionClient &client = *clientPtr;
+
+    bool action_in_cache = false;
+    ActionResult result;
+
+    blobs[actionDigest] = action.SerializeAsString();
+
+    // Start uploading the inputs while we wait for the action cache, so
+    // that a miss doesn't pay for both round trips in turn:
+    std::unique_ptr<BackgroundUpload> backgroundUpload;
+    if (RECC_SPECULATIVE_UPLOAD && !RECC_SKIP_CACHE && !RECC_CACHE_ONLY) {
+        backgroundUpload = std::make_unique<BackgroundUpload>(
+            [&](GrpcContext *uploadContext) {
+                return casClient(returnChannels.get(), uploadContext);
+            },
+            actionDigest, blobs, digest_to_filepaths);
+    }
+
+    // If allowed, we look in the action cache first:
+    if (!RECC_SKIP_CACHE) {
+        try {
+            { // Timed block
+                buildboxcommon::buildboxcommonmetrics::MetricGuard<
+                    buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
+                    mt(TIMER_NAME_QUERY_ACTION_CACHE);
+
+                action_in_cache = client.fetch_from_action_cache(
+                    actionDigest, command.get_products(), RECC_INSTANCE,
+                    &result);
+                if (action_in_cache) {
+                    BUILDBOX_LOG_INFO("Action Cache hit for [" << actionDigest
+                                                               << "]");
+                    if (backgroundUpload) {
+                        backgroundUpload->cancel();
+                    }
+                }
+            }
+        }
+        catch (const std::exception &e) {
+            BUILDBOX_LOG_ERROR("Error while querying action cache at \""
+                               << RECC_ACTION_CACHE_SERVER
+                               << "\": " << e.what());
+        }
+    }
+
+    // If the results for the action are not cached, we upload the
+    // necessary resources to CAS:
+    if (!action_in_cache) {
+        if (RECC_CACHE_ONLY) {
+            BUILDBOX_LOG_INFO(
+                "Action not cached and running in cache-only mode, "
+                "executing locally");
+            *runLocally = true;
+            return RC_OK;
+        }
+
+        BUILDBOX_LOG_INFO("Executing action remotely... [actionDigest="
+                          << actionDigest << "]");
+
+        BUILDBOX_LOG_DEBUG("Uploading resources...");
+        try {
+            if (backgroundUpload) {
+                backgroundUpload->wait();
+                client.copyServerCapabilities(backgroundUpload->casClient());
+            }
+            else {
+                // We are going to make a batch request to the CAS, setting
+                // up the client's max. batch size according to what the
+                // server supports:
+                if (RECC_CAS_GET_CAPABILITIES) {
+                    client.setUpFromServerCapabilities();
+                }
+
+                client.upload_resources(blobs, digest_to_filepaths);
+            }
+        }
+        catch (const std::exception &e) {
+            BUILDBOX_LOG_ERROR("Error while uploading resources to CAS at \""
+                               << RECC_CAS_SERVER << "\": " << e.what());
+            return RC_INVALID_SERVER_CAPABILITIES;
+        }
+
+        // And call `Execute()`:
+        try {
+            // Timed block
+            buildboxcommon::buildboxcommonmetrics::MetricGuard<
+                buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
+                mt(TIMER_NAME_EXECUTE_ACTION);
+
+            result = client.execute_action(actionDigest, RECC_SKIP_CACHE);
+            BUILDBOX_LOG_INFO("Remote execution finished with exit code "
+                              << result.d_exitCode);
+        }
+        catch (const std::exception &e) {
+            BUILDBOX_LOG_ERROR("Error while calling `Execute()` on \""
+                               << RECC_SERVER << "\": " << e.what());
+            return RC_EXEC_ACTIONS_FAILURE;
+        }
+    }
+
+    // Outputs are fetched in batches sized to what the server supports, so
+    // its capabilities are needed if they weren't fetched above:
+    if (RECC_CAS_GET_CAPABILITIES && !client.serverCapabilitiesKnown()) {
+        try {
+            client.setUpFromServerCapabilities();
+        }
+        catch (const std::exception &e) {
+            BUILDBOX_LOG_ERROR("Error while fetching capabilities from \""
+                               << RECC_CAS_SERVER << "\": " << e.what());
+            return RC_INVALID_SERVER_CAPABILITIES;
+        }
+    }
+
+    const int exitCode = result.d_exitCode;
+    try {
+        // stdout and stderr are fetched together if they weren't inlined.
+        client.fetch_outputblobs({&result.d_stdOut, &result.d_stdErr});
+
+        /* These don't use logging macros because they are compiler output
+         */
+        std::cout << client.get_outputblob(result.d_stdOut);
+        std::cerr << client.get_outputblob(result.d_stdErr);
+
+        if (!RECC_DONT_SAVE_OUTPUT) {
+            client.write_files_to_disk(result);
+        }
+
+        return exitCode;
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_ERROR(e.what());
+        return (exitCode == 0 ? RC_SAVING_OUTPUT_FAILURE : exitCode);
+    }
+}
+
+} // namespace recc
+} // namespace BloombergLP
@@ -0,0 +1,91 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_COMMANDRUNNER
+#define INCLUDED_COMMANDRUNNER
+
+#include <grpcchannels.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+namespace BloombergLP {
+namespace recc {
+
+enum ReturnCode {
+    RC_OK = 0,
+    RC_USAGE = 100,
+    RC_EXEC_FAILURE = 101,
+    RC_INVALID_GRPC_CHANNELS = 102,
+    RC_INVALID_SERVER_CAPABILITIES = 103,
+    RC_EXEC_ACTIONS_FAILURE = 104,
+    RC_SAVING_OUTPUT_FAILURE = 105,
+    RC_METRICS_PUBLISHER_INIT_FAILURE = 106,
+    RC_DAEMON_FAILURE = 107
+};
+
+/**
+ * Runs a command remotely using the current configuration, writing its
+ * output files to the working directory and its stdout and stderr to ours.
+ *
+ * The gRPC channels are kept between calls to `run()` for as long as the
+ * configuration of the servers doesn't change, so that a long-lived process
+ * doesn't have to connect again for every command.
+ */
+class CASClient;
+class GrpcContext;
+class RemoteExecutionClient;
+
+class CommandRunner {
+  public:
+    virtual ~CommandRunner();
+
+    /**
+     * Run the null-terminated command `argv` from the working directory
+     * `cwd`, which must be the current one. Returns the exit code of the
+     * command, or a `ReturnCode` if something went wrong. If the command has
+     * to be run locally instead, sets `runLocally` and returns `RC_OK`.
+     */
+    int run(char *argv[], const std::string &cwd, bool *runLocally);
+
+  protected:
+    /**
+     * Return a client for the servers behind `channels`. Tests override
+     * this and `casClient()` to talk to stubs instead.
+     */
+    virtual std::unique_ptr<RemoteExecutionClient>
+    remoteExecutionClient(GrpcChannels *channels, GrpcContext *grpcContext);
+
+    /**
+     * Return a client for the CAS server behind `channels`, used to upload
+     * inputs while the action cache is queried.
+     */
+    virtual std::unique_ptr<CASClient> casClient(GrpcChannels *channels,
+                                                 GrpcContext *grpcContext);
+
+  private:
+    /**
+     * Return the channels for the configured servers, creating them if
+     * necessary. Throws `std::runtime_error` if the configuration is invalid.
+     */
+    std::shared_ptr<GrpcChannels> channels();
+
+    std::map<std::string, std::shared_ptr<GrpcChannels>> d_channels;
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
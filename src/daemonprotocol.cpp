@@ -0,0 +1,333 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <daemonprotocol.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace BloombergLP {
+namespace recc {
+
+const uint32_t DaemonProtocol::s_version = 0x52454303;
+const uint32_t DaemonProtocol::s_maxRequestSize = 64 * 1024 * 1024;
+const int DaemonProtocol::s_fdCount;
+
+namespace {
+
+// Sent by the daemon once it has taken a request.
+const char s_acceptance = 'A';
+
+bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool readAll(int fd, char *data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t received = read(fd, data, size);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+void appendInteger(std::string *buffer, uint32_t value)
+{
+    buffer->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void appendString(std::string *buffer, const std::string &value)
+{
+    appendInteger(buffer, static_cast<uint32_t>(value.size()));
+    buffer->append(value);
+}
+
+void appendStrings(std::string *buffer, const std::vector<std::string> &values)
+{
+    appendInteger(buffer, static_cast<uint32_t>(values.size()));
+    for (const auto &value : values) {
+        appendString(buffer, value);
+    }
+}
+
+// Reads fields from a received request, failing once it runs out of data.
+class RequestReader {
+  public:
+    explicit RequestReader(const std::string &data)
+        : d_data(data), d_position(0)
+    {
+    }
+
+    bool readInteger(uint32_t *value)
+    {
+        if (d_data.size() - d_position < sizeof(*value)) {
+            return false;
+        }
+        memcpy(value, d_data.data() + d_position, sizeof(*value));
+        d_position += sizeof(*value);
+        return true;
+    }
+
+    bool readString(std::string *value)
+    {
+        uint32_t size = 0;
+        if (!readInteger(&size) || d_data.size() - d_position < size) {
+            return false;
+        }
+        value->assign(d_data, d_position, size);
+        d_position += size;
+        return true;
+    }
+
+    bool readStrings(std::vector<std::string> *values)
+    {
+        uint32_t count = 0;
+        if (!readInteger(&count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            std::string value;
+            if (!readString(&value)) {
+                return false;
+            }
+            values->push_back(value);
+        }
+        return true;
+    }
+
+    bool atEnd() const { return d_position == d_data.size(); }
+
+  private:
+    const std::string &d_data;
+    size_t d_position;
+};
+
+} // namespace
+
+std::string DaemonProtocol::encodeRequest(const Request &request)
+{
+    std::string body;
+    appendStrings(&body, request.d_argv);
+    appendString(&body, request.d_cwd);
+    appendStrings(&body, request.d_environment);
+    if (body.size() > s_maxRequestSize) {
+        throw std::length_error("Request of " + std::to_string(body.size()) +
+                                " bytes is too large");
+    }
+
+    std::string message;
+    appendInteger(&message, s_version);
+    appendInteger(&message, static_cast<uint32_t>(body.size()));
+    message += body;
+    return message;
+}
+
+bool DaemonProtocol::sendWithFds(int socket, const std::string &message,
+                                 const int fds[])
+{
+    union {
+        struct cmsghdr d_header;
+        char d_buffer[CMSG_SPACE(s_fdCount * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(message.data());
+    iov.iov_len = message.size();
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.d_buffer;
+    header.msg_controllen = sizeof(control.d_buffer);
+
+    struct cmsghdr *controlMessage = CMSG_FIRSTHDR(&header);
+    controlMessage->cmsg_level = SOL_SOCKET;
+    controlMessage->cmsg_type = SCM_RIGHTS;
+    controlMessage->cmsg_len = CMSG_LEN(s_fdCount * sizeof(int));
+    memcpy(CMSG_DATA(controlMessage), fds, s_fdCount * sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket, &header, 0);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        return false;
+    }
+    const size_t offset = static_cast<size_t>(sent);
+    return writeAll(socket, message.data() + offset, message.size() - offset);
+}
+
+bool DaemonProtocol::receiveRequest(int socket, Request *request, int fds[])
+{
+    union {
+        struct cmsghdr d_header;
+        char d_buffer[CMSG_SPACE(s_fdCount * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    uint32_t prefix[2]; // version, size
+    struct iovec iov;
+    iov.iov_base = prefix;
+    iov.iov_len = sizeof(prefix);
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.d_buffer;
+    header.msg_controllen = sizeof(control.d_buffer);
+
+    ssize_t received;
+    do {
+        received = recvmsg(socket, &header, 0);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+        return false;
+    }
+
+    int fdCount = 0;
+    for (struct cmsghdr *controlMessage = CMSG_FIRSTHDR(&header);
+         controlMessage != nullptr;
+         controlMessage = CMSG_NXTHDR(&header, controlMessage)) {
+        if (controlMessage->cmsg_level == SOL_SOCKET &&
+            controlMessage->cmsg_type == SCM_RIGHTS) {
+            const size_t count =
+                (controlMessage->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; ++i) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(controlMessage) + i * sizeof(int),
+                       sizeof(int));
+                if (fdCount < s_fdCount) {
+                    fds[fdCount++] = fd;
+                }
+                else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    const auto closeFds = [&]() {
+        for (int i = 0; i < fdCount; ++i) {
+            close(fds[i]);
+        }
+        return false;
+    };
+
+    const size_t prefixReceived = static_cast<size_t>(received);
+    if (fdCount != s_fdCount || (header.msg_flags & MSG_CTRUNC) != 0 ||
+        !readAll(socket, reinterpret_cast<char *>(prefix) + prefixReceived,
+                 sizeof(prefix) - prefixReceived) ||
+        prefix[0] != s_version || prefix[1] > s_maxRequestSize) {
+        return closeFds();
+    }
+
+    std::string data(prefix[1], '\0');
+    if (!readAll(socket, &data[0], data.size())) {
+        return closeFds();
+    }
+
+    RequestReader reader(data);
+    if (!reader.readStrings(&request->d_argv) || request->d_argv.empty() ||
+        !reader.readString(&request->d_cwd) ||
+        !reader.readStrings(&request->d_environment) || !reader.atEnd()) {
+        return closeFds();
+    }
+    return true;
+}
+
+bool DaemonProtocol::sendAcceptance(int socket)
+{
+    return writeAll(socket, &s_acceptance, sizeof(s_acceptance));
+}
+
+bool DaemonProtocol::receiveAcceptance(int socket)
+{
+    char acceptance;
+    return readAll(socket, &acceptance, sizeof(acceptance)) &&
+           acceptance == s_acceptance;
+}
+
+bool DaemonProtocol::sendReply(int socket, bool runLocally, int32_t exitCode)
+{
+    char reply[1 + sizeof(exitCode)];
+    reply[0] = runLocally ? 1 : 0;
+    memcpy(reply + 1, &exitCode, sizeof(exitCode));
+    return writeAll(socket, reply, sizeof(reply));
+}
+
+bool DaemonProtocol::receiveReply(int socket, bool *runLocally,
+                                  int32_t *exitCode)
+{
+    char reply[1 + sizeof(*exitCode)];
+    if (!readAll(socket, reply, sizeof(reply)) || (reply[0] & ~1) != 0) {
+        return false;
+    }
+    *runLocally = reply[0] == 1;
+    memcpy(exitCode, reply + 1, sizeof(*exitCode));
+    return true;
+}
+
+bool DaemonProtocol::peerIsSameUser(int connection)
+{
+#if defined(SO_PEERCRED)
+    struct ucred credentials;
+    socklen_t size = sizeof(credentials);
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials,
+                   &size) != 0) {
+        return false;
+    }
+    return credentials.uid == geteuid();
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(_AIX)
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(connection, &uid, &gid) != 0) {
+        return false;
+    }
+    return uid == geteuid();
+#else
+    // The socket is only accessible to the user who created it.
+    (void)connection;
+    return true;
+#endif
+}
+
+} // namespace recc
+} // namespace BloombergLP
@@ -0,0 +1,98 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_DAEMONPROTOCOL
+#define INCLUDED_DAEMONPROTOCOL
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * The messages `DaemonClient` and `Daemon` exchange over a Unix domain
+ * socket.
+ *
+ * A request starts with the protocol version and the size of the rest, both
+ * 32-bit integers in host byte order, followed by the command line, working
+ * directory and environment of the client. The client's standard file
+ * descriptors are passed along with it. The daemon acknowledges a
+ * well-formed request with a single byte before it starts on the command,
+ * so that the client knows whether it may still run the command itself if
+ * the daemon goes away. The reply is the result of
+ * `CommandRunner::run()`: a byte that tells whether the command has to be
+ * run locally, followed by its exit code as a 32-bit integer, so that any
+ * exit code can be told apart from running locally.
+ */
+struct DaemonProtocol {
+    // Sent at the start of every request, to reject clients of another
+    // version.
+    static const uint32_t s_version;
+
+    // Upper bound on the size of a request, to reject garbage early.
+    static const uint32_t s_maxRequestSize;
+
+    // The number of file descriptors sent with a request.
+    static const int s_fdCount = 3;
+
+    struct Request {
+        std::vector<std::string> d_argv;
+        std::string d_cwd;
+        std::vector<std::string> d_environment;
+    };
+
+    /**
+     * Return `request` encoded, version and size included. Throws
+     * `std::length_error` if it is larger than `s_maxRequestSize`.
+     */
+    static std::string encodeRequest(const Request &request);
+
+    /**
+     * Send `message` on `socket`, passing the `s_fdCount` descriptors in
+     * `fds` along with it.
+     */
+    static bool sendWithFds(int socket, const std::string &message,
+                            const int fds[]);
+
+    /**
+     * Receive a request and the descriptors sent with it. Returns false if
+     * the request is of another version, too large, truncated or malformed,
+     * or doesn't come with exactly `s_fdCount` descriptors. On success the
+     * caller owns the descriptors in `fds`.
+     */
+    static bool receiveRequest(int socket, Request *request, int fds[]);
+
+    static bool sendAcceptance(int socket);
+
+    static bool receiveAcceptance(int socket);
+
+    static bool sendReply(int socket, bool runLocally, int32_t exitCode);
+
+    static bool receiveReply(int socket, bool *runLocally,
+                             int32_t *exitCode);
+
+    /**
+     * Whether the process on the other end of `connection` runs as our
+     * effective user.
+     */
+    static bool peerIsSameUser(int connection);
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
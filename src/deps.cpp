@@ -15,16 +15,21 @@
 #include <deps.h>
 
 #include <compilerdefaults.h>
+#include <depscache.h>
 #include <env.h>
+#include <includescanner.h>
 #include <subprocess.h>
 
 #include <buildboxcommon_fileutils.h>
 #include <buildboxcommon_logging.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <iostream>
 #include <regex>
 #include <sstream>
@@ -36,20 +41,111 @@
 namespace BloombergLP {
 namespace recc {
 
+namespace {
+
+// A filename found in Make rules. It points into the rules, or, for a name
+// with escaped characters, to an unescaped copy.
+struct FilenameView {
+    const char *d_data;
+    size_t d_length;
+
+    bool operator<(const FilenameView &other) const
+    {
+        const int result =
+            memcmp(d_data, other.d_data, std::min(d_length, other.d_length));
+        return result < 0 || (result == 0 && d_length < other.d_length);
+    }
+
+    bool operator==(const FilenameView &other) const
+    {
+        return d_length == other.d_length &&
+               memcmp(d_data, other.d_data, d_length) == 0;
+    }
+};
+
+/**
+ * For every character, whether it's handled like those before it in a run
+ * of characters, that is, whether it's none of those that change the state
+ * of the parser: backslashes, newlines and spaces, and, while they have an
+ * effect, colons and slashes. There is a table for each combination of the
+ * latter two.
+ */
+class RunCharacterTables {
+  public:
+    RunCharacterTables()
+    {
+        for (int table = 0; table < 4; ++table) {
+            for (int character = 0; character < 256; ++character) {
+                d_tables[table][character] =
+                    !(character == '\\' || character == '\n' ||
+                      character == ' ' ||
+                      (character == ':' && (table & 1) != 0) ||
+                      (character == '/' && (table & 2) != 0));
+            }
+        }
+    }
+
+    const bool *get(bool colonEndsRun, bool slashEndsRun) const
+    {
+        return d_tables[(colonEndsRun ? 1 : 0) | (slashEndsRun ? 2 : 0)];
+    }
+
+  private:
+    bool d_tables[4][256];
+};
+
+} // namespace
+
 std::set<std::string> Deps::dependencies_from_make_rules(
     const std::string &rules, bool is_sun_format, bool include_global_paths)
 {
-    std::set<std::string> result;
+    std::vector<FilenameView> filenames;
+    std::deque<std::string> unescapedFilenames;
     bool saw_colon_on_line = false;
     bool saw_backslash = false;
     bool ignoring_file = false;
 
-    std::string current_filename;
-    for (const char &character : rules) {
+    // The filename being read is kept as a view into the rules until an
+    // escaped character makes it non-contiguous, when it is copied.
+    const char *current_start = nullptr;
+    size_t current_length = 0;
+    std::string *current_copy = nullptr;
+
+    const auto append = [&](const char *characters, size_t length) {
+        if (current_copy == nullptr) {
+            if (current_length == 0) {
+                current_start = characters;
+            }
+            else if (current_start + current_length != characters) {
+                unescapedFilenames.emplace_back(current_start,
+                                                current_length);
+                current_copy = &unescapedFilenames.back();
+            }
+        }
+        if (current_copy != nullptr) {
+            current_copy->append(characters, length);
+        }
+        current_length += length;
+    };
+    const auto finish = [&]() {
+        if (current_length > 0) {
+            filenames.push_back({current_copy == nullptr
+                                     ? current_start
+                                     : current_copy->data(),
+                                 current_length});
+        }
+        current_length = 0;
+        current_copy = nullptr;
+    };
+
+    const char *position = rules.data();
+    const char *end = position + rules.size();
+    while (position < end) {
+        const char character = *position;
         if (saw_backslash) {
             saw_backslash = false;
             if (character != '\n' && !ignoring_file && saw_colon_on_line) {
-                current_filename += character;
+                append(position, 1);
             }
         }
         else if (character == '\\') {
@@ -61,39 +157,57 @@ std::set<std::string> Deps::dependencies_from_make_rules(
         else if (character == '\n') {
             saw_colon_on_line = false;
             ignoring_file = false;
-            if (!current_filename.empty()) {
-                result.insert(current_filename);
-            }
-            current_filename.clear();
+            finish();
         }
         else if (character == ' ') {
             if (is_sun_format) {
-                if (!current_filename.empty() && !ignoring_file &&
+                if (current_length > 0 && !ignoring_file &&
                     saw_colon_on_line) {
-                    current_filename += character;
+                    append(position, 1);
                 }
             }
             else {
                 ignoring_file = false;
-                if (!current_filename.empty()) {
-                    result.insert(current_filename);
-                }
-                current_filename.clear();
+                finish();
             }
         }
-        else if (character == '/' && current_filename.empty() &&
+        else if (character == '/' && current_length == 0 &&
                  !include_global_paths) {
             ignoring_file = true;
         }
-        else if (!ignoring_file && saw_colon_on_line) {
-            current_filename += character;
+        else {
+            // Take the rest of the run of ordinary characters at once. A
+            // slash only has an effect while no filename is being read.
+            const bool appending = !ignoring_file && saw_colon_on_line;
+            const bool slashEndsRun = !appending && !ignoring_file &&
+                                      current_length == 0 &&
+                                      !include_global_paths;
+            const char *runEnd = position + 1;
+            static const RunCharacterTables s_tables;
+            const bool *continuesRun =
+                s_tables.get(!saw_colon_on_line, slashEndsRun);
+            while (runEnd < end &&
+                   continuesRun[static_cast<unsigned char>(*runEnd)]) {
+                ++runEnd;
+            }
+            if (appending) {
+                append(position, static_cast<size_t>(runEnd - position));
+            }
+            position = runEnd;
+            continue;
         }
+        ++position;
     }
+    finish();
 
-    if (!current_filename.empty()) {
-        result.insert(current_filename);
+    // Sorting the names lets the set be filled in order, in linear time.
+    std::sort(filenames.begin(), filenames.end());
+    filenames.erase(std::unique(filenames.begin(), filenames.end()),
+                    filenames.end());
+    std::set<std::string> result;
+    for (const FilenameView &filename : filenames) {
+        result.emplace_hint(result.end(), filename.d_data, filename.d_length);
     }
-
     return result;
 }
 
@@ -131,60 +245,131 @@ std::string Deps::crtbegin_from_clang_v(const std::string &str)
     return crtbegin_file;
 }
 
+std::string Deps::resolve_executable(const std::string &name)
+{
+    if (name.find('/') != std::string::npos) {
+        return name;
+    }
+    std::string searchPath;
+    const auto pathOverride = RECC_DEPS_ENV.find("PATH");
+    if (pathOverride != RECC_DEPS_ENV.cend()) {
+        searchPath = pathOverride->second;
+    }
+    else if (const char *path = getenv("PATH")) {
+        searchPath = path;
+    }
+
+    std::istringstream directories(searchPath);
+    std::string directory;
+    while (std::getline(directories, directory, ':')) {
+        const std::string candidate =
+            (directory.empty() ? "." : directory) + "/" + name;
+        if (access(candidate.c_str(), X_OK) == 0) {
+            return candidate;
+        }
+    }
+    return "";
+}
+
 CommandFileInfo Deps::get_file_info(const ParsedCommand &parsedCommand)
 {
     CommandFileInfo result;
+    const bool useCache = DepsCache::enabled(parsedCommand);
+    if (useCache &&
+        DepsCache::lookup(parsedCommand, &result.d_dependencies)) {
+        result.d_possibleProducts = possible_products(parsedCommand, result);
+        return result;
+    }
+
     bool is_clang = parsedCommand.is_clang();
-    const auto subprocessResult =
-        Subprocess::execute(parsedCommand.get_dependencies_command(), true,
-                            is_clang, RECC_DEPS_ENV);
+    const time_t startTime = time(nullptr);
+    // Every file read to find the dependencies, including the system
+    // headers left out of them, against which a cached result is validated.
+    std::set<std::string> inputs;
+    std::string verboseOutput;
 
-    if (subprocessResult.d_exitCode != 0) {
-        std::string errorMsg = "Failed to execute get dependencies command: ";
-        for (const auto &token : parsedCommand.get_dependencies_command()) {
-            errorMsg += (token + " ");
+    if (IncludeScanner::enabled(parsedCommand) &&
+        IncludeScanner::scan(parsedCommand, &inputs, &verboseOutput)) {
+        for (const auto &input : inputs) {
+            if (RECC_DEPS_GLOBAL_PATHS || input[0] != '/') {
+                result.d_dependencies.insert(input);
+            }
         }
-        BUILDBOX_LOG_ERROR(errorMsg);
-        BUILDBOX_LOG_ERROR("Exit status: " << subprocessResult.d_exitCode);
-        BUILDBOX_LOG_DEBUG("stdout: " << subprocessResult.d_stdOut);
-        BUILDBOX_LOG_DEBUG("stderr: " << subprocessResult.d_stdErr);
-        throw subprocess_failed_error(subprocessResult.d_exitCode);
     }
+    else {
+        const auto subprocessResult =
+            Subprocess::execute(parsedCommand.get_dependencies_command(), true,
+                                is_clang, RECC_DEPS_ENV);
 
-    std::string dependencies = subprocessResult.d_stdOut;
+        if (subprocessResult.d_exitCode != 0) {
+            std::string errorMsg =
+                "Failed to execute get dependencies command: ";
+            for (const auto &token :
+                 parsedCommand.get_dependencies_command()) {
+                errorMsg += (token + " ");
+            }
+            BUILDBOX_LOG_ERROR(errorMsg);
+            BUILDBOX_LOG_ERROR("Exit status: " << subprocessResult.d_exitCode);
+            BUILDBOX_LOG_DEBUG("stdout: " << subprocessResult.d_stdOut);
+            BUILDBOX_LOG_DEBUG("stderr: " << subprocessResult.d_stdErr);
+            throw subprocess_failed_error(subprocessResult.d_exitCode);
+        }
 
-    // If AIX compiler, read dependency information from temporary file.
+        std::string dependencies = subprocessResult.d_stdOut;
 
-    if (parsedCommand.is_AIX()) {
-        dependencies = buildboxcommon::FileUtils::getFileContents(
-            parsedCommand.get_aix_dependency_file_name().c_str());
-    }
+        // If AIX compiler, read dependency information from temporary file.
 
-    result.d_dependencies = dependencies_from_make_rules(
-        dependencies, parsedCommand.produces_sun_make_rules(),
-        RECC_DEPS_GLOBAL_PATHS);
+        if (parsedCommand.is_AIX()) {
+            dependencies = buildboxcommon::FileUtils::getFileContents(
+                parsedCommand.get_aix_dependency_file_name().c_str());
+        }
+
+        result.d_dependencies = dependencies_from_make_rules(
+            dependencies, parsedCommand.produces_sun_make_rules(),
+            RECC_DEPS_GLOBAL_PATHS);
+        if (useCache) {
+            inputs = dependencies_from_make_rules(
+                dependencies, parsedCommand.produces_sun_make_rules(), true);
+        }
+        verboseOutput = subprocessResult.d_stdErr;
+    }
 
     if (RECC_DEPS_GLOBAL_PATHS && is_clang) {
         // Clang tries to locate GCC installations by looking for crtbegin.o
         // and then adjusts its system include paths. We need to upload this
         // file as if it were an input.
-        std::string crtbegin =
-            crtbegin_from_clang_v(subprocessResult.d_stdErr);
+        std::string crtbegin = crtbegin_from_clang_v(verboseOutput);
         if (crtbegin != "") {
             result.d_dependencies.insert(crtbegin);
         }
     }
 
+    if (useCache) {
+        inputs.insert(result.d_dependencies.cbegin(),
+                      result.d_dependencies.cend());
+        DepsCache::store(parsedCommand, inputs, result.d_dependencies,
+                         startTime);
+    }
+
+    result.d_possibleProducts = possible_products(parsedCommand, result);
+    return result;
+}
+
+std::set<std::string>
+Deps::possible_products(const ParsedCommand &parsedCommand,
+                        const CommandFileInfo &fileInfo)
+{
     std::set<std::string> products;
     if (parsedCommand.get_products().size() > 0) {
         products = parsedCommand.get_products();
     }
     else {
-        products = guess_products(result.d_dependencies);
+        products = guess_products(fileInfo.d_dependencies);
     }
 
+    std::set<std::string> result;
     for (const auto &product : products) {
-        result.d_possibleProducts.insert(
+        result.insert(
             buildboxcommon::FileUtils::normalizePath(product.c_str()));
     }
 
@@ -78,6 +78,23 @@ struct Deps {
      * Returns an empty string if something went wrong.
      */
     static std::string crtbegin_from_clang_v(const std::string &str);
+
+    /**
+     * Return the path of the executable that running `name` as part of a
+     * dependencies command would start, looking it up in PATH (as set by
+     * RECC_DEPS_ENV, if it is) if it contains no slash. Returns an empty
+     * string if it can't be found.
+     */
+    static std::string resolve_executable(const std::string &name);
+
+  private:
+    /**
+     * Return the normalized paths the command may write its outputs to,
+     * guessing them from its dependencies if it doesn't name them.
+     */
+    static std::set<std::string>
+    possible_products(const ParsedCommand &command,
+                      const CommandFileInfo &fileInfo);
 };
 
 } // namespace recc
@@ -0,0 +1,297 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <depscache.h>
+
+#include <deps.h>
+#include <digestgenerator.h>
+#include <env.h>
+#include <fileutils.h>
+#include <hashtohex.h>
+
+#include <buildboxcommon_fileutils.h>
+#include <buildboxcommon_logging.h>
+
+#include <cstdlib>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+const char s_entryHeader[] = "recc-deps-cache 1";
+
+// Variables that change where compilers look for headers.
+const char *const s_searchPathVariables[] = {
+    "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH",
+    "SDKROOT", "DEVELOPER_DIR"};
+
+// Inputs modified less than this long before the dependencies command
+// started are not trusted, to allow for coarse filesystem timestamps.
+const time_t s_minimumInputAgeSeconds = 2;
+
+std::string digestToHex(const proto::Digest &digest)
+{
+    if (!digest.hash_other().empty()) {
+        return digest.hash_other();
+    }
+    return hashToHex(
+        reinterpret_cast<const unsigned char *>(digest.hash_blake3zcc().data()),
+        static_cast<unsigned int>(digest.hash_blake3zcc().size()));
+}
+
+void appendField(std::string *key, const std::string &field)
+{
+    key->append(field);
+    key->push_back('\0');
+}
+
+// Return the name of the cache entry for `command`, or an empty string if
+// the compiler can't be identified.
+std::string entryName(const ParsedCommand &command)
+{
+    const std::vector<std::string> depsCommand =
+        command.get_dependencies_command();
+    if (depsCommand.empty()) {
+        return "";
+    }
+    const std::string compiler = Deps::resolve_executable(depsCommand.front());
+    struct stat compilerStat;
+    if (compiler.empty() || stat(compiler.c_str(), &compilerStat) != 0) {
+        return "";
+    }
+
+    std::string key;
+    appendField(&key, s_entryHeader);
+    appendField(&key, RECC_CAS_DIGEST_FUNCTION);
+    appendField(&key, RECC_DEPS_GLOBAL_PATHS ? "global" : "local");
+    appendField(&key, FileUtils::getCurrentWorkingDirectory());
+
+    const struct timespec &compilerMtime =
+        FileUtils::modificationTime(compilerStat);
+    appendField(&key, compiler);
+    appendField(&key, std::to_string(compilerStat.st_dev) + ":" +
+                          std::to_string(compilerStat.st_ino) + ":" +
+                          std::to_string(compilerStat.st_size) + ":" +
+                          std::to_string(compilerMtime.tv_sec) + "." +
+                          std::to_string(compilerMtime.tv_nsec));
+
+    for (const auto &argument : depsCommand) {
+        appendField(&key, argument);
+    }
+    appendField(&key, "");
+
+    for (const auto &variable : RECC_DEPS_ENV) {
+        appendField(&key, variable.first + "=" + variable.second);
+    }
+    appendField(&key, "");
+
+    for (const char *variable : s_searchPathVariables) {
+        const char *value = getenv(variable);
+        appendField(&key, value ? std::string(variable) + "=" + value : "");
+    }
+
+    const std::string name =
+        digestToHex(DigestGenerator::make_digest(key));
+    return RECC_DEPS_CACHE_DIR + "/" + name.substr(0, 2) + "/" + name;
+}
+
+struct InputRecord {
+    int64_t d_size;
+    struct timespec d_mtime;
+    struct timespec d_ctime;
+    std::string d_hash;
+    std::string d_path;
+};
+
+// Return whether the file at `input.d_path` still has the recorded
+// contents. Unchanged timestamps are taken as proof; otherwise the file is
+// hashed again.
+bool inputUnchanged(const InputRecord &input)
+{
+    struct stat statResult;
+    if (stat(input.d_path.c_str(), &statResult) != 0 ||
+        !S_ISREG(statResult.st_mode) ||
+        static_cast<int64_t>(statResult.st_size) != input.d_size) {
+        return false;
+    }
+
+    const struct timespec &mtime = FileUtils::modificationTime(statResult);
+    const struct timespec &ctime = FileUtils::changeTime(statResult);
+    if (mtime.tv_sec == input.d_mtime.tv_sec &&
+        mtime.tv_nsec == input.d_mtime.tv_nsec &&
+        ctime.tv_sec == input.d_ctime.tv_sec &&
+        ctime.tv_nsec == input.d_ctime.tv_nsec) {
+        return true;
+    }
+
+    try {
+        return digestToHex(DigestGenerator::make_digest_from_file(
+                   input.d_path)) == input.d_hash;
+    }
+    catch (const std::exception &) {
+        return false;
+    }
+}
+
+// Parse an entry written by `DepsCache::store()`. Returns false if it is
+// malformed.
+bool parseEntry(const std::string &contents,
+                std::set<std::string> *dependencies,
+                std::vector<InputRecord> *inputs)
+{
+    std::istringstream stream(contents);
+    std::string line;
+    if (!std::getline(stream, line) || line != s_entryHeader) {
+        return false;
+    }
+
+    size_t dependencyCount = 0;
+    if (!std::getline(stream, line)) {
+        return false;
+    }
+    std::istringstream(line) >> dependencyCount;
+    for (size_t i = 0; i < dependencyCount; ++i) {
+        if (!std::getline(stream, line)) {
+            return false;
+        }
+        dependencies->insert(line);
+    }
+
+    while (std::getline(stream, line)) {
+        // <size> <mtime s> <mtime ns> <ctime s> <ctime ns> <hash> <path>
+        std::istringstream fields(line);
+        InputRecord input;
+        if (!(fields >> input.d_size >> input.d_mtime.tv_sec >>
+              input.d_mtime.tv_nsec >> input.d_ctime.tv_sec >>
+              input.d_ctime.tv_nsec >> input.d_hash) ||
+            fields.get() != ' ' || !std::getline(fields, input.d_path)) {
+            return false;
+        }
+        inputs->push_back(input);
+    }
+    return !inputs->empty();
+}
+
+} // namespace
+
+bool DepsCache::enabled(const ParsedCommand &command)
+{
+    // The AIX dependencies command names a new temporary file every time.
+    return !RECC_DEPS_CACHE_DIR.empty() && !command.is_AIX();
+}
+
+bool DepsCache::lookup(const ParsedCommand &command,
+                       std::set<std::string> *dependencies)
+{
+    const std::string path = entryName(command);
+    if (path.empty() || access(path.c_str(), R_OK) != 0) {
+        return false;
+    }
+
+    std::set<std::string> storedDependencies;
+    std::vector<InputRecord> inputs;
+    try {
+        if (!parseEntry(
+                buildboxcommon::FileUtils::getFileContents(path.c_str()),
+                &storedDependencies, &inputs)) {
+            BUILDBOX_LOG_WARNING("Ignoring malformed dependency cache entry \""
+                                 << path << "\"");
+            return false;
+        }
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_DEBUG("Could not read dependency cache entry \""
+                           << path << "\": " << e.what());
+        return false;
+    }
+
+    for (const auto &input : inputs) {
+        if (!inputUnchanged(input)) {
+            BUILDBOX_LOG_DEBUG("Dependency cache entry \""
+                               << path << "\" is stale: \"" << input.d_path
+                               << "\" changed");
+            return false;
+        }
+    }
+
+    BUILDBOX_LOG_DEBUG("Using cached dependencies from \"" << path << "\"");
+    *dependencies = storedDependencies;
+    return true;
+}
+
+void DepsCache::store(const ParsedCommand &command,
+                      const std::set<std::string> &inputs,
+                      const std::set<std::string> &dependencies,
+                      time_t commandStartTime)
+{
+    const std::string path = entryName(command);
+    if (path.empty()) {
+        return;
+    }
+
+    std::ostringstream entry;
+    entry << s_entryHeader << "\n" << dependencies.size() << "\n";
+    for (const auto &dependency : dependencies) {
+        if (dependency.find('\n') != std::string::npos) {
+            return;
+        }
+        entry << dependency << "\n";
+    }
+
+    const time_t newestAllowed = commandStartTime - s_minimumInputAgeSeconds;
+    for (const auto &input : inputs) {
+        struct stat statResult;
+        if (input.find('\n') != std::string::npos ||
+            stat(input.c_str(), &statResult) != 0 ||
+            !S_ISREG(statResult.st_mode)) {
+            return;
+        }
+        const struct timespec &mtime = FileUtils::modificationTime(statResult);
+        const struct timespec &ctime = FileUtils::changeTime(statResult);
+        if (mtime.tv_sec >= newestAllowed || ctime.tv_sec >= newestAllowed) {
+            BUILDBOX_LOG_DEBUG("Not caching dependencies: \""
+                               << input << "\" was modified too recently");
+            return;
+        }
+
+        try {
+            entry << statResult.st_size << " " << mtime.tv_sec << " "
+                  << mtime.tv_nsec << " " << ctime.tv_sec << " "
+                  << ctime.tv_nsec << " "
+                  << digestToHex(DigestGenerator::make_digest_from_file(input))
+                  << " " << input << "\n";
+        }
+        catch (const std::exception &) {
+            return;
+        }
+    }
+
+    try {
+        const std::string directory = path.substr(0, path.rfind('/'));
+        buildboxcommon::FileUtils::createDirectory(directory.c_str());
+        buildboxcommon::FileUtils::writeFileAtomically(path, entry.str());
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_WARNING("Could not write dependency cache entry \""
+                             << path << "\": " << e.what());
+    }
+}
+
+} // namespace recc
+} // namespace BloombergLP
@@ -0,0 +1,72 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_DEPSCACHE
+#define INCLUDED_DEPSCACHE
+
+#include <parsedcommand.h>
+
+#include <ctime>
+#include <set>
+#include <string>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * Caches the dependencies reported by a compiler under RECC_DEPS_CACHE_DIR,
+ * so that unchanged compilations don't need to run the dependencies command
+ * again.
+ *
+ * Entries are keyed on the compiler binary, the dependencies command, the
+ * working directory and the environment that affects the compiler's search
+ * paths. Each entry records the size, timestamps and digest of every file
+ * the compiler read, and is only reused if all of them are unchanged.
+ *
+ * A header added to a directory that is searched before the one holding a
+ * previously found header is not detected.
+ */
+struct DepsCache {
+    /**
+     * Return whether the cache is enabled and can be used for `command`.
+     */
+    static bool enabled(const ParsedCommand &command);
+
+    /**
+     * If dependencies were stored for `command` and none of the files they
+     * were computed from have changed, write them to `dependencies` and
+     * return true.
+     */
+    static bool lookup(const ParsedCommand &command,
+                       std::set<std::string> *dependencies);
+
+    /**
+     * Record `dependencies` as the result for `command`. `inputs` lists every
+     * file read by the dependencies command, including those filtered out of
+     * `dependencies`.
+     *
+     * Nothing is stored if an input was modified after, or shortly before,
+     * `commandStartTime`, since the compiler may have seen a different
+     * version of it.
+     */
+    static void store(const ParsedCommand &command,
+                      const std::set<std::string> &inputs,
+                      const std::set<std::string> &dependencies,
+                      time_t commandStartTime);
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
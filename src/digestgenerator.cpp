@@ -14,17 +14,26 @@
 
 #include <blake3.h>
 #include <digestgenerator.h>
+#include <directorysnapshot.h>
 #include <hashtohex.h>
+#include <threadutils.h>
 
+#include <buildboxcommon_logging.h>
 #include <buildboxcommonmetrics_metricguard.h>
 #include <buildboxcommonmetrics_totaldurationmetrictimer.h>
 #include <env.h>
 
-#include <iomanip>
-#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <string>
+#include <system_error>
+#include <vector>
 
+#include <fcntl.h>
 #include <openssl/evp.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define TIMER_NAME_CALCULATE_DIGESTS_TOTAL "recc.calculate_digests_total"
 
@@ -33,6 +42,19 @@ namespace recc {
 
 namespace {
 
+// BLAKE3 blobs at least this large are hashed on several threads. Smaller
+// ones are hashed faster on the calling thread than it takes to start others.
+const size_t s_parallelHashThresholdBytes = 4 * 1024 * 1024;
+
+// Descriptors other than regular files are hashed this many bytes at a
+// time. It is a whole number of BLAKE3 chunks so that every update past the
+// first can be hashed as complete subtrees.
+const size_t s_readBufferSizeBytes = 1024 * 1024;
+
+// Regular files are read this many bytes at a time, so that large ones are
+// still hashed in parallel.
+const size_t s_fileBufferSizeBytes = s_parallelHashThresholdBytes;
+
 // If `status_code` is 0, throw an `std::runtime_error` exception with a
 // description containing `function_name`. Otherwise, do
 // nothing.
@@ -82,18 +104,6 @@ EVP_MD_CTX_ptr createDigestContext(const EVP_MD *digestFunctionStruct)
     return digest_context;
 }
 
-// Take a hash value produced by OpenSSL and return a string with its
-// representation in hexadecimal.
-//std::string hashToHex(const unsigned char *hash_buffer, unsigned int hash_size)
-//{
-    //std::ostringstream ss;
-    //for (unsigned int i = 0; i < hash_size; i++) {
-        //ss << std::hex << std::setw(2) << std::setfill('0')
-           //<< static_cast<int>(hash_buffer[i]);
-    //}
-    //return ss.str();
-//}
-
 // Get the OpenSSL MD struct for the digest function specified in the
 // configuration. (Throws `out_of_range` for values not defined.)
 const EVP_MD *getDigestFunctionStruct()
@@ -117,65 +127,213 @@ const EVP_MD *getDigestFunctionStruct()
 
     return digestValueToOpenSslStructMap.at(digestValue);
 }
-} // namespace
 
-proto::Digest DigestGenerator::make_digest(const std::string &blob)
+const EVP_MD *getDigestFunctionStructOrThrow()
 {
-
-    const EVP_MD *hashAlgorithm;
     try {
-        hashAlgorithm = getDigestFunctionStruct();
+        return getDigestFunctionStruct();
     }
     catch (const std::out_of_range &) {
         throw std::runtime_error("Invalid or not supported digest function: " +
                                  RECC_CAS_DIGEST_FUNCTION);
     }
+}
 
-    std::string hash;
-    proto::Digest result;
-    if (!hashAlgorithm) {
-      blake3_hasher b;
-      blake3_hasher_init(&b);
-      blake3_hasher_update(&b, &blob[0], blob.length());
-      unsigned char hashBuffer[BLAKE3_OUT_LEN];
-      blake3_hasher_finalize(&b, hashBuffer, BLAKE3_OUT_LEN);
-      result.set_hash_blake3zcc((const void *)&hashBuffer, BLAKE3_OUT_LEN);
-      //for (int i = 0; i < BLAKE3_OUT_LEN; i++) {
-        //printf("%d ", (int)hashBuffer[i]);
-      //}
-      //printf("\n");
+void throwSystemError(const std::string &operation)
+{
+    const int errorNumber = errno;
+    BUILDBOX_LOG_ERROR("Error calling " << operation << " while hashing: "
+                                        << strerror(errorNumber));
+    throw std::system_error(errorNumber, std::system_category(), operation);
+}
+
+// Feed `context` from `fd` using `read()` until end of file.
+void hashByReading(int fd, DigestContext *context)
+{
+    std::vector<char> buffer(s_readBufferSizeBytes);
+    while (true) {
+        const ssize_t bytesRead = read(fd, buffer.data(), buffer.size());
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throwSystemError("read()");
+        }
+        if (bytesRead == 0) {
+            return;
+        }
+        context->update(buffer.data(), static_cast<size_t>(bytesRead));
     }
-    else {
-      { // Timed block
-        buildboxcommon::buildboxcommonmetrics::MetricGuard<
-          buildboxcommon::buildboxcommonmetrics::TotalDurationMetricTimer>
-          mt(TIMER_NAME_CALCULATE_DIGESTS_TOTAL);
+}
 
-        // Initialize context:
-        EVP_MD_CTX_ptr hashContext = createDigestContext(hashAlgorithm);
-        // (Automatically destroyed)
+// Feed `context` with the contents of the regular file behind `fd`, which
+// `statResult` describes, reading it with `pread()` rather than mapping it
+// so that a file truncated by another process meanwhile can't raise
+// SIGBUS. Throws `std::runtime_error` if the file was modified while it was
+// read, since the digest would then match neither version of it.
+void hashRegularFile(int fd, const struct stat &statResult,
+                     DigestContext *context)
+{
+    const off_t size = statResult.st_size;
+    std::vector<char> buffer(
+        std::min(static_cast<size_t>(size), s_fileBufferSizeBytes));
+    off_t offset = 0;
+    while (offset < size) {
+        const size_t bytesToRead =
+            std::min(buffer.size(), static_cast<size_t>(size - offset));
+        const ssize_t bytesRead =
+            pread(fd, buffer.data(), bytesToRead, offset);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throwSystemError("pread()");
+        }
+        if (bytesRead == 0) {
+            break;
+        }
+        context->update(buffer.data(), static_cast<size_t>(bytesRead));
+        offset += bytesRead;
+    }
 
-        // Calculate hash:
+    struct stat statAfterReading;
+    if (fstat(fd, &statAfterReading) < 0) {
+        throwSystemError("fstat()");
+    }
+    if (offset != size ||
+        !StatSignature(statResult).matches(statAfterReading)) {
+        BUILDBOX_LOG_ERROR("File modified while hashing");
+        throw std::runtime_error("File modified while hashing");
+    }
+}
+} // namespace
+
+struct DigestContext::Impl {
+    const EVP_MD *d_algorithm;
+    EVP_MD_CTX_ptr d_evpContext;
+    blake3_hasher d_blake3Hasher;
+
+    Impl()
+        : d_algorithm(getDigestFunctionStructOrThrow()),
+          d_evpContext(nullptr, &deleteDigestContext)
+    {
+        if (d_algorithm) {
+            d_evpContext = createDigestContext(d_algorithm);
+        }
+        else {
+            blake3_hasher_init(&d_blake3Hasher);
+        }
+    }
+};
+
+DigestContext::DigestContext()
+    : d_impl(new Impl()), d_size(0), d_finalized(false)
+{
+}
+
+DigestContext::~DigestContext() {}
+
+void DigestContext::update(const char *data, size_t size)
+{
+    if (d_finalized) {
+        throw std::logic_error("DigestContext updated after finalize()");
+    }
+    if (size == 0) {
+        return;
+    }
+    if (d_impl->d_algorithm) {
         throwIfNotSuccessful(
-            EVP_DigestUpdate(hashContext.get(), &blob[0], blob.length()),
+            EVP_DigestUpdate(d_impl->d_evpContext.get(), data, size),
             "EVP_DigestUpdate()");
+    }
+    else {
+        const size_t threads = size < s_parallelHashThresholdBytes
+                                   ? 1
+                                   : ThreadUtils::maxThreads();
+        blake3_hasher_update_parallel(&d_impl->d_blake3Hasher, data, size,
+                                      threads);
+    }
+    d_size += size;
+}
+
+proto::Digest DigestContext::finalize()
+{
+    if (d_finalized) {
+        throw std::logic_error("DigestContext finalized twice");
+    }
+    d_finalized = true;
 
+    proto::Digest result;
+    if (d_impl->d_algorithm) {
         unsigned char hashBuffer[EVP_MAX_MD_SIZE];
         unsigned int messageLength;
-        throwIfNotSuccessful(
-            EVP_DigestFinal_ex(hashContext.get(), hashBuffer, &messageLength),
-            "EVP_DigestFinal_ex()");
+        throwIfNotSuccessful(EVP_DigestFinal_ex(d_impl->d_evpContext.get(),
+                                                hashBuffer, &messageLength),
+                             "EVP_DigestFinal_ex()");
 
         // Generate hash string:
-        hash = hashToHex(hashBuffer, static_cast<unsigned int>(messageLength));
-      }
-
-      result.set_hash_other(hash);
+        result.set_hash_other(
+            hashToHex(hashBuffer, static_cast<unsigned int>(messageLength)));
+    }
+    else {
+        unsigned char hashBuffer[BLAKE3_OUT_LEN];
+        blake3_hasher_finalize(&d_impl->d_blake3Hasher, hashBuffer,
+                               BLAKE3_OUT_LEN);
+        result.set_hash_blake3zcc(hashBuffer, BLAKE3_OUT_LEN);
     }
-    result.set_size_bytes(static_cast<google::protobuf::int64>(blob.size()));
+    result.set_size_bytes(static_cast<google::protobuf::int64>(d_size));
     return result;
 }
 
+proto::Digest DigestGenerator::make_digest(const std::string &blob)
+{
+    buildboxcommon::buildboxcommonmetrics::MetricGuard<
+        buildboxcommon::buildboxcommonmetrics::TotalDurationMetricTimer>
+        mt(TIMER_NAME_CALCULATE_DIGESTS_TOTAL);
+
+    DigestContext context;
+    context.update(blob.data(), blob.size());
+    return context.finalize();
+}
+
+proto::Digest DigestGenerator::make_digest_from_fd(int fd)
+{
+    buildboxcommon::buildboxcommonmetrics::MetricGuard<
+        buildboxcommon::buildboxcommonmetrics::TotalDurationMetricTimer>
+        mt(TIMER_NAME_CALCULATE_DIGESTS_TOTAL);
+
+    DigestContext context;
+
+    struct stat statResult;
+    if (fstat(fd, &statResult) < 0) {
+        throwSystemError("fstat()");
+    }
+    if (!S_ISREG(statResult.st_mode)) {
+        hashByReading(fd, &context);
+        return context.finalize();
+    }
+
+    hashRegularFile(fd, statResult, &context);
+    return context.finalize();
+}
+
+proto::Digest DigestGenerator::make_digest_from_file(const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throwSystemError("open(\"" + path + "\")");
+    }
+    try {
+        const proto::Digest digest = make_digest_from_fd(fd);
+        close(fd);
+        return digest;
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
 proto::Digest
 DigestGenerator::make_digest(const google::protobuf::MessageLite &message)
 {
@@ -17,17 +17,73 @@
 
 #include <protos.h>
 
+#include <cstddef>
 #include <map>
+#include <memory>
+#include <string>
 
 namespace BloombergLP {
 namespace recc {
 
+/**
+ * Computes the digest of a blob that is supplied in pieces, using the digest
+ * function selected by RECC_CAS_DIGEST_FUNCTION. This allows large inputs to
+ * be hashed without holding all of them in memory at once.
+ */
+class DigestContext {
+  public:
+    /**
+     * Throws `std::runtime_error` if the configured digest function is not
+     * supported.
+     */
+    DigestContext();
+    ~DigestContext();
+
+    DigestContext(const DigestContext &) = delete;
+    DigestContext &operator=(const DigestContext &) = delete;
+
+    /**
+     * Append `size` bytes starting at `data` to the blob being hashed.
+     */
+    void update(const char *data, size_t size);
+
+    /**
+     * Return the digest of everything passed to `update()`. The context
+     * cannot be used again afterwards.
+     */
+    proto::Digest finalize();
+
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> d_impl;
+    size_t d_size;
+    bool d_finalized;
+};
+
 struct DigestGenerator {
     static proto::Digest make_digest(const std::string &blob);
 
     static proto::Digest
     make_digest(const google::protobuf::MessageLite &message);
 
+    /**
+     * Return the digest of the data behind the file descriptor `fd`.
+     * Regular files are hashed in full, regardless of the descriptor's
+     * offset, a bounded piece at a time so that memory use does not grow
+     * with the size of the file. Other descriptors, such as pipes, are read
+     * from their current position until end of file.
+     *
+     * Throws `std::system_error` if reading fails, and
+     * `std::runtime_error` if a regular file is modified while it is read.
+     */
+    static proto::Digest make_digest_from_fd(int fd);
+
+    /**
+     * Return the digest of the contents of the file at `path`, as with
+     * `make_digest_from_fd()`.
+     */
+    static proto::Digest make_digest_from_file(const std::string &path);
+
     static const std::map<std::string, proto::DigestFunction_Value> &
     stringToDigestFunctionMap();
 
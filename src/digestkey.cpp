@@ -0,0 +1,77 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <digestkey.h>
+
+#include <hashtohex.h>
+
+#include <stdexcept>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+// Length of the raw hashes stored in `hash_blake3zcc`.
+const size_t s_blake3zccHashLength = 32;
+
+} // namespace
+
+const size_t DigestKey::MAX_HASH_LENGTH;
+
+DigestKey::DigestKey(const proto::Digest &digest)
+    : d_hash(), d_hashLength(0), d_blake3zcc(false),
+      d_sizeBytes(digest.size_bytes())
+{
+    if (digest.hash_other().empty() && !digest.hash_blake3zcc().empty()) {
+        if (digest.hash_blake3zcc().size() != s_blake3zccHashLength) {
+            throw std::invalid_argument("Invalid BLAKE3ZCC digest of " +
+                                        std::to_string(digest.size_bytes()) +
+                                        " bytes");
+        }
+        std::memcpy(d_hash, digest.hash_blake3zcc().data(),
+                    s_blake3zccHashLength);
+        d_hashLength = static_cast<uint8_t>(s_blake3zccHashLength);
+        d_blake3zcc = true;
+        return;
+    }
+
+    size_t length = 0;
+    if (!hexToHash(digest.hash_other(), d_hash, MAX_HASH_LENGTH, &length)) {
+        throw std::invalid_argument("Invalid digest hash \"" +
+                                    digest.hash_other() + "\"");
+    }
+    d_hashLength = static_cast<uint8_t>(length);
+}
+
+proto::Digest DigestKey::to_digest() const
+{
+    proto::Digest digest;
+    if (d_blake3zcc) {
+        digest.set_hash_blake3zcc(d_hash, d_hashLength);
+    }
+    else {
+        digest.set_hash_other(hashToHex(d_hash, d_hashLength));
+    }
+    digest.set_size_bytes(d_sizeBytes);
+    return digest;
+}
+
+std::ostream &operator<<(std::ostream &out, const DigestKey &key)
+{
+    return out << key.to_digest();
+}
+
+} // namespace recc
+} // namespace BloombergLP
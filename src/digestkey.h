@@ -0,0 +1,105 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_DIGESTKEY
+#define INCLUDED_DIGESTKEY
+
+#include <protos.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * A `proto::Digest` stored as the raw bytes of its hash and its size, for
+ * use as a key in hash maps and sets.
+ *
+ * Building one from a `proto::Digest` decodes the hexadecimal hash once;
+ * comparing and hashing keys then doesn't allocate or serialize anything.
+ * Convert back with `to_digest()` when building requests.
+ */
+class DigestKey {
+  public:
+    /**
+     * Large enough for the raw bytes of a SHA-512 hash.
+     */
+    static const size_t MAX_HASH_LENGTH = 64;
+
+    DigestKey()
+        : d_hash(), d_hashLength(0), d_blake3zcc(false), d_sizeBytes(0)
+    {
+    }
+
+    /**
+     * Implicit, so that a `proto::Digest` can be used to look up keys.
+     * Throws `std::invalid_argument` if the hash is not a lowercase
+     * hexadecimal string of at most `MAX_HASH_LENGTH` bytes, or a BLAKE3ZCC
+     * hash of the wrong length.
+     */
+    DigestKey(const proto::Digest &digest);
+
+    proto::Digest to_digest() const;
+
+    int64_t size_bytes() const { return d_sizeBytes; }
+
+    bool operator==(const DigestKey &other) const
+    {
+        return d_sizeBytes == other.d_sizeBytes &&
+               d_hashLength == other.d_hashLength &&
+               d_blake3zcc == other.d_blake3zcc &&
+               std::memcmp(d_hash, other.d_hash, d_hashLength) == 0;
+    }
+
+    bool operator!=(const DigestKey &other) const { return !(*this == other); }
+
+    /**
+     * The bytes of a cryptographic hash are already evenly distributed, so
+     * the first few of them are used as they are.
+     */
+    size_t hash() const
+    {
+        uint64_t prefix = 0;
+        std::memcpy(&prefix, d_hash, sizeof(prefix));
+        return static_cast<size_t>(prefix ^
+                                   static_cast<uint64_t>(d_sizeBytes));
+    }
+
+  private:
+    uint8_t d_hash[MAX_HASH_LENGTH];
+    uint8_t d_hashLength;
+    // Whether the hash goes in `hash_blake3zcc` rather than `hash_other`.
+    bool d_blake3zcc;
+    int64_t d_sizeBytes;
+};
+
+std::ostream &operator<<(std::ostream &out, const DigestKey &key);
+
+} // namespace recc
+} // namespace BloombergLP
+
+namespace std {
+template <> struct hash<BloombergLP::recc::DigestKey> {
+    size_t operator()(const BloombergLP::recc::DigestKey &key) const
+    {
+        return key.hash();
+    }
+};
+} // namespace std
+
+#endif
@@ -0,0 +1,365 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <directorysnapshot.h>
+
+#include <digestgenerator.h>
+#include <env.h>
+#include <fileutils.h>
+#include <hashtohex.h>
+
+#include <buildboxcommon_fileutils.h>
+#include <buildboxcommon_logging.h>
+
+#include <unistd.h>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+const char s_snapshotHeader[] = "recc-directory-snapshot 1";
+
+// Entries modified less than this long before they were looked at are
+// not trusted later, to allow for coarse filesystem timestamps.
+const time_t s_minimumEntryAgeSeconds = 2;
+
+// Deeper trees than this are taken to be corrupt snapshots.
+const size_t s_maxDepth = 4096;
+
+std::string digestToHex(const proto::Digest &digest)
+{
+    if (!digest.hash_other().empty()) {
+        return digest.hash_other();
+    }
+    return hashToHex(
+        reinterpret_cast<const unsigned char *>(digest.hash_blake3zcc().data()),
+        static_cast<unsigned int>(digest.hash_blake3zcc().size()));
+}
+
+std::string absoluteRoot(const std::string &root)
+{
+    if (!root.empty() && root[0] == '/') {
+        return buildboxcommon::FileUtils::normalizePath(root.c_str());
+    }
+    const std::string absolute =
+        FileUtils::getCurrentWorkingDirectory() + "/" + root;
+    return buildboxcommon::FileUtils::normalizePath(absolute.c_str());
+}
+
+// Return the path of the snapshot of the tree at `absoluteRoot`.
+std::string snapshotPath(const std::string &absoluteRoot)
+{
+    std::string key(s_snapshotHeader);
+    key.push_back('\0');
+    key.append(RECC_CAS_DIGEST_FUNCTION);
+    key.push_back('\0');
+    key.append(absoluteRoot);
+    return RECC_DIRECTORY_SNAPSHOT_DIR + "/" +
+           digestToHex(DigestGenerator::make_digest(key));
+}
+
+/**
+ * Writes a snapshot as a sequence of varints and length-prefixed strings.
+ */
+class SnapshotWriter {
+  public:
+    SnapshotWriter(std::string *data, time_t walkStartTime)
+        : d_data(data), d_walkStartTime(walkStartTime)
+    {
+    }
+
+    void writeInteger(uint64_t value)
+    {
+        while (value >= 0x80) {
+            d_data->push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        d_data->push_back(static_cast<char>(value));
+    }
+
+    void writeString(const std::string &value)
+    {
+        writeInteger(value.size());
+        d_data->append(value);
+    }
+
+    void writeSignature(const StatSignature &signature)
+    {
+        // Recently modified entries are stored with a signature that
+        // matches nothing.
+        const StatSignature &written = signature.isRecent(d_walkStartTime)
+                                           ? StatSignature()
+                                           : signature;
+        writeInteger(written.d_device);
+        writeInteger(written.d_inode);
+        writeInteger(written.d_mode);
+        writeInteger(static_cast<uint64_t>(written.d_size));
+        writeInteger(static_cast<uint64_t>(written.d_mtimeSeconds));
+        writeInteger(written.d_mtimeNanoseconds);
+        writeInteger(static_cast<uint64_t>(written.d_ctimeSeconds));
+        writeInteger(written.d_ctimeNanoseconds);
+    }
+
+    void writeDirectory(const SnapshotDirectory &directory)
+    {
+        writeString(directory.d_name);
+        writeSignature(directory.d_stat);
+        writeInteger((directory.d_empty ? 1 : 0) |
+                     (directory.d_present ? 2 : 0));
+        writeString(directory.d_present
+                        ? directory.d_digest.SerializeAsString()
+                        : std::string());
+
+        writeInteger(directory.d_files.size());
+        for (const SnapshotEntry &file : directory.d_files) {
+            writeString(file.d_name);
+            writeSignature(file.d_stat);
+            writeString(file.d_digest.SerializeAsString());
+            writeInteger((file.d_executable ? 1 : 0) |
+                         (file.d_symlink ? 2 : 0));
+            writeString(file.d_symlinkTarget);
+        }
+
+        writeInteger(directory.d_subdirectories.size());
+        for (const SnapshotDirectory &subdirectory :
+             directory.d_subdirectories) {
+            writeDirectory(subdirectory);
+        }
+    }
+
+  private:
+    std::string *d_data;
+    time_t d_walkStartTime;
+};
+
+/**
+ * Reads what `SnapshotWriter` wrote. Every method returns false if the data
+ * is truncated or malformed.
+ */
+class SnapshotReader {
+  public:
+    explicit SnapshotReader(const std::string &data)
+        : d_position(data.data()), d_end(data.data() + data.size())
+    {
+    }
+
+    bool atEnd() const { return d_position == d_end; }
+
+    bool readInteger(uint64_t *value)
+    {
+        *value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (d_position == d_end) {
+                return false;
+            }
+            const uint8_t byte = static_cast<uint8_t>(*d_position++);
+            *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool readString(std::string *value)
+    {
+        uint64_t length = 0;
+        if (!readInteger(&length) ||
+            length > static_cast<uint64_t>(d_end - d_position)) {
+            return false;
+        }
+        value->assign(d_position, static_cast<size_t>(length));
+        d_position += length;
+        return true;
+    }
+
+    bool readSignature(StatSignature *signature)
+    {
+        uint64_t fields[8];
+        for (uint64_t &field : fields) {
+            if (!readInteger(&field)) {
+                return false;
+            }
+        }
+        signature->d_device = fields[0];
+        signature->d_inode = fields[1];
+        signature->d_mode = static_cast<uint32_t>(fields[2]);
+        signature->d_size = static_cast<int64_t>(fields[3]);
+        signature->d_mtimeSeconds = static_cast<int64_t>(fields[4]);
+        signature->d_mtimeNanoseconds = static_cast<uint32_t>(fields[5]);
+        signature->d_ctimeSeconds = static_cast<int64_t>(fields[6]);
+        signature->d_ctimeNanoseconds = static_cast<uint32_t>(fields[7]);
+        return true;
+    }
+
+    bool readDigest(proto::Digest *digest)
+    {
+        std::string serialized;
+        return readString(&serialized) && digest->ParseFromString(serialized);
+    }
+
+    bool readDirectory(SnapshotDirectory *directory, size_t depth)
+    {
+        uint64_t flags = 0;
+        if (depth > s_maxDepth || !readString(&directory->d_name) ||
+            !readSignature(&directory->d_stat) || !readInteger(&flags) ||
+            !readDigest(&directory->d_digest)) {
+            return false;
+        }
+        directory->d_empty = (flags & 1) != 0;
+        directory->d_present = (flags & 2) != 0;
+
+        uint64_t fileCount = 0;
+        if (!readInteger(&fileCount) ||
+            fileCount > static_cast<uint64_t>(d_end - d_position)) {
+            return false;
+        }
+        directory->d_files.resize(static_cast<size_t>(fileCount));
+        for (SnapshotEntry &file : directory->d_files) {
+            if (!readString(&file.d_name) || !readSignature(&file.d_stat) ||
+                !readDigest(&file.d_digest) || !readInteger(&flags) ||
+                !readString(&file.d_symlinkTarget)) {
+                return false;
+            }
+            file.d_executable = (flags & 1) != 0;
+            file.d_symlink = (flags & 2) != 0;
+        }
+
+        uint64_t subdirectoryCount = 0;
+        if (!readInteger(&subdirectoryCount) ||
+            subdirectoryCount > static_cast<uint64_t>(d_end - d_position)) {
+            return false;
+        }
+        directory->d_subdirectories.resize(
+            static_cast<size_t>(subdirectoryCount));
+        for (SnapshotDirectory &subdirectory : directory->d_subdirectories) {
+            if (!readDirectory(&subdirectory, depth + 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    const char *d_position;
+    const char *d_end;
+};
+
+} // namespace
+
+StatSignature::StatSignature(const struct stat &statResult)
+    : d_device(static_cast<uint64_t>(statResult.st_dev)),
+      d_inode(static_cast<uint64_t>(statResult.st_ino)),
+      d_mode(static_cast<uint32_t>(statResult.st_mode)),
+      d_size(static_cast<int64_t>(statResult.st_size)),
+      d_mtimeSeconds(static_cast<int64_t>(
+          FileUtils::modificationTime(statResult).tv_sec)),
+      d_ctimeSeconds(
+          static_cast<int64_t>(FileUtils::changeTime(statResult).tv_sec)),
+      d_mtimeNanoseconds(static_cast<uint32_t>(
+          FileUtils::modificationTime(statResult).tv_nsec)),
+      d_ctimeNanoseconds(
+          static_cast<uint32_t>(FileUtils::changeTime(statResult).tv_nsec))
+{
+}
+
+bool StatSignature::matches(const struct stat &statResult) const
+{
+    // Every real `st_mode` has the bits of a file type set.
+    if (d_mode == 0) {
+        return false;
+    }
+    const StatSignature other(statResult);
+    return d_device == other.d_device && d_inode == other.d_inode &&
+           d_mode == other.d_mode && d_size == other.d_size &&
+           d_mtimeSeconds == other.d_mtimeSeconds &&
+           d_mtimeNanoseconds == other.d_mtimeNanoseconds &&
+           d_ctimeSeconds == other.d_ctimeSeconds &&
+           d_ctimeNanoseconds == other.d_ctimeNanoseconds;
+}
+
+bool StatSignature::isRecent(time_t time) const
+{
+    const time_t newestTrusted = time - s_minimumEntryAgeSeconds;
+    return d_mtimeSeconds >= newestTrusted || d_ctimeSeconds >= newestTrusted;
+}
+
+bool DirectorySnapshot::enabled()
+{
+    return !RECC_DIRECTORY_SNAPSHOT_DIR.empty();
+}
+
+bool DirectorySnapshot::lookup(const std::string &root,
+                               SnapshotDirectory *snapshot)
+{
+    const std::string absolute = absoluteRoot(root);
+    const std::string path = snapshotPath(absolute);
+    if (access(path.c_str(), R_OK) != 0) {
+        return false;
+    }
+
+    std::string contents;
+    try {
+        contents = buildboxcommon::FileUtils::getFileContents(path.c_str());
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_DEBUG("Could not read directory snapshot \""
+                           << path << "\": " << e.what());
+        return false;
+    }
+
+    SnapshotReader reader(contents);
+    std::string header;
+    std::string storedRoot;
+    if (!reader.readString(&header) || header != s_snapshotHeader ||
+        !reader.readString(&storedRoot) || storedRoot != absolute ||
+        !reader.readDirectory(snapshot, 0) || !reader.atEnd()) {
+        BUILDBOX_LOG_WARNING("Ignoring malformed directory snapshot \""
+                             << path << "\"");
+        *snapshot = SnapshotDirectory();
+        return false;
+    }
+
+    BUILDBOX_LOG_DEBUG("Using directory snapshot \"" << path << "\" of \""
+                                                     << absolute << "\"");
+    return true;
+}
+
+void DirectorySnapshot::store(const std::string &root,
+                              const SnapshotDirectory &snapshot,
+                              time_t walkStartTime)
+{
+    const std::string absolute = absoluteRoot(root);
+    const std::string path = snapshotPath(absolute);
+
+    std::string contents;
+    SnapshotWriter writer(&contents, walkStartTime);
+    writer.writeString(s_snapshotHeader);
+    writer.writeString(absolute);
+    writer.writeDirectory(snapshot);
+
+    try {
+        buildboxcommon::FileUtils::createDirectory(
+            RECC_DIRECTORY_SNAPSHOT_DIR.c_str());
+        buildboxcommon::FileUtils::writeFileAtomically(path, contents);
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_WARNING("Could not write directory snapshot \""
+                             << path << "\": " << e.what());
+    }
+}
+
+} // namespace recc
+} // namespace BloombergLP
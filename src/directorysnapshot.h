@@ -0,0 +1,127 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_DIRECTORYSNAPSHOT
+#define INCLUDED_DIRECTORYSNAPSHOT
+
+#include <protos.h>
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * The parts of a `stat()` result that change when a file or directory is
+ * modified, replaced or has its permissions changed.
+ *
+ * A default-constructed signature matches nothing.
+ */
+struct StatSignature {
+    uint64_t d_device = 0;
+    uint64_t d_inode = 0;
+    uint32_t d_mode = 0;
+    int64_t d_size = 0;
+    int64_t d_mtimeSeconds = 0;
+    int64_t d_ctimeSeconds = 0;
+    uint32_t d_mtimeNanoseconds = 0;
+    uint32_t d_ctimeNanoseconds = 0;
+
+    StatSignature() = default;
+    explicit StatSignature(const struct stat &statResult);
+
+    bool matches(const struct stat &statResult) const;
+
+    /**
+     * Whether the entry was modified or changed so shortly before `time`
+     * that, on a filesystem with coarse timestamps, a further change might
+     * leave its signature the same. Such signatures are not to be trusted
+     * by later lookups.
+     */
+    bool isRecent(time_t time) const;
+};
+
+/**
+ * A file or symlink found in a directory.
+ */
+struct SnapshotEntry {
+    std::string d_name;
+    StatSignature d_stat;
+    proto::Digest d_digest;
+    bool d_executable = false;
+    bool d_symlink = false;
+    std::string d_symlinkTarget;
+};
+
+/**
+ * A directory as last walked, with what was found in it.
+ */
+struct SnapshotDirectory {
+    std::string d_name;
+    StatSignature d_stat;
+    // Whether the directory had no entries at all.
+    bool d_empty = false;
+    // The supported files and symlinks, sorted by name.
+    std::vector<SnapshotEntry> d_files;
+    // Sorted by name.
+    std::vector<SnapshotDirectory> d_subdirectories;
+    // Whether the directory is part of the input tree, which those holding
+    // only unsupported entries are not.
+    bool d_present = false;
+    // The digest of the `Directory` message of a present directory, and,
+    // while walking, the message itself. Only the digest is stored.
+    proto::Digest d_digest;
+    std::string d_blob;
+};
+
+/**
+ * Stores the state of directory trees walked by `make_nesteddirectory()`
+ * under RECC_DIRECTORY_SNAPSHOT_DIR, so that the next walk of the same tree
+ * only lists the directories and hashes the files that changed since, and
+ * reuses the digests of the subtrees that didn't.
+ *
+ * A directory's listing is reused while its own `stat()` result is
+ * unchanged, and a file's digest while the file's is. Entries whose
+ * timestamps were too recent when they were recorded are never reused,
+ * since a further change within the timestamp granularity of the
+ * filesystem would go unnoticed.
+ */
+struct DirectorySnapshot {
+    /**
+     * Return whether RECC_DIRECTORY_SNAPSHOT_DIR is set.
+     */
+    static bool enabled();
+
+    /**
+     * If a snapshot of the tree at `root` was stored with the configured
+     * digest function, write it to `snapshot` and return true.
+     */
+    static bool lookup(const std::string &root, SnapshotDirectory *snapshot);
+
+    /**
+     * Record `snapshot` as the state of the tree at `root`, as found by a
+     * walk that started at `walkStartTime`.
+     */
+    static void store(const std::string &root,
+                      const SnapshotDirectory &snapshot, time_t walkStartTime);
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
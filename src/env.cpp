@@ -61,6 +61,8 @@ std::string RECC_METRICS_FILE = DEFAULT_RECC_METRICS_FILE;
 std::string RECC_METRICS_UDP_SERVER = DEFAULT_RECC_METRICS_UDP_SERVER;
 std::string RECC_PREFIX_MAP = DEFAULT_RECC_PREFIX_MAP;
 std::vector<std::pair<std::string, std::string>> RECC_PREFIX_REPLACEMENT;
+PathPrefixMatcher RECC_PREFIX_REPLACEMENT_MATCHER;
+PathPrefixMatcher RECC_DEPS_EXCLUDE_PATHS_MATCHER;
 
 std::string RECC_CAS_DIGEST_FUNCTION = DEFAULT_RECC_CAS_DIGEST_FUNCTION;
 std::string RECC_WORKING_DIR_PREFIX = DEFAULT_RECC_WORKING_DIR_PREFIX;
@@ -75,6 +77,7 @@ bool RECC_SERVER_AUTH_GOOGLEAPI = DEFAULT_RECC_SERVER_AUTH_GOOGLEAPI;
 bool RECC_SERVER_SSL =
     DEFAULT_RECC_SERVER_SSL; // deprecated: inferred from URL
 bool RECC_DEPS_GLOBAL_PATHS = DEFAULT_RECC_DEPS_GLOBAL_PATHS;
+bool RECC_DEPS_SCAN = DEFAULT_RECC_DEPS_SCAN;
 bool RECC_VERBOSE = DEFAULT_RECC_VERBOSE;
 bool RECC_CAS_GET_CAPABILITIES = false;
 
@@ -112,6 +115,19 @@ std::map<std::string, std::string> RECC_REMOTE_PLATFORM =
 // Keep this empty initially and have set_config_locations() populate it
 std::deque<std::string> RECC_CONFIG_LOCATIONS = {};
 int RECC_MAX_THREADS = DEFAULT_RECC_MAX_THREADS;
+std::string RECC_FILE_DIGEST_CACHE_DIR = DEFAULT_RECC_FILE_DIGEST_CACHE_DIR;
+int RECC_FILE_DIGEST_CACHE_MAX_ENTRIES =
+    DEFAULT_RECC_FILE_DIGEST_CACHE_MAX_ENTRIES;
+std::string RECC_DEPS_CACHE_DIR = DEFAULT_RECC_DEPS_CACHE_DIR;
+std::string RECC_DIRECTORY_SNAPSHOT_DIR = DEFAULT_RECC_DIRECTORY_SNAPSHOT_DIR;
+std::string RECC_DAEMON_SOCKET = DEFAULT_RECC_DAEMON_SOCKET;
+int RECC_DAEMON_WORKERS = DEFAULT_RECC_DAEMON_WORKERS;
+bool RECC_SPECULATIVE_UPLOAD = DEFAULT_RECC_SPECULATIVE_UPLOAD;
+int RECC_MAX_CONCURRENT_BATCH_UPLOADS =
+    DEFAULT_RECC_MAX_CONCURRENT_BATCH_UPLOADS;
+int RECC_MAX_CONCURRENT_STREAM_UPLOADS =
+    DEFAULT_RECC_MAX_CONCURRENT_STREAM_UPLOADS;
+int RECC_MAX_UPLOAD_BYTES_IN_FLIGHT = DEFAULT_RECC_MAX_UPLOAD_BYTES_IN_FLIGHT;
 
 std::string RECC_REAPI_VERSION = DEFAULT_RECC_REAPI_VERSION;
 
@@ -300,6 +316,10 @@ void Env::parse_config_variables(const char *const *env)
         STRVAR(RECC_CAS_DIGEST_FUNCTION)
         STRVAR(RECC_WORKING_DIR_PREFIX)
         STRVAR(RECC_REAPI_VERSION)
+        STRVAR(RECC_FILE_DIGEST_CACHE_DIR)
+        STRVAR(RECC_DEPS_CACHE_DIR)
+        STRVAR(RECC_DIRECTORY_SNAPSHOT_DIR)
+        STRVAR(RECC_DAEMON_SOCKET)
 
         BOOLVAR(RECC_VERBOSE)
         BOOLVAR(RECC_ENABLE_METRICS)
@@ -311,11 +331,18 @@ void Env::parse_config_variables(const char *const *env)
         BOOLVAR(RECC_SERVER_AUTH_GOOGLEAPI)
         BOOLVAR(RECC_SERVER_SSL)
         BOOLVAR(RECC_DEPS_GLOBAL_PATHS)
+        BOOLVAR(RECC_DEPS_SCAN)
         BOOLVAR(RECC_CAS_GET_CAPABILITIES)
+        BOOLVAR(RECC_SPECULATIVE_UPLOAD)
 
         INTVAR(RECC_RETRY_LIMIT)
         INTVAR(RECC_RETRY_DELAY)
         INTVAR(RECC_MAX_THREADS)
+        INTVAR(RECC_FILE_DIGEST_CACHE_MAX_ENTRIES)
+        INTVAR(RECC_DAEMON_WORKERS)
+        INTVAR(RECC_MAX_CONCURRENT_BATCH_UPLOADS)
+        INTVAR(RECC_MAX_CONCURRENT_STREAM_UPLOADS)
+        INTVAR(RECC_MAX_UPLOAD_BYTES_IN_FLIGHT)
 
         SETVAR(RECC_DEPS_OVERRIDE, ',')
         SETVAR(RECC_OUTPUT_FILES_OVERRIDE, ',')
@@ -432,6 +459,7 @@ void Env::handle_special_defaults()
         RECC_PREFIX_REPLACEMENT =
             Env::vector_from_delimited_string(RECC_PREFIX_MAP);
     }
+    compile_path_matchers();
 
     if (DigestGenerator::stringToDigestFunctionMap().count(
             RECC_CAS_DIGEST_FUNCTION) == 0) {
@@ -446,6 +474,18 @@ void Env::handle_special_defaults()
     }
 }
 
+void Env::compile_path_matchers()
+{
+    std::vector<std::string> replacedPrefixes;
+    replacedPrefixes.reserve(RECC_PREFIX_REPLACEMENT.size());
+    for (const auto &pair : RECC_PREFIX_REPLACEMENT) {
+        replacedPrefixes.push_back(pair.first);
+    }
+    RECC_PREFIX_REPLACEMENT_MATCHER = PathPrefixMatcher(replacedPrefixes);
+    RECC_DEPS_EXCLUDE_PATHS_MATCHER =
+        PathPrefixMatcher(RECC_DEPS_EXCLUDE_PATHS);
+}
+
 void Env::assert_reapi_version_is_valid()
 {
     if (!proto::s_reapiSupportedVersions.count(RECC_REAPI_VERSION)) {
@@ -551,6 +591,79 @@ Env::vector_from_delimited_string(std::string prefix_map,
     return return_vector;
 }
 
+void Env::reset_config_variables()
+{
+    RECC_SERVER = "";
+    RECC_CAS_SERVER = "";
+    RECC_ACTION_CACHE_SERVER = "";
+
+    RECC_INSTANCE = DEFAULT_RECC_INSTANCE;
+    RECC_DEPS_DIRECTORY_OVERRIDE = DEFAULT_RECC_DEPS_DIRECTORY_OVERRIDE;
+    RECC_PROJECT_ROOT = DEFAULT_RECC_PROJECT_ROOT;
+    TMPDIR = DEFAULT_RECC_TMPDIR;
+    RECC_ACCESS_TOKEN_PATH = DEFAULT_RECC_ACCESS_TOKEN_PATH;
+    RECC_CORRELATED_INVOCATIONS_ID = DEFAULT_RECC_CORRELATED_INVOCATIONS_ID;
+    RECC_METRICS_FILE = DEFAULT_RECC_METRICS_FILE;
+    RECC_METRICS_UDP_SERVER = DEFAULT_RECC_METRICS_UDP_SERVER;
+    RECC_PREFIX_MAP = DEFAULT_RECC_PREFIX_MAP;
+    RECC_PREFIX_REPLACEMENT.clear();
+
+    RECC_CAS_DIGEST_FUNCTION = DEFAULT_RECC_CAS_DIGEST_FUNCTION;
+    RECC_WORKING_DIR_PREFIX = DEFAULT_RECC_WORKING_DIR_PREFIX;
+
+    RECC_ENABLE_METRICS = DEFAULT_RECC_ENABLE_METRICS;
+    RECC_FORCE_REMOTE = DEFAULT_RECC_FORCE_REMOTE;
+    RECC_CACHE_ONLY = DEFAULT_RECC_CACHE_ONLY;
+    RECC_ACTION_UNCACHEABLE = DEFAULT_RECC_ACTION_UNCACHEABLE;
+    RECC_SKIP_CACHE = DEFAULT_RECC_SKIP_CACHE;
+    RECC_DONT_SAVE_OUTPUT = DEFAULT_RECC_DONT_SAVE_OUTPUT;
+    RECC_SERVER_AUTH_GOOGLEAPI = DEFAULT_RECC_SERVER_AUTH_GOOGLEAPI;
+    RECC_SERVER_SSL = DEFAULT_RECC_SERVER_SSL;
+    RECC_DEPS_GLOBAL_PATHS = DEFAULT_RECC_DEPS_GLOBAL_PATHS;
+    RECC_DEPS_SCAN = DEFAULT_RECC_DEPS_SCAN;
+    RECC_VERBOSE = DEFAULT_RECC_VERBOSE;
+    RECC_CAS_GET_CAPABILITIES = false;
+
+    RECC_RETRY_LIMIT = DEFAULT_RECC_RETRY_LIMIT;
+    RECC_RETRY_DELAY = DEFAULT_RECC_RETRY_DELAY;
+
+    RECC_AUTH_UNCONFIGURED_MSG = DEFAULT_RECC_AUTH_UNCONFIGURED_MSG;
+
+#ifdef CMAKE_INSTALL_DIR
+    RECC_INSTALL_DIR = std::string(CMAKE_INSTALL_DIR);
+#else
+    RECC_INSTALL_DIR = std::string("");
+#endif
+
+    RECC_DEPS_OVERRIDE = DEFAULT_RECC_DEPS_OVERRIDE;
+    RECC_OUTPUT_FILES_OVERRIDE = DEFAULT_RECC_OUTPUT_FILES_OVERRIDE;
+    RECC_OUTPUT_DIRECTORIES_OVERRIDE = DEFAULT_RECC_OUTPUT_DIRECTORIES_OVERRIDE;
+    RECC_DEPS_EXCLUDE_PATHS = DEFAULT_RECC_DEPS_EXCLUDE_PATHS;
+    compile_path_matchers();
+
+    RECC_DEPS_ENV = DEFAULT_RECC_DEPS_ENV;
+    RECC_REMOTE_ENV = DEFAULT_RECC_REMOTE_ENV;
+    RECC_REMOTE_PLATFORM = DEFAULT_RECC_REMOTE_PLATFORM;
+
+    RECC_CONFIG_LOCATIONS.clear();
+    RECC_MAX_THREADS = DEFAULT_RECC_MAX_THREADS;
+    RECC_FILE_DIGEST_CACHE_DIR = DEFAULT_RECC_FILE_DIGEST_CACHE_DIR;
+    RECC_FILE_DIGEST_CACHE_MAX_ENTRIES =
+        DEFAULT_RECC_FILE_DIGEST_CACHE_MAX_ENTRIES;
+    RECC_DEPS_CACHE_DIR = DEFAULT_RECC_DEPS_CACHE_DIR;
+    RECC_DIRECTORY_SNAPSHOT_DIR = DEFAULT_RECC_DIRECTORY_SNAPSHOT_DIR;
+    RECC_DAEMON_SOCKET = DEFAULT_RECC_DAEMON_SOCKET;
+    RECC_DAEMON_WORKERS = DEFAULT_RECC_DAEMON_WORKERS;
+    RECC_SPECULATIVE_UPLOAD = DEFAULT_RECC_SPECULATIVE_UPLOAD;
+    RECC_MAX_CONCURRENT_BATCH_UPLOADS =
+        DEFAULT_RECC_MAX_CONCURRENT_BATCH_UPLOADS;
+    RECC_MAX_CONCURRENT_STREAM_UPLOADS =
+        DEFAULT_RECC_MAX_CONCURRENT_STREAM_UPLOADS;
+    RECC_MAX_UPLOAD_BYTES_IN_FLIGHT = DEFAULT_RECC_MAX_UPLOAD_BYTES_IN_FLIGHT;
+
+    RECC_REAPI_VERSION = DEFAULT_RECC_REAPI_VERSION;
+}
+
 void Env::set_config_locations()
 {
     set_config_locations(Env::evaluate_config_locations());
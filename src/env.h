@@ -15,6 +15,8 @@
 #ifndef INCLUDED_ENV
 #define INCLUDED_ENV
 
+#include <pathprefixmatcher.h>
+
 #include <deque>
 #include <map>
 #include <set>
@@ -36,7 +38,9 @@ extern std::string RECC_SERVER;
 extern std::string RECC_CAS_SERVER;
 
 /**
- * Whether to issue a `GetCapabilities()` request to the CAS server.
+ * Whether to issue a `GetCapabilities()` request to the CAS server. Small
+ * outputs are only fetched with BatchReadBlobs once the server's batch limit
+ * is known this way.
  */
 extern bool RECC_CAS_GET_CAPABILITIES;
 
@@ -86,6 +90,13 @@ extern std::string RECC_METRICS_UDP_SERVER;
  */
 extern bool RECC_DEPS_GLOBAL_PATHS;
 
+/**
+ * If set, recc finds the dependencies of GCC and Clang commands by reading
+ * the source and the headers it includes, rather than by running the
+ * compiler, falling back to the compiler for includes it can't follow.
+ */
+extern bool RECC_DEPS_SCAN;
+
 /**
  * The location to store temporary files. (Currently used only by the tests.)
  */
@@ -232,6 +243,14 @@ extern std::map<std::string, std::string> RECC_REMOTE_PLATFORM;
 extern std::vector<std::pair<std::string, std::string>>
     RECC_PREFIX_REPLACEMENT;
 
+/**
+ * The prefixes of RECC_PREFIX_REPLACEMENT and RECC_DEPS_EXCLUDE_PATHS,
+ * compiled by `Env::compile_path_matchers()` when the configuration is
+ * parsed.
+ */
+extern PathPrefixMatcher RECC_PREFIX_REPLACEMENT_MATCHER;
+extern PathPrefixMatcher RECC_DEPS_EXCLUDE_PATHS_MATCHER;
+
 /**
  * Used to specify absolute paths for finding recc.conf.
  * If specifying absolute path, only include up until directory containing
@@ -257,10 +276,80 @@ extern std::string RECC_WORKING_DIR_PREFIX;
 
 /**
  * Specify the maximum number of system threads available to the recc process.
- * -1 specifies use as many system threads as cores
+ * -1 specifies use as many system threads as cores. The process-wide thread
+ * pool is started with this many threads the first time it is needed, and
+ * restarted if a later command run by a reccd worker sets a different value.
  */
 extern int RECC_MAX_THREADS;
 
+/**
+ * Directory holding a table of file digests that is shared between recc
+ * processes, so that unchanged dependencies are not hashed again. Empty
+ * disables the table.
+ */
+extern std::string RECC_FILE_DIGEST_CACHE_DIR;
+
+/**
+ * Number of entries in the file digest table. Each entry takes 128 bytes.
+ * Only used when creating the table: an existing one keeps its size.
+ */
+extern int RECC_FILE_DIGEST_CACHE_MAX_ENTRIES;
+
+/**
+ * Directory in which to cache the dependencies reported by the compiler,
+ * so that they are not computed again for unchanged compilations. Empty
+ * disables the cache.
+ */
+extern std::string RECC_DEPS_CACHE_DIR;
+
+/**
+ * Directory in which to keep a snapshot of each RECC_DEPS_DIRECTORY_OVERRIDE
+ * tree, so that only the parts of it that changed since the last command
+ * are read and hashed again. Empty disables the snapshots.
+ */
+extern std::string RECC_DIRECTORY_SNAPSHOT_DIR;
+
+/**
+ * Path of the Unix domain socket on which reccd listens. When set in the
+ * environment of recc, commands are handed to that daemon, falling back to
+ * running them in-process if it can't be reached. Empty disables the daemon.
+ */
+extern std::string RECC_DAEMON_SOCKET;
+
+/**
+ * Upload the inputs of an action while the action cache is queried, rather
+ * than after a miss. Saves round trips on a miss, at the cost of sending
+ * inputs that turn out not to be needed on a hit.
+ */
+extern bool RECC_SPECULATIVE_UPLOAD;
+
+/**
+ * Maximum number of BatchUpdateBlobs requests in flight at once when
+ * uploading to the CAS. Uploads run on threads of their own, one for each
+ * of these requests and of the RECC_MAX_CONCURRENT_STREAM_UPLOADS writes,
+ * so RECC_MAX_THREADS doesn't limit them.
+ */
+extern int RECC_MAX_CONCURRENT_BATCH_UPLOADS;
+
+/**
+ * Maximum number of ByteStream writes in flight at once when uploading blobs
+ * too large to batch.
+ */
+extern int RECC_MAX_CONCURRENT_STREAM_UPLOADS;
+
+/**
+ * Maximum number of bytes of blob data held by the uploads in flight, where
+ * a ByteStream write holds one chunk of its blob at a time. An upload larger
+ * than this is sent on its own.
+ */
+extern int RECC_MAX_UPLOAD_BYTES_IN_FLIGHT;
+
+/**
+ * Number of worker processes started by reccd, each of which runs one
+ * command at a time. -1 starts one per core.
+ */
+extern int RECC_DAEMON_WORKERS;
+
 /**
  * Version of the Remote Execution API to use.
  */
@@ -281,6 +370,12 @@ struct Env {
      */
     static void parse_config_variables(const char *const *environ);
 
+    /**
+     * Set every configuration variable back to its default value, so that a
+     * long-running process can parse a new configuration from scratch.
+     */
+    static void reset_config_variables();
+
     /**
      * Finds config files specified in RECC_CONFIG_LOCATIONS and passes
      * variables to parse_config_variables
@@ -292,6 +387,12 @@ struct Env {
      */
     static void handle_special_defaults();
 
+    /**
+     * Compiles RECC_PREFIX_REPLACEMENT and RECC_DEPS_EXCLUDE_PATHS into their
+     * matchers. Must be called again whenever either of them is changed.
+     */
+    static void compile_path_matchers();
+
     /**
      * Asserts that RECC_REAPI_VERSION is set to a valid value.
      */
@@ -0,0 +1,481 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <filedigestcache.h>
+
+#include <digestgenerator.h>
+#include <env.h>
+#include <fileutils.h>
+#include <hashtohex.h>
+
+#include <buildboxcommon_fileutils.h>
+#include <buildboxcommon_logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+const uint64_t s_magic = 0x3143474944434552ULL; // "RECDIGC1"
+const uint32_t s_formatVersion = 1;
+const char s_tableFileName[] = "file-digests";
+
+// Keys hash to a bucket of this many slots, so that a collision doesn't
+// immediately evict an entry.
+const size_t s_slotsPerBucket = 8;
+
+// Large enough for the raw bytes of a SHA-512 hash.
+const size_t s_maxHashLength = 64;
+
+// Slots start at this offset into the table file.
+const size_t s_headerSize = 128;
+
+// How many times opening the table starts over when another process
+// creates or replaces it at the same time.
+const int s_maxOpenAttempts = 4;
+
+// Return the configured digest function as stored in the table, or 0 if it
+// is not known.
+uint8_t currentDigestFunction()
+{
+    const auto &functions = DigestGenerator::stringToDigestFunctionMap();
+    const auto it = functions.find(RECC_CAS_DIGEST_FUNCTION);
+    return it == functions.cend() ? 0 : static_cast<uint8_t>(it->second);
+}
+
+void throwSystemError(const std::string &operation, const std::string &path)
+{
+    throw std::system_error(errno, std::system_category(),
+                            operation + " on \"" + path + "\"");
+}
+
+// Holds the advisory lock on the table file for the lifetime of the object.
+class TableLock {
+  public:
+    explicit TableLock(int fd) : d_fd(fd), d_locked(false)
+    {
+        while (flock(d_fd, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                return;
+            }
+        }
+        d_locked = true;
+    }
+    ~TableLock()
+    {
+        if (d_locked) {
+            flock(d_fd, LOCK_UN);
+        }
+    }
+    bool locked() const { return d_locked; }
+
+  private:
+    int d_fd;
+    bool d_locked;
+};
+
+std::unique_ptr<FileDigestCache> openConfiguredCache()
+{
+    if (RECC_FILE_DIGEST_CACHE_DIR.empty() ||
+        RECC_FILE_DIGEST_CACHE_MAX_ENTRIES <= 0) {
+        return nullptr;
+    }
+    try {
+        return std::unique_ptr<FileDigestCache>(new FileDigestCache(
+            RECC_FILE_DIGEST_CACHE_DIR,
+            static_cast<size_t>(RECC_FILE_DIGEST_CACHE_MAX_ENTRIES)));
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_WARNING("Not using file digest cache in \""
+                             << RECC_FILE_DIGEST_CACHE_DIR
+                             << "\": " << e.what());
+        return nullptr;
+    }
+}
+
+// The contents of a table slot, copied out as a whole by readers.
+struct SlotEntry {
+    uint64_t d_device;
+    uint64_t d_inode;
+    int64_t d_size;
+    int64_t d_mtimeSeconds;
+    int64_t d_ctimeSeconds;
+    uint32_t d_mtimeNanoseconds;
+    uint32_t d_ctimeNanoseconds;
+    uint8_t d_digestFunction;
+    // Zero for an empty slot.
+    uint8_t d_hashLength;
+    uint8_t d_unused[6];
+    uint8_t d_hash[s_maxHashLength];
+};
+
+bool sameFile(const SlotEntry &entry, const struct stat &statResult,
+              uint8_t digestFunction)
+{
+    return entry.d_device == static_cast<uint64_t>(statResult.st_dev) &&
+           entry.d_inode == static_cast<uint64_t>(statResult.st_ino) &&
+           entry.d_digestFunction == digestFunction;
+}
+
+bool sameVersion(const SlotEntry &entry, const struct stat &statResult)
+{
+    const struct timespec &mtime = FileUtils::modificationTime(statResult);
+    const struct timespec &ctime = FileUtils::changeTime(statResult);
+    return entry.d_size == static_cast<int64_t>(statResult.st_size) &&
+           entry.d_mtimeSeconds == static_cast<int64_t>(mtime.tv_sec) &&
+           entry.d_mtimeNanoseconds == static_cast<uint32_t>(mtime.tv_nsec) &&
+           entry.d_ctimeSeconds == static_cast<int64_t>(ctime.tv_sec) &&
+           entry.d_ctimeNanoseconds == static_cast<uint32_t>(ctime.tv_nsec);
+}
+
+} // namespace
+
+struct FileDigestCache::Header {
+    uint64_t d_magic;
+    uint32_t d_version;
+    uint32_t d_slotSize;
+    uint64_t d_bucketCount;
+    // Picks which slot to replace when a bucket is full.
+    std::atomic<uint64_t> d_insertions;
+};
+
+struct FileDigestCache::Slot {
+    // Odd while a writer is modifying `d_entry`.
+    std::atomic<uint32_t> d_sequence;
+    uint32_t d_unused;
+    SlotEntry d_entry;
+};
+
+FileDigestCache::FileDigestCache(const std::string &directory,
+                                 size_t maxEntries, int minimumFileAgeSeconds)
+    : d_fd(-1), d_mapping(MAP_FAILED), d_mappingSize(0), d_bucketCount(0),
+      d_minimumFileAgeSeconds(minimumFileAgeSeconds)
+{
+    static_assert(sizeof(Header) <= s_headerSize,
+                  "table header must fit before the first slot");
+    static_assert(sizeof(Slot) == 128, "table slots are two cache lines");
+
+    const std::string path = directory + "/" + s_tableFileName;
+
+    // Another process may create the table at the same time as this one, in
+    // which case the table it put in place first is used.
+    for (int attempt = 0; attempt < s_maxOpenAttempts; ++attempt) {
+        if (openExisting(path)) {
+            return;
+        }
+        const size_t bucketCount = std::max<size_t>(
+            (maxEntries + s_slotsPerBucket - 1) / s_slotsPerBucket, 1);
+        if (create(directory, path, bucketCount)) {
+            BUILDBOX_LOG_DEBUG("Created file digest cache \""
+                               << path << "\" with "
+                               << d_bucketCount * s_slotsPerBucket
+                               << " entries");
+            return;
+        }
+    }
+    throw std::system_error(EEXIST, std::system_category(),
+                            "Opening \"" + path +
+                                "\" while other processes replace it");
+}
+
+bool FileDigestCache::openExisting(const std::string &path)
+{
+    d_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (d_fd < 0) {
+        return false;
+    }
+
+    // Whatever its size, a table of this format is used as it is, so that
+    // processes configured with different sizes share it rather than
+    // replacing each other's.
+    const size_t bucketBytes = s_slotsPerBucket * sizeof(Slot);
+    struct stat statResult;
+    const bool statted = fstat(d_fd, &statResult) == 0;
+    if (statted && static_cast<size_t>(statResult.st_size) > s_headerSize) {
+        d_mappingSize = static_cast<size_t>(statResult.st_size);
+        d_mapping = mmap(nullptr, d_mappingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, d_fd, 0);
+    }
+    if (d_mapping != MAP_FAILED) {
+        const Header *existing = header();
+        const size_t slotsSize = d_mappingSize - s_headerSize;
+        if (existing->d_magic == s_magic &&
+            existing->d_version == s_formatVersion &&
+            existing->d_slotSize == sizeof(Slot) &&
+            slotsSize % bucketBytes == 0 &&
+            existing->d_bucketCount == slotsSize / bucketBytes) {
+            d_bucketCount = static_cast<size_t>(existing->d_bucketCount);
+            return true;
+        }
+        munmap(d_mapping, d_mappingSize);
+        d_mapping = MAP_FAILED;
+    }
+
+    // A table of another format is removed to make way for a new one,
+    // unless another process has already replaced it.
+    struct stat current;
+    if (statted && stat(path.c_str(), &current) == 0 &&
+        current.st_dev == statResult.st_dev &&
+        current.st_ino == statResult.st_ino) {
+        BUILDBOX_LOG_DEBUG("Replacing file digest cache \"" << path
+                                                           << "\"");
+        unlink(path.c_str());
+    }
+    close(d_fd);
+    d_fd = -1;
+    return false;
+}
+
+bool FileDigestCache::create(const std::string &directory,
+                             const std::string &path, size_t bucketCount)
+{
+    // The table is built next to its final path and linked into place
+    // complete, which fails if another process got there first.
+    buildboxcommon::FileUtils::createDirectory(directory.c_str());
+    std::string temporaryPath = path + ".XXXXXX";
+    d_fd = mkstemp(&temporaryPath[0]);
+    if (d_fd < 0) {
+        throwSystemError("mkstemp()", temporaryPath);
+    }
+    d_bucketCount = bucketCount;
+    d_mappingSize =
+        s_headerSize + d_bucketCount * s_slotsPerBucket * sizeof(Slot);
+    bool linked = false;
+    try {
+        if (fcntl(d_fd, F_SETFD, FD_CLOEXEC) != 0) {
+            throwSystemError("fcntl()", temporaryPath);
+        }
+        if (ftruncate(d_fd, static_cast<off_t>(d_mappingSize)) != 0) {
+            throwSystemError("ftruncate()", temporaryPath);
+        }
+        d_mapping = mmap(nullptr, d_mappingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, d_fd, 0);
+        if (d_mapping == MAP_FAILED) {
+            throwSystemError("mmap()", temporaryPath);
+        }
+        // The file is zero-filled, which leaves every slot empty.
+        Header *created = header();
+        created->d_version = s_formatVersion;
+        created->d_slotSize = sizeof(Slot);
+        created->d_bucketCount = d_bucketCount;
+        created->d_insertions.store(0);
+        created->d_magic = s_magic;
+
+        if (link(temporaryPath.c_str(), path.c_str()) == 0) {
+            linked = true;
+        }
+        else if (errno != EEXIST) {
+            // On filesystems without hard links, the table is moved into
+            // place instead, which replaces one created meanwhile.
+            if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+                throwSystemError("rename()", temporaryPath);
+            }
+            return true;
+        }
+    }
+    catch (...) {
+        unlink(temporaryPath.c_str());
+        if (d_mapping != MAP_FAILED) {
+            munmap(d_mapping, d_mappingSize);
+            d_mapping = MAP_FAILED;
+        }
+        close(d_fd);
+        d_fd = -1;
+        throw;
+    }
+
+    unlink(temporaryPath.c_str());
+    if (!linked) {
+        munmap(d_mapping, d_mappingSize);
+        d_mapping = MAP_FAILED;
+        close(d_fd);
+        d_fd = -1;
+    }
+    return linked;
+}
+
+FileDigestCache::~FileDigestCache()
+{
+    munmap(d_mapping, d_mappingSize);
+    close(d_fd);
+}
+
+FileDigestCache::Header *FileDigestCache::header() const
+{
+    return static_cast<Header *>(d_mapping);
+}
+
+FileDigestCache::Slot *
+FileDigestCache::bucket(const struct stat &statResult) const
+{
+    // Only the file's identity picks the bucket, so that a new version of a
+    // file replaces the previous one.
+    uint64_t hash = static_cast<uint64_t>(statResult.st_ino) * 31 +
+                    static_cast<uint64_t>(statResult.st_dev);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    const size_t index = static_cast<size_t>(hash % d_bucketCount);
+    return reinterpret_cast<Slot *>(static_cast<char *>(d_mapping) +
+                                    s_headerSize) +
+           index * s_slotsPerBucket;
+}
+
+bool FileDigestCache::lookup(const struct stat &statResult,
+                             proto::Digest *digest) const
+{
+    const uint8_t digestFunction = currentDigestFunction();
+    if (digestFunction == 0) {
+        return false;
+    }
+
+    Slot *slots = bucket(statResult);
+    for (size_t i = 0; i < s_slotsPerBucket; ++i) {
+        Slot &slot = slots[i];
+        const uint32_t sequence =
+            slot.d_sequence.load(std::memory_order_acquire);
+        if (sequence % 2 != 0) {
+            continue;
+        }
+        SlotEntry entry;
+        memcpy(&entry, &slot.d_entry, sizeof(entry));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.d_sequence.load(std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+
+        if (entry.d_hashLength == 0 ||
+            entry.d_hashLength > s_maxHashLength ||
+            !sameFile(entry, statResult, digestFunction) ||
+            !sameVersion(entry, statResult)) {
+            continue;
+        }
+
+        digest->Clear();
+        if (digestFunction == proto::DigestFunction_Value_BLAKE3ZCC) {
+            digest->set_hash_blake3zcc(entry.d_hash, entry.d_hashLength);
+        }
+        else {
+            digest->set_hash_other(
+                hashToHex(entry.d_hash, entry.d_hashLength));
+        }
+        digest->set_size_bytes(statResult.st_size);
+        return true;
+    }
+    return false;
+}
+
+void FileDigestCache::store(const struct stat &statResult,
+                            const proto::Digest &digest)
+{
+    const uint8_t digestFunction = currentDigestFunction();
+    if (digestFunction == 0 || digest.size_bytes() != statResult.st_size) {
+        return;
+    }
+
+    const time_t newestAllowed = time(nullptr) - d_minimumFileAgeSeconds;
+    if (FileUtils::modificationTime(statResult).tv_sec >= newestAllowed ||
+        FileUtils::changeTime(statResult).tv_sec >= newestAllowed) {
+        return;
+    }
+
+    SlotEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    size_t hashLength = 0;
+    if (digestFunction == proto::DigestFunction_Value_BLAKE3ZCC) {
+        const std::string &hash = digest.hash_blake3zcc();
+        if (hash.empty() || hash.size() > s_maxHashLength) {
+            return;
+        }
+        memcpy(entry.d_hash, hash.data(), hash.size());
+        hashLength = hash.size();
+    }
+    else if (!hexToHash(digest.hash_other(), entry.d_hash, s_maxHashLength,
+                         &hashLength) ||
+             hashLength == 0) {
+        return;
+    }
+
+    const struct timespec &mtime = FileUtils::modificationTime(statResult);
+    const struct timespec &ctime = FileUtils::changeTime(statResult);
+    entry.d_device = static_cast<uint64_t>(statResult.st_dev);
+    entry.d_inode = static_cast<uint64_t>(statResult.st_ino);
+    entry.d_size = static_cast<int64_t>(statResult.st_size);
+    entry.d_mtimeSeconds = static_cast<int64_t>(mtime.tv_sec);
+    entry.d_mtimeNanoseconds = static_cast<uint32_t>(mtime.tv_nsec);
+    entry.d_ctimeSeconds = static_cast<int64_t>(ctime.tv_sec);
+    entry.d_ctimeNanoseconds = static_cast<uint32_t>(ctime.tv_nsec);
+    entry.d_digestFunction = digestFunction;
+    entry.d_hashLength = static_cast<uint8_t>(hashLength);
+
+    // The advisory lock is per open file description, so threads of this
+    // process need their own exclusion.
+    const std::lock_guard<std::mutex> guard(d_writeMutex);
+    const TableLock lock(d_fd);
+    if (!lock.locked()) {
+        return;
+    }
+
+    // Prefer the slot already holding this file, then an empty one, and
+    // otherwise evict.
+    Slot *slots = bucket(statResult);
+    Slot *target = nullptr;
+    for (size_t i = 0; i < s_slotsPerBucket && target == nullptr; ++i) {
+        if (sameFile(slots[i].d_entry, statResult, digestFunction)) {
+            target = &slots[i];
+        }
+    }
+    for (size_t i = 0; i < s_slotsPerBucket && target == nullptr; ++i) {
+        if (slots[i].d_entry.d_hashLength == 0) {
+            target = &slots[i];
+        }
+    }
+    if (target == nullptr) {
+        const uint64_t insertion = header()->d_insertions.fetch_add(
+            1, std::memory_order_relaxed);
+        target = &slots[insertion % s_slotsPerBucket];
+    }
+
+    // A sequence number that is already odd was left by a writer that died;
+    // holding the lock means we can safely take over.
+    const uint32_t sequence =
+        target->d_sequence.load(std::memory_order_relaxed) | 1;
+    target->d_sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&target->d_entry, &entry, sizeof(entry));
+    target->d_sequence.store(sequence + 1, std::memory_order_release);
+}
+
+FileDigestCache *FileDigestCache::instance()
+{
+    static const std::unique_ptr<FileDigestCache> cache =
+        openConfiguredCache();
+    return cache.get();
+}
+
+} // namespace recc
+} // namespace BloombergLP
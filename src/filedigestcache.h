@@ -0,0 +1,116 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_FILEDIGESTCACHE
+#define INCLUDED_FILEDIGESTCACHE
+
+#include <protos.h>
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * A table of file digests stored in a memory-mapped file, shared by all recc
+ * processes that point at the same directory.
+ *
+ * Entries are keyed on the device, inode, size, modification and change
+ * times of a file and on the digest function, so any change to the file
+ * (or a switch of digest function) makes its entry unreachable. The table
+ * has a fixed number of entries; when the set of slots a key can occupy is
+ * full, inserting replaces one of them.
+ *
+ * Lookups take no locks: each entry carries a sequence number that writers
+ * make odd while they modify it, and readers discard entries whose sequence
+ * changed underneath them. Writers serialize on an advisory lock on the
+ * table file, which the kernel releases if a process dies mid-write.
+ */
+class FileDigestCache {
+  public:
+    /**
+     * Open the table in `directory`, or create one holding `maxEntries`
+     * entries if there is none. An existing table keeps its size, whatever
+     * `maxEntries` is, and is only replaced if it is of another format.
+     * Throws `std::system_error` on failure.
+     *
+     * Files whose modification or change time is less than
+     * `minimumFileAgeSeconds` old are never stored.
+     */
+    FileDigestCache(const std::string &directory, size_t maxEntries,
+                    int minimumFileAgeSeconds = 2);
+    ~FileDigestCache();
+
+    FileDigestCache(const FileDigestCache &) = delete;
+    FileDigestCache &operator=(const FileDigestCache &) = delete;
+
+    /**
+     * If a digest was stored for a file with the given `stat()` result
+     * using the configured digest function, write it to `digest` and
+     * return true.
+     */
+    bool lookup(const struct stat &statResult, proto::Digest *digest) const;
+
+    /**
+     * Record `digest` for a file with the given `stat()` result.
+     *
+     * Recently modified files are not stored, because a further
+     * modification within the timestamp granularity of the filesystem
+     * would go unnoticed.
+     */
+    void store(const struct stat &statResult, const proto::Digest &digest);
+
+    /**
+     * Return the process-wide cache configured by
+     * RECC_FILE_DIGEST_CACHE_DIR, or nullptr if it is disabled or could
+     * not be opened.
+     */
+    static FileDigestCache *instance();
+
+  private:
+    struct Header;
+    struct Slot;
+
+    int d_fd;
+    void *d_mapping;
+    size_t d_mappingSize;
+    size_t d_bucketCount;
+    int d_minimumFileAgeSeconds;
+    std::mutex d_writeMutex;
+
+    /**
+     * Map the table at `path` and return true if it is of this format.
+     * Otherwise remove it and return false.
+     */
+    bool openExisting(const std::string &path);
+
+    /**
+     * Create a table of `bucketCount` buckets at `path` and map it,
+     * returning false if another process created one there first.
+     */
+    bool create(const std::string &directory, const std::string &path,
+                size_t bucketCount);
+
+    Header *header() const;
+    Slot *bucket(const struct stat &statResult) const;
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
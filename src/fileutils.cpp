@@ -62,8 +62,31 @@ bool FileUtils::isExecutable(const struct stat &s)
 
 bool FileUtils::isSymlink(const struct stat &s) { return S_ISLNK(s.st_mode); }
 
+#ifdef __APPLE__
+const struct timespec &FileUtils::modificationTime(const struct stat &s)
+{
+    return s.st_mtimespec;
+}
+
+const struct timespec &FileUtils::changeTime(const struct stat &s)
+{
+    return s.st_ctimespec;
+}
+#else
+const struct timespec &FileUtils::modificationTime(const struct stat &s)
+{
+    return s.st_mtim;
+}
+
+const struct timespec &FileUtils::changeTime(const struct stat &s)
+{
+    return s.st_ctim;
+}
+#endif
+
 std::string FileUtils::getSymlinkContents(const std::string &path,
-                                          const struct stat &statResult)
+                                          const struct stat &statResult,
+                                          int dirfd)
 {
     if (path.empty()) {
         const std::string error = "invalid args: path is empty";
@@ -79,7 +102,8 @@ std::string FileUtils::getSymlinkContents(const std::string &path,
     }
 
     std::string contents(static_cast<size_t>(statResult.st_size), '\0');
-    const ssize_t rc = readlink(path.c_str(), &contents[0], contents.size());
+    const ssize_t rc =
+        readlinkat(dirfd, path.c_str(), &contents[0], contents.size());
     if (rc < 0) {
         std::ostringstream oss;
         oss << "readlink failed for \"" << path << "\", rc = " << rc
@@ -103,15 +127,14 @@ bool FileUtils::hasPathPrefix(const std::string &path,
     }
 
     /*
-     * Make sure prefix ends in a slash.
+     * Make sure prefix is followed by a slash in path.
      * This is so we don't return true if path = /foo and prefix = /foobar
      */
-    std::string tmpPrefix(prefix);
-    if (tmpPrefix.back() != '/') {
-        tmpPrefix.push_back('/');
+    if (prefix.back() == '/') {
+        return path.compare(0, prefix.length(), prefix) == 0;
     }
-
-    return path.substr(0, tmpPrefix.length()) == tmpPrefix;
+    return path.length() > prefix.length() && path[prefix.length()] == '/' &&
+           path.compare(0, prefix.length(), prefix) == 0;
 }
 
 bool FileUtils::hasPathPrefixes(const std::string &path,
@@ -227,23 +250,18 @@ std::string FileUtils::resolvePathFromPrefixMap(const std::string &path)
         return path;
     }
 
-    // Iterate through dictionary, replacing path if it includes key, with
-    // value.
-    for (const auto &pair : RECC_PREFIX_REPLACEMENT) {
-        // Check if prefix is found in the path, and that it is a prefix.
-        if (FileUtils::hasPathPrefix(path, pair.first)) {
-            // Append a trailing slash to the replacement, in cases of
-            // replacing `/` Double slashes will get removed during
-            // normalization.
-            const std::string replaced_path =
-                pair.second + '/' + path.substr(pair.first.length());
-            const std::string newPath =
-                buildboxcommon::FileUtils::normalizePath(
-                    replaced_path.c_str());
-            return newPath;
-        }
+    // Replace the first prefix in the map that path has with its value.
+    const size_t index = RECC_PREFIX_REPLACEMENT_MATCHER.find(path);
+    if (index == PathPrefixMatcher::npos) {
+        return path;
     }
-    return path;
+    const auto &pair = RECC_PREFIX_REPLACEMENT[index];
+    // Append a trailing slash to the replacement, in cases of
+    // replacing `/` Double slashes will get removed during
+    // normalization.
+    const std::string replaced_path =
+        pair.second + '/' + path.substr(pair.first.length());
+    return buildboxcommon::FileUtils::normalizePath(replaced_path.c_str());
 }
 
 std::vector<std::string> FileUtils::parseDirectories(const std::string &path)
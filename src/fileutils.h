@@ -15,6 +15,7 @@
 #ifndef INCLUDED_FILEUTILS
 #define INCLUDED_FILEUTILS
 
+#include <fcntl.h>
 #include <functional>
 #include <iostream>
 #include <iterator>
@@ -38,14 +39,23 @@ struct FileUtils {
     static bool isExecutable(const struct stat &s);
     static bool isSymlink(const struct stat &s);
 
+    /**
+     * Return the last modification and status change times, with
+     * nanoseconds, from a 'struct stat'.
+     */
+    static const struct timespec &modificationTime(const struct stat &s);
+    static const struct timespec &changeTime(const struct stat &s);
+
     /**
      * Given the path to a symlink, return a std::string with its contents.
      *
      * The path must be a path to a symlink that exists on disk. It can be
-     * absolute or relative to the current directory.
+     * absolute or relative to the directory open as `dirfd`, which is the
+     * current directory by default.
      */
     static std::string getSymlinkContents(const std::string &path,
-                                          const struct stat &statResult);
+                                          const struct stat &statResult,
+                                          int dirfd = AT_FDCWD);
 
     /**
      * Returns true if "path" has "prefix" as a prefix.
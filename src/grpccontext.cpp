@@ -21,15 +21,40 @@
 namespace BloombergLP {
 namespace recc {
 
+void GrpcContext::ClientContextDeleter::operator()(
+    grpc::ClientContext *context) const
+{
+    if (d_owner != nullptr) {
+        const std::lock_guard<std::mutex> lock(d_owner->d_contextsMutex);
+        d_owner->d_contexts.erase(context);
+    }
+    delete context;
+}
+
 GrpcContext::GrpcClientContextPtr GrpcContext::new_client_context()
 {
-    GrpcContext::GrpcClientContextPtr context(
-        std::make_unique<grpc::ClientContext>());
+    GrpcContext::GrpcClientContextPtr context(new grpc::ClientContext(),
+                                              ClientContextDeleter(this));
 
     RequestMetadataGenerator::attach_request_metadata(*context, d_action_id);
+
+    const std::lock_guard<std::mutex> lock(d_contextsMutex);
+    d_contexts.insert(context.get());
+    if (d_cancelled) {
+        context->TryCancel();
+    }
     return context;
 }
 
+void GrpcContext::cancel()
+{
+    const std::lock_guard<std::mutex> lock(d_contextsMutex);
+    d_cancelled = true;
+    for (grpc::ClientContext *context : d_contexts) {
+        context->TryCancel();
+    }
+}
+
 void GrpcContext::set_action_id(const std::string &action_id)
 {
     d_action_id = action_id;
@@ -17,14 +17,39 @@
 
 #include <grpcpp/client_context.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+
 namespace BloombergLP {
 namespace recc {
 
 class GrpcContext {
   public:
-    typedef std::unique_ptr<grpc::ClientContext> GrpcClientContextPtr;
+    /**
+     * Forgets about a ClientContext before deleting it.
+     */
+    class ClientContextDeleter {
+      public:
+        explicit ClientContextDeleter(GrpcContext *owner = nullptr)
+            : d_owner(owner)
+        {
+        }
+
+        void operator()(grpc::ClientContext *context) const;
+
+      private:
+        GrpcContext *d_owner;
+    };
+
+    typedef std::unique_ptr<grpc::ClientContext, ClientContextDeleter>
+        GrpcClientContextPtr;
 
-    GrpcContext() {}
+    GrpcContext() : d_cancelled(false) {}
+
+    GrpcContext(const GrpcContext &) = delete;
+    GrpcContext &operator=(const GrpcContext &) = delete;
 
     /**
      * Build a new ClientContext object for rpc calls.
@@ -36,8 +61,21 @@ class GrpcContext {
      */
     void set_action_id(const std::string &action_id);
 
+    /**
+     * Cancel the calls in progress that use contexts built by this object.
+     * Contexts built afterwards start out cancelled, and `grpc_retry()`
+     * gives up on them without retrying.
+     */
+    void cancel();
+
+    bool cancelled() const { return d_cancelled; }
+
   private:
     std::string d_action_id;
+    std::atomic<bool> d_cancelled;
+
+    std::mutex d_contextsMutex;
+    std::set<grpc::ClientContext *> d_contexts;
 };
 
 } // namespace recc
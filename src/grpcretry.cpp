@@ -36,11 +36,17 @@ void grpc_retry(
     int NO_AUTH = int(grpc::StatusCode::UNAUTHENTICATED);
     grpc::Status status;
     do {
+        if (grpcContext->cancelled()) {
+            throw std::runtime_error("gRPC call cancelled");
+        }
         auto context = grpcContext->new_client_context();
         status = grpc_invocation(*context);
         if (status.ok()) {
             return;
         }
+        if (grpcContext->cancelled()) {
+            throw std::runtime_error("gRPC call cancelled");
+        }
         if (status.error_code() == NO_AUTH && !refreshed) {
             refreshed = true;
         }
@@ -1,20 +1,89 @@
-#include <iomanip>
-#include <sstream>
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_HASHTOHEX
+#define INCLUDED_HASHTOHEX
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
 
 namespace BloombergLP {
 namespace recc {
 
-namespace {
-std::string hashToHex(const unsigned char *hash_buffer, unsigned int hash_size)
+/**
+ * Return the lowercase hexadecimal representation of the given hash.
+ */
+inline std::string hashToHex(const unsigned char *hash_buffer,
+                             unsigned int hash_size)
 {
-    std::ostringstream ss;
+    static const char digits[] = "0123456789abcdef";
+
+    std::string result(2 * static_cast<size_t>(hash_size), '\0');
     for (unsigned int i = 0; i < hash_size; i++) {
-        ss << std::hex << std::setw(2) << std::setfill('0')
-           << static_cast<int>(hash_buffer[i]);
+        result[2 * i] = digits[hash_buffer[i] >> 4];
+        result[2 * i + 1] = digits[hash_buffer[i] & 0xf];
     }
-    return ss.str();
-}
-}
- 
+    return result;
 }
+
+/**
+ * Decode the lowercase hexadecimal string produced by `hashToHex()` into
+ * `out`, storing the number of bytes written in `length`. Returns false if
+ * `hex` is not such a string or doesn't fit in `outSize` bytes.
+ */
+inline bool hexToHash(const std::string &hex, uint8_t *out, size_t outSize,
+                      size_t *length)
+{
+    // Maps characters to their value, or to 0xff if they are not lowercase
+    // hexadecimal digits.
+    struct DecodingTable {
+        uint8_t d_values[256];
+
+        DecodingTable()
+        {
+            for (int c = 0; c < 256; c++) {
+                d_values[c] = 0xff;
+            }
+            for (int c = '0'; c <= '9'; c++) {
+                d_values[c] = static_cast<uint8_t>(c - '0');
+            }
+            for (int c = 'a'; c <= 'f'; c++) {
+                d_values[c] = static_cast<uint8_t>(c - 'a' + 10);
+            }
+        }
+    };
+    static const DecodingTable table;
+
+    if (hex.size() % 2 != 0 || hex.size() / 2 > outSize) {
+        return false;
+    }
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        const uint8_t high =
+            table.d_values[static_cast<unsigned char>(hex[i])];
+        const uint8_t low =
+            table.d_values[static_cast<unsigned char>(hex[i + 1])];
+        if (high == 0xff || low == 0xff) {
+            return false;
+        }
+        out[i / 2] = static_cast<uint8_t>(high << 4 | low);
+    }
+    *length = hex.size() / 2;
+    return true;
 }
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
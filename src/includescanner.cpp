@@ -0,0 +1,1263 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <includescanner.h>
+
+#include <compilerdefaults.h>
+#include <deps.h>
+#include <directorysnapshot.h>
+#include <env.h>
+#include <fileutils.h>
+#include <subprocess.h>
+
+#include <buildboxcommon_fileutils.h>
+#include <buildboxcommon_logging.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+using Kind = IncludeDirective::Kind;
+
+const size_t npos = std::string::npos;
+
+bool isHorizontalSpace(char character)
+{
+    return character == ' ' || character == '\t' || character == '\f' ||
+           character == '\v' || character == '\r';
+}
+
+bool isIdentifierCharacter(char character)
+{
+    return isalnum(static_cast<unsigned char>(character)) ||
+           character == '_' || character == '$';
+}
+
+bool startsWith(const std::string &string, const char *prefix)
+{
+    return string.compare(0, strlen(prefix), prefix) == 0;
+}
+
+/**
+ * Return `contents` with every backslash-newline removed, including those
+ * with whitespace between the two, which GCC also accepts.
+ */
+std::string removeLineSplices(const std::string &contents)
+{
+    std::string result;
+    result.reserve(contents.size());
+    for (size_t i = 0; i < contents.size(); ++i) {
+        if (contents[i] == '\\') {
+            size_t next = i + 1;
+            while (next < contents.size() && isHorizontalSpace(contents[next])) {
+                ++next;
+            }
+            if (next < contents.size() && contents[next] == '\n') {
+                i = next;
+                continue;
+            }
+        }
+        result.push_back(contents[i]);
+    }
+    return result;
+}
+
+/**
+ * Walks the text of a source file, with line splices removed, stopping at
+ * directives and skipping comments and literals in between.
+ */
+class DirectiveReader {
+  public:
+    explicit DirectiveReader(const std::string &text)
+        : d_begin(text.data()), d_end(text.data() + text.size()),
+          d_position(d_begin)
+    {
+    }
+
+    /**
+     * Move to just after the '#' of the next directive and return true, or
+     * return false at the end of the text.
+     */
+    bool nextDirective();
+
+    /**
+     * Read an identifier after any whitespace and comments, which is empty
+     * if there is none.
+     */
+    std::string readIdentifier();
+
+    /**
+     * Read a header name in angle brackets or quotes after any whitespace
+     * and comments, or return false if there isn't one.
+     */
+    bool readHeaderName(std::string *name, bool *angled);
+
+    /**
+     * Read up to the end of the line, with comments replaced by spaces.
+     */
+    std::string readRestOfLine();
+
+  private:
+    const char *skipBlockComment(const char *position) const;
+    const char *skipLiteral(const char *position) const;
+    bool isRawStringStart(const char *quote) const;
+    bool isDigitSeparator(const char *quote) const;
+    void skipSpaceAndComments();
+
+    const char *d_begin;
+    const char *d_end;
+    const char *d_position;
+};
+
+const char *DirectiveReader::skipBlockComment(const char *position) const
+{
+    for (position += 2; position + 1 < d_end; ++position) {
+        if (position[0] == '*' && position[1] == '/') {
+            return position + 2;
+        }
+    }
+    return d_end;
+}
+
+bool DirectiveReader::isRawStringStart(const char *quote) const
+{
+    const char *start = quote;
+    while (start > d_begin && isIdentifierCharacter(start[-1])) {
+        --start;
+    }
+    const std::string prefix(start, quote);
+    return prefix == "R" || prefix == "LR" || prefix == "uR" ||
+           prefix == "UR" || prefix == "u8R";
+}
+
+bool DirectiveReader::isDigitSeparator(const char *quote) const
+{
+    // As in 1'000, where the quote is within a number rather than after the
+    // prefix of a character literal.
+    const char *start = quote;
+    while (start > d_begin && isIdentifierCharacter(start[-1])) {
+        --start;
+    }
+    return start < quote && isdigit(static_cast<unsigned char>(*start));
+}
+
+const char *DirectiveReader::skipLiteral(const char *position) const
+{
+    const char quote = *position;
+    if (quote == '"' && isRawStringStart(position)) {
+        const char *delimiter = position + 1;
+        const char *delimiterEnd = delimiter;
+        while (delimiterEnd < d_end && delimiterEnd - delimiter <= 16 &&
+               *delimiterEnd != '(' && *delimiterEnd != ')' &&
+               *delimiterEnd != '\\' && *delimiterEnd != '\n' &&
+               !isHorizontalSpace(*delimiterEnd)) {
+            ++delimiterEnd;
+        }
+        if (delimiterEnd < d_end && *delimiterEnd == '(') {
+            const std::string terminator =
+                ")" + std::string(delimiter, delimiterEnd) + "\"";
+            const char *close =
+                std::search(delimiterEnd + 1, d_end, terminator.cbegin(),
+                            terminator.cend());
+            return close == d_end ? d_end : close + terminator.size();
+        }
+    }
+
+    // An unterminated literal ends with the line.
+    for (++position; position < d_end && *position != '\n'; ++position) {
+        if (*position == quote) {
+            return position + 1;
+        }
+        if (*position == '\\' && position + 1 < d_end &&
+            position[1] != '\n') {
+            ++position;
+        }
+    }
+    return position;
+}
+
+bool DirectiveReader::nextDirective()
+{
+    bool lineStart = d_position == d_begin || d_position[-1] == '\n';
+    while (d_position < d_end) {
+        const char character = *d_position;
+        const char next = d_position + 1 < d_end ? d_position[1] : '\0';
+        if (character == '\n') {
+            lineStart = true;
+            ++d_position;
+        }
+        else if (isHorizontalSpace(character)) {
+            ++d_position;
+        }
+        else if (character == '/' && next == '*') {
+            d_position = skipBlockComment(d_position);
+        }
+        else if (character == '/' && next == '/') {
+            while (d_position < d_end && *d_position != '\n') {
+                ++d_position;
+            }
+        }
+        else if (lineStart && character == '#') {
+            ++d_position;
+            return true;
+        }
+        else if (lineStart && character == '%' && next == ':') {
+            // The "%:" digraph.
+            d_position += 2;
+            return true;
+        }
+        else {
+            lineStart = false;
+            if ((character == '"' || character == '\'') &&
+                !(character == '\'' && isDigitSeparator(d_position))) {
+                d_position = skipLiteral(d_position);
+            }
+            else {
+                ++d_position;
+            }
+        }
+    }
+    return false;
+}
+
+void DirectiveReader::skipSpaceAndComments()
+{
+    while (d_position < d_end) {
+        if (isHorizontalSpace(*d_position)) {
+            ++d_position;
+        }
+        else if (*d_position == '/' && d_position + 1 < d_end &&
+                 d_position[1] == '*') {
+            // A comment spanning lines doesn't end the directive.
+            d_position = skipBlockComment(d_position);
+        }
+        else {
+            break;
+        }
+    }
+}
+
+std::string DirectiveReader::readIdentifier()
+{
+    skipSpaceAndComments();
+    const char *start = d_position;
+    while (d_position < d_end && isIdentifierCharacter(*d_position)) {
+        ++d_position;
+    }
+    return std::string(start, d_position);
+}
+
+bool DirectiveReader::readHeaderName(std::string *name, bool *angled)
+{
+    skipSpaceAndComments();
+    if (d_position == d_end || (*d_position != '<' && *d_position != '"')) {
+        return false;
+    }
+
+    const char close = *d_position == '<' ? '>' : '"';
+    for (const char *end = d_position + 1; end < d_end && *end != '\n';
+         ++end) {
+        if (*end == close) {
+            name->assign(d_position + 1, end);
+            *angled = close == '>';
+            d_position = end + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string DirectiveReader::readRestOfLine()
+{
+    std::string line;
+    while (d_position < d_end && *d_position != '\n') {
+        const char character = *d_position;
+        if (character == '/' && d_position + 1 < d_end &&
+            d_position[1] == '*') {
+            d_position = skipBlockComment(d_position);
+            line.push_back(' ');
+        }
+        else if (character == '/' && d_position + 1 < d_end &&
+                 d_position[1] == '/') {
+            while (d_position < d_end && *d_position != '\n') {
+                ++d_position;
+            }
+        }
+        else if (character == '"' || character == '\'') {
+            const char *end = skipLiteral(d_position);
+            line.append(d_position, end);
+            d_position = end;
+        }
+        else {
+            line.push_back(character);
+            ++d_position;
+        }
+    }
+    return line;
+}
+
+/**
+ * Return 0 or 1 if `expression` is an integer literal that is zero or
+ * nonzero, and -1 if it is anything else.
+ */
+int literalValue(const std::string &expression)
+{
+    size_t start = 0;
+    size_t end = expression.size();
+    while (start < end && isspace(static_cast<unsigned char>(expression[start]))) {
+        ++start;
+    }
+    while (end > start &&
+           isspace(static_cast<unsigned char>(expression[end - 1]))) {
+        --end;
+    }
+
+    size_t digitsEnd = start;
+    bool nonzero = false;
+    while (digitsEnd < end &&
+           isdigit(static_cast<unsigned char>(expression[digitsEnd]))) {
+        nonzero = nonzero || expression[digitsEnd] != '0';
+        ++digitsEnd;
+    }
+    if (digitsEnd == start) {
+        return -1;
+    }
+    for (size_t i = digitsEnd; i < end; ++i) {
+        if (strchr("uUlL", expression[i]) == nullptr) {
+            return -1;
+        }
+    }
+    return nonzero ? 1 : 0;
+}
+
+/**
+ * Return the macro that `#if !defined(X)` or `#if !defined X` tests, or an
+ * empty string if `expression` isn't of that form.
+ */
+std::string negatedDefinedMacro(const std::string &expression)
+{
+    size_t position = 0;
+    const auto skipSpace = [&expression, &position]() {
+        while (position < expression.size() &&
+               isspace(static_cast<unsigned char>(expression[position]))) {
+            ++position;
+        }
+    };
+    const auto skipCharacter = [&expression, &position](char character) {
+        if (position < expression.size() &&
+            expression[position] == character) {
+            ++position;
+            return true;
+        }
+        return false;
+    };
+
+    skipSpace();
+    if (!skipCharacter('!')) {
+        return "";
+    }
+    skipSpace();
+    if (expression.compare(position, 7, "defined") != 0) {
+        return "";
+    }
+    position += 7;
+    skipSpace();
+    const bool parenthesized = skipCharacter('(');
+    skipSpace();
+    const size_t start = position;
+    while (position < expression.size() &&
+           isIdentifierCharacter(expression[position])) {
+        ++position;
+    }
+    const std::string macro = expression.substr(start, position - start);
+    skipSpace();
+    if (parenthesized && !skipCharacter(')')) {
+        return "";
+    }
+    skipSpace();
+    return position == expression.size() ? macro : "";
+}
+
+/**
+ * Append the files named in `__has_include` and `__has_include_next` in
+ * `expression` to `directives`.
+ */
+void addHasIncludes(const std::string &expression, bool conditional,
+                    std::vector<IncludeDirective> *directives)
+{
+    static const std::string keyword = "__has_include";
+    for (size_t position = expression.find(keyword); position != npos;
+         position = expression.find(keyword, position + 1)) {
+        if (position > 0 && isIdentifierCharacter(expression[position - 1])) {
+            continue;
+        }
+
+        size_t end = position + keyword.size();
+        const bool next = expression.compare(end, 5, "_next") == 0;
+        if (next) {
+            end += 5;
+        }
+        // GCC before version 10 defines `__has_include` as a macro for
+        // `__has_include__`.
+        if (expression.compare(end, 2, "__") == 0) {
+            end += 2;
+        }
+        if (end < expression.size() && isIdentifierCharacter(expression[end])) {
+            continue;
+        }
+
+        while (end < expression.size() && isspace(static_cast<unsigned char>(expression[end]))) {
+            ++end;
+        }
+        if (end == expression.size() || expression[end] != '(') {
+            continue;
+        }
+        ++end;
+        while (end < expression.size() && isspace(static_cast<unsigned char>(expression[end]))) {
+            ++end;
+        }
+        if (end == expression.size() ||
+            (expression[end] != '<' && expression[end] != '"')) {
+            // A header name given by a macro, which may only be known when
+            // the condition is evaluated. The file only matters if it
+            // exists, and then it is also included.
+            continue;
+        }
+
+        const char close = expression[end] == '<' ? '>' : '"';
+        const size_t closePosition = expression.find(close, end + 1);
+        if (closePosition == npos) {
+            continue;
+        }
+        directives->push_back(
+            {next ? Kind::HAS_INCLUDE_NEXT : Kind::HAS_INCLUDE, close == '>',
+             expression.substr(end + 1, closePosition - end - 1),
+             conditional});
+    }
+}
+
+/**
+ * The search paths a command's compiler reported, as given by
+ * `getSearchPaths()`.
+ */
+struct SearchPaths {
+    // The directories searched for quoted includes only, followed by those
+    // searched for all includes, starting at `d_firstAngled`.
+    std::vector<std::string> d_directories;
+    size_t d_firstAngled = 0;
+    // The directories the compiler ignored because they didn't exist, which
+    // are searched if they are created.
+    std::vector<std::string> d_missingDirectories;
+    // The files read before any source, such as the stdc-predef.h that GCC
+    // includes on glibc systems.
+    std::set<std::string> d_implicitIncludes;
+    // What the compiler wrote to standard error.
+    std::string d_output;
+    // The compiler binary the paths were reported by.
+    StatSignature d_compiler;
+};
+
+/**
+ * Parse the output of `-v`, returning false if it doesn't hold the search
+ * paths or lists a framework directory, which is searched differently.
+ */
+bool parseSearchPaths(const std::string &output, SearchPaths *searchPaths)
+{
+    static const std::string missingPrefix =
+        "ignoring nonexistent directory \"";
+    static const std::string framework = " (framework directory)";
+
+    std::istringstream stream(output);
+    std::string line;
+    bool inQuoteList = false;
+    bool inAngleList = false;
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
+        if (startsWith(line, missingPrefix.c_str()) && line.back() == '"') {
+            searchPaths->d_missingDirectories.push_back(line.substr(
+                missingPrefix.size(),
+                line.size() - missingPrefix.size() - 1));
+        }
+        else if (line == "#include \"...\" search starts here:") {
+            inQuoteList = true;
+        }
+        else if (line == "#include <...> search starts here:") {
+            inQuoteList = false;
+            inAngleList = true;
+            searchPaths->d_firstAngled = searchPaths->d_directories.size();
+        }
+        else if (line == "End of search list.") {
+            return inAngleList;
+        }
+        else if ((inQuoteList || inAngleList) && !line.empty() &&
+                 line[0] == ' ') {
+            if (line.size() > framework.size() &&
+                line.compare(line.size() - framework.size(), npos,
+                             framework) == 0) {
+                return false;
+            }
+            searchPaths->d_directories.push_back(line.substr(1));
+        }
+    }
+    return false;
+}
+
+/**
+ * A map that holds at most `capacity` entries, forgetting the least
+ * recently used one to make room for each new one. Not thread-safe.
+ */
+template <typename Value> class LruMap {
+  public:
+    explicit LruMap(size_t capacity) : d_capacity(capacity) {}
+
+    /**
+     * Return the value for `key`, now the most recently used, or null if
+     * there is none.
+     */
+    Value *find(const std::string &key)
+    {
+        const auto it = d_index.find(key);
+        if (it == d_index.end()) {
+            return nullptr;
+        }
+        d_entries.splice(d_entries.begin(), d_entries, it->second);
+        return &it->second->second;
+    }
+
+    void insert(const std::string &key, Value value)
+    {
+        Value *existing = find(key);
+        if (existing != nullptr) {
+            *existing = std::move(value);
+            return;
+        }
+        if (d_index.size() >= d_capacity) {
+            d_index.erase(d_entries.back().first);
+            d_entries.pop_back();
+        }
+        d_entries.emplace_front(key, std::move(value));
+        d_index.emplace(key, d_entries.begin());
+    }
+
+  private:
+    typedef std::list<std::pair<std::string, Value>> Entries;
+
+    const size_t d_capacity;
+    // The most recently used first.
+    Entries d_entries;
+    std::unordered_map<std::string, typename Entries::iterator> d_index;
+};
+
+// The search paths of this many compiler and option combinations are kept,
+// so that a long-running reccd serving many builds doesn't keep all of them.
+std::mutex s_searchPathsMutex;
+LruMap<std::shared_ptr<const SearchPaths>> s_searchPaths(32);
+
+/**
+ * Return the search paths the compiler reports for `query`, which is run
+ * only if it wasn't already in the same working directory with the same
+ * compiler binary, or if one of the directories it ignored now exists.
+ * Returns null if the compiler can't be found or fails.
+ */
+std::shared_ptr<const SearchPaths>
+getSearchPaths(const std::vector<std::string> &query,
+               const std::string &workingDirectory)
+{
+    // As for the dependencies cache, the binary identifies the compiler, so
+    // that one upgraded in place or found elsewhere in PATH is run again.
+    const std::string compiler = Deps::resolve_executable(query.front());
+    const time_t compilerStatTime = time(nullptr);
+    struct stat compilerStat;
+    if (compiler.empty() || stat(compiler.c_str(), &compilerStat) != 0) {
+        return nullptr;
+    }
+
+    std::string key = compiler;
+    key.push_back('\0');
+    key.append(workingDirectory);
+    for (const auto &argument : query) {
+        key.push_back('\0');
+        key.append(argument);
+    }
+    for (const auto &variable : RECC_DEPS_ENV) {
+        key.push_back('\0');
+        key.append(variable.first + "=" + variable.second);
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(s_searchPathsMutex);
+        const auto cached = s_searchPaths.find(key);
+        if (cached != nullptr && (*cached)->d_compiler.matches(compilerStat) &&
+            std::none_of((*cached)->d_missingDirectories.cbegin(),
+                         (*cached)->d_missingDirectories.cend(),
+                         [](const std::string &directory) {
+                             return access(directory.c_str(), F_OK) == 0;
+                         })) {
+            return *cached;
+        }
+    }
+
+    const auto subprocessResult =
+        Subprocess::execute(query, true, true, RECC_DEPS_ENV);
+    if (subprocessResult.d_exitCode != 0) {
+        BUILDBOX_LOG_DEBUG("Failed to get the include search paths, exit "
+                           "status "
+                           << subprocessResult.d_exitCode
+                           << ", stderr: " << subprocessResult.d_stdErr);
+        return nullptr;
+    }
+
+    auto searchPaths = std::make_shared<SearchPaths>();
+    if (!parseSearchPaths(subprocessResult.d_stdErr, searchPaths.get())) {
+        BUILDBOX_LOG_DEBUG("Can't use the include search paths in: "
+                           << subprocessResult.d_stdErr);
+        return nullptr;
+    }
+    searchPaths->d_output = subprocessResult.d_stdErr;
+    searchPaths->d_implicitIncludes = Deps::dependencies_from_make_rules(
+        subprocessResult.d_stdOut, false, true);
+    searchPaths->d_implicitIncludes.erase("/dev/null");
+    searchPaths->d_compiler = StatSignature(compilerStat);
+
+    if (!searchPaths->d_compiler.isRecent(compilerStatTime)) {
+        const std::lock_guard<std::mutex> lock(s_searchPathsMutex);
+        s_searchPaths.insert(key, searchPaths);
+    }
+    return searchPaths;
+}
+
+struct CachedDirectives {
+    StatSignature d_stat;
+    std::shared_ptr<const std::vector<IncludeDirective>> d_directives;
+};
+
+// The directives of this many files are kept, so that a long-running reccd
+// doesn't keep every header it ever saw. The least recently used go first,
+// which leaves the system headers that most sources include.
+std::mutex s_directivesMutex;
+LruMap<CachedDirectives> s_directives(1 << 16);
+
+/**
+ * Return the directives in the file at `path`, parsing it only if it changed
+ * since it was last parsed. Returns null if it can't be read.
+ *
+ * Files modified too shortly before they are read aren't cached, as with
+ * `DirectorySnapshot`, since a further change might not alter their
+ * `stat()` result.
+ */
+std::shared_ptr<const std::vector<IncludeDirective>>
+getDirectives(const std::string &path, const std::string &workingDirectory)
+{
+    const time_t statTime = time(nullptr);
+    struct stat statResult;
+    if (stat(path.c_str(), &statResult) != 0) {
+        return nullptr;
+    }
+
+    const std::string key =
+        path[0] == '/' ? path : workingDirectory + "/" + path;
+    {
+        const std::lock_guard<std::mutex> lock(s_directivesMutex);
+        const CachedDirectives *cached = s_directives.find(key);
+        if (cached != nullptr && cached->d_stat.matches(statResult)) {
+            return cached->d_directives;
+        }
+    }
+
+    std::string contents;
+    try {
+        contents = buildboxcommon::FileUtils::getFileContents(path.c_str());
+    }
+    catch (const std::exception &e) {
+        BUILDBOX_LOG_DEBUG("Can't read \"" << path << "\": " << e.what());
+        return nullptr;
+    }
+    const auto directives = std::make_shared<const std::vector<IncludeDirective>>(
+        IncludeScanner::parseDirectives(contents));
+
+    const StatSignature signature(statResult);
+    if (signature.isRecent(statTime)) {
+        return directives;
+    }
+    const std::lock_guard<std::mutex> lock(s_directivesMutex);
+    s_directives.insert(key, {signature, directives});
+    return directives;
+}
+
+/**
+ * What the scanner needs from a command's dependencies command.
+ */
+struct ScanCommand {
+    std::string d_source;
+    // The files given to `-include` and `-imacros`.
+    std::vector<std::string> d_forcedIncludes;
+    // The command asking the compiler for its search paths and implicit
+    // includes.
+    std::vector<std::string> d_searchPathQuery;
+};
+
+std::string languageOfSource(const std::string &source)
+{
+    static const std::map<std::string, std::string> languages = {
+        {"c", "c"},
+        {"cc", "c++"},
+        {"cp", "c++"},
+        {"cxx", "c++"},
+        {"cpp", "c++"},
+        {"CPP", "c++"},
+        {"c++", "c++"},
+        {"C", "c++"},
+        {"m", "objective-c"},
+        {"mm", "objective-c++"},
+        {"M", "objective-c++"},
+        {"S", "assembler-with-cpp"},
+        {"sx", "assembler-with-cpp"}};
+
+    const size_t dot = source.rfind('.');
+    if (dot == npos || source.find('/', dot) != npos) {
+        return "";
+    }
+    const auto it = languages.find(source.substr(dot + 1));
+    return it == languages.cend() ? "" : it->second;
+}
+
+/**
+ * Fill `scanCommand` from `command`, a GCC or Clang dependencies command,
+ * or return false if it is one the scanner can't follow.
+ */
+bool parseScanCommand(const std::vector<std::string> &command, bool isClang,
+                      ScanCommand *scanCommand)
+{
+    // The options whose value may be the next argument, other than those
+    // handled below.
+    static const std::set<std::string> optionsWithValue = {
+        "-I",          "-iquote",     "-isystem",      "-idirafter",
+        "-iprefix",    "-iwithprefix", "-iwithprefixbefore",
+        "-isysroot",   "-imultilib",  "-cxx-isystem",  "-D",
+        "-U",          "-A",          "-MF",           "-MT",
+        "-MQ",         "-MJ",         "-o",            "-L",
+        "-l",          "-T",          "-u",            "-z",
+        "-Xlinker",    "-Xassembler", "-aux-info",     "--param",
+        "-target",     "-arch",       "-gcc-toolchain", "-resource-dir",
+        "--sysroot",   "-isystem-after", "-main-file-name", "-G"};
+    // Options that change how headers are found or read in ways the scanner
+    // doesn't follow, matched as prefixes.
+    static const std::vector<std::string> unsupportedOptions = {
+        "-I-",          "-Xpreprocessor", "-Wp,",
+        "-Xclang",      "-fmodule",       "-fcxx-modules",
+        "-fimplicit-module", "-include-pch", "-ivfsoverlay",
+        "-F",           "-iframework",    "-working-directory",
+        "-traditional", "--include",      "--imacros",
+        "-###",         "-fdirectives-only"};
+    // Options that only matter to the dependencies command, or to
+    // compiling, and are left out of the search path query.
+    static const std::set<std::string> dropped = {
+        "-c", "-S", "-E", "-M", "-MM", "-MD", "-MMD", "-MG",
+        "-MP", "-MV", "-v", "--verbose", "-fsyntax-only"};
+
+    if (command.empty()) {
+        return false;
+    }
+
+    std::string language;
+    std::vector<std::string> &query = scanCommand->d_searchPathQuery;
+    query.push_back(command[0]);
+    for (size_t i = 1; i < command.size(); ++i) {
+        const std::string &argument = command[i];
+
+        if (argument.empty() || argument == "-" || argument[0] == '@') {
+            BUILDBOX_LOG_DEBUG("Can't scan includes for argument \""
+                               << argument << "\"");
+            return false;
+        }
+
+        if (argument[0] != '-') {
+            if (!scanCommand->d_source.empty()) {
+                BUILDBOX_LOG_DEBUG("Can't scan includes for \"" << argument
+                                   << "\" after source \""
+                                   << scanCommand->d_source << "\"");
+                return false;
+            }
+            scanCommand->d_source = argument;
+            continue;
+        }
+
+        if (argument == "-x" || startsWith(argument, "-x")) {
+            if (!scanCommand->d_source.empty()) {
+                return false;
+            }
+            language = argument == "-x" && i + 1 < command.size()
+                           ? command[++i]
+                           : argument.substr(2);
+            continue;
+        }
+
+        if (std::any_of(unsupportedOptions.cbegin(), unsupportedOptions.cend(),
+                        [&argument](const std::string &option) {
+                            return startsWith(argument, option.c_str());
+                        }) ||
+            (isClang && startsWith(argument, "-fsanitize"))) {
+            BUILDBOX_LOG_DEBUG("Can't scan includes for option \""
+                               << argument << "\"");
+            return false;
+        }
+
+        bool forcedInclude = false;
+        for (const char *option : {"-include", "-imacros"}) {
+            if (!startsWith(argument, option)) {
+                continue;
+            }
+            std::string file = argument.substr(strlen(option));
+            if (file.empty() && i + 1 < command.size()) {
+                file = command[++i];
+            }
+            if (file.empty() || file[0] == '=') {
+                return false;
+            }
+            scanCommand->d_forcedIncludes.push_back(file);
+            forcedInclude = true;
+        }
+        if (forcedInclude) {
+            continue;
+        }
+
+        const bool takesValue =
+            optionsWithValue.count(argument) > 0 && i + 1 < command.size();
+        if (dropped.count(argument) > 0 || startsWith(argument, "-MF") ||
+            startsWith(argument, "-MT") || startsWith(argument, "-MQ") ||
+            startsWith(argument, "-MJ") || startsWith(argument, "-o") ||
+            startsWith(argument, "-save-temps")) {
+            if (takesValue) {
+                ++i;
+            }
+            continue;
+        }
+
+        query.push_back(argument);
+        if (takesValue) {
+            query.push_back(command[++i]);
+        }
+    }
+
+    if (scanCommand->d_source.empty()) {
+        return false;
+    }
+    if (language.empty()) {
+        language = languageOfSource(scanCommand->d_source);
+    }
+    if (language != "c" && language != "c++" && language != "objective-c" &&
+        language != "objective-c++" && language != "assembler-with-cpp") {
+        BUILDBOX_LOG_DEBUG("Can't scan includes for the language of \""
+                           << scanCommand->d_source << "\"");
+        return false;
+    }
+
+    // The dependencies of an empty source are the files the compiler
+    // includes implicitly.
+    query.insert(query.end(),
+                 {"-E", "-M", "-v", "-x", language, "/dev/null"});
+    return true;
+}
+
+/**
+ * Follows the includes from a source file, as `IncludeScanner::scan()`.
+ */
+class Scanner {
+  public:
+    Scanner(const SearchPaths &searchPaths,
+            const std::string &workingDirectory,
+            std::set<std::string> *inputs)
+        : d_searchPaths(searchPaths), d_workingDirectory(workingDirectory),
+          d_inputs(inputs)
+    {
+    }
+
+    /**
+     * Add a file read before any include: the source, an implicit include,
+     * or a file given to `-include`, which is looked up in the working
+     * directory first and then in the quoted include search path.
+     */
+    bool addSource(const std::string &path);
+    bool addForcedInclude(const std::string &name);
+
+    /**
+     * Follow the includes from the files added, returning false if one of
+     * them can't be followed.
+     */
+    bool run();
+
+  private:
+    // A file to read, with where to start looking for the files it names
+    // with `#include_next`: an index into the search path, or `npos` to
+    // look for them as with `#include`, for files that weren't found in a
+    // directory.
+    struct File {
+        std::string d_path;
+        size_t d_nextIndex = npos;
+        bool d_conditional = false;
+    };
+
+    bool isFile(const std::string &path);
+    std::string inDirectory(const std::string &directory,
+                            const std::string &name) const;
+    bool find(const IncludeDirective &directive, const File &includer,
+              File *found);
+    void add(File file);
+    bool process(const File &file);
+
+    const SearchPaths &d_searchPaths;
+    const std::string &d_workingDirectory;
+    std::set<std::string> *d_inputs;
+
+    std::vector<File> d_pending;
+    // For each file and `d_nextIndex` read, whether it was only read from
+    // conditional includes. A file is read again if it is later included
+    // unconditionally, so that its own includes are no longer treated as
+    // conditional.
+    std::map<std::pair<std::string, size_t>, bool> d_read;
+    std::unordered_map<std::string, bool> d_isFile;
+};
+
+bool Scanner::isFile(const std::string &path)
+{
+    const auto it = d_isFile.find(path);
+    if (it != d_isFile.cend()) {
+        return it->second;
+    }
+    struct stat statResult;
+    const bool result =
+        stat(path.c_str(), &statResult) == 0 && S_ISREG(statResult.st_mode);
+    d_isFile.emplace(path, result);
+    return result;
+}
+
+std::string Scanner::inDirectory(const std::string &directory,
+                                 const std::string &name) const
+{
+    if (directory.empty() || directory.back() == '/') {
+        return directory + name;
+    }
+    return directory + "/" + name;
+}
+
+bool Scanner::find(const IncludeDirective &directive, const File &includer,
+                   File *found)
+{
+    const std::string &name = directive.d_name;
+    if (!name.empty() && name[0] == '/') {
+        found->d_path = name;
+        found->d_nextIndex = npos;
+        return isFile(name);
+    }
+
+    const bool next = directive.d_kind == Kind::INCLUDE_NEXT ||
+                      directive.d_kind == Kind::HAS_INCLUDE_NEXT;
+    size_t first = directive.d_angled ? d_searchPaths.d_firstAngled : 0;
+    if (next && includer.d_nextIndex != npos) {
+        first = includer.d_nextIndex;
+    }
+    else if (!directive.d_angled) {
+        const size_t slash = includer.d_path.rfind('/');
+        found->d_path =
+            slash == npos ? name : includer.d_path.substr(0, slash + 1) + name;
+        // As GCC does, a later `#include_next` searches the whole path.
+        found->d_nextIndex = 0;
+        if (isFile(found->d_path)) {
+            return true;
+        }
+    }
+
+    const auto &directories = d_searchPaths.d_directories;
+    for (size_t i = first; i < directories.size(); ++i) {
+        found->d_path = inDirectory(directories[i], name);
+        found->d_nextIndex = i + 1;
+        if (isFile(found->d_path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scanner::add(File file)
+{
+    const auto key = std::make_pair(file.d_path, file.d_nextIndex);
+    const auto it = d_read.find(key);
+    if (it != d_read.cend() && (!it->second || file.d_conditional)) {
+        return;
+    }
+    d_read[key] = file.d_conditional;
+    d_pending.push_back(std::move(file));
+}
+
+bool Scanner::addSource(const std::string &path)
+{
+    if (!isFile(path)) {
+        return false;
+    }
+    add({path, npos, false});
+    return true;
+}
+
+bool Scanner::addForcedInclude(const std::string &name)
+{
+    // Treated as a quoted include from a file in the working directory.
+    File found;
+    if (find({Kind::INCLUDE, false, name, false}, {"", 0, false}, &found)) {
+        add(std::move(found));
+        return true;
+    }
+    BUILDBOX_LOG_DEBUG("Can't find forced include \"" << name << "\"");
+    return false;
+}
+
+bool Scanner::process(const File &file)
+{
+    const auto directives = getDirectives(file.d_path, d_workingDirectory);
+    if (directives == nullptr) {
+        BUILDBOX_LOG_DEBUG("Can't read \"" << file.d_path
+                                           << "\" to scan its includes");
+        return false;
+    }
+    d_inputs->insert(file.d_path);
+
+    for (const IncludeDirective &directive : *directives) {
+        if (directive.d_kind == Kind::COMPUTED) {
+            BUILDBOX_LOG_DEBUG("\"" << file.d_path
+                                    << "\" has an include that depends on "
+                                       "macros: "
+                                    << directive.d_name);
+            return false;
+        }
+
+        const bool hasInclude = directive.d_kind == Kind::HAS_INCLUDE ||
+                                directive.d_kind == Kind::HAS_INCLUDE_NEXT;
+        const bool conditional = file.d_conditional || directive.d_conditional;
+        File found;
+        if (!find(directive, file, &found)) {
+            if (hasInclude || conditional) {
+                continue;
+            }
+            BUILDBOX_LOG_DEBUG("Can't find \"" << directive.d_name
+                                               << "\", included from \""
+                                               << file.d_path << "\"");
+            return false;
+        }
+
+        d_inputs->insert(found.d_path);
+        if (!hasInclude) {
+            found.d_conditional = conditional;
+            add(std::move(found));
+        }
+    }
+    return true;
+}
+
+bool Scanner::run()
+{
+    while (!d_pending.empty()) {
+        const File file = std::move(d_pending.back());
+        d_pending.pop_back();
+        if (!process(file)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+bool IncludeScanner::enabled(const ParsedCommand &command)
+{
+    return RECC_DEPS_SCAN &&
+           SupportedCompilers::Gcc.count(command.get_compiler()) > 0;
+}
+
+bool IncludeScanner::scan(const ParsedCommand &command,
+                          std::set<std::string> *inputs,
+                          std::string *searchPathOutput)
+{
+    ScanCommand scanCommand;
+    if (!parseScanCommand(command.get_dependencies_command(),
+                          command.is_clang(), &scanCommand)) {
+        return false;
+    }
+
+    const std::string workingDirectory =
+        FileUtils::getCurrentWorkingDirectory();
+    const auto searchPaths =
+        getSearchPaths(scanCommand.d_searchPathQuery, workingDirectory);
+    if (searchPaths == nullptr) {
+        return false;
+    }
+
+    std::set<std::string> scanned;
+    Scanner scanner(*searchPaths, workingDirectory, &scanned);
+    if (!scanner.addSource(scanCommand.d_source)) {
+        return false;
+    }
+    for (const auto &path : searchPaths->d_implicitIncludes) {
+        if (!scanner.addSource(path)) {
+            return false;
+        }
+    }
+    for (const auto &name : scanCommand.d_forcedIncludes) {
+        if (!scanner.addForcedInclude(name)) {
+            return false;
+        }
+    }
+    if (!scanner.run()) {
+        return false;
+    }
+
+    BUILDBOX_LOG_DEBUG("Found " << scanned.size() << " files included from \""
+                                << scanCommand.d_source << "\"");
+    *inputs = std::move(scanned);
+    *searchPathOutput = searchPaths->d_output;
+    return true;
+}
+
+std::vector<IncludeDirective>
+IncludeScanner::parseDirectives(const std::string &contents)
+{
+    // The state of each enclosing `#if`.
+    struct Conditional {
+        // Whether the current branch is known to be skipped.
+        bool d_skipped;
+        // Whether an earlier or the current branch is known to be taken,
+        // so that the following ones are skipped.
+        bool d_taken;
+        // Whether it is an include guard, which a header is only read
+        // through once, and so doesn't make what it holds conditional.
+        bool d_guard;
+    };
+
+    const std::string text = removeLineSplices(contents);
+    DirectiveReader reader(text);
+    std::vector<IncludeDirective> directives;
+    std::vector<Conditional> conditionals;
+    // The macro tested by an `#ifndef` that may be an include guard, if it
+    // is defined by the directive that follows.
+    std::string guardMacro;
+
+    const auto skipped = [&conditionals]() {
+        return std::any_of(
+            conditionals.cbegin(), conditionals.cend(),
+            [](const Conditional &entry) { return entry.d_skipped; });
+    };
+    const auto conditional = [&conditionals]() {
+        return std::any_of(
+            conditionals.cbegin(), conditionals.cend(),
+            [](const Conditional &entry) { return !entry.d_guard; });
+    };
+
+    while (reader.nextDirective()) {
+        const std::string name = reader.readIdentifier();
+        const std::string previousGuardMacro = std::move(guardMacro);
+        guardMacro.clear();
+
+        if (name == "include" || name == "include_next" || name == "import") {
+            IncludeDirective directive;
+            directive.d_kind =
+                name == "include_next" ? Kind::INCLUDE_NEXT : Kind::INCLUDE;
+            if (!reader.readHeaderName(&directive.d_name,
+                                       &directive.d_angled)) {
+                directive.d_kind = Kind::COMPUTED;
+                directive.d_angled = false;
+                directive.d_name = reader.readRestOfLine();
+            }
+            directive.d_conditional = conditional();
+            if (!skipped()) {
+                directives.push_back(std::move(directive));
+            }
+        }
+        else if (name == "if" || name == "ifdef" || name == "ifndef") {
+            const bool outerSkipped = skipped();
+            const std::string expression = reader.readRestOfLine();
+            const int value = name == "if" ? literalValue(expression) : -1;
+            conditionals.push_back({value == 0, value == 1, false});
+
+            if (name == "ifndef") {
+                guardMacro = DirectiveReader(expression).readIdentifier();
+            }
+            else if (name == "if") {
+                guardMacro = negatedDefinedMacro(expression);
+                if (!outerSkipped) {
+                    addHasIncludes(expression, true, &directives);
+                }
+            }
+        }
+        else if (name == "elif" || name == "elifdef" || name == "elifndef") {
+            const std::string expression = reader.readRestOfLine();
+            if (conditionals.empty()) {
+                continue;
+            }
+            Conditional &current = conditionals.back();
+            current.d_guard = false;
+            if (current.d_taken) {
+                current.d_skipped = true;
+                continue;
+            }
+            const int value =
+                name == "elif" ? literalValue(expression) : -1;
+            current.d_skipped = value == 0;
+            current.d_taken = value == 1;
+            if (name == "elif" && !skipped()) {
+                addHasIncludes(expression, true, &directives);
+            }
+        }
+        else if (name == "else") {
+            if (!conditionals.empty()) {
+                Conditional &current = conditionals.back();
+                current.d_guard = false;
+                current.d_skipped = current.d_taken;
+                current.d_taken = true;
+            }
+        }
+        else if (name == "endif") {
+            if (!conditionals.empty()) {
+                conditionals.pop_back();
+            }
+        }
+        else if (name == "define" && !previousGuardMacro.empty() &&
+                 !conditionals.empty() &&
+                 reader.readIdentifier() == previousGuardMacro) {
+            conditionals.back().d_guard = true;
+        }
+
+        reader.readRestOfLine();
+    }
+
+    return directives;
+}
+
+} // namespace recc
+} // namespace BloombergLP
@@ -0,0 +1,102 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_INCLUDESCANNER
+#define INCLUDED_INCLUDESCANNER
+
+#include <parsedcommand.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * A preprocessor directive that names a file.
+ */
+struct IncludeDirective {
+    enum class Kind {
+        INCLUDE,
+        INCLUDE_NEXT,
+        HAS_INCLUDE,
+        HAS_INCLUDE_NEXT,
+        // An include whose operand is not a header name, and so can only be
+        // known by expanding macros.
+        COMPUTED
+    };
+
+    Kind d_kind;
+    // Whether the name was between angle brackets rather than quotes.
+    bool d_angled;
+    std::string d_name;
+    // Whether the directive is in a conditional section other than an
+    // include guard, so that it may be skipped by the preprocessor.
+    bool d_conditional;
+};
+
+/**
+ * Finds the files a GCC or Clang command includes by reading them, rather
+ * than running the preprocessor, when RECC_DEPS_SCAN is set.
+ *
+ * The search paths, and the files the compiler includes before any source,
+ * are those it reports for the command with `-E -M -v` on an empty input,
+ * which is cheap to run and cached in memory for the most recently used
+ * compilers and options.
+ * Every `#include`, `#include_next`, `#import` and file named in
+ * `__has_include` is followed. Conditionals are not evaluated, except for
+ * integer literals, so both branches of the others are followed; a header
+ * that can't be found is taken to be in a branch that isn't used if the
+ * directive is in a conditional section, and an error otherwise.
+ *
+ * The directives found in each header are cached in memory for as long as
+ * its `stat()` result doesn't change.
+ *
+ * A scan gives up, so that the compiler is run instead, on includes that
+ * can only be resolved by expanding macros, on headers that can't be found
+ * outside conditionals, and on options that change how headers are found
+ * in ways the scanner doesn't follow.
+ */
+struct IncludeScanner {
+    /**
+     * Return whether RECC_DEPS_SCAN is set and `command` is one the scanner
+     * may handle.
+     */
+    static bool enabled(const ParsedCommand &command);
+
+    /**
+     * Write every file the preprocessor may read for `command` to `inputs`
+     * and return true, or return false if the compiler must be run to find
+     * them.
+     *
+     * `searchPathOutput` is set to what the compiler wrote to standard error
+     * when asked for its search paths.
+     */
+    static bool scan(const ParsedCommand &command,
+                     std::set<std::string> *inputs,
+                     std::string *searchPathOutput);
+
+    /**
+     * Return the directives in `contents` that name files, leaving out those
+     * in sections excluded by `#if 0` and the like.
+     */
+    static std::vector<IncludeDirective>
+    parseDirectives(const std::string &contents);
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
@@ -15,19 +15,30 @@
 #include <merklize.h>
 
 #include <digestgenerator.h>
+#include <directorysnapshot.h>
 #include <fileutils.h>
+#include <threadpool.h>
+#include <threadutils.h>
 
 #include <buildboxcommon_logging.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cstring>
+#include <ctime>
 #include <dirent.h>
+#include <fcntl.h>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <openssl/evp.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <system_error>
+#include <unistd.h>
+#include <vector>
 
 #define TIMER_NAME_CALCULATE_DIGESTS_TOTAL "recc.calculate_digests_total"
 
@@ -63,6 +74,450 @@ const std::string normalize_replace_root(const std::string path)
     return normalizedReplacedRoot;
 }
 
+// Remove the leading, trailing and repeated slashes of `path`, which
+// `NestedDirectory` skips over as empty path components.
+std::string trimSlashes(std::string path)
+{
+    if (path.find("//") == std::string::npos &&
+        (path.empty() || (path.front() != '/' && path.back() != '/'))) {
+        return path;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path[i] == '/' && (length == 0 || path[length - 1] == '/')) {
+            continue;
+        }
+        path[length++] = path[i];
+    }
+    if (length > 0 && path[length - 1] == '/') {
+        length--;
+    }
+    path.resize(length);
+    return path;
+}
+
+// Whether `a` sorts before `b` when comparing their components in turn.
+// This is byte order, except that the separator sorts before everything
+// else, so that "a/b" comes before "a.b" as "a" comes before "a.b".
+bool componentwiseLess(const std::string &a, const std::string &b)
+{
+    const size_t length = std::min(a.size(), b.size());
+    for (size_t i = 0; i < length; ++i) {
+        if (a[i] != b[i]) {
+            if (a[i] == '/' || b[i] == '/') {
+                return a[i] == '/';
+            }
+            return static_cast<unsigned char>(a[i]) <
+                   static_cast<unsigned char>(b[i]);
+        }
+    }
+    return a.size() < b.size();
+}
+
+/**
+ * Writes the fields of a `Directory` message in their wire format, producing
+ * the same bytes as `SerializeAsString()` on the equivalent message without
+ * building it. That requires files, directories and symlinks to be added in
+ * that order, which is the order of their field numbers.
+ */
+class DirectoryEncoder {
+  public:
+    explicit DirectoryEncoder(std::string *buffer) : d_buffer(buffer)
+    {
+        d_buffer->clear();
+    }
+
+    void addFile(const char *name, size_t nameLength,
+                 const proto::Digest &digest, bool executable)
+    {
+        const size_t digestSize = digest.ByteSizeLong();
+        const size_t fileNodeSize = stringFieldSize(nameLength) +
+                                    messageFieldSize(digestSize) +
+                                    (executable ? 2 : 0);
+
+        writeTag(s_directoryFilesField, s_lengthDelimited);
+        writeVarint(fileNodeSize);
+        writeString(s_nodeNameField, name, nameLength);
+        writeDigest(s_nodeDigestField, digest, digestSize);
+        if (executable) {
+            writeTag(s_fileNodeIsExecutableField, s_varint);
+            writeVarint(1);
+        }
+    }
+
+    void addDirectory(const char *name, size_t nameLength,
+                      const proto::Digest &digest)
+    {
+        const size_t digestSize = digest.ByteSizeLong();
+
+        writeTag(s_directoryDirectoriesField, s_lengthDelimited);
+        writeVarint(stringFieldSize(nameLength) +
+                    messageFieldSize(digestSize));
+        writeString(s_nodeNameField, name, nameLength);
+        writeDigest(s_nodeDigestField, digest, digestSize);
+    }
+
+    void addSymlink(const char *name, size_t nameLength,
+                    const std::string &target)
+    {
+        writeTag(s_directorySymlinksField, s_lengthDelimited);
+        writeVarint(stringFieldSize(nameLength) +
+                    stringFieldSize(target.size()));
+        writeString(s_nodeNameField, name, nameLength);
+        writeString(s_symlinkNodeTargetField, target.data(), target.size());
+    }
+
+  private:
+    // Field numbers of `Directory`, `FileNode`, `DirectoryNode` and
+    // `SymlinkNode`, all of which fit in a single byte tag.
+    static const uint32_t s_directoryFilesField = 1;
+    static const uint32_t s_directoryDirectoriesField = 2;
+    static const uint32_t s_directorySymlinksField = 3;
+    static const uint32_t s_nodeNameField = 1;
+    static const uint32_t s_nodeDigestField = 2;
+    static const uint32_t s_fileNodeIsExecutableField = 4;
+    static const uint32_t s_symlinkNodeTargetField = 2;
+
+    static const uint32_t s_varint = 0;
+    static const uint32_t s_lengthDelimited = 2;
+
+    static size_t varintSize(size_t value)
+    {
+        size_t size = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    // Empty strings are left out, as proto3 does for default values.
+    static size_t stringFieldSize(size_t length)
+    {
+        return length == 0 ? 0 : 1 + varintSize(length) + length;
+    }
+
+    // Message fields are written when set, even if empty.
+    static size_t messageFieldSize(size_t size)
+    {
+        return 1 + varintSize(size) + size;
+    }
+
+    void writeTag(uint32_t field, uint32_t wireType)
+    {
+        d_buffer->push_back(static_cast<char>(field << 3 | wireType));
+    }
+
+    void writeVarint(size_t value)
+    {
+        while (value >= 0x80) {
+            d_buffer->push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        d_buffer->push_back(static_cast<char>(value));
+    }
+
+    void writeString(uint32_t field, const char *data, size_t length)
+    {
+        if (length == 0) {
+            return;
+        }
+        writeTag(field, s_lengthDelimited);
+        writeVarint(length);
+        d_buffer->append(data, length);
+    }
+
+    void writeDigest(uint32_t field, const proto::Digest &digest,
+                     size_t digestSize)
+    {
+        writeTag(field, s_lengthDelimited);
+        writeVarint(digestSize);
+        const size_t offset = d_buffer->size();
+        d_buffer->resize(offset + digestSize);
+        digest.SerializeToArray(&(*d_buffer)[offset],
+                                static_cast<int>(digestSize));
+    }
+
+    std::string *d_buffer;
+};
+
+enum class NodeKind { DIRECTORY, FILE, SYMLINK };
+
+struct TreeNode {
+    // Points into storage that outlives the layout.
+    const char *d_name;
+    size_t d_nameLength;
+    NodeKind d_kind;
+    // The file of a file node, and of a symlink node without a target.
+    const ReccFile *d_file;
+    const std::string *d_symlinkTarget;
+    // The `Directory` message of a directory, if already known.
+    const SerializedDirectory *d_serialized;
+    // Range of `TreeLayout::d_children` that holds the children of a
+    // directory.
+    size_t d_firstChild;
+    size_t d_childCount;
+    // Number of nodes in the subtree rooted here, including this one.
+    size_t d_subtreeSize;
+    // Used while building: the parent of the node, and for directories the
+    // last child of each kind added to them.
+    size_t d_parent;
+    size_t d_lastChild[3];
+};
+
+const size_t s_noNode = std::numeric_limits<size_t>::max();
+
+// Subtrees with fewer nodes than this are not worth a task of their own.
+const size_t s_minParallelSubtreeSize = 128;
+
+/**
+ * A directory tree laid out in a single array of nodes, which computes the
+ * digests of its directories.
+ *
+ * Nodes are added either by path, in component-wise sorted order, or one by
+ * one under a given parent. In sorted order the children of a directory are
+ * added in name order, and a child that already exists under the name of a
+ * new one is always the last of its kind, so each path component costs a
+ * single comparison.
+ */
+class TreeLayout {
+  public:
+    explicit TreeLayout(size_t expectedNodes = 0) : d_pool(nullptr)
+    {
+        d_nodes.reserve(expectedNodes + 1);
+        addNode(s_noNode, nullptr, 0, NodeKind::DIRECTORY);
+    }
+
+    /**
+     * Add the node for `path`, and the directories leading to it, returning
+     * its index.
+     */
+    size_t addPath(const std::string &path, NodeKind kind)
+    {
+        size_t parent = 0;
+        size_t start = 0;
+        while (true) {
+            const size_t slash = path.find('/', start);
+            const bool last = slash == std::string::npos;
+            const size_t end = last ? path.size() : slash;
+            parent = child(parent, path.data() + start, end - start,
+                           last ? kind : NodeKind::DIRECTORY);
+            if (last) {
+                return parent;
+            }
+            start = slash + 1;
+        }
+    }
+
+    /**
+     * Add the contents of `directory`, and of its subdirectories, under
+     * the directory node `parent`.
+     */
+    void addNestedDirectory(size_t parent, const NestedDirectory &directory)
+    {
+        d_nodes[parent].d_serialized = directory.d_serialized.get();
+        for (const auto &file : directory.d_files) {
+            const size_t node = addNode(parent, file.first.data(),
+                                        file.first.size(), NodeKind::FILE);
+            d_nodes[node].d_file = file.second.get();
+        }
+        for (const auto &symlink : directory.d_symlinks) {
+            const size_t node =
+                addNode(parent, symlink.first.data(), symlink.first.size(),
+                        NodeKind::SYMLINK);
+            d_nodes[node].d_symlinkTarget = &symlink.second;
+        }
+        for (const auto &subdir : *directory.d_subdirs) {
+            const size_t node =
+                addNode(parent, subdir.first.data(), subdir.first.size(),
+                        NodeKind::DIRECTORY);
+            addNestedDirectory(node, subdir.second);
+        }
+    }
+
+    void setFile(size_t node, const ReccFile *file)
+    {
+        d_nodes[node].d_file = file;
+    }
+
+    /**
+     * Store the children of every directory contiguously, in the order they
+     * were added, and count the nodes of every subtree.
+     */
+    void finish()
+    {
+        // Parents are always added before their children.
+        for (size_t i = d_nodes.size() - 1; i > 0; --i) {
+            TreeNode &parent = d_nodes[d_nodes[i].d_parent];
+            parent.d_childCount++;
+            parent.d_subtreeSize += d_nodes[i].d_subtreeSize;
+        }
+        size_t offset = 0;
+        for (TreeNode &node : d_nodes) {
+            node.d_firstChild = offset;
+            offset += node.d_childCount;
+            node.d_childCount = 0;
+        }
+        d_children.resize(offset);
+        for (size_t i = 1; i < d_nodes.size(); ++i) {
+            TreeNode &parent = d_nodes[d_nodes[i].d_parent];
+            d_children[parent.d_firstChild + parent.d_childCount++] = i;
+        }
+    }
+
+    /**
+     * Return the digest of the root directory, storing the serialized
+     * `Directory` messages of the whole tree in `digestMap` if given.
+     */
+    proto::Digest to_digest(digest_string_umap *digestMap)
+    {
+        if (ThreadUtils::maxThreads() > 1 &&
+            d_nodes.front().d_subtreeSize >= 2 * s_minParallelSubtreeSize) {
+            d_pool = &ThreadPool::instance();
+        }
+        d_digests.resize(d_nodes.size());
+        if (digestMap != nullptr) {
+            d_blobs.resize(d_nodes.size());
+        }
+
+        digestDirectory(0, digestMap != nullptr);
+
+        if (digestMap != nullptr) {
+            for (size_t i = 0; i < d_nodes.size(); ++i) {
+                if (d_nodes[i].d_kind == NodeKind::DIRECTORY) {
+                    digestMap->emplace(d_digests[i], std::move(d_blobs[i]));
+                }
+            }
+        }
+        return d_digests.front();
+    }
+
+  private:
+    size_t addNode(size_t parent, const char *name, size_t nameLength,
+                   NodeKind kind)
+    {
+        TreeNode node;
+        node.d_name = name;
+        node.d_nameLength = nameLength;
+        node.d_kind = kind;
+        node.d_file = nullptr;
+        node.d_symlinkTarget = nullptr;
+        node.d_serialized = nullptr;
+        node.d_firstChild = 0;
+        node.d_childCount = 0;
+        node.d_subtreeSize = 1;
+        node.d_parent = parent;
+        std::fill(std::begin(node.d_lastChild), std::end(node.d_lastChild),
+                  s_noNode);
+        d_nodes.push_back(node);
+        return d_nodes.size() - 1;
+    }
+
+    size_t child(size_t parent, const char *name, size_t nameLength,
+                 NodeKind kind)
+    {
+        const size_t kindIndex = static_cast<size_t>(kind);
+        const size_t last = d_nodes[parent].d_lastChild[kindIndex];
+        if (last != s_noNode && d_nodes[last].d_nameLength == nameLength &&
+            std::memcmp(d_nodes[last].d_name, name, nameLength) == 0) {
+            return last;
+        }
+        const size_t added = addNode(parent, name, nameLength, kind);
+        d_nodes[parent].d_lastChild[kindIndex] = added;
+        return added;
+    }
+
+    /**
+     * Compute the digest of the directory `index` once those of its
+     * subdirectories are known. Large subtrees are handed to the pool, so
+     * that sibling subtrees are digested in parallel; other threads take
+     * them while this one works through the rest.
+     */
+    void digestDirectory(size_t index, bool keepBlob)
+    {
+        const TreeNode &node = d_nodes[index];
+        const size_t *begin = d_children.data() + node.d_firstChild;
+        const size_t *end = begin + node.d_childCount;
+
+        if (node.d_serialized != nullptr) {
+            d_digests[index] = node.d_serialized->d_digest;
+            if (keepBlob) {
+                // The messages of the subdirectories are still needed, and
+                // are usually known as well.
+                d_blobs[index] = node.d_serialized->d_blob;
+                for (const size_t *it = begin; it != end; ++it) {
+                    if (d_nodes[*it].d_kind == NodeKind::DIRECTORY) {
+                        digestDirectory(*it, keepBlob);
+                    }
+                }
+            }
+            return;
+        }
+
+        {
+            TaskGroup subdirectories(d_pool);
+            for (const size_t *it = begin; it != end; ++it) {
+                const size_t child = *it;
+                if (d_nodes[child].d_kind != NodeKind::DIRECTORY) {
+                    continue;
+                }
+                if (d_pool != nullptr &&
+                    d_nodes[child].d_subtreeSize >= s_minParallelSubtreeSize) {
+                    subdirectories.submit([this, child, keepBlob] {
+                        digestDirectory(child, keepBlob);
+                    });
+                }
+                else {
+                    digestDirectory(child, keepBlob);
+                }
+            }
+            subdirectories.wait();
+        }
+
+        // Reused by every directory digested on this thread.
+        thread_local std::string buffer;
+        DirectoryEncoder encoder(&buffer);
+        for (const size_t *it = begin; it != end; ++it) {
+            const TreeNode &child = d_nodes[*it];
+            if (child.d_kind == NodeKind::FILE) {
+                encoder.addFile(child.d_name, child.d_nameLength,
+                                child.d_file->getDigest(),
+                                child.d_file->isExecutable());
+            }
+        }
+        for (const size_t *it = begin; it != end; ++it) {
+            const TreeNode &child = d_nodes[*it];
+            if (child.d_kind == NodeKind::DIRECTORY) {
+                encoder.addDirectory(child.d_name, child.d_nameLength,
+                                     d_digests[*it]);
+            }
+        }
+        for (const size_t *it = begin; it != end; ++it) {
+            const TreeNode &child = d_nodes[*it];
+            if (child.d_kind == NodeKind::SYMLINK) {
+                encoder.addSymlink(child.d_name, child.d_nameLength,
+                                   child.d_symlinkTarget != nullptr
+                                       ? *child.d_symlinkTarget
+                                       : child.d_file->getFileContents());
+            }
+        }
+
+        d_digests[index] = DigestGenerator::make_digest(buffer);
+        if (keepBlob) {
+            d_blobs[index] = buffer;
+        }
+    }
+
+    std::vector<TreeNode> d_nodes;
+    std::vector<size_t> d_children;
+
+    // Set when digesting, indexed like `d_nodes`.
+    ThreadPool *d_pool;
+    std::vector<proto::Digest> d_digests;
+    std::vector<std::string> d_blobs;
+};
+
 } // unnamed namespace
 
 void NestedDirectory::add(std::shared_ptr<ReccFile> file,
@@ -72,6 +527,7 @@ void NestedDirectory::add(std::shared_ptr<ReccFile> file,
     if (relativePath == nullptr || strcmp(relativePath, "/") == 0) {
         return;
     }
+    d_serialized.reset();
 
     if (file->isSymlink()) {
         this->addSymlink(file->getFileContents(), relativePath, checkedPrefix);
@@ -112,6 +568,8 @@ void NestedDirectory::add(std::shared_ptr<ReccFile> file,
 void NestedDirectory::addSymlink(const std::string &target,
                                  const char *relativePath, bool checkedPrefix)
 {
+    d_serialized.reset();
+
     // Check if directory passed in matches any in PREFIX_REPLACEMENT_MAP. if
     // so replace the path. Only check on the inital call, when the full
     // directory path is avaliable.
@@ -149,6 +607,7 @@ void NestedDirectory::addDirectory(const char *directory, bool checkedPrefix)
     if (directory == nullptr || strcmp(directory, "/") == 0) {
         return;
     }
+    d_serialized.reset();
 
     // If an absolute path, go one past the first slash, saving an unnecessary
     // recursive call.
@@ -197,42 +656,10 @@ void NestedDirectory::addDirectory(const char *directory, bool checkedPrefix)
 
 proto::Digest NestedDirectory::to_digest(digest_string_umap *digestMap) const
 {
-    // The 'd_files' and 'd_subdirs' maps make sure everything is sorted by
-    // name thus the iterators will iterate lexicographically
-
-    proto::Directory directoryMessage;
-
-    // files
-    for (const auto &fileIter : d_files) {
-        *directoryMessage.add_files() =
-            fileIter.second->getFileNode(fileIter.first);
-    }
-
-    // symlinks
-    for (const auto &symlinkIter : d_symlinks) {
-        proto::SymlinkNode symlinkNode;
-        symlinkNode.set_name(symlinkIter.first);
-        symlinkNode.set_target(symlinkIter.second);
-        *directoryMessage.add_symlinks() = symlinkNode;
-    }
-
-    // directories
-    for (const auto &subdirIter : *d_subdirs) {
-        auto subdirNode = directoryMessage.add_directories();
-        subdirNode->set_name(subdirIter.first);
-        auto subdirDigest = subdirIter.second.to_digest(digestMap);
-        *subdirNode->mutable_digest() = subdirDigest;
-    }
-
-    const auto blob = directoryMessage.SerializeAsString();
-    const auto digest = DigestGenerator::make_digest(blob);
-
-    if (digestMap != nullptr) {
-      digestMap->emplace(digest.SerializeAsString(), blob);
-      
-    }
-
-    return digest;
+    TreeLayout layout;
+    layout.addNestedDirectory(0, *this);
+    layout.finish();
+    return layout.to_digest(digestMap);
 }
 
 void NestedDirectory::print(std::ostream &out,
@@ -262,112 +689,687 @@ void NestedDirectory::print(std::ostream &out,
     }
 }
 
+void DirectoryTree::add(std::shared_ptr<ReccFile> file,
+                        std::string relativePath)
+{
+    d_entries.push_back({trimSlashes(std::move(relativePath)), file});
+}
+
+void DirectoryTree::addDirectory(std::string relativePath)
+{
+    d_entries.push_back({trimSlashes(std::move(relativePath)), nullptr});
+}
+
+proto::Digest DirectoryTree::to_digest(digest_string_umap *digestMap) const
+{
+    std::vector<const Entry *> sortedEntries;
+    sortedEntries.reserve(d_entries.size());
+    for (const Entry &entry : d_entries) {
+        sortedEntries.push_back(&entry);
+    }
+    // Stable, so that the last of several files added at the same path is
+    // the one kept.
+    std::stable_sort(sortedEntries.begin(), sortedEntries.end(),
+                     [](const Entry *a, const Entry *b) {
+                         return componentwiseLess(a->d_path, b->d_path);
+                     });
+
+    TreeLayout layout(d_entries.size());
+    for (const Entry *entry : sortedEntries) {
+        // An empty path is the root, which always exists.
+        if (entry->d_path.empty()) {
+            continue;
+        }
+        if (!entry->d_file) {
+            layout.addPath(entry->d_path, NodeKind::DIRECTORY);
+            continue;
+        }
+        const size_t node = layout.addPath(entry->d_path,
+                                           entry->d_file->isSymlink()
+                                               ? NodeKind::SYMLINK
+                                               : NodeKind::FILE);
+        layout.setFile(node, entry->d_file.get());
+    }
+    layout.finish();
+
+    return layout.to_digest(digestMap);
+}
+
+namespace {
+
+// A directory being walked, identified by its device and inode when
+// symlinks are followed, to detect symlinks that lead back to one of its
+// ancestors.
+struct WalkedDirectory {
+    dev_t d_device;
+    ino_t d_inode;
+    const WalkedDirectory *d_parent;
+};
+
+// Return the path at which `NestedDirectory::add()` places a file given the
+// result of `normalize_replace_root()` for it.
+std::string fileTreePath(const std::string &normalizedPath)
+{
+    return trimSlashes(FileUtils::resolvePathFromPrefixMap(normalizedPath));
+}
+
+// Likewise for `NestedDirectory::addDirectory()`, which drops a leading
+// slash before looking the path up in the prefix map.
+std::string directoryTreePath(const std::string &normalizedPath)
+{
+    if (!normalizedPath.empty() && normalizedPath[0] == '/') {
+        return trimSlashes(
+            FileUtils::resolvePathFromPrefixMap(normalizedPath.substr(1)));
+    }
+    return trimSlashes(FileUtils::resolvePathFromPrefixMap(normalizedPath));
+}
+
+std::string joinTreePath(const std::string &directory, const std::string &name)
+{
+    if (directory.empty() || directory == ".") {
+        return name;
+    }
+    return directory + "/" + name;
+}
+
+// Find the record named `name` in `records`, which are sorted by name.
+template <typename Record>
+const Record *findByName(const std::vector<Record> &records,
+                         const std::string &name)
+{
+    const auto it = std::lower_bound(
+        records.cbegin(), records.cend(), name,
+        [](const Record &record, const std::string &value) {
+            return record.d_name < value;
+        });
+    return it != records.cend() && it->d_name == name ? &*it : nullptr;
+}
+
+bool sameDigest(const proto::Digest &a, const proto::Digest &b)
+{
+    return a.size_bytes() == b.size_bytes() &&
+           a.hash_other() == b.hash_other() &&
+           a.hash_blake3zcc() == b.hash_blake3zcc();
+}
+
+// Whether `a` and `b` have the same `Directory` message, given the digests
+// of their subdirectories.
+bool sameContents(const SnapshotDirectory &a, const SnapshotDirectory &b)
+{
+    if (a.d_files.size() != b.d_files.size() ||
+        a.d_subdirectories.size() != b.d_subdirectories.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.d_files.size(); ++i) {
+        const SnapshotEntry &fileA = a.d_files[i];
+        const SnapshotEntry &fileB = b.d_files[i];
+        if (fileA.d_name != fileB.d_name ||
+            fileA.d_symlink != fileB.d_symlink) {
+            return false;
+        }
+        if (fileA.d_symlink
+                ? fileA.d_symlinkTarget != fileB.d_symlinkTarget
+                : fileA.d_executable != fileB.d_executable ||
+                      !sameDigest(fileA.d_digest, fileB.d_digest)) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < a.d_subdirectories.size(); ++i) {
+        const SnapshotDirectory &subdirectoryA = a.d_subdirectories[i];
+        const SnapshotDirectory &subdirectoryB = b.d_subdirectories[i];
+        if (subdirectoryA.d_name != subdirectoryB.d_name ||
+            subdirectoryA.d_present != subdirectoryB.d_present) {
+            return false;
+        }
+        if (subdirectoryA.d_present &&
+            !sameDigest(subdirectoryA.d_digest, subdirectoryB.d_digest)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /**
- * Helper method, iterates through local filesystem, and populates fileMap,
- * and filePathMap.
+ * Walks a directory tree, adding its files and empty directories to a
+ * `NestedDirectory`, and returns a record of what it found. They are added
+ * in a single pass once the walk is done, so that the threads walking the
+ * tree don't contend for it.
+ *
+ * Every subdirectory is read by a task of the process-wide `ThreadPool`,
+ * and the files of a directory are hashed in parallel. Entries are opened
+ * and stat'ed relative to the descriptor of their directory, so the kernel
+ * doesn't resolve their whole path every time, and entries that `readdir()`
+ * reports as directories aren't stat'ed at all.
+ *
+ * Given the record of a previous walk, directories whose `stat()` result is
+ * unchanged are not listed again, and files whose `stat()` result is
+ * unchanged are not hashed again. When computing digests, the walker also
+ * serializes the `Directory` message of every directory once its
+ * subdirectories are done, reusing the digest of those that are the same as
+ * before.
  */
-void make_nesteddirectoryhelper(
-    const char *path, digest_string_umap *fileMap,
-    std::unordered_map<std::shared_ptr<ReccFile>, std::string> *filePathMap,
-    std::unordered_set<std::string> *emptyDirSet, const bool followSymlinks)
-{
-    BUILDBOX_LOG_DEBUG("Iterating through " << path);
+class DirectoryWalker {
+  public:
+    DirectoryWalker(NestedDirectory *nestedDirectory,
+                    digest_string_umap *fileMap, bool followSymlinks,
+                    bool computeDigests)
+        : d_nestedDirectory(nestedDirectory), d_fileMap(fileMap),
+          d_followSymlinks(followSymlinks), d_computeDigests(computeDigests),
+          d_pool(ThreadUtils::maxThreads() > 1 ? &ThreadPool::instance()
+                                               : nullptr),
+          d_treeMatchesDisk(true), d_directoriesListed(0), d_filesHashed(0)
+    {
+    }
 
-    // dir is used to iterate through subdirectories in path
-    auto dir = opendir(path);
-    if (dir == nullptr) {
-        throw std::system_error(errno, std::system_category());
+    SnapshotDirectory walk(const char *path, const SnapshotDirectory *previous)
+    {
+        const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::system_category());
+        }
+        d_rootTreePath = fileTreePath(normalize_replace_root(path));
+        Additions additions;
+        SnapshotDirectory record = walkDirectory(
+            fd, path, d_rootTreePath, nullptr, previous, &additions);
+        addToTree(additions);
+        return record;
     }
 
-    bool dirIsEmpty = true;
+    /**
+     * Hand the `Directory` messages computed for `snapshot`, as returned by
+     * `walk()`, to the directories of the `NestedDirectory`.
+     *
+     * Nothing is handed over if the tree doesn't mirror the directories on
+     * disk, as when RECC_PREFIX_MAP moves part of it elsewhere.
+     */
+    void attachDirectories(SnapshotDirectory *snapshot)
+    {
+        if (!d_computeDigests || !d_treeMatchesDisk) {
+            return;
+        }
 
-    // pathString is used to keep track of the top-level directory
-    const std::string pathString(path);
-    // Iterate through directory entries, if a directory, recurse, otherwise
-    // (a file) store file digest -> path in fileMap passed in.
-    for (auto dirent = readdir(dir); dirent != nullptr;
-         dirent = readdir(dir)) {
-        if (strcmp(dirent->d_name, ".") == 0 ||
-            strcmp(dirent->d_name, "..") == 0) {
-            continue;
+        NestedDirectory *directory = d_nestedDirectory;
+        size_t start = 0;
+        while (start < d_rootTreePath.size()) {
+            size_t slash = d_rootTreePath.find('/', start);
+            if (slash == std::string::npos) {
+                slash = d_rootTreePath.size();
+            }
+            const std::string name =
+                d_rootTreePath.substr(start, slash - start);
+            start = slash + 1;
+            if (name == ".") {
+                continue;
+            }
+            const auto subdirectory = directory->d_subdirs->find(name);
+            if (subdirectory == directory->d_subdirs->end()) {
+                return;
+            }
+            directory = &subdirectory->second;
         }
+        attachDirectory(directory, snapshot);
+    }
+
+    // The number of directories that were listed, and of files that were
+    // hashed, rather than taken from the previous record.
+    size_t directoriesListed() const { return d_directoriesListed; }
+    size_t filesHashed() const { return d_filesHashed; }
+
+  private:
+    // A file to add to the tree, at the path given by
+    // `normalize_replace_root()`.
+    struct FileAddition {
+        std::shared_ptr<ReccFile> d_file;
+        std::string d_path;
+    };
 
-        dirIsEmpty = false;
+    // What a directory adds to the tree, each part of it filled in by the
+    // thread that handles it.
+    struct Additions {
+        // Set for an empty directory.
+        std::string d_emptyDirectory;
+        bool d_empty = false;
+        std::vector<FileAddition> d_files;
+        std::vector<Additions> d_subdirectories;
+    };
 
-        const std::string entityName(dirent->d_name);
-        const std::string entityPath = pathString + "/" + entityName;
+    /**
+     * Walk the directory open as `fd`, which this takes ownership of, and
+     * whose contents go at `treePath` in the `NestedDirectory`, recording
+     * what is to be added there in `additions`.
+     */
+    SnapshotDirectory walkDirectory(int fd, const std::string &path,
+                                    const std::string &treePath,
+                                    const WalkedDirectory *parent,
+                                    const SnapshotDirectory *previous,
+                                    Additions *additions)
+    {
+        BUILDBOX_LOG_DEBUG("Iterating through " << path);
+
+        DIR *dir = fdopendir(fd);
+        if (dir == nullptr) {
+            const int errorNumber = errno;
+            close(fd);
+            throw std::system_error(errorNumber, std::system_category());
+        }
+        const std::unique_ptr<DIR, int (*)(DIR *)> dirCloser(dir, closedir);
+
+        SnapshotDirectory record;
+        WalkedDirectory self = {0, 0, parent};
+        bool listingUnchanged = false;
+        if (d_followSymlinks || d_computeDigests) {
+            struct stat statResult;
+            if (fstat(fd, &statResult) < 0) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (d_followSymlinks) {
+                checkForLoop(statResult, path, &self);
+            }
+            record.d_stat = StatSignature(statResult);
+            listingUnchanged =
+                previous != nullptr && previous->d_stat.matches(statResult);
+        }
 
-        struct stat statResult =
-            FileUtils::getStat(entityPath, followSymlinks);
-        if (S_ISDIR(statResult.st_mode)) {
-            make_nesteddirectoryhelper(entityPath.c_str(), fileMap,
-                                       filePathMap, emptyDirSet,
-                                       followSymlinks);
+        std::vector<std::string> subdirectories;
+        std::vector<std::string> files;
+        if (listingUnchanged) {
+            record.d_empty = previous->d_empty;
+            for (const auto &subdirectory : previous->d_subdirectories) {
+                subdirectories.push_back(subdirectory.d_name);
+            }
+            for (const auto &file : previous->d_files) {
+                files.push_back(file.d_name);
+            }
         }
         else {
-            const std::shared_ptr<ReccFile> file = ReccFileFactory::createFile(
-                entityPath.c_str(), followSymlinks);
-            if (!file) {
-                BUILDBOX_LOG_DEBUG("Encountered unsupported file \""
-                                   << entityPath << "\", skipping...");
-                continue;
+            d_directoriesListed++;
+            for (auto dirent = readdir(dir); dirent != nullptr;
+                 dirent = readdir(dir)) {
+                if (strcmp(dirent->d_name, ".") == 0 ||
+                    strcmp(dirent->d_name, "..") == 0) {
+                    continue;
+                }
+                if (isDirectory(fd, path, *dirent)) {
+                    subdirectories.emplace_back(dirent->d_name);
+                }
+                else {
+                    files.emplace_back(dirent->d_name);
+                }
+            }
+            record.d_empty = subdirectories.empty() && files.empty();
+            // Records are kept in name order.
+            std::sort(subdirectories.begin(), subdirectories.end());
+            std::sort(files.begin(), files.end());
+        }
+
+        if (record.d_empty) {
+            additions->d_emptyDirectory = emptyDirectoryPath(path, treePath);
+            additions->d_empty = true;
+            record.d_present = true;
+            if (d_computeDigests) {
+                digestDirectory(&record, previous);
+            }
+            return record;
+        }
+
+        // Subdirectories are queued first, so that other threads can start
+        // on them while this one hashes files. The group waits for them
+        // before `dirCloser` closes the descriptor they are opened from.
+        record.d_subdirectories.resize(subdirectories.size());
+        additions->d_subdirectories.resize(subdirectories.size());
+        TaskGroup subdirectoryTasks(d_pool);
+        for (size_t i = 0; i < subdirectories.size(); ++i) {
+            const std::string &name = subdirectories[i];
+            SnapshotDirectory *subdirectory = &record.d_subdirectories[i];
+            Additions *subdirectoryAdditions =
+                &additions->d_subdirectories[i];
+            const SnapshotDirectory *previousSubdirectory =
+                previous == nullptr
+                    ? nullptr
+                    : findByName(previous->d_subdirectories, name);
+            const auto walkSubdirectory = [this, fd, &path, &treePath, &self,
+                                           &name, subdirectory,
+                                           subdirectoryAdditions,
+                                           previousSubdirectory] {
+                *subdirectory = openSubdirectory(
+                    fd, path, treePath, &self, name, previousSubdirectory,
+                    subdirectoryAdditions);
+            };
+            if (d_pool != nullptr) {
+                subdirectoryTasks.submit(walkSubdirectory);
+            }
+            else {
+                walkSubdirectory();
+            }
+        }
+
+        std::vector<SnapshotEntry> entries(files.size());
+        std::vector<FileAddition> fileAdditions(files.size());
+        std::vector<char> supported(files.size(), 0);
+        const auto addFileAt = [this, fd, &path, &treePath, &files, previous,
+                                &entries, &fileAdditions,
+                                &supported](size_t i) {
+            const SnapshotEntry *previousEntry =
+                previous == nullptr ? nullptr
+                                    : findByName(previous->d_files, files[i]);
+            supported[i] =
+                addFile(fd, path, treePath, files[i], previousEntry,
+                        &entries[i], &fileAdditions[i]);
+        };
+        if (d_pool != nullptr) {
+            d_pool->parallel(files.size(), addFileAt,
+                             ThreadUtils::maxThreads());
+        }
+        else {
+            for (size_t i = 0; i < files.size(); ++i) {
+                addFileAt(i);
             }
+        }
 
-            if (fileMap != nullptr) {
-                const std::string normalizedReplacedRoot =
-                    normalize_replace_root(entityPath);
+        subdirectoryTasks.wait();
 
-                BUILDBOX_LOG_DEBUG("Mapping local file path: ["
-                                   << entityPath
-                                   << "] to normalized-relative (if)updated: ["
-                                   << normalizedReplacedRoot << "]");
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (supported[i]) {
+                record.d_files.push_back(std::move(entries[i]));
+                additions->d_files.push_back(std::move(fileAdditions[i]));
+            }
+        }
+        record.d_present =
+            !record.d_files.empty() ||
+            std::any_of(record.d_subdirectories.cbegin(),
+                        record.d_subdirectories.cend(),
+                        [](const SnapshotDirectory &subdirectory) {
+                            return subdirectory.d_present;
+                        });
+        if (d_computeDigests && record.d_present) {
+            digestDirectory(&record, previous);
+        }
+        return record;
+    }
+
+    SnapshotDirectory openSubdirectory(int parentFd,
+                                       const std::string &parentPath,
+                                       const std::string &parentTreePath,
+                                       const WalkedDirectory *parent,
+                                       const std::string &name,
+                                       const SnapshotDirectory *previous,
+                                       Additions *additions)
+    {
+        const std::string path = parentPath + "/" + name;
+        const int fd =
+            openat(parentFd, name.c_str(),
+                   O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                       (d_followSymlinks ? 0 : O_NOFOLLOW));
+        if (fd < 0) {
+            throw std::system_error(errno, std::system_category());
+        }
+        SnapshotDirectory record =
+            walkDirectory(fd, path, joinTreePath(parentTreePath, name),
+                          parent, previous, additions);
+        record.d_name = name;
+        return record;
+    }
 
-                // Store the digest, and the file contents.
-                fileMap->emplace(file->getDigest().SerializeAsString(), file->getFileContents());
-                // Store the updated/replaced path in the filePathMap, which
-                // will be used to construct the NestedDirectory later.
-                filePathMap->emplace(file, normalizedReplacedRoot);
+    /**
+     * Identify the directory with the given `stat()` result in `self`,
+     * throwing if one of its ancestors is the same directory.
+     */
+    void checkForLoop(const struct stat &statResult, const std::string &path,
+                      WalkedDirectory *self) const
+    {
+        self->d_device = statResult.st_dev;
+        self->d_inode = statResult.st_ino;
+        for (auto ancestor = self->d_parent; ancestor != nullptr;
+             ancestor = ancestor->d_parent) {
+            if (ancestor->d_device == self->d_device &&
+                ancestor->d_inode == self->d_inode) {
+                throw std::system_error(ELOOP, std::system_category(),
+                                        "Symlink loop at \"" + path + "\"");
             }
         }
     }
-    if (dirIsEmpty) {
-        const std::string normalizedReplacedDir =
-            normalize_replace_root(pathString);
 
+    bool isDirectory(int dirFd, const std::string &dirPath,
+                     const struct dirent &entry) const
+    {
+        if (entry.d_type == DT_DIR) {
+            return true;
+        }
+        if (entry.d_type == DT_REG ||
+            (entry.d_type == DT_LNK && !d_followSymlinks)) {
+            return false;
+        }
+        // Symlinks that are followed, and filesystems that don't report
+        // the type of entries.
+        return S_ISDIR(statAt(dirFd, dirPath, entry.d_name).st_mode);
+    }
+
+    struct stat statAt(int dirFd, const std::string &dirPath,
+                       const char *name) const
+    {
+        struct stat statResult;
+        if (fstatat(dirFd, name, &statResult,
+                    d_followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW) < 0) {
+            const int errorNumber = errno;
+            BUILDBOX_LOG_ERROR("Error calling fstatat() for path \""
+                               << dirPath << "/" << name
+                               << "\": " << strerror(errorNumber));
+            throw std::system_error(errorNumber, std::system_category());
+        }
+        return statResult;
+    }
+
+    /**
+     * Read the file `name` of the directory open as `dirFd`, describing it
+     * in `record` and what it adds to the tree in `addition`. Returns false
+     * if it is not a supported type of file.
+     */
+    bool addFile(int dirFd, const std::string &dirPath,
+                 const std::string &dirTreePath, const std::string &name,
+                 const SnapshotEntry *previous, SnapshotEntry *record,
+                 FileAddition *addition)
+    {
+        const std::string path = dirPath + "/" + name;
+        const struct stat statResult = statAt(dirFd, dirPath, name.c_str());
+        std::shared_ptr<ReccFile> file;
+        if (previous != nullptr && previous->d_stat.matches(statResult)) {
+            file = std::make_shared<ReccFile>(
+                path, name, previous->d_digest, previous->d_executable,
+                previous->d_symlink, previous->d_symlinkTarget);
+        }
+        else {
+            d_filesHashed++;
+            file = ReccFileFactory::createFileAt(dirFd, name.c_str(), path,
+                                                 statResult);
+        }
+        if (!file) {
+            BUILDBOX_LOG_DEBUG("Encountered unsupported file \""
+                               << path << "\", skipping...");
+            return false;
+        }
+
+        const std::string normalizedReplacedRoot =
+            normalize_replace_root(path);
+        BUILDBOX_LOG_DEBUG("Mapping local file path: ["
+                           << path << "] to normalized-relative (if)updated: ["
+                           << normalizedReplacedRoot << "]");
+        if (d_computeDigests && fileTreePath(normalizedReplacedRoot) !=
+                                    joinTreePath(dirTreePath, name)) {
+            d_treeMatchesDisk = false;
+        }
+
+        record->d_name = name;
+        record->d_stat = StatSignature(statResult);
+        record->d_digest = file->getDigest();
+        record->d_executable = file->isExecutable();
+        record->d_symlink = file->isSymlink();
+        if (record->d_symlink) {
+            record->d_symlinkTarget = file->getFileContents();
+        }
+        addition->d_file = std::move(file);
+        addition->d_path = normalizedReplacedRoot;
+        return true;
+    }
+
+    /**
+     * Return the path at which the empty directory `path` is added to the
+     * tree.
+     */
+    std::string emptyDirectoryPath(const std::string &path,
+                                   const std::string &treePath)
+    {
+        const std::string normalizedReplacedDir = normalize_replace_root(path);
         BUILDBOX_LOG_DEBUG("Mapping local empty directory: ["
-                           << pathString
-                           << "] to normalized-relative (if)updated: ["
+                           << path << "] to normalized-relative (if)updated: ["
                            << normalizedReplacedDir << "]");
+        if (d_computeDigests &&
+            directoryTreePath(normalizedReplacedDir) != treePath) {
+            d_treeMatchesDisk = false;
+        }
+        return normalizedReplacedDir;
+    }
 
-        // Store the updated/replaced path to directory in emptyDirSet.
-        // Which will be used to construct the NestedDirectory later
-        emptyDirSet->emplace(normalizedReplacedDir);
+    void addToTree(const Additions &additions)
+    {
+        if (additions.d_empty) {
+            d_nestedDirectory->addDirectory(
+                additions.d_emptyDirectory.c_str());
+        }
+        for (const FileAddition &addition : additions.d_files) {
+            // Store the digest and the path to read the contents from if the
+            // CAS needs them. Symlinks are not uploaded as blobs.
+            if (d_fileMap != nullptr && !addition.d_file->isSymlink()) {
+                d_fileMap->emplace(addition.d_file->getDigest(),
+                                   addition.d_file->getFilePath());
+            }
+            d_nestedDirectory->add(addition.d_file, addition.d_path.c_str());
+        }
+        for (const Additions &subdirectory : additions.d_subdirectories) {
+            addToTree(subdirectory);
+        }
     }
-    closedir(dir);
-}
+
+    /**
+     * Serialize the `Directory` message of `record`, whose subdirectories
+     * are done, reusing the digest of `previous` if it had the same one.
+     */
+    void digestDirectory(SnapshotDirectory *record,
+                         const SnapshotDirectory *previous) const
+    {
+        DirectoryEncoder encoder(&record->d_blob);
+        for (const SnapshotEntry &file : record->d_files) {
+            if (!file.d_symlink) {
+                encoder.addFile(file.d_name.data(), file.d_name.size(),
+                                file.d_digest, file.d_executable);
+            }
+        }
+        for (const SnapshotDirectory &subdirectory :
+             record->d_subdirectories) {
+            if (subdirectory.d_present) {
+                encoder.addDirectory(subdirectory.d_name.data(),
+                                     subdirectory.d_name.size(),
+                                     subdirectory.d_digest);
+            }
+        }
+        for (const SnapshotEntry &file : record->d_files) {
+            if (file.d_symlink) {
+                encoder.addSymlink(file.d_name.data(), file.d_name.size(),
+                                   file.d_symlinkTarget);
+            }
+        }
+
+        if (previous != nullptr && previous->d_present &&
+            sameContents(*previous, *record)) {
+            record->d_digest = previous->d_digest;
+        }
+        else {
+            record->d_digest = DigestGenerator::make_digest(record->d_blob);
+        }
+    }
+
+    void attachDirectory(NestedDirectory *directory,
+                         SnapshotDirectory *record)
+    {
+        size_t files = 0;
+        size_t symlinks = 0;
+        for (const SnapshotEntry &file : record->d_files) {
+            if (file.d_symlink) {
+                symlinks++;
+            }
+            else {
+                files++;
+            }
+        }
+        size_t subdirectories = 0;
+        for (SnapshotDirectory &subdirectory : record->d_subdirectories) {
+            if (!subdirectory.d_present) {
+                continue;
+            }
+            subdirectories++;
+            const auto it = directory->d_subdirs->find(subdirectory.d_name);
+            if (it != directory->d_subdirs->end()) {
+                attachDirectory(&it->second, &subdirectory);
+            }
+        }
+
+        // Anything else in the directory, such as a subdirectory named
+        // "." added for an empty root, would be missing from the message.
+        if (directory->d_files.size() != files ||
+            directory->d_symlinks.size() != symlinks ||
+            directory->d_subdirs->size() != subdirectories) {
+            return;
+        }
+        auto serialized = std::make_shared<SerializedDirectory>();
+        serialized->d_digest = record->d_digest;
+        serialized->d_blob = std::move(record->d_blob);
+        directory->d_serialized = std::move(serialized);
+    }
+
+    NestedDirectory *d_nestedDirectory;
+    digest_string_umap *d_fileMap;
+    const bool d_followSymlinks;
+    const bool d_computeDigests;
+    ThreadPool *d_pool;
+
+    // Where the contents of the walked directory go in the tree, and
+    // whether all of its entries went where expected from there.
+    std::string d_rootTreePath;
+    std::atomic<bool> d_treeMatchesDisk;
+
+    std::atomic<size_t> d_directoriesListed;
+    std::atomic<size_t> d_filesHashed;
+};
+
+} // unnamed namespace
 
 NestedDirectory make_nesteddirectory(const char *path,
                                      digest_string_umap *fileMap,
                                      const bool followSymlinks)
 {
     NestedDirectory nestedDir;
-    std::unordered_map<std::shared_ptr<ReccFile>, std::string> file_path_map;
-    std::unordered_set<std::string> empty_dir_set;
-
-    // Populate both maps
-    make_nesteddirectoryhelper(path, fileMap, &file_path_map, &empty_dir_set,
-                               followSymlinks);
-
-    // Construct nestedDirectory
-    for (const auto &file : file_path_map) {
-        nestedDir.add(file.first, file.second.c_str());
+    // What a followed symlink points to can change without its directory
+    // changing, so such trees are always walked in full.
+    if (followSymlinks || !DirectorySnapshot::enabled()) {
+        DirectoryWalker(&nestedDir, fileMap, followSymlinks, false)
+            .walk(path, nullptr);
+        return nestedDir;
     }
 
-    // Add empty directories to nestedDirectory
-    for (const auto &dir : empty_dir_set) {
-        nestedDir.addDirectory(dir.c_str());
-    }
+    const time_t startTime = time(nullptr);
+    SnapshotDirectory previous;
+    const bool havePrevious = DirectorySnapshot::lookup(path, &previous);
 
+    DirectoryWalker walker(&nestedDir, fileMap, false, true);
+    SnapshotDirectory snapshot =
+        walker.walk(path, havePrevious ? &previous : nullptr);
+    BUILDBOX_LOG_DEBUG("Listed " << walker.directoriesListed()
+                                 << " directories and hashed "
+                                 << walker.filesHashed() << " files of \""
+                                 << path << "\"");
+    walker.attachDirectories(&snapshot);
+    if (walker.directoriesListed() > 0 || walker.filesHashed() > 0) {
+        DirectorySnapshot::store(path, snapshot, startTime);
+    }
     return nestedDir;
 }
 
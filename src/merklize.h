@@ -17,6 +17,7 @@
 
 #include <buildboxcommon_fileutils.h>
 
+#include <digestkey.h>
 #include <env.h>
 #include <protos.h>
 #include <reccfile.h>
@@ -30,8 +31,15 @@
 namespace BloombergLP {
 namespace recc {
 
-typedef std::unordered_map<std::string, std::string> digest_string_umap;
-//typedef std::unordered_map<proto::Digest, std::string> digest_string_umap;
+typedef std::unordered_map<DigestKey, std::string> digest_string_umap;
+
+/**
+ * A serialized `Directory` message and its digest.
+ */
+struct SerializedDirectory {
+    proto::Digest d_digest;
+    std::string d_blob;
+};
 
 /**
  * Represents a directory that, optionally, has other directories inside.
@@ -47,6 +55,10 @@ struct NestedDirectory {
     // name, target
     std::map<std::string, std::string> d_symlinks;
 
+    // The `Directory` message of this directory, if it was computed while
+    // adding its contents. Cleared by the methods below, which change them.
+    std::shared_ptr<const SerializedDirectory> d_serialized;
+
     NestedDirectory() : d_subdirs(std::make_unique<subdir_map>()){};
 
     /**
@@ -88,6 +100,53 @@ struct NestedDirectory {
     void print(std::ostream &out, const std::string &dirName = "") const;
 };
 
+/**
+ * A directory tree that is built all at once from the paths of its contents,
+ * for input roots with many files.
+ *
+ * `add()` and `addDirectory()` only record paths. `to_digest()` sorts them
+ * and lays the tree out in a single pass into one array of nodes, with the
+ * children of each directory stored contiguously and in name order. A
+ * directory is a single node however many paths go through it, and node
+ * names point into the recorded paths instead of being copied at every
+ * level as `NestedDirectory::add()` does.
+ *
+ * The `Directory` messages produced are identical to those of a
+ * `NestedDirectory` with the same contents. Unlike `NestedDirectory`, no
+ * prefix replacement is applied to the paths.
+ */
+class DirectoryTree {
+  public:
+    /**
+     * Add the given file or symlink at the given path, which may include
+     * subdirectories. A file added twice at the same path replaces the
+     * first one.
+     */
+    void add(std::shared_ptr<ReccFile> file, std::string relativePath);
+
+    /**
+     * Add a directory, and any of its parents, at the given path.
+     */
+    void addDirectory(std::string relativePath);
+
+    /**
+     * Convert this tree to Directory messages and return the Digest of the
+     * root one, storing the serialized messages in `digestMap` if given, as
+     * `NestedDirectory::to_digest()` does.
+     */
+    proto::Digest to_digest(digest_string_umap *digestMap = nullptr) const;
+
+  private:
+    struct Entry {
+        // With no leading, trailing or repeated slashes.
+        std::string d_path;
+        // Null for directories.
+        std::shared_ptr<ReccFile> d_file;
+    };
+
+    std::vector<Entry> d_entries;
+};
+
 /**
  * Create a NestedDirectory containing the contents of the given path and
  * its subdirectories.
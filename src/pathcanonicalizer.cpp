@@ -0,0 +1,238 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pathcanonicalizer.h>
+
+#include <fileutils.h>
+
+#include <cstring>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+bool isParentSegment(const char *data, size_t length)
+{
+    return length == 2 && data[0] == '.' && data[1] == '.';
+}
+
+bool equals(const std::string &string, const char *data, size_t length)
+{
+    return string.compare(0, std::string::npos, data, length) == 0;
+}
+
+std::vector<std::string>
+getPrefixes(const std::vector<std::pair<std::string, std::string>> &prefixMap)
+{
+    std::vector<std::string> prefixes;
+    prefixes.reserve(prefixMap.size());
+    for (const auto &pair : prefixMap) {
+        prefixes.push_back(pair.first);
+    }
+    return prefixes;
+}
+
+} // namespace
+
+PathCanonicalizer::PathCanonicalizer(
+    const std::string &workingDirectory,
+    const std::vector<std::pair<std::string, std::string>> &prefixMap,
+    const std::string &projectRoot)
+    : d_prefixMap(prefixMap), d_prefixMatcher(getPrefixes(prefixMap)),
+      d_projectRoot(projectRoot),
+      d_hasWorkingDirectory(!workingDirectory.empty())
+{
+    appendSegments(workingDirectory.data(), workingDirectory.size(), true);
+    for (const Segment &segment : d_segments) {
+        d_workingDirectory.emplace_back(segment.d_data, segment.d_length);
+    }
+    d_segments.clear();
+}
+
+void PathCanonicalizer::appendSegments(const char *path, size_t length,
+                                       bool absolute)
+{
+    const char *end = path + length;
+    while (path < end) {
+        const char *slash = static_cast<const char *>(
+            memchr(path, '/', static_cast<size_t>(end - path)));
+        const char *segmentEnd = slash == nullptr ? end : slash;
+        const size_t segmentLength = static_cast<size_t>(segmentEnd - path);
+
+        if (segmentLength == 0 || (segmentLength == 1 && path[0] == '.')) {
+            // Empty or dot segments don't change the path.
+        }
+        else if (isParentSegment(path, segmentLength)) {
+            if (!d_segments.empty() &&
+                !isParentSegment(d_segments.back().d_data,
+                                 d_segments.back().d_length)) {
+                d_segments.pop_back();
+            }
+            else if (!absolute) {
+                // There is nothing above the root to go to.
+                d_segments.push_back({path, segmentLength});
+            }
+        }
+        else {
+            d_segments.push_back({path, segmentLength});
+        }
+
+        path = segmentEnd + 1;
+    }
+}
+
+void PathCanonicalizer::process(const std::string &path, bool directory,
+                                Result *result)
+{
+    d_segments.clear();
+    bool absolute = !path.empty() && path[0] == '/';
+    bool withinProjectRoot = false;
+
+    if (absolute) {
+        result->d_prefixIndex = d_prefixMatcher.find(path);
+        if (result->d_prefixIndex != PathPrefixMatcher::npos) {
+            // Like normalizing the replacement, a slash and the rest of the
+            // path.
+            const auto &pair = d_prefixMap[result->d_prefixIndex];
+            absolute = !pair.second.empty() && pair.second[0] == '/';
+            appendSegments(pair.second.data(), pair.second.size(), absolute);
+            appendSegments(path.data() + pair.first.size(),
+                           path.size() - pair.first.size(), absolute);
+
+            std::string &normalized = result->d_rootCheckPath;
+            if (absolute) {
+                normalized.push_back('/');
+            }
+            for (size_t i = 0; i < d_segments.size(); ++i) {
+                if (i > 0) {
+                    normalized.push_back('/');
+                }
+                normalized.append(d_segments[i].d_data,
+                                  d_segments[i].d_length);
+            }
+            if (directory && !d_segments.empty()) {
+                normalized.push_back('/');
+            }
+        }
+        else {
+            appendSegments(path.data(), path.size(), true);
+            result->d_rootCheckPath = path;
+        }
+
+        withinProjectRoot =
+            absolute && d_hasWorkingDirectory &&
+            FileUtils::hasPathPrefix(result->d_rootCheckPath, d_projectRoot);
+    }
+    else {
+        appendSegments(path.data(), path.size(), false);
+    }
+
+    std::string &output = result->d_path;
+    size_t first = 0;
+    if (withinProjectRoot) {
+        while (first < d_segments.size() &&
+               first < d_workingDirectory.size() &&
+               equals(d_workingDirectory[first], d_segments[first].d_data,
+                      d_segments[first].d_length)) {
+            ++first;
+        }
+        if (first == d_segments.size() && first < d_workingDirectory.size()) {
+            result->d_nextWorkingDirectorySegment =
+                &d_workingDirectory[first];
+        }
+
+        result->d_parentLevels =
+            static_cast<int>(d_workingDirectory.size() - first);
+        for (int i = 0; i < result->d_parentLevels; ++i) {
+            output.append("../");
+        }
+    }
+    else if (absolute) {
+        output.push_back('/');
+    }
+    else {
+        while (result->d_parentLevels < static_cast<int>(d_segments.size()) &&
+               isParentSegment(d_segments[result->d_parentLevels].d_data,
+                               d_segments[result->d_parentLevels].d_length)) {
+            result->d_parentLevels++;
+        }
+    }
+
+    for (size_t i = first; i < d_segments.size(); ++i) {
+        output.append(d_segments[i].d_data, d_segments[i].d_length);
+        output.push_back('/');
+    }
+    // Keep the trailing slash only for directories, other than the root,
+    // which already has one.
+    if (!directory && output.size() > 1) {
+        output.pop_back();
+    }
+}
+
+CanonicalPath PathCanonicalizer::canonicalize(const std::string &path)
+{
+    CanonicalPath canonicalPath;
+
+    const size_t slash = path.rfind('/');
+    const size_t nameStart = slash == std::string::npos ? 0 : slash + 1;
+    const char *name = path.data() + nameStart;
+    const size_t nameLength = path.size() - nameStart;
+
+    // The result for the directory, followed by the name, is the result for
+    // an entry in it, unless the name is a dot segment or the entry itself
+    // is one of the paths it's compared against.
+    if (nameLength > 0 && !(nameLength == 1 && name[0] == '.') &&
+        !isParentSegment(name, nameLength)) {
+        d_key.assign(path, 0, nameStart);
+        auto it = d_directories.find(d_key);
+        if (it == d_directories.end()) {
+            Result result;
+            process(d_key, true, &result);
+            it = d_directories.emplace(d_key, std::move(result)).first;
+        }
+        const Result &directory = it->second;
+
+        const std::string &rootCheckPath = directory.d_rootCheckPath;
+        const bool reusable =
+            path[0] != '/' ||
+            (d_prefixMatcher.find(path) == directory.d_prefixIndex &&
+             !(d_projectRoot.size() == rootCheckPath.size() + nameLength &&
+               d_projectRoot.compare(0, rootCheckPath.size(),
+                                     rootCheckPath) == 0 &&
+               d_projectRoot.compare(rootCheckPath.size(), std::string::npos,
+                                     name, nameLength) == 0) &&
+             !(directory.d_nextWorkingDirectorySegment != nullptr &&
+               equals(*directory.d_nextWorkingDirectorySegment, name,
+                      nameLength)));
+        if (reusable) {
+            canonicalPath.d_path.reserve(directory.d_path.size() +
+                                         nameLength);
+            canonicalPath.d_path.append(directory.d_path);
+            canonicalPath.d_path.append(name, nameLength);
+            canonicalPath.d_parentLevels = directory.d_parentLevels;
+            return canonicalPath;
+        }
+    }
+
+    Result result;
+    process(path, false, &result);
+    canonicalPath.d_path =
+        result.d_path.empty() ? std::string(".") : std::move(result.d_path);
+    canonicalPath.d_parentLevels = result.d_parentLevels;
+    return canonicalPath;
+}
+
+} // namespace recc
+} // namespace BloombergLP
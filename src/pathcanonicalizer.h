@@ -0,0 +1,110 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_PATHCANONICALIZER
+#define INCLUDED_PATHCANONICALIZER
+
+#include <pathprefixmatcher.h>
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * The path of a dependency in the input root, as given by
+ * `PathCanonicalizer`.
+ */
+struct CanonicalPath {
+    // Normalized, and relative to the working directory unless the
+    // dependency is outside the project root.
+    std::string d_path;
+    // How many levels above the working directory the path reaches, that is
+    // its number of leading ".." segments.
+    int d_parentLevels = 0;
+};
+
+/**
+ * Maps the local paths of dependencies to their paths in the input root.
+ *
+ * An absolute path has the prefix map applied to it and, if it is then
+ * within the project root, is made relative to the working directory.
+ * Unlike calling `FileUtils::resolvePathFromPrefixMap()`,
+ * `makePathRelative()` and `parentDirectoryLevels()` in turn, this is done
+ * in a single pass over the segments of the path, which are normalized
+ * along the way.
+ *
+ * The result for the directory of a path is kept and reused for the other
+ * files in that directory, so each directory is only processed once however
+ * many dependencies it holds.
+ */
+class PathCanonicalizer {
+  public:
+    PathCanonicalizer(
+        const std::string &workingDirectory,
+        const std::vector<std::pair<std::string, std::string>> &prefixMap,
+        const std::string &projectRoot);
+
+    CanonicalPath canonicalize(const std::string &path);
+
+    /**
+     * Return the number of directories processed so far.
+     */
+    size_t directoriesProcessed() const { return d_directories.size(); }
+
+  private:
+    struct Segment {
+        const char *d_data;
+        size_t d_length;
+    };
+
+    struct Result {
+        // For a directory, empty or ending in a slash, so that the names of
+        // its entries can be appended to it.
+        std::string d_path;
+        int d_parentLevels = 0;
+        // What is needed to tell whether the result of a directory holds
+        // for a given entry in it: the index of the first matching prefix
+        // in the map, the path compared to the project root and, for an
+        // ancestor of the working directory, the next segment of the
+        // working directory.
+        size_t d_prefixIndex = PathPrefixMatcher::npos;
+        std::string d_rootCheckPath;
+        const std::string *d_nextWorkingDirectorySegment = nullptr;
+    };
+
+    void appendSegments(const char *path, size_t length, bool absolute);
+
+    void process(const std::string &path, bool directory, Result *result);
+
+    std::vector<std::pair<std::string, std::string>> d_prefixMap;
+    PathPrefixMatcher d_prefixMatcher;
+    std::string d_projectRoot;
+    std::vector<std::string> d_workingDirectory;
+    bool d_hasWorkingDirectory;
+
+    std::unordered_map<std::string, Result> d_directories;
+    // Reused between calls to avoid allocating.
+    std::vector<Segment> d_segments;
+    std::string d_key;
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
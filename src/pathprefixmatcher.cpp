@@ -0,0 +1,131 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pathprefixmatcher.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace BloombergLP {
+namespace recc {
+
+const size_t PathPrefixMatcher::npos = std::numeric_limits<size_t>::max();
+
+PathPrefixMatcher::PathPrefixMatcher(const std::vector<std::string> &prefixes)
+{
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        add(prefixes[i], i);
+    }
+}
+
+PathPrefixMatcher::PathPrefixMatcher(const std::set<std::string> &prefixes)
+{
+    size_t index = 0;
+    for (const auto &prefix : prefixes) {
+        add(prefix, index++);
+    }
+}
+
+void PathPrefixMatcher::add(const std::string &prefix, size_t index)
+{
+    // A path can never have the empty path as a prefix.
+    if (prefix.empty()) {
+        return;
+    }
+    if (d_nodes.empty()) {
+        d_nodes.push_back({{}, npos, npos});
+    }
+
+    // The components are those of the prefix with a trailing slash, so
+    // "/usr/include" is "", "usr" and "include", and "/" is just "".
+    size_t node = 0;
+    size_t start = 0;
+    while (start < prefix.size()) {
+        size_t slash = prefix.find('/', start);
+        if (slash == std::string::npos) {
+            slash = prefix.size();
+        }
+        const std::string name = prefix.substr(start, slash - start);
+        start = slash + 1;
+
+        auto &children = d_nodes[node].d_children;
+        const auto it = std::lower_bound(
+            children.begin(), children.end(), name,
+            [](const std::pair<std::string, size_t> &child,
+               const std::string &value) { return child.first < value; });
+        if (it != children.end() && it->first == name) {
+            node = it->second;
+        }
+        else {
+            const size_t added = d_nodes.size();
+            children.insert(it, std::make_pair(name, added));
+            d_nodes.push_back({{}, npos, npos});
+            node = added;
+        }
+    }
+
+    Node &last = d_nodes[node];
+    last.d_prefix = std::min(last.d_prefix, index);
+    if (prefix.back() != '/') {
+        last.d_exactPrefix = std::min(last.d_exactPrefix, index);
+    }
+}
+
+size_t PathPrefixMatcher::child(size_t node, const char *name,
+                                size_t nameLength) const
+{
+    const auto &children = d_nodes[node].d_children;
+    const auto it = std::lower_bound(
+        children.cbegin(), children.cend(), nameLength,
+        [name](const std::pair<std::string, size_t> &child, size_t length) {
+            return child.first.compare(0, std::string::npos, name, length) <
+                   0;
+        });
+    if (it != children.cend() &&
+        it->first.compare(0, std::string::npos, name, nameLength) == 0) {
+        return it->second;
+    }
+    return npos;
+}
+
+size_t PathPrefixMatcher::find(const std::string &path) const
+{
+    if (d_nodes.empty()) {
+        return npos;
+    }
+
+    size_t found = npos;
+    size_t node = 0;
+    const char *component = path.c_str();
+    const char *end = component + path.size();
+    while (true) {
+        const char *slash = static_cast<const char *>(
+            memchr(component, '/', static_cast<size_t>(end - component)));
+        const char *componentEnd = slash == nullptr ? end : slash;
+        node = child(node, component,
+                     static_cast<size_t>(componentEnd - component));
+        if (node == npos) {
+            return found;
+        }
+        if (slash == nullptr) {
+            return std::min(found, d_nodes[node].d_exactPrefix);
+        }
+        found = std::min(found, d_nodes[node].d_prefix);
+        component = slash + 1;
+    }
+}
+
+} // namespace recc
+} // namespace BloombergLP
@@ -0,0 +1,75 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_PATHPREFIXMATCHER
+#define INCLUDED_PATHPREFIXMATCHER
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * A list of path prefixes compiled into a trie of their components, which
+ * finds the prefixes of a path in a single walk over it without allocating.
+ *
+ * A path has a prefix under the same rules as `FileUtils::hasPathPrefix()`:
+ * it is equal to the prefix, or starts with it followed by a slash.
+ */
+class PathPrefixMatcher {
+  public:
+    static const size_t npos;
+
+    PathPrefixMatcher() = default;
+    explicit PathPrefixMatcher(const std::vector<std::string> &prefixes);
+    explicit PathPrefixMatcher(const std::set<std::string> &prefixes);
+
+    /**
+     * Return the index of the first of the prefixes that `path` has, or
+     * `npos` if it has none of them.
+     */
+    size_t find(const std::string &path) const;
+
+    bool matches(const std::string &path) const
+    {
+        return find(path) != npos;
+    }
+
+  private:
+    struct Node {
+        // Sorted by name.
+        std::vector<std::pair<std::string, size_t>> d_children;
+        // The first prefix made of the components leading to this node,
+        // matched by paths that continue with a slash.
+        size_t d_prefix;
+        // Likewise for paths that end here, which prefixes that end with a
+        // slash don't match.
+        size_t d_exactPrefix;
+    };
+
+    void add(const std::string &prefix, size_t index);
+
+    size_t child(size_t node, const char *name, size_t nameLength) const;
+
+    std::vector<Node> d_nodes;
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
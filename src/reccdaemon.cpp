@@ -0,0 +1,353 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <reccdaemon.h>
+
+#include <daemonprotocol.h>
+#include <env.h>
+#include <filedigestcache.h>
+#include <fileutils.h>
+
+#include <buildboxcommon_logging.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+const int s_standardFds[] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+const int s_standardFdCount = DaemonProtocol::s_fdCount;
+
+volatile sig_atomic_t s_stopRequested = 0;
+
+void requestStop(int) { s_stopRequested = 1; }
+
+void setCloseOnExec(int fd)
+{
+    const int flags = fcntl(fd, F_GETFD);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+    }
+}
+
+bool makeAddress(const std::string &socketPath, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address->sun_path)) {
+        return false;
+    }
+    memcpy(address->sun_path, socketPath.c_str(), socketPath.size() + 1);
+    return true;
+}
+
+// Return a socket connected to `socketPath`, or -1.
+int connectTo(const std::string &socketPath)
+{
+    struct sockaddr_un address;
+    if (!makeAddress(socketPath, &address)) {
+        return -1;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&address),
+                sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+} // namespace
+
+DaemonClient::Status DaemonClient::run(const std::string &socketPath,
+                                       char *argv[], bool *runLocally,
+                                       int *exitCode)
+{
+    // Every standard descriptor has to be open to be passed on.
+    for (const int fd : s_standardFds) {
+        if (fcntl(fd, F_GETFD) < 0) {
+            return UNAVAILABLE;
+        }
+    }
+
+    const int connection = connectTo(socketPath);
+    if (connection < 0) {
+        return UNAVAILABLE;
+    }
+
+    DaemonProtocol::Request request;
+    for (char **arg = argv; *arg != nullptr; ++arg) {
+        request.d_argv.push_back(*arg);
+    }
+    for (char **variable = environ; *variable != nullptr; ++variable) {
+        request.d_environment.push_back(*variable);
+    }
+
+    std::string message;
+    try {
+        request.d_cwd = FileUtils::getCurrentWorkingDirectory();
+        message = DaemonProtocol::encodeRequest(request);
+    }
+    catch (const std::exception &) {
+        close(connection);
+        return UNAVAILABLE;
+    }
+
+    if (!DaemonProtocol::sendWithFds(connection, message, s_standardFds) ||
+        !DaemonProtocol::receiveAcceptance(connection)) {
+        close(connection);
+        BUILDBOX_LOG_WARNING("reccd at \"" << socketPath
+                                           << "\" did not take the command, "
+                                              "running it in-process");
+        return UNAVAILABLE;
+    }
+
+    // From here on the command may have started, so it mustn't be run again.
+    int32_t reply = 0;
+    const bool replied =
+        DaemonProtocol::receiveReply(connection, runLocally, &reply);
+    close(connection);
+
+    if (!replied) {
+        BUILDBOX_LOG_ERROR("reccd at \"" << socketPath
+                                         << "\" stopped before replying");
+        return FAILED;
+    }
+    *exitCode = reply;
+    return REPLIED;
+}
+
+Daemon::Daemon(const std::string &socketPath, int workers)
+    : d_socketPath(socketPath), d_workers(workers), d_socket(-1),
+      d_logLevel(RECC_VERBOSE ? buildboxcommon::LogLevel::DEBUG
+                              : buildboxcommon::LogLevel::INFO)
+{
+    struct sockaddr_un address;
+    if (!makeAddress(socketPath, &address)) {
+        throw std::runtime_error("Socket path \"" + socketPath +
+                                 "\" is too long");
+    }
+
+    struct stat statResult;
+    if (lstat(socketPath.c_str(), &statResult) == 0) {
+        if (!S_ISSOCK(statResult.st_mode)) {
+            throw std::runtime_error("\"" + socketPath +
+                                     "\" exists and is not a socket");
+        }
+        const int existing = connectTo(socketPath);
+        if (existing >= 0) {
+            close(existing);
+            throw std::runtime_error("Another reccd is listening on \"" +
+                                     socketPath + "\"");
+        }
+        unlink(socketPath.c_str());
+    }
+
+    d_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (d_socket < 0) {
+        throw std::system_error(errno, std::system_category());
+    }
+    setCloseOnExec(d_socket);
+
+    // Nobody else may connect: commands run with our credentials.
+    const mode_t previousMask = umask(0077);
+    const int bound =
+        bind(d_socket, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address));
+    const int bindError = errno;
+    umask(previousMask);
+    if (bound != 0 || listen(d_socket, SOMAXCONN) != 0) {
+        const int error = bound != 0 ? bindError : errno;
+        close(d_socket);
+        throw std::system_error(error, std::system_category());
+    }
+}
+
+Daemon::~Daemon()
+{
+    close(d_socket);
+    unlink(d_socketPath.c_str());
+}
+
+void Daemon::serve()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    BUILDBOX_LOG_INFO("Listening on \"" << d_socketPath << "\" with "
+                                        << d_workers << " workers");
+
+    while (!s_stopRequested) {
+        while (static_cast<int>(d_workerPids.size()) < d_workers) {
+            const pid_t pid = fork();
+            if (pid < 0) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (pid == 0) {
+                runWorker();
+                _exit(0);
+            }
+            d_workerPids.push_back(pid);
+        }
+
+        int status;
+        const pid_t exited = waitpid(-1, &status, 0);
+        if (exited > 0) {
+            BUILDBOX_LOG_WARNING("Worker " << exited
+                                           << " exited, starting another");
+            d_workerPids.erase(std::remove(d_workerPids.begin(),
+                                           d_workerPids.end(), exited),
+                               d_workerPids.end());
+            // Don't spin if workers die straight away.
+            sleep(1);
+        }
+    }
+
+    for (const pid_t pid : d_workerPids) {
+        kill(pid, SIGTERM);
+    }
+    for (const pid_t pid : d_workerPids) {
+        waitpid(pid, nullptr, 0);
+    }
+    d_workerPids.clear();
+}
+
+void Daemon::runWorker()
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    // Clients may go away while we write to them.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Opened with the daemon's own configuration, and kept for the life of
+    // the worker.
+    FileDigestCache::instance();
+
+    CommandRunner runner;
+    while (true) {
+        const int connection = accept(d_socket, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            BUILDBOX_LOG_ERROR("accept() failed: " << strerror(errno));
+            return;
+        }
+        setCloseOnExec(connection);
+        handleConnection(connection, &runner);
+        close(connection);
+    }
+}
+
+void Daemon::handleConnection(int connection, CommandRunner *runner)
+{
+    if (!DaemonProtocol::peerIsSameUser(connection)) {
+        BUILDBOX_LOG_WARNING("Rejecting connection from another user");
+        return;
+    }
+
+    DaemonProtocol::Request request;
+    int clientFds[s_standardFdCount];
+    if (!DaemonProtocol::receiveRequest(connection, &request, clientFds)) {
+        BUILDBOX_LOG_WARNING("Ignoring malformed request");
+        return;
+    }
+    if (!DaemonProtocol::sendAcceptance(connection)) {
+        for (const int fd : clientFds) {
+            close(fd);
+        }
+        return;
+    }
+
+    int savedFds[s_standardFdCount];
+    for (int i = 0; i < s_standardFdCount; ++i) {
+        savedFds[i] = dup(s_standardFds[i]);
+        dup2(clientFds[i], s_standardFds[i]);
+        close(clientFds[i]);
+    }
+
+    std::vector<char *> argv;
+    for (auto &arg : request.d_argv) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    std::vector<char *> environment;
+    for (auto &variable : request.d_environment) {
+        environment.push_back(&variable[0]);
+    }
+    environment.push_back(nullptr);
+    char **const previousEnvironment = environ;
+    environ = environment.data();
+
+    bool runLocally = false;
+    int32_t result = RC_EXEC_FAILURE;
+    if (chdir(request.d_cwd.c_str()) != 0) {
+        BUILDBOX_LOG_ERROR("Could not enter \"" << request.d_cwd
+                                                << "\": " << strerror(errno));
+    }
+    else {
+        try {
+            Env::reset_config_variables();
+            Env::set_config_locations();
+            Env::parse_config_variables();
+            result = runner->run(argv.data(), request.d_cwd, &runLocally);
+        }
+        catch (const std::exception &e) {
+            BUILDBOX_LOG_ERROR(e.what());
+        }
+    }
+
+    BUILDBOX_LOG_SET_LEVEL(d_logLevel);
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(nullptr);
+
+    environ = previousEnvironment;
+    if (chdir("/") != 0) {
+        BUILDBOX_LOG_WARNING("Could not leave \"" << request.d_cwd << "\"");
+    }
+    for (int i = 0; i < s_standardFdCount; ++i) {
+        dup2(savedFds[i], s_standardFds[i]);
+        close(savedFds[i]);
+    }
+
+    DaemonProtocol::sendReply(connection, runLocally, result);
+}
+
+} // namespace recc
+} // namespace BloombergLP
@@ -0,0 +1,108 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_RECCDAEMON
+#define INCLUDED_RECCDAEMON
+
+#include <commandrunner.h>
+
+#include <buildboxcommon_logging.h>
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * Hands commands to a running `reccd`.
+ */
+struct DaemonClient {
+    enum Status {
+        // The daemon can't be reached, or went away before taking the
+        // request: the command should be run in-process.
+        UNAVAILABLE,
+        // The daemon took the request but went away before replying, so the
+        // command may have run, in part or in full.
+        FAILED,
+        // The daemon replied.
+        REPLIED
+    };
+
+    /**
+     * Ask the daemon listening on `socketPath` to run the null-terminated
+     * command `argv` in our working directory and environment, writing to our
+     * stdout and stderr.
+     *
+     * Once the daemon has replied, stores the result of
+     * `CommandRunner::run()` in `runLocally` and `exitCode`.
+     */
+    static Status run(const std::string &socketPath, char *argv[],
+                      bool *runLocally, int *exitCode);
+};
+
+/**
+ * Serves `DaemonClient` requests on a Unix domain socket.
+ *
+ * Each request is handled by one of a fixed number of worker processes,
+ * which take the client's working directory, environment and standard file
+ * descriptors for its duration and keep their `CommandRunner`, and so their
+ * gRPC channels, between requests. Configuration and process-wide state are
+ * not shared between concurrent commands, since every worker runs one at a
+ * time.
+ *
+ * Only connections from the user running the daemon are accepted.
+ */
+class Daemon {
+  public:
+    /**
+     * Listen on `socketPath`, replacing a stale socket left there. Throws
+     * `std::runtime_error` if another daemon is listening on it or the
+     * socket can't be created.
+     */
+    Daemon(const std::string &socketPath, int workers);
+
+    ~Daemon();
+
+    Daemon(const Daemon &) = delete;
+    Daemon &operator=(const Daemon &) = delete;
+
+    /**
+     * Start the workers, restarting any that exit, until SIGINT or SIGTERM
+     * is received.
+     */
+    void serve();
+
+  private:
+    /**
+     * Accept and handle connections forever. Runs in a worker process.
+     */
+    void runWorker();
+
+    void handleConnection(int connection, CommandRunner *runner);
+
+    std::string d_socketPath;
+    int d_workers;
+    int d_socket;
+    // Taken from the daemon's own configuration, and restored after every
+    // command, since commands set it from theirs.
+    buildboxcommon::LogLevel d_logLevel;
+    std::vector<pid_t> d_workerPids;
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
@@ -35,6 +35,7 @@
 #define DEFAULT_RECC_CONFIG "recc.conf"
 #define DEFAULT_RECC_PROJECT_ROOT ""
 #define DEFAULT_RECC_DEPS_GLOBAL_PATHS 0
+#define DEFAULT_RECC_DEPS_SCAN 0
 #define DEFAULT_RECC_AUTH_UNCONFIGURED_MSG ""
 #define DEFAULT_RECC_CORRELATED_INVOCATIONS_ID ""
 #define DEFAULT_RECC_METRICS_FILE ""
@@ -61,6 +62,16 @@
 
 #define DEFAULT_RECC_CAS_DIGEST_FUNCTION "SHA256"
 #define DEFAULT_RECC_MAX_THREADS 4
+#define DEFAULT_RECC_FILE_DIGEST_CACHE_DIR ""
+#define DEFAULT_RECC_FILE_DIGEST_CACHE_MAX_ENTRIES 65536
+#define DEFAULT_RECC_DEPS_CACHE_DIR ""
+#define DEFAULT_RECC_DIRECTORY_SNAPSHOT_DIR ""
+#define DEFAULT_RECC_DAEMON_SOCKET ""
+#define DEFAULT_RECC_DAEMON_WORKERS -1
+#define DEFAULT_RECC_SPECULATIVE_UPLOAD 0
+#define DEFAULT_RECC_MAX_CONCURRENT_BATCH_UPLOADS 4
+#define DEFAULT_RECC_MAX_CONCURRENT_STREAM_UPLOADS 2
+#define DEFAULT_RECC_MAX_UPLOAD_BYTES_IN_FLIGHT (64 * 1024 * 1024)
 
 #define DEFAULT_RECC_REAPI_VERSION "2.0"
 
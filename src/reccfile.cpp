@@ -15,18 +15,26 @@
 #include <reccfile.h>
 
 #include <digestgenerator.h>
+#include <filedigestcache.h>
 #include <fileutils.h>
 
 #include <buildboxcommon_fileutils.h>
 #include <buildboxcommon_logging.h>
 
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <system_error>
+#include <unistd.h>
+
 namespace BloombergLP {
 namespace recc {
 ReccFile::ReccFile(const std::string &file_path, const std::string &file_name,
-                   const std::string &contents, const proto::Digest &digest,
-                   bool executable, bool symlink)
-    : d_filePath(file_path), d_fileName(file_name), d_fileContents(contents),
-      d_digest(digest), d_executable(executable), d_symlink(symlink)
+                   const proto::Digest &digest, bool executable, bool symlink,
+                   const std::string &symlink_target)
+    : d_filePath(file_path), d_fileName(file_name), d_digest(digest),
+      d_executable(executable), d_symlink(symlink),
+      d_symlinkTarget(symlink_target)
 {
 }
 
@@ -43,13 +51,19 @@ proto::FileNode ReccFile::getFileNode(const std::string &override_name) const
     return result;
 }
 
-proto::Digest ReccFile::getDigest() const { return d_digest; }
+const proto::Digest &ReccFile::getDigest() const { return d_digest; }
 
 const std::string &ReccFile::getFileName() const { return d_fileName; }
 
 const std::string &ReccFile::getFilePath() const { return d_filePath; }
 
-const std::string &ReccFile::getFileContents() const { return d_fileContents; }
+std::string ReccFile::getFileContents() const
+{
+    if (d_symlink) {
+        return d_symlinkTarget;
+    }
+    return buildboxcommon::FileUtils::getFileContents(d_filePath.c_str());
+}
 
 bool ReccFile::isExecutable() const { return d_executable; }
 
@@ -61,31 +75,7 @@ ReccFileFactory::createFile(const char *path, const bool followSymlinks)
     if (path != nullptr) {
         const struct stat statResult =
             FileUtils::getStat(path, followSymlinks);
-        if (!FileUtils::isRegularFileOrSymlink(statResult)) {
-            return nullptr;
-        }
-
-        const bool executable = FileUtils::isExecutable(statResult);
-        const bool symlink = FileUtils::isSymlink(statResult);
-        const std::string file_name =
-            buildboxcommon::FileUtils::pathBasename(path);
-        const std::string file_contents =
-            (symlink ? FileUtils::getSymlinkContents(path, statResult)
-                     : buildboxcommon::FileUtils::getFileContents(path));
-
-        const proto::Digest file_digest =
-            DigestGenerator::make_digest(file_contents);
-
-        BUILDBOX_LOG_DEBUG(
-            "Creating" << (executable ? " " : " non-")
-                       << "executable file object"
-                       << " with digest \"" << file_digest.ShortDebugString()
-                       << "\" and path \"" << path
-                       << "\", symlink = " << std::boolalpha << symlink);
-
-        return std::make_shared<ReccFile>(
-            ReccFile(std::string(path), file_name, file_contents, file_digest,
-                     executable, symlink));
+        return createFileAt(AT_FDCWD, path, path, statResult);
     }
     else {
         BUILDBOX_LOG_ERROR("Path is not valid");
@@ -93,5 +83,65 @@ ReccFileFactory::createFile(const char *path, const bool followSymlinks)
     }
 }
 
+std::shared_ptr<ReccFile>
+ReccFileFactory::createFileAt(int dirfd, const char *name,
+                              const std::string &path,
+                              const struct stat &statResult)
+{
+    if (!FileUtils::isRegularFileOrSymlink(statResult)) {
+        return nullptr;
+    }
+
+    const bool executable = FileUtils::isExecutable(statResult);
+    const bool symlink = FileUtils::isSymlink(statResult);
+    const std::string file_name =
+        buildboxcommon::FileUtils::pathBasename(path.c_str());
+    std::string symlink_target;
+    proto::Digest file_digest;
+    if (symlink) {
+        // Symlinks are cheap to hash and their stat() result describes
+        // the link rather than its target, so they bypass the cache.
+        symlink_target =
+            FileUtils::getSymlinkContents(name, statResult, dirfd);
+        file_digest = DigestGenerator::make_digest(symlink_target);
+    }
+    else {
+        FileDigestCache *digestCache = FileDigestCache::instance();
+        if (digestCache == nullptr ||
+            !digestCache->lookup(statResult, &file_digest)) {
+            const int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                const int errorNumber = errno;
+                BUILDBOX_LOG_ERROR("Error calling openat() for path \""
+                                   << path << "\": " << strerror(errorNumber));
+                throw std::system_error(errorNumber, std::system_category(),
+                                        "openat(\"" + path + "\")");
+            }
+            try {
+                file_digest = DigestGenerator::make_digest_from_fd(fd);
+            }
+            catch (...) {
+                close(fd);
+                throw;
+            }
+            close(fd);
+            if (digestCache != nullptr) {
+                digestCache->store(statResult, file_digest);
+            }
+        }
+    }
+
+    BUILDBOX_LOG_DEBUG("Creating" << (executable ? " " : " non-")
+                                  << "executable file object"
+                                  << " with digest \""
+                                  << file_digest.ShortDebugString()
+                                  << "\" and path \"" << path
+                                  << "\", symlink = " << std::boolalpha
+                                  << symlink);
+
+    return std::make_shared<ReccFile>(path, file_name, file_digest,
+                                      executable, symlink, symlink_target);
+}
+
 } // namespace recc
 } // namespace BloombergLP
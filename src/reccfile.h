@@ -18,38 +18,47 @@
 #include <memory>
 #include <protos.h>
 #include <string>
+#include <sys/stat.h>
 
 namespace BloombergLP {
 namespace recc {
 
 /*
  * Represents a single file in the filesystem.
+ *
+ * Only the path and digest of regular files are kept; their contents are
+ * read from disk when needed, so that files the CAS already has are never
+ * held in memory.
  */
 class ReccFile {
   public:
     ReccFile(const std::string &file_path, const std::string &file_name,
-             const std::string &contents, const proto::Digest &digest,
-             bool executable, bool symlink = false);
+             const proto::Digest &digest, bool executable,
+             bool symlink = false, const std::string &symlink_target = "");
     ReccFile() = delete;
     /**
      * Converts a ReccFile to a proto::FileNode with the given name.
      * Defaults to the file_name taken from the path.
      */
     proto::FileNode getFileNode(const std::string &override_name = "") const;
-    proto::Digest getDigest() const;
+    const proto::Digest &getDigest() const;
     const std::string &getFileName() const;
     const std::string &getFilePath() const;
-    const std::string &getFileContents() const;
+    /**
+     * Read the contents of the file from disk, or return the target of a
+     * symlink.
+     */
+    std::string getFileContents() const;
     bool isExecutable() const;
     bool isSymlink() const;
 
   private:
     const std::string d_filePath;
     const std::string d_fileName;
-    const std::string d_fileContents;
     const proto::Digest d_digest;
     bool d_executable;
     bool d_symlink;
+    const std::string d_symlinkTarget;
 };
 
 /*
@@ -59,6 +68,18 @@ class ReccFileFactory {
   public:
     static std::shared_ptr<ReccFile>
     createFile(const char *path, const bool followSymlinks = true);
+
+    /**
+     * Constructs a ReccFile for the entry `name` of the directory open as
+     * `dirfd`, given its full `path` and the `stat()` result already
+     * obtained for it. Accessing the file relative to its directory spares
+     * the kernel from resolving the whole path again.
+     *
+     * Returns nullptr if the entry is neither a regular file nor a symlink.
+     */
+    static std::shared_ptr<ReccFile>
+    createFileAt(int dirfd, const char *name, const std::string &path,
+                 const struct stat &statResult);
     ReccFileFactory() = delete;
 };
 
@@ -15,10 +15,12 @@
 #include <remoteexecutionclient.h>
 
 #include <digestgenerator.h>
+#include <digestkey.h>
 #include <fileutils.h>
 #include <grpcretry.h>
 #include <reccdefaults.h>
 #include <remoteexecutionsignals.h>
+#include <threadutils.h>
 
 #include <buildboxcommon_logging.h>
 #include <buildboxcommonmetrics_durationmetrictimer.h>
@@ -26,6 +28,9 @@
 
 #include <functional>
 #include <future>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <signal.h>
 
 #define TIMER_NAME_FETCH_WRITE_RESULTS "recc.fetch_write_results"
@@ -46,7 +51,7 @@ namespace { // Helper functions used by `RemoteExecutionClient`.
 void add_from_directory(
     FileInfoMap *outputFiles, const proto::Directory &directory,
     const std::string &prefix,
-    const std::unordered_map<proto::Digest, proto::Directory> &digestMap)
+    const std::unordered_map<DigestKey, proto::Directory> &digestMap)
 {
     for (int i = 0; i < directory.files_size(); ++i) {
         (*outputFiles)[prefix + directory.files(i).name()] =
@@ -263,7 +268,7 @@ void RemoteExecutionClient::cancel_operation(const std::string &operationName)
     cancelRequest.set_name(operationName);
 
     /* Can't use the same context for simultaneous async RPCs */
-    std::unique_ptr<grpc::ClientContext> cancelContext =
+    const GrpcContext::GrpcClientContextPtr cancelContext =
         d_grpcContext->new_client_context();
 
     /* Send the cancellation request and report any errors */
@@ -287,20 +292,76 @@ void RemoteExecutionClient::write_files_to_disk(const ActionResult &result,
         buildboxcommon::buildboxcommonmetrics::DurationMetricTimer>
         mt(TIMER_NAME_FETCH_WRITE_RESULTS);
 
-    for (const auto &fileIter : result.d_outputFiles) {
-        const std::string path = std::string(root) + "/" + fileIter.first;
+    // Inlined files are written in parallel, then the others as their
+    // contents arrive from the CAS, several of which are fetched at once.
+    // Files with the same contents are written together.
+    std::vector<FileInfoMap::const_iterator> inlinedFiles;
+    std::unordered_map<DigestKey, std::vector<FileInfoMap::const_iterator>>
+        filesByDigest;
+    std::vector<proto::Digest> digests;
+    for (auto it = result.d_outputFiles.cbegin();
+         it != result.d_outputFiles.cend(); ++it) {
+        if (it->second.d_inlined) {
+            inlinedFiles.push_back(it);
+            continue;
+        }
+        auto &files = filesByDigest[it->second.d_digest];
+        if (files.empty()) {
+            digests.push_back(it->second.d_digest);
+        }
+        files.push_back(it);
+    }
+
+    const auto writeFile = [&](FileInfoMap::const_iterator fileIter,
+                               const std::string &contents) {
+        const std::string path = std::string(root) + "/" + fileIter->first;
         BUILDBOX_LOG_DEBUG("Writing " << path);
 
         const std::string parent_path = path.substr(0, path.rfind('/'));
         buildboxcommon::FileUtils::createDirectory(parent_path.c_str());
 
         mode_t mode = 0644;
-        if (fileIter.second.d_executable) {
+        if (fileIter->second.d_executable) {
             mode |= S_IXUSR | S_IXGRP | S_IXOTH;
         }
-        buildboxcommon::FileUtils::writeFileAtomically(
-            path, get_outputblob(fileIter.second), mode);
+        buildboxcommon::FileUtils::writeFileAtomically(path, contents, mode);
+    };
+
+    ThreadPool::instance().parallel(
+        inlinedFiles.size(),
+        [&](size_t index) {
+            writeFile(inlinedFiles[index], inlinedFiles[index]->second.d_blob);
+        },
+        ThreadUtils::maxThreads());
+    fetch_blobs(digests, [&](const proto::Digest &digest,
+                             const std::string &blob) {
+        for (const auto &fileIter : filesByDigest.at(digest)) {
+            writeFile(fileIter, blob);
+        }
+    });
+}
+
+void RemoteExecutionClient::fetch_outputblobs(
+    const std::vector<OutputBlob *> &blobs)
+{
+    std::vector<proto::Digest> digests;
+    for (const OutputBlob *blob : blobs) {
+        if (!blob->d_inlined) {
+            digests.push_back(blob->d_digest);
+        }
     }
+
+    std::mutex mutex;
+    fetch_blobs(digests, [&](const proto::Digest &digest,
+                             const std::string &contents) {
+        const std::lock_guard<std::mutex> lock(mutex);
+        for (OutputBlob *blob : blobs) {
+            if (!blob->d_inlined && DigestKey(blob->d_digest) == digest) {
+                blob->d_blob = contents;
+                blob->d_inlined = true;
+            }
+        }
+    });
 }
 
 ActionResult
@@ -325,7 +386,7 @@ RemoteExecutionClient::from_proto(const proto::ActionResult &proto)
         const auto tree =
             fetch_message<proto::Tree>(outputDirectoryProto.tree_digest());
 
-        std::unordered_map<proto::Digest, proto::Directory> digestMap;
+        std::unordered_map<DigestKey, proto::Directory> digestMap;
         for (int j = 0; j < tree.children_size(); ++j) {
             digestMap[DigestGenerator::make_digest(tree.children(j))] =
                 tree.children(j);
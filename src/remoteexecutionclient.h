@@ -22,6 +22,7 @@
 #include <atomic>
 #include <map>
 #include <set>
+#include <vector>
 
 namespace BloombergLP {
 namespace recc {
@@ -159,6 +160,13 @@ class RemoteExecutionClient final : public CASClient {
         return b.d_inlined ? b.d_blob : fetch_blob(b.d_digest);
     }
 
+    /**
+     * Fetch the contents of the given OutputBlobs that aren't inlined, all
+     * at once, and store them inline so that `get_outputblob()` doesn't need
+     * to fetch them.
+     */
+    void fetch_outputblobs(const std::vector<OutputBlob *> &blobs);
+
     /**
      * Write the given ActionResult's output files to disk.
      */
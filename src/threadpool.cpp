@@ -0,0 +1,282 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <threadpool.h>
+
+#include <env.h>
+#include <threadutils.h>
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+
+#include <unistd.h>
+
+namespace BloombergLP {
+namespace recc {
+
+namespace {
+
+const size_t s_notAPoolThread = std::numeric_limits<size_t>::max();
+
+// The pool that the current thread belongs to, if any, and the index of its
+// queue there.
+thread_local const ThreadPool *t_pool = nullptr;
+thread_local size_t t_queueIndex = s_notAPoolThread;
+
+// A pool shared by the process, which `sharedPool()` starts on first use.
+struct SharedPool {
+    std::mutex d_mutex;
+    std::unique_ptr<ThreadPool> d_pool;
+    pid_t d_owner = 0;
+};
+
+ThreadPool &sharedPool(SharedPool *shared, size_t threads)
+{
+    // A replaced pool is destroyed once the lock is released, since its
+    // tasks may call this while it waits for them.
+    std::unique_ptr<ThreadPool> replacedPool;
+    const std::lock_guard<std::mutex> lock(shared->d_mutex);
+    std::unique_ptr<ThreadPool> &pool = shared->d_pool;
+    if (!pool || shared->d_owner != getpid()) {
+        // In a forked child the threads of the parent's pool are gone, and
+        // its locks may be held forever, so it is left alone.
+        pool.release();
+        pool.reset(new ThreadPool(threads));
+        shared->d_owner = getpid();
+    }
+    else if (pool->size() != threads && t_pool != pool.get()) {
+        // The configuration changed, as it may between the commands a reccd
+        // worker runs. The old pool's threads finish what is queued and
+        // stop. A task of the old pool keeps using it, since it can't wait
+        // for its own thread to stop.
+        replacedPool = std::move(pool);
+        pool.reset(new ThreadPool(threads));
+    }
+    return *pool;
+}
+
+} // namespace
+
+const std::chrono::microseconds ThreadPool::s_idleWait(1000);
+
+ThreadPool &ThreadPool::instance()
+{
+    static SharedPool shared;
+    return sharedPool(&shared, ThreadUtils::maxThreads());
+}
+
+ThreadPool &ThreadPool::uploadInstance()
+{
+    static SharedPool shared;
+    const int threads = std::max(RECC_MAX_CONCURRENT_BATCH_UPLOADS, 1) +
+                        std::max(RECC_MAX_CONCURRENT_STREAM_UPLOADS, 1);
+    return sharedPool(&shared, static_cast<size_t>(threads));
+}
+
+ThreadPool::ThreadPool(size_t threads)
+    : d_queuedTasks(0), d_stopping(false), d_nextQueue(0), d_tasksRun(0),
+      d_tasksStolen(0), d_busyMicroseconds(0)
+{
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        d_queues.emplace_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        d_threads.emplace_back(&ThreadPool::runThread, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        const std::lock_guard<std::mutex> lock(d_wakeMutex);
+        d_stopping = true;
+    }
+    d_wake.notify_all();
+    for (auto &thread : d_threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::enqueue(std::function<void()> task)
+{
+    const size_t index = t_pool == this ? t_queueIndex
+                                        : d_nextQueue++ % d_queues.size();
+    {
+        Queue &queue = *d_queues[index];
+        const std::lock_guard<std::mutex> lock(queue.d_mutex);
+        queue.d_tasks.push_back(std::move(task));
+    }
+    {
+        const std::lock_guard<std::mutex> lock(d_wakeMutex);
+        d_queuedTasks++;
+    }
+    d_wake.notify_one();
+}
+
+bool ThreadPool::runQueuedTask()
+{
+    const size_t ownIndex = t_pool == this ? t_queueIndex : s_notAPoolThread;
+
+    std::function<void()> task;
+    bool stolen = false;
+    if (ownIndex != s_notAPoolThread) {
+        Queue &queue = *d_queues[ownIndex];
+        const std::lock_guard<std::mutex> lock(queue.d_mutex);
+        if (!queue.d_tasks.empty()) {
+            task = std::move(queue.d_tasks.back());
+            queue.d_tasks.pop_back();
+        }
+    }
+    if (!task) {
+        const size_t start = ownIndex == s_notAPoolThread ? 0 : ownIndex + 1;
+        for (size_t i = 0; i < d_queues.size() && !task; ++i) {
+            const size_t index = (start + i) % d_queues.size();
+            if (index == ownIndex) {
+                continue;
+            }
+            Queue &queue = *d_queues[index];
+            const std::lock_guard<std::mutex> lock(queue.d_mutex);
+            if (!queue.d_tasks.empty()) {
+                task = std::move(queue.d_tasks.front());
+                queue.d_tasks.pop_front();
+                stolen = ownIndex != s_notAPoolThread;
+            }
+        }
+    }
+    if (!task) {
+        return false;
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(d_wakeMutex);
+        d_queuedTasks--;
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    task();
+    d_tasksRun++;
+    if (ownIndex != s_notAPoolThread) {
+        const auto busyTime =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - startTime);
+        d_busyMicroseconds += static_cast<uint64_t>(busyTime.count());
+        if (stolen) {
+            d_tasksStolen++;
+        }
+    }
+    return true;
+}
+
+void ThreadPool::runThread(size_t index)
+{
+    t_pool = this;
+    t_queueIndex = index;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(d_wakeMutex);
+            d_wake.wait(lock,
+                        [this] { return d_queuedTasks > 0 || d_stopping; });
+            if (d_queuedTasks == 0) {
+                return;
+            }
+        }
+        runQueuedTask();
+    }
+}
+
+void ThreadPool::parallel(size_t jobs,
+                          const std::function<void(size_t)> &job,
+                          size_t parallelism)
+{
+    // Shared with the helper tasks, which may only start running after all
+    // the jobs are done and this call has returned. They then find no job to
+    // take and don't touch `d_job`.
+    struct State {
+        const std::function<void(size_t)> *d_job;
+        size_t d_jobs;
+        std::atomic<size_t> d_nextJob;
+        size_t d_remainingJobs;
+        std::exception_ptr d_error;
+        std::mutex d_mutex;
+        std::condition_variable d_done;
+
+        void run()
+        {
+            for (size_t i = d_nextJob++; i < d_jobs; i = d_nextJob++) {
+                std::exception_ptr error;
+                try {
+                    (*d_job)(i);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+
+                const std::lock_guard<std::mutex> lock(d_mutex);
+                if (error && !d_error) {
+                    d_error = error;
+                }
+                if (--d_remainingJobs == 0) {
+                    d_done.notify_all();
+                }
+            }
+        }
+    };
+
+    if (jobs == 0) {
+        return;
+    }
+
+    auto state = std::make_shared<State>();
+    state->d_job = &job;
+    state->d_jobs = jobs;
+    state->d_nextJob = 0;
+    state->d_remainingJobs = jobs;
+
+    const size_t helpers =
+        std::min(std::max<size_t>(parallelism, 1), jobs) - 1;
+    for (size_t i = 0; i < helpers; ++i) {
+        enqueue([state] { state->run(); });
+    }
+    state->run();
+
+    std::unique_lock<std::mutex> lock(state->d_mutex);
+    while (state->d_remainingJobs > 0) {
+        lock.unlock();
+        const bool helped = runQueuedTask();
+        lock.lock();
+        if (!helped) {
+            state->d_done.wait_for(lock, s_idleWait, [&state] {
+                return state->d_remainingJobs == 0;
+            });
+        }
+    }
+    if (state->d_error) {
+        std::rethrow_exception(state->d_error);
+    }
+}
+
+ThreadPool::Stats ThreadPool::stats() const
+{
+    Stats result;
+    result.d_tasksRun = d_tasksRun;
+    result.d_tasksStolen = d_tasksStolen;
+    result.d_busyMicroseconds = d_busyMicroseconds;
+    return result;
+}
+
+} // namespace recc
+} // namespace BloombergLP
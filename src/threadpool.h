@@ -0,0 +1,238 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCLUDED_THREADPOOL
+#define INCLUDED_THREADPOOL
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace BloombergLP {
+namespace recc {
+
+/**
+ * A fixed set of threads that run submitted tasks, kept for the lifetime of
+ * the process so that parallel operations don't pay for starting threads.
+ *
+ * Every thread has its own queue. Tasks submitted from a pool thread go to
+ * the back of its own queue, which it works through newest first; idle
+ * threads steal the oldest tasks from the others. Threads waiting for a task
+ * with `wait()` or `parallel()` run queued tasks meanwhile, so tasks may
+ * themselves submit and wait for others without exhausting the pool.
+ */
+class ThreadPool {
+  public:
+    /**
+     * Counters of the work done by the pool threads since they started.
+     */
+    struct Stats {
+        uint64_t d_tasksRun = 0;
+        uint64_t d_tasksStolen = 0;
+        uint64_t d_busyMicroseconds = 0;
+    };
+
+    /**
+     * Return the pool shared by the process, starting it with
+     * `ThreadUtils::maxThreads()` threads on first use. A forked child gets a
+     * pool of its own, since the threads of its parent don't exist in it.
+     *
+     * If `maxThreads()` has changed since, the pool is replaced by one of
+     * the new size, so RECC_MAX_THREADS must only change while nothing is
+     * using the pool, as between the commands a reccd worker runs.
+     */
+    static ThreadPool &instance();
+
+    /**
+     * Return the pool that uploads to the CAS run on, as `instance()` does,
+     * with a thread for each of the RECC_MAX_CONCURRENT_BATCH_UPLOADS and
+     * RECC_MAX_CONCURRENT_STREAM_UPLOADS uploads in flight. Keeping them
+     * apart means that blocking calls don't hold threads that hashing
+     * needs, and that RECC_MAX_THREADS doesn't limit the uploads.
+     */
+    static ThreadPool &uploadInstance();
+
+    explicit ThreadPool(size_t threads);
+
+    /**
+     * Run the tasks already queued and stop the threads.
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return d_threads.size(); }
+
+    /**
+     * Queue `task` to be run by the pool, returning a future for its result.
+     */
+    template <typename Task>
+    std::future<typename std::result_of<Task()>::type> submit(Task &&task)
+    {
+        typedef typename std::result_of<Task()>::type Result;
+        auto packagedTask = std::make_shared<std::packaged_task<Result()>>(
+            std::forward<Task>(task));
+        std::future<Result> result = packagedTask->get_future();
+        enqueue([packagedTask] { (*packagedTask)(); });
+        return result;
+    }
+
+    /**
+     * Return the result of a task submitted to the pool, running other
+     * queued tasks until it is ready.
+     */
+    template <typename Result> Result wait(std::future<Result> &future)
+    {
+        waitUntilReady(future);
+        return future.get();
+    }
+
+    /**
+     * Run other queued tasks until the task with the given future is done,
+     * without taking its result.
+     */
+    template <typename Result>
+    void waitUntilReady(const std::future<Result> &future)
+    {
+        while (future.wait_for(std::chrono::seconds(0)) !=
+               std::future_status::ready) {
+            if (!runQueuedTask()) {
+                future.wait_for(s_idleWait);
+            }
+        }
+    }
+
+    /**
+     * Call `job(i)` for every `i` in [0, `jobs`), on at most `parallelism`
+     * threads including the caller. Threads take the next job as soon as
+     * they finish one, so a slow job only delays the thread running it.
+     * Rethrows the first exception thrown by a job once all have run.
+     */
+    void parallel(size_t jobs, const std::function<void(size_t)> &job,
+                  size_t parallelism);
+
+    Stats stats() const;
+
+  private:
+    struct Queue {
+        std::mutex d_mutex;
+        std::deque<std::function<void()>> d_tasks;
+    };
+
+    // How long a waiting thread sleeps when there is nothing to help with
+    // before checking again.
+    static const std::chrono::microseconds s_idleWait;
+
+    void enqueue(std::function<void()> task);
+
+    /**
+     * Run one queued task on the calling thread, preferring those of its
+     * own queue. Returns false if there were none.
+     */
+    bool runQueuedTask();
+
+    void runThread(size_t index);
+
+    std::vector<std::unique_ptr<Queue>> d_queues;
+    std::vector<std::thread> d_threads;
+
+    std::mutex d_wakeMutex;
+    std::condition_variable d_wake;
+    size_t d_queuedTasks;
+    bool d_stopping;
+
+    std::atomic<size_t> d_nextQueue;
+
+    std::atomic<uint64_t> d_tasksRun;
+    std::atomic<uint64_t> d_tasksStolen;
+    std::atomic<uint64_t> d_busyMicroseconds;
+};
+
+/**
+ * Tasks submitted to a `ThreadPool` that are waited for together. Destroying
+ * the group waits for the tasks that are still running, so that they can
+ * safely refer to state that goes away with it, even if an exception is
+ * thrown before `wait()` is reached.
+ */
+class TaskGroup {
+  public:
+    explicit TaskGroup(ThreadPool *pool) : d_pool(pool) {}
+
+    ~TaskGroup()
+    {
+        // Queued tasks are run meanwhile, since those of the group may be
+        // waiting in this thread's own queue.
+        for (auto &task : d_tasks) {
+            if (task.valid()) {
+                try {
+                    d_pool->waitUntilReady(task);
+                }
+                catch (...) {
+                    task.wait();
+                }
+            }
+        }
+    }
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    template <typename Task> void submit(Task &&task)
+    {
+        d_tasks.push_back(d_pool->submit(std::forward<Task>(task)));
+    }
+
+    /**
+     * Wait for all the tasks, rethrowing the first exception one of them
+     * threw.
+     */
+    void wait()
+    {
+        std::exception_ptr error;
+        for (auto &task : d_tasks) {
+            try {
+                d_pool->wait(task);
+            }
+            catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        d_tasks.clear();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+  private:
+    ThreadPool *d_pool;
+    std::vector<std::future<void>> d_tasks;
+};
+
+} // namespace recc
+} // namespace BloombergLP
+
+#endif
@@ -16,20 +16,44 @@
 #define INCLUDED_THREADUTILS
 
 #include <env.h>
+#include <threadpool.h>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 namespace BloombergLP {
 namespace recc {
 
 struct ThreadUtils {
 
+    /**
+     * Return the number of threads that parallel operations may use,
+     * following the RECC_MAX_THREADS convention that a negative value means
+     * "as many as there are cores".
+     */
+    static size_t maxThreads()
+    {
+        if (RECC_MAX_THREADS < 0) {
+            // This call can return 0. If so, default to one thread.
+            const unsigned int availableThreads =
+                std::thread::hardware_concurrency();
+            return availableThreads ? availableThreads : 1;
+        }
+        return static_cast<size_t>(std::max(RECC_MAX_THREADS, 1));
+    }
+
     /**
      * Apply doWorkInRange to a range of elements in the container, in
-     * parallel. Will partition the container according to the RECC_MAX_THREADS
-     * global variable.
-     * If there are less than 50 elements in the container, the work will not
-     * be parallelized.
+     * parallel on the process-wide `ThreadPool`, using up to
+     * RECC_MAX_THREADS threads including the caller.
+     *
+     * The container is split into several ranges per thread, which threads
+     * take as they become free, so that a range of slow elements doesn't
+     * hold up the others.
      *
      * NOTE: This fuction makes no guarantees about thread safety or
      * ordering of the parallel operations done in doWorkInRange. It is up to
@@ -42,55 +66,37 @@ struct ThreadUtils {
         std::function<void(typename ContainerT::iterator,
                            typename ContainerT::iterator)> &doWorkInRange)
     {
-        int numThreads = RECC_MAX_THREADS;
-        typename ContainerT::iterator start = container.begin();
-        typename ContainerT::iterator end = container.end();
-        const auto containerLength = container.size();
-        if (containerLength < 50 || numThreads == 0) {
-            doWorkInRange(start, end);
+        const size_t numThreads = maxThreads();
+        const size_t containerLength = container.size();
+        if (containerLength < 2 || numThreads < 2) {
+            doWorkInRange(container.begin(), container.end());
+            return;
         }
-        else {
-            if (numThreads < 0) {
-                // This call can return 0. If so, default to numThreads.
-                int available_threads =
-                    static_cast<int>(std::thread::hardware_concurrency());
-                numThreads =
-                    available_threads ? available_threads : numThreads;
-            }
-            if (numThreads == 0) {
-                numThreads = 1;
-            }
 
-            auto positiveNumThreads = static_cast<unsigned long>(numThreads);
-            const auto numItemsPerPartition =
-                containerLength / positiveNumThreads;
-            std::vector<std::thread> threadObjects;
-            // The conversion to unsigned is fine here, as we handle negative
-            // values for numThreads above.
-            threadObjects.reserve(positiveNumThreads);
-            end = start;
-            for (auto partition = 0; partition < numThreads; ++partition) {
-                // To handle a none evenly divisible number of objects, the
-                // last partition goes to the end of the range.
-                //
-                // Additionally, the main thread will process the remaining
-                // elements.
-                if (partition == numThreads - 1) {
-                    end = container.end();
-                    doWorkInRange(start, end);
-                    continue;
-                }
-                else {
-                    std::advance(end, static_cast<long>(numItemsPerPartition));
-                }
-                threadObjects.push_back(
-                    std::thread(std::ref(doWorkInRange), start, end));
-                start = end;
-            }
-            for (auto &thread : threadObjects) {
-                thread.join();
-            }
+        const size_t rangesPerThread = 4;
+        const size_t numRanges =
+            std::min(containerLength, numThreads * rangesPerThread);
+
+        // Spread the remainder over the first ranges, so that their sizes
+        // differ by one at most.
+        std::vector<typename ContainerT::iterator> boundaries;
+        boundaries.reserve(numRanges + 1);
+        auto boundary = container.begin();
+        boundaries.push_back(boundary);
+        for (size_t range = 0; range < numRanges; ++range) {
+            const size_t rangeLength =
+                containerLength / numRanges +
+                (range < containerLength % numRanges ? 1 : 0);
+            std::advance(boundary, static_cast<long>(rangeLength));
+            boundaries.push_back(boundary);
         }
+
+        ThreadPool::instance().parallel(
+            numRanges,
+            [&](size_t range) {
+                doWorkInRange(boundaries[range], boundaries[range + 1]);
+            },
+            numThreads);
     }
 };
 
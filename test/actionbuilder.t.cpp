@@ -14,6 +14,7 @@
 
 #include <actionbuilder.h>
 #include <buildboxcommon_fileutils.h>
+#include <buildboxcommon_temporarydirectory.h>
 #include <buildboxcommonmetrics_durationmetricvalue.h>
 #include <buildboxcommonmetrics_testingutils.h>
 #include <digestgenerator.h>
@@ -60,6 +61,7 @@ class ActionBuilderTestFixture
         RECC_WORKING_DIR_PREFIX = d_previous_working_dir_prefix;
         RECC_REAPI_VERSION = d_previous_reapi_version;
         RECC_REMOTE_PLATFORM = d_previous_remote_platform;
+        Env::compile_path_matchers();
     }
 
     void writeDependenciesToTempFile(const std::string &dependency_file_name)
@@ -74,7 +76,7 @@ class ActionBuilderTestFixture
     }
 
     digest_string_umap blobs;
-    digest_string_umap digest_to_filecontents;
+    digest_string_umap digest_to_filepaths;
     std::string cwd;
 
   private:
@@ -153,7 +155,7 @@ TEST_F(ActionBuilderTestFixture, PlatformPropertiesInActionWhenSupported)
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
 
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     ASSERT_NE(actionPtr, nullptr);
 
@@ -176,7 +178,7 @@ TEST_F(ActionBuilderTestFixture, GetDependenciesAIX)
 
     writeDependenciesToTempFile(command.get_aix_dependency_file_name());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 }
 
@@ -190,7 +192,7 @@ TEST_F(ActionBuilderTestFixture, IllegalNonCompileCommand)
     ASSERT_TRUE(command.get_aix_dependency_file_name().empty());
 
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_EQ(actionPtr, nullptr);
 }
 
@@ -202,7 +204,7 @@ TEST_F(ActionBuilderTestFixture, IllegalCompileCommandThrows)
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
 
     EXPECT_THROW(ActionBuilder::BuildAction(command, cwd, &blobs,
-                                            &digest_to_filecontents),
+                                            &digest_to_filepaths),
                  std::invalid_argument);
 }
 
@@ -214,6 +216,42 @@ TEST_F(ActionBuilderTestFixture, BuildMerkleTreeVerifyMetricsCollection)
         collectedByName<DurationMetricValue>(TIMER_NAME_BUILD_MERKLE_TREE));
 }
 
+TEST_F(ActionBuilderTestFixture, BuildMerkleTreeIsIndependentOfThreadCount)
+{
+    buildboxcommon::TemporaryDirectory tempDir;
+    DependencyPairs dep_pairs;
+    for (int i = 0; i < 7; i++) {
+        buildboxcommon::FileUtils::createDirectory(
+            (std::string(tempDir.name()) + "/dir" + std::to_string(i))
+                .c_str());
+    }
+    for (int i = 0; i < 200; i++) {
+        const std::string relativePath =
+            "dir" + std::to_string(i % 7) + "/file" + std::to_string(i);
+        const std::string path =
+            std::string(tempDir.name()) + "/" + relativePath;
+        buildboxcommon::FileUtils::writeFileAtomically(path,
+                                                       std::to_string(i % 50));
+        dep_pairs.emplace_back(path, relativePath);
+    }
+
+    const int previousMaxThreads = RECC_MAX_THREADS;
+    RECC_MAX_THREADS = 1;
+    DirectoryTree serialDirectory;
+    digest_string_umap serialFiles;
+    buildMerkleTree(dep_pairs, "cwd", &serialDirectory, &serialFiles);
+
+    RECC_MAX_THREADS = 4;
+    DirectoryTree parallelDirectory;
+    digest_string_umap parallelFiles;
+    buildMerkleTree(dep_pairs, "cwd", &parallelDirectory, &parallelFiles);
+    RECC_MAX_THREADS = previousMaxThreads;
+
+    EXPECT_EQ(serialDirectory.to_digest(), parallelDirectory.to_digest());
+    EXPECT_EQ(serialFiles.size(), 50);
+    EXPECT_EQ(parallelFiles.size(), 50);
+}
+
 TEST_F(ActionBuilderTestFixture, GetDependenciesVerifyMetricsCollection)
 {
     const std::vector<std::string> recc_args = {"./gcc", "-c", "hello.cpp",
@@ -314,6 +352,7 @@ TEST_F(ActionBuilderTestFixture, WorkingDirectory)
 TEST_F(ActionBuilderTestFixture, PathsArePrefixed)
 {
     RECC_PREFIX_REPLACEMENT = {{"/usr/bin", "/opt"}};
+    Env::compile_path_matchers();
     const auto working_directory = "/usr/bin";
 
     const proto::Command command_proto =
@@ -383,7 +422,7 @@ TEST_P(ActionBuilderTestFixture, ActionContainsExpectedCompileCommand)
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
 
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     ASSERT_NE(actionPtr, nullptr);
 
@@ -409,7 +448,7 @@ TEST_P(ActionBuilderTestFixture, ActionCompileCommandGoldenDigests)
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
 
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     /** Modifying these hash values should be done carefully and only if
@@ -444,7 +483,7 @@ TEST_P(ActionBuilderTestFixture, ActionNonCompileCommandGoldenDigests)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     /** Modifying these hash values should be done carefully and only if
      * absolutely required.
@@ -542,7 +581,7 @@ TEST_P(ActionBuilderTestFixture, ActionContainsExpectedMerkleTree)
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
 
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     ASSERT_NE(actionPtr, nullptr);
 
@@ -584,7 +623,7 @@ TEST_P(ActionBuilderTestFixture, ActionBuiltGoldenDigests)
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
 
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     ASSERT_NE(actionPtr, nullptr);
 
@@ -620,7 +659,7 @@ TEST_P(ActionBuilderTestFixture, NonCompileCommand)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     ASSERT_EQ(actionPtr, nullptr);
 }
@@ -641,7 +680,7 @@ TEST_P(ActionBuilderTestFixture, NonCompileCommandForceRemoteMerkleTree)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     MerkleTree expected_tree;
@@ -687,7 +726,7 @@ TEST_P(ActionBuilderTestFixture, NonCompileCommandForceRemoteGoldenDigests)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     const auto digest = DigestGenerator::make_digest(*actionPtr);
@@ -738,7 +777,7 @@ TEST_P(ActionBuilderTestFixture, AbsolutePathActionBuilt)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
@@ -794,7 +833,7 @@ TEST_P(ActionBuilderTestFixture, RelativePathAndAbsolutePathWithCwd)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
@@ -832,13 +871,14 @@ TEST_P(ActionBuilderTestFixture, ExcludePath)
                           "hello.cpp"};
     RECC_DEPS_GLOBAL_PATHS = 1;
     RECC_DEPS_EXCLUDE_PATHS = {"/usr/include"};
+    Env::compile_path_matchers();
 
     const std::vector<std::string> recc_args = {"/my/fake/gcc", "-c",
                                                 "hello.cpp", "-o", "hello.o"};
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
@@ -877,13 +917,14 @@ TEST_P(ActionBuilderTestFixture, ExcludePathMultipleMatchOne)
                           "hello.cpp"};
     RECC_DEPS_GLOBAL_PATHS = 1;
     RECC_DEPS_EXCLUDE_PATHS = {"/foo/bar", "/usr/include"};
+    Env::compile_path_matchers();
 
     std::vector<std::string> recc_args = {"/my/fake/gcc", "-c", "hello.cpp",
                                           "-o", "hello.o"};
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
@@ -925,13 +966,14 @@ TEST_P(ActionBuilderTestFixture, ExcludePathNoMatch)
                           "hello.cpp"};
     RECC_DEPS_GLOBAL_PATHS = 1;
     RECC_DEPS_EXCLUDE_PATHS = {"/foo/bar"};
+    Env::compile_path_matchers();
 
     const std::vector<std::string> recc_args = {"/my/fake/gcc", "-c",
                                                 "hello.cpp", "-o", "hello.o"};
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
@@ -975,13 +1017,14 @@ TEST_P(ActionBuilderTestFixture, ExcludePathSingleWithMultiInput)
                           "hello.cpp"};
     RECC_DEPS_GLOBAL_PATHS = 1;
     RECC_DEPS_EXCLUDE_PATHS = {"/usr/include/net"};
+    Env::compile_path_matchers();
 
     const std::vector<std::string> recc_args = {"/my/fake/gcc", "-c",
                                                 "hello.cpp", "-o", "hello.o"};
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     // Verify the command working directory matches
     verify_working_directory(actionPtr->command_digest(), expected_working_dir,
@@ -1024,7 +1067,7 @@ TEST_P(ActionBuilderTestFixture, EmptyWorkingDirInputRoot)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
@@ -1053,7 +1096,7 @@ TEST_P(ActionBuilderTestFixture, UnrelatedOutputDirectory)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
 
     ASSERT_EQ(actionPtr, nullptr);
 }
@@ -1083,6 +1126,7 @@ TEST_P(ActionBuilderTestFixture, SimplePathReplacement)
 
     // Replace all paths to /usr/include to /usr
     RECC_PREFIX_REPLACEMENT = {{"/usr/include", "/usr"}};
+    Env::compile_path_matchers();
 
     RECC_DEPS_OVERRIDE = {"/usr/include/ctype.h", "hello.cpp"};
     RECC_DEPS_GLOBAL_PATHS = 1;
@@ -1092,7 +1136,7 @@ TEST_P(ActionBuilderTestFixture, SimplePathReplacement)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
@@ -1105,6 +1149,36 @@ TEST_P(ActionBuilderTestFixture, SimplePathReplacement)
                        expected_tree.size(), blobs);
 }
 
+/**
+ * Dependency paths are replaced once, so a replaced path that matches
+ * another prefix is left alone.
+ */
+TEST_F(ActionBuilderTestFixture, ChainedPathReplacementAppliedOnce)
+{
+    RECC_PREFIX_REPLACEMENT = {{"/usr/include", "/opt/include"},
+                               {"/opt", "/srv"}};
+    Env::compile_path_matchers();
+
+    RECC_DEPS_OVERRIDE = {"/usr/include/ctype.h", "hello.cpp"};
+    RECC_DEPS_GLOBAL_PATHS = 1;
+
+    const std::vector<std::string> recc_args = {"/my/fake/gcc", "-c",
+                                                "hello.cpp", "-o", "hello.o"};
+    const auto command =
+        ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
+    const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
+                                                      &digest_to_filepaths);
+    ASSERT_NE(actionPtr, nullptr);
+
+    const MerkleTree expected_tree = {
+        {{"files", {"hello.cpp"}}, {"directories", {"opt"}}},
+        {{"directories", {"include"}}},
+        {{"files", {"ctype.h"}}}};
+    size_t startIndex = 0;
+    verify_merkle_tree(actionPtr->input_root_digest(), expected_tree,
+                       startIndex, expected_tree.size(), blobs);
+}
+
 /**
  * Test that absolute paths are made relative to RECC_PROJECT_ROOT
  * and that if a working_dir_prefix is specified that it is prepended
@@ -1135,7 +1209,7 @@ TEST_P(ActionBuilderTestFixture, PathsMadeRelativeToProjectRoot)
     const auto command =
         ParsedCommandFactory::createParsedCommand(recc_args, cwd.c_str());
     const auto actionPtr = ActionBuilder::BuildAction(command, cwd, &blobs,
-                                                      &digest_to_filecontents);
+                                                      &digest_to_filepaths);
     ASSERT_NE(actionPtr, nullptr);
 
     // Verify the command working directory matches
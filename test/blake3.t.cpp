@@ -0,0 +1,239 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <blake3.h>
+#include <blake3_impl.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef void (*HashManyFn)(const uint8_t *const *inputs, size_t num_inputs,
+                           size_t blocks, const uint32_t key[8],
+                           uint64_t counter, bool increment_counter,
+                           uint8_t flags, uint8_t flags_start,
+                           uint8_t flags_end, uint8_t *out);
+
+typedef void (*CompressInPlaceFn)(uint32_t cv[8],
+                                  const uint8_t block[BLAKE3_BLOCK_LEN],
+                                  uint8_t block_len, uint64_t counter,
+                                  uint8_t flags);
+
+typedef void (*CompressXofFn)(const uint32_t cv[8],
+                              const uint8_t block[BLAKE3_BLOCK_LEN],
+                              uint8_t block_len, uint64_t counter,
+                              uint8_t flags, uint8_t out[64]);
+
+std::vector<uint8_t> randomBytes(size_t length)
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist(0, 255);
+    std::vector<uint8_t> bytes(length);
+    for (auto &byte : bytes) {
+        byte = static_cast<uint8_t>(dist(rng));
+    }
+    return bytes;
+}
+
+const uint32_t s_key[8] = {0x01234567, 0x89abcdef, 0xfedcba98, 0x76543210,
+                           0x0f1e2d3c, 0x4b5a6978, 0x8796a5b4, 0xc3d2e1f0};
+
+// Every backend must agree with the portable implementation for any number
+// of inputs, including the remainders that don't fill a whole SIMD batch.
+void expectHashManyMatchesPortable(HashManyFn hashMany)
+{
+    const auto data = randomBytes(48 * BLAKE3_CHUNK_LEN);
+    for (size_t blocks : {1, 2, 16}) {
+        for (size_t numInputs = 1; numInputs <= 33; ++numInputs) {
+            std::vector<const uint8_t *> inputs;
+            for (size_t i = 0; i < numInputs; ++i) {
+                // Deliberately misaligned
+                inputs.push_back(&data[i * BLAKE3_CHUNK_LEN + (i % 7)]);
+            }
+            std::vector<uint8_t> expected(numInputs * BLAKE3_OUT_LEN);
+            std::vector<uint8_t> actual(numInputs * BLAKE3_OUT_LEN);
+            blake3_hash_many_portable(inputs.data(), numInputs, blocks, s_key,
+                                      0, true, 0, CHUNK_START, CHUNK_END,
+                                      expected.data());
+            hashMany(inputs.data(), numInputs, blocks, s_key, 0, true, 0,
+                     CHUNK_START, CHUNK_END, actual.data());
+            EXPECT_EQ(expected, actual)
+                << "blocks=" << blocks << " numInputs=" << numInputs;
+        }
+    }
+}
+
+void expectCompressMatchesPortable(CompressInPlaceFn compressInPlace,
+                                   CompressXofFn compressXof)
+{
+    const auto data = randomBytes(BLAKE3_BLOCK_LEN);
+    const uint8_t allFlags[] = {0, CHUNK_START | CHUNK_END | ROOT, PARENT};
+    for (uint8_t blockLen : {0, 1, 63, 64}) {
+        for (uint8_t flags : allFlags) {
+            uint32_t expected[8], actual[8];
+            std::copy(s_key, s_key + 8, expected);
+            std::copy(s_key, s_key + 8, actual);
+            blake3_compress_in_place_portable(expected, data.data(), blockLen,
+                                              0, flags);
+            compressInPlace(actual, data.data(), blockLen, 0, flags);
+            EXPECT_TRUE(std::equal(expected, expected + 8, actual));
+
+            uint8_t expectedXof[64], actualXof[64];
+            blake3_compress_xof_portable(s_key, data.data(), blockLen, 0,
+                                         flags, expectedXof);
+            compressXof(s_key, data.data(), blockLen, 0, flags, actualXof);
+            EXPECT_TRUE(std::equal(expectedXof, expectedXof + 64, actualXof));
+        }
+    }
+}
+
+std::string hashPattern(size_t length)
+{
+    std::vector<uint8_t> input(length);
+    for (size_t i = 0; i < length; ++i) {
+        input[i] = static_cast<uint8_t>(i % 251);
+    }
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, input.data(), input.size());
+    uint8_t out[BLAKE3_OUT_LEN];
+    blake3_hasher_finalize(&hasher, out, BLAKE3_OUT_LEN);
+
+    std::string hex;
+    char byte[3];
+    for (uint8_t b : out) {
+        snprintf(byte, sizeof(byte), "%02x", b);
+        hex += byte;
+    }
+    return hex;
+}
+
+} // namespace
+
+#if defined(IS_X86) && (defined(__GNUC__) || defined(__clang__))
+#if !defined(BLAKE3_NO_SSE2)
+TEST(Blake3BackendTest, SSE2MatchesPortable)
+{
+    if (!__builtin_cpu_supports("sse2")) {
+        return;
+    }
+    expectHashManyMatchesPortable(blake3_hash_many_sse2);
+    expectCompressMatchesPortable(blake3_compress_in_place_sse2,
+                                  blake3_compress_xof_sse2);
+}
+#endif
+
+#if !defined(BLAKE3_NO_SSE41)
+TEST(Blake3BackendTest, SSE41MatchesPortable)
+{
+    if (!__builtin_cpu_supports("sse4.1")) {
+        return;
+    }
+    expectHashManyMatchesPortable(blake3_hash_many_sse41);
+    expectCompressMatchesPortable(blake3_compress_in_place_sse41,
+                                  blake3_compress_xof_sse41);
+}
+#endif
+
+#if !defined(BLAKE3_NO_AVX2)
+TEST(Blake3BackendTest, AVX2MatchesPortable)
+{
+    if (!__builtin_cpu_supports("avx2")) {
+        return;
+    }
+    expectHashManyMatchesPortable(blake3_hash_many_avx2);
+}
+#endif
+
+#if !defined(BLAKE3_NO_AVX512)
+TEST(Blake3BackendTest, AVX512MatchesPortable)
+{
+    if (!__builtin_cpu_supports("avx512f") ||
+        !__builtin_cpu_supports("avx512vl")) {
+        return;
+    }
+    expectHashManyMatchesPortable(blake3_hash_many_avx512);
+    expectCompressMatchesPortable(blake3_compress_in_place_avx512,
+                                  blake3_compress_xof_avx512);
+}
+#endif
+#endif
+
+#if defined(BLAKE3_USE_NEON)
+TEST(Blake3BackendTest, NEONMatchesPortable)
+{
+    expectHashManyMatchesPortable(blake3_hash_many_neon);
+}
+#endif
+
+// Known answers for the zero-chunk-counter variant, produced by the portable
+// implementation. These go through blake3_dispatch.cpp, so they cover
+// whichever backend the host selects, across chunk and SIMD batch edges.
+TEST(Blake3HasherTest, KnownAnswers)
+{
+    const std::vector<std::pair<size_t, std::string>> cases = {
+        {0,
+         "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+        {1,
+         "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+        {64,
+         "4eed7141ea4a5cd4b788606bd23f46e212af9cacebacdc7d1f4c6dc7f2511b98"},
+        {1025,
+         "c8f3d3293fc52e525bcb33e182a4e160a5bdf219b951bac5e7b41da5c737f1d5"},
+        {4096,
+         "cbd15819798dcda8a686594582fb0dbe89bc2c053a4caaae9d0ace41d1bd54dc"},
+        {31744,
+         "ab08a58e2f25418bdc944ec1f2cf473d46781e59180952ccc110b69deccb5d70"},
+        {100000,
+         "6e5e3bd4fdf1cfc00b737f09df32f160ab2c551862bc50e3d6875682dfa9d157"},
+        {1048583,
+         "6fb968637457c3fa85eb171124f10fe804d13ba3e2d573cf69f536722916561b"},
+    };
+    for (const auto &testCase : cases) {
+        EXPECT_EQ(hashPattern(testCase.first), testCase.second)
+            << "length=" << testCase.first;
+    }
+}
+
+TEST(Blake3HasherTest, ParallelUpdateMatchesSerial)
+{
+    const auto data = randomBytes(9 * 1024 * 1024 + 123);
+    for (size_t length : {size_t(0), size_t(1025), size_t(1024 * 1024),
+                          data.size()}) {
+        blake3_hasher serial;
+        blake3_hasher_init(&serial);
+        blake3_hasher_update(&serial, data.data(), length);
+        uint8_t expected[BLAKE3_OUT_LEN];
+        blake3_hasher_finalize(&serial, expected, BLAKE3_OUT_LEN);
+
+        for (size_t threads : {0, 1, 2, 3, 8}) {
+            blake3_hasher parallel;
+            blake3_hasher_init(&parallel);
+            blake3_hasher_update_parallel(&parallel, data.data(), length,
+                                          threads);
+            uint8_t actual[BLAKE3_OUT_LEN];
+            blake3_hasher_finalize(&parallel, actual, BLAKE3_OUT_LEN);
+            EXPECT_TRUE(
+                std::equal(expected, expected + BLAKE3_OUT_LEN, actual))
+                << "length=" << length << " threads=" << threads;
+        }
+    }
+}
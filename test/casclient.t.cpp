@@ -29,7 +29,13 @@
 #include <google/protobuf/util/message_differencer.h>
 #include <grpcpp/test/mock_stream.h>
 #include <gtest/gtest.h>
+
+#include <chrono>
+#include <mutex>
 #include <regex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #define TIMER_NAME_FIND_MISSING_BLOBS "recc.find_missing_blobs"
 #define TIMER_NAME_UPLOAD_MISSING_BLOBS "recc.upload_missing_blobs"
@@ -130,8 +136,8 @@ TEST_F(CasClientFixture, AlreadyUploadedFile)
     std::string path = tmpdir.name() + std::string("/abc.txt");
     buildboxcommon::FileUtils::writeFileAtomically(path, "abc");
 
-    digest_string_umap digest_to_filecontents;
-    digest_to_filecontents[make_digest(abc)] = path;
+    digest_string_umap digest_to_filepaths;
+    digest_to_filepaths[make_digest(abc)] = path;
     proto::FindMissingBlobsResponse response;
 
     EXPECT_CALL(*casStub,
@@ -139,7 +145,45 @@ TEST_F(CasClientFixture, AlreadyUploadedFile)
         .WillOnce(DoAll(SetArgPointee<2>(response), Return(grpc::Status::OK)));
     EXPECT_CALL(*casStub, BatchUpdateBlobs(_, _, _)).Times(0);
 
-    casClient.upload_resources({}, digest_to_filecontents);
+    casClient.upload_resources({}, digest_to_filepaths);
+}
+
+TEST_F(CasClientFixture, FindMissingBlobsInShards)
+{
+    digest_string_umap blobs;
+    for (int i = 0; i < 40000; ++i) {
+        const std::string blob = std::to_string(i);
+        blobs[make_digest(blob)] = blob;
+    }
+
+    // Each request reports its first digest as missing.
+    std::mutex mutex;
+    std::set<std::string> requested;
+    std::unordered_set<DigestKey> expectedMissing;
+    EXPECT_CALL(*casStub, FindMissingBlobs(_, _, _))
+        .Times(AtLeast(3))
+        .WillRepeatedly(
+            Invoke([&](grpc::ClientContext *,
+                       const proto::FindMissingBlobsRequest &request,
+                       proto::FindMissingBlobsResponse *response) {
+                EXPECT_LE(request.blob_digests_size(), 16384);
+                EXPECT_LE(request.ByteSizeLong(), 2 * 1024 * 1024);
+                *response->add_missing_blob_digests() =
+                    request.blob_digests(0);
+
+                const std::lock_guard<std::mutex> lock(mutex);
+                for (const auto &digest : request.blob_digests()) {
+                    EXPECT_TRUE(
+                        requested.insert(digest.SerializeAsString()).second);
+                }
+                expectedMissing.insert(request.blob_digests(0));
+                return grpc::Status::OK;
+            }));
+
+    const auto missing = casClient.find_missing_resources(blobs, {});
+
+    EXPECT_EQ(blobs.size(), requested.size());
+    EXPECT_EQ(expectedMissing, missing);
 }
 
 TEST_F(CasClientFixture, NewBlobUpload)
@@ -174,9 +218,8 @@ TEST_F(CasClientFixture, NewFileUpload)
     std::string path = tmpdir.name() + std::string("/abc.txt");
     buildboxcommon::FileUtils::writeFileAtomically(path, "abc");
 
-    digest_string_umap digest_to_filecontents;
-    digest_to_filecontents[make_digest(abc)] =
-        buildboxcommon::FileUtils::getFileContents(path.c_str());
+    digest_string_umap digest_to_filepaths;
+    digest_to_filepaths[make_digest(abc)] = path;
     proto::FindMissingBlobsResponse response;
     *response.add_missing_blob_digests() = make_digest(abc);
 
@@ -192,7 +235,93 @@ TEST_F(CasClientFixture, NewFileUpload)
         .WillOnce(DoAll(SetArgPointee<2>(updateBlobsResponse),
                         Return(grpc::Status::OK)));
 
-    casClient.upload_resources({}, digest_to_filecontents);
+    casClient.upload_resources({}, digest_to_filepaths);
+}
+
+TEST_F(CasClientFixture, BlobsPackedIntoFewestBatches)
+{
+    proto::ServerCapabilities serverCapabilities;
+    auto cacheCapabilities = serverCapabilities.mutable_cache_capabilities();
+    const int64_t maxBatchSize = 1100;
+    cacheCapabilities->set_max_batch_total_size_bytes(maxBatchSize);
+    for (const auto &entry : DigestGenerator::stringToDigestFunctionMap()) {
+        cacheCapabilities->add_digest_function(entry.second);
+    }
+    EXPECT_CALL(*capabilitiesStub, GetCapabilities(_, _, _))
+        .WillOnce(DoAll(SetArgPointee<2>(serverCapabilities),
+                        Return(grpc::Status::OK)));
+    casClient.setUpFromServerCapabilities();
+
+    // No two large blobs fit in a batch, and neither do three small ones,
+    // but each large blob fits with a small one.
+    digest_string_umap blobs;
+    for (char c = 'a'; c < 'g'; ++c) {
+        const std::string largeBlob(480, c);
+        const std::string smallBlob(320, c);
+        blobs[make_digest(largeBlob)] = largeBlob;
+        blobs[make_digest(smallBlob)] = smallBlob;
+    }
+
+    EXPECT_CALL(*casStub, FindMissingBlobs(_, _, _))
+        .WillRepeatedly(Invoke([](grpc::ClientContext *,
+                                  const proto::FindMissingBlobsRequest &request,
+                                  proto::FindMissingBlobsResponse *response) {
+            *response->mutable_missing_blob_digests() = request.blob_digests();
+            return grpc::Status::OK;
+        }));
+
+    std::mutex mutex;
+    std::set<std::string> uploaded;
+    EXPECT_CALL(*casStub, BatchUpdateBlobs(_, _, _))
+        .Times(6)
+        .WillRepeatedly(
+            Invoke([&](grpc::ClientContext *,
+                       const proto::BatchUpdateBlobsRequest &request,
+                       proto::BatchUpdateBlobsResponse *response) {
+                EXPECT_LE(request.ByteSizeLong(), maxBatchSize);
+                const std::lock_guard<std::mutex> lock(mutex);
+                for (const auto &blobRequest : request.requests()) {
+                    EXPECT_TRUE(uploaded.insert(blobRequest.data()).second);
+                    *response->add_responses()->mutable_digest() =
+                        blobRequest.digest();
+                }
+                return grpc::Status::OK;
+            }));
+
+    casClient.upload_resources(blobs, {});
+
+    EXPECT_EQ(blobs.size(), uploaded.size());
+}
+
+TEST_F(CasClientFixture, FailedBlobUploadThrows)
+{
+    digest_string_umap blobs;
+    blobs[make_digest(abc)] = abc;
+    blobs[make_digest(defg)] = defg;
+    proto::FindMissingBlobsResponse response;
+    *response.add_missing_blob_digests() = make_digest(abc);
+    *response.add_missing_blob_digests() = make_digest(defg);
+
+    EXPECT_CALL(*casStub, FindMissingBlobs(_, _, _))
+        .WillOnce(DoAll(SetArgPointee<2>(response), Return(grpc::Status::OK)));
+
+    // Only one of the blobs is rejected, the other one is still uploaded:
+    proto::BatchUpdateBlobsResponse updateBlobsResponse;
+    auto blobResponse = updateBlobsResponse.add_responses();
+    *blobResponse->mutable_digest() = make_digest(abc);
+    blobResponse->mutable_status()->set_code(
+        google::rpc::Code::RESOURCE_EXHAUSTED);
+    *updateBlobsResponse.add_responses()->mutable_digest() = make_digest(defg);
+    EXPECT_CALL(*casStub,
+                BatchUpdateBlobs(
+                    _,
+                    AllOf(HasUpdateBlobRequest(make_digest(abc), abc),
+                          HasUpdateBlobRequest(make_digest(defg), defg)),
+                    _))
+        .WillOnce(DoAll(SetArgPointee<2>(updateBlobsResponse),
+                        Return(grpc::Status::OK)));
+
+    EXPECT_THROW(casClient.upload_resources(blobs, {}), std::runtime_error);
 }
 
 ACTION_P3(AddWriteRequestData, blob, name, isComplete)
@@ -255,6 +384,216 @@ TEST_F(CasClientFixture, LargeBlobUpload)
     EXPECT_TRUE(regex_match(name, std::regex(uploadNameRegex)));
 }
 
+TEST_F(CasClientFixture, LargeFileUpload)
+{
+    auto writer = new grpc::testing::MockClientWriter<
+        google::bytestream::WriteRequest>();
+
+    buildboxcommon::TemporaryDirectory tmpdir;
+    const std::string path = tmpdir.name() + std::string("/big.txt");
+    std::string bigBlob;
+    for (int i = 0; bigBlob.size() < 5000000; ++i) {
+        bigBlob += std::to_string(i);
+    }
+    buildboxcommon::FileUtils::writeFileAtomically(path, bigBlob);
+
+    digest_string_umap digest_to_filepaths;
+    const auto bigBlobDigest = make_digest(bigBlob);
+    digest_to_filepaths[bigBlobDigest] = path;
+    proto::FindMissingBlobsResponse response;
+    *response.add_missing_blob_digests() = bigBlobDigest;
+
+    EXPECT_CALL(*casStub, FindMissingBlobs(_, HasBlobDigest(bigBlobDigest), _))
+        .WillOnce(DoAll(SetArgPointee<2>(response), Return(grpc::Status::OK)));
+
+    google::bytestream::WriteResponse writeResponse;
+    writeResponse.set_committed_size(
+        static_cast<google::protobuf::int64>(bigBlob.length()));
+
+    EXPECT_CALL(*byteStreamStub, WriteRaw(_, _))
+        .WillOnce(DoAll(SetArgPointee<1>(writeResponse), Return(writer)));
+
+    std::string storedBlob;
+    std::string name;
+    bool isComplete = false;
+    EXPECT_CALL(*writer, Write(_, _))
+        .WillRepeatedly(
+            DoAll(AddWriteRequestData(&storedBlob, &name, &isComplete),
+                  Return(true)));
+    EXPECT_CALL(*writer, WritesDone()).WillOnce(Return(true));
+    EXPECT_CALL(*writer, Finish()).WillOnce(Return(grpc::Status::OK));
+
+    casClient.upload_resources({}, digest_to_filepaths);
+
+    EXPECT_TRUE(isComplete);
+    EXPECT_EQ(storedBlob, bigBlob);
+}
+
+TEST_F(CasClientFixture, LargeBlobUploadResumes)
+{
+    const int oldRetryLimit = RECC_RETRY_LIMIT;
+    RECC_RETRY_LIMIT = 1;
+
+    auto brokenWriter = new grpc::testing::MockClientWriter<
+        google::bytestream::WriteRequest>();
+    auto writer = new grpc::testing::MockClientWriter<
+        google::bytestream::WriteRequest>();
+
+    std::string bigBlob;
+    for (int i = 0; bigBlob.size() < 5000000; ++i) {
+        bigBlob += std::to_string(i);
+    }
+    const auto bigBlobDigest = make_digest(bigBlob);
+
+    google::bytestream::WriteResponse writeResponse;
+    writeResponse.set_committed_size(
+        static_cast<google::protobuf::int64>(bigBlob.length()));
+    EXPECT_CALL(*byteStreamStub, WriteRaw(_, _))
+        .WillOnce(Return(brokenWriter))
+        .WillOnce(DoAll(SetArgPointee<1>(writeResponse), Return(writer)));
+
+    // The first write fails after one chunk, of which the server only
+    // committed half:
+    std::string storedBlob;
+    std::string name;
+    bool isComplete = false;
+    EXPECT_CALL(*brokenWriter, Write(_, _))
+        .WillOnce(DoAll(AddWriteRequestData(&storedBlob, &name, &isComplete),
+                        Return(true)))
+        .WillOnce(DoAll(AddWriteRequestData(&storedBlob, &name, &isComplete),
+                        Return(true)))
+        .WillOnce(Return(false));
+    EXPECT_CALL(*brokenWriter, WritesDone()).WillOnce(Return(true));
+    EXPECT_CALL(*brokenWriter, Finish())
+        .WillOnce(Return(grpc::Status(grpc::UNAVAILABLE, "unavailable")));
+
+    EXPECT_CALL(*byteStreamStub, QueryWriteStatus(_, _, _))
+        .WillOnce(
+            Invoke([&](grpc::ClientContext *,
+                       const google::bytestream::QueryWriteStatusRequest
+                           &request,
+                       google::bytestream::QueryWriteStatusResponse *response) {
+                EXPECT_EQ(name, request.resource_name());
+                EXPECT_FALSE(storedBlob.empty());
+                storedBlob.resize(storedBlob.size() / 2);
+                response->set_committed_size(
+                    static_cast<google::protobuf::int64>(storedBlob.size()));
+                return grpc::Status::OK;
+            }));
+
+    // The second resumes from there:
+    EXPECT_CALL(*writer, Write(_, _))
+        .WillRepeatedly(
+            DoAll(AddWriteRequestData(&storedBlob, &name, &isComplete),
+                  Return(true)));
+    EXPECT_CALL(*writer, WritesDone()).WillOnce(Return(true));
+    EXPECT_CALL(*writer, Finish()).WillOnce(Return(grpc::Status::OK));
+
+    casClient.upload_blob(bigBlobDigest, bigBlob);
+
+    EXPECT_TRUE(isComplete);
+    EXPECT_EQ(storedBlob, bigBlob);
+
+    RECC_RETRY_LIMIT = oldRetryLimit;
+}
+
+TEST(ChunkSizerTest, ChunksTakeAQuarterSecond)
+{
+    const int64_t mebibyte = 1024 * 1024;
+    ChunkSizer sizer(mebibyte, 64 * 1024, 3 * mebibyte);
+    EXPECT_EQ(sizer.size(), mebibyte);
+
+    sizer.recordProgress(mebibyte, std::chrono::seconds(1));
+    EXPECT_EQ(sizer.size(), mebibyte / 4);
+
+    // The throughput is averaged with what was seen before.
+    sizer.recordProgress(mebibyte, std::chrono::milliseconds(1));
+    EXPECT_EQ(sizer.size(), 3 * mebibyte);
+
+    sizer.recordFailure();
+    EXPECT_EQ(sizer.size(), 3 * mebibyte / 2);
+}
+
+TEST(ChunkSizerTest, SizeIsBounded)
+{
+    ChunkSizer sizer(1024 * 1024, 64 * 1024, 3 * 1024 * 1024);
+    sizer.recordProgress(1024, std::chrono::seconds(10));
+    EXPECT_EQ(sizer.size(), 64 * 1024);
+}
+
+TEST_F(CasClientFixture, SlowUploadShrinksChunksOfLaterUploads)
+{
+    // The server takes a while to acknowledge a first blob that is sent
+    // in a single chunk...
+    const std::string slowBlob(256 * 1024, 's');
+    auto slowWriter = new grpc::testing::MockClientWriter<
+        google::bytestream::WriteRequest>();
+    google::bytestream::WriteResponse slowResponse;
+    slowResponse.set_committed_size(
+        static_cast<google::protobuf::int64>(slowBlob.size()));
+    EXPECT_CALL(*slowWriter, Write(_, _)).WillRepeatedly(Return(true));
+    EXPECT_CALL(*slowWriter, WritesDone()).WillOnce(Return(true));
+    EXPECT_CALL(*slowWriter, Finish()).WillOnce(InvokeWithoutArgs([] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        return grpc::Status::OK;
+    }));
+
+    // ...so the next blob is sent in chunks smaller than the initial 1 MiB.
+    const std::string blob(1024 * 1024, 'b');
+    auto writer = new grpc::testing::MockClientWriter<
+        google::bytestream::WriteRequest>();
+    google::bytestream::WriteResponse response;
+    response.set_committed_size(
+        static_cast<google::protobuf::int64>(blob.size()));
+    std::vector<size_t> chunkSizes;
+    EXPECT_CALL(*writer, Write(_, _))
+        .WillRepeatedly(Invoke(
+            [&chunkSizes](const google::bytestream::WriteRequest &request,
+                          grpc::WriteOptions) {
+                if (!request.data().empty()) {
+                    chunkSizes.push_back(request.data().size());
+                }
+                return true;
+            }));
+    EXPECT_CALL(*writer, WritesDone()).WillOnce(Return(true));
+    EXPECT_CALL(*writer, Finish()).WillOnce(Return(grpc::Status::OK));
+
+    EXPECT_CALL(*byteStreamStub, WriteRaw(_, _))
+        .WillOnce(DoAll(SetArgPointee<1>(slowResponse), Return(slowWriter)))
+        .WillOnce(DoAll(SetArgPointee<1>(response), Return(writer)));
+
+    casClient.upload_blob(make_digest(slowBlob), slowBlob);
+    casClient.upload_blob(make_digest(blob), blob);
+
+    ASSERT_GT(chunkSizes.size(), 1);
+    for (const size_t chunkSize : chunkSizes) {
+        EXPECT_LT(chunkSize, blob.size());
+    }
+}
+
+TEST_F(CasClientFixture, CancelledUploadSendsNothing)
+{
+    digest_string_umap blobs;
+    blobs[make_digest(abc)] = abc;
+    const std::string bigBlob(3 * 1024 * 1024, 'q');
+    const auto bigBlobDigest = make_digest(bigBlob);
+    blobs[bigBlobDigest] = bigBlob;
+    proto::FindMissingBlobsResponse response;
+    *response.add_missing_blob_digests() = make_digest(abc);
+    *response.add_missing_blob_digests() = bigBlobDigest;
+
+    // Cancelled while the missing blobs are looked up, as by a background
+    // upload that is no longer needed.
+    EXPECT_CALL(*casStub, FindMissingBlobs(_, _, _))
+        .WillOnce(DoAll(SetArgPointee<2>(response),
+                        InvokeWithoutArgs([this] { grpcContext.cancel(); }),
+                        Return(grpc::Status::OK)));
+    EXPECT_CALL(*casStub, BatchUpdateBlobs(_, _, _)).Times(0);
+    EXPECT_CALL(*byteStreamStub, WriteRaw(_, _)).Times(0);
+
+    EXPECT_THROW(casClient.upload_resources(blobs, {}), std::runtime_error);
+}
+
 TEST_F(CasClientFixture, FetchBlob)
 {
     const auto digest = make_digest(abc);
@@ -321,6 +660,99 @@ TEST_F(CasClientFixture, FetchBlobResumeDownload)
     EXPECT_EQ(blob, abc);
 }
 
+TEST_F(CasClientFixture, FetchBlobsBatchedAndStreamed)
+{
+    proto::ServerCapabilities serverCapabilities;
+    auto cacheCapabilities = serverCapabilities.mutable_cache_capabilities();
+    cacheCapabilities->set_max_batch_total_size_bytes(1100);
+    for (const auto &entry : DigestGenerator::stringToDigestFunctionMap()) {
+        cacheCapabilities->add_digest_function(entry.second);
+    }
+    EXPECT_CALL(*capabilitiesStub, GetCapabilities(_, _, _))
+        .WillOnce(DoAll(SetArgPointee<2>(serverCapabilities),
+                        Return(grpc::Status::OK)));
+    casClient.setUpFromServerCapabilities();
+
+    // The small blobs fit in one batch, the large one must be streamed.
+    const std::string largeBlob(2000, 'q');
+    digest_string_umap blobs;
+    std::vector<proto::Digest> digests;
+    for (const auto &blob : {abc, defg, std::string(500, 'x'), largeBlob}) {
+        blobs[make_digest(blob)] = blob;
+        digests.push_back(make_digest(blob));
+    }
+    digests.push_back(make_digest(abc));
+
+    EXPECT_CALL(*casStub, BatchReadBlobs(_, _, _))
+        .WillOnce(Invoke([&](grpc::ClientContext *,
+                             const proto::BatchReadBlobsRequest &request,
+                             proto::BatchReadBlobsResponse *response) {
+            EXPECT_EQ(3, request.digests_size());
+            for (const auto &digest : request.digests()) {
+                auto blobResponse = response->add_responses();
+                *blobResponse->mutable_digest() = digest;
+                blobResponse->set_data(blobs.at(digest));
+                blobResponse->mutable_status();
+            }
+            EXPECT_LE(response->ByteSizeLong(), 1100);
+            return grpc::Status::OK;
+        }));
+
+    google::bytestream::ReadRequest expectedRequest;
+    expectedRequest.set_resource_name(
+        "blobs/" + make_digest(largeBlob).hash_other() + "/2000");
+    google::bytestream::ReadResponse readResponse;
+    readResponse.set_data(largeBlob);
+    auto reader = new grpc::testing::MockClientReader<
+        google::bytestream::ReadResponse>();
+    EXPECT_CALL(*byteStreamStub, ReadRaw(_, MessageEq(expectedRequest)))
+        .WillOnce(Return(reader));
+    EXPECT_CALL(*reader, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(readResponse), Return(true)))
+        .WillOnce(Return(false));
+    EXPECT_CALL(*reader, Finish()).WillOnce(Return(grpc::Status::OK));
+
+    std::mutex mutex;
+    digest_string_umap fetched;
+    casClient.fetch_blobs(
+        digests, [&](const proto::Digest &digest, const std::string &blob) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            EXPECT_TRUE(fetched.emplace(digest, blob).second);
+        });
+
+    EXPECT_EQ(blobs, fetched);
+}
+
+TEST_F(CasClientFixture, FetchBlobsStreamedWithoutCapabilities)
+{
+    // Without the server's batch limit, even small blobs are streamed.
+    EXPECT_CALL(*casStub, BatchReadBlobs(_, _, _)).Times(0);
+
+    google::bytestream::ReadRequest expectedRequest;
+    expectedRequest.set_resource_name(
+        "blobs/" + make_digest(abc).hash_other() + "/3");
+    google::bytestream::ReadResponse readResponse;
+    readResponse.set_data(abc);
+    auto reader = new grpc::testing::MockClientReader<
+        google::bytestream::ReadResponse>();
+    EXPECT_CALL(*byteStreamStub, ReadRaw(_, MessageEq(expectedRequest)))
+        .WillOnce(Return(reader));
+    EXPECT_CALL(*reader, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(readResponse), Return(true)))
+        .WillOnce(Return(false));
+    EXPECT_CALL(*reader, Finish()).WillOnce(Return(grpc::Status::OK));
+
+    digest_string_umap fetched;
+    casClient.fetch_blobs(
+        {make_digest(abc)},
+        [&](const proto::Digest &digest, const std::string &blob) {
+            fetched.emplace(digest, blob);
+        });
+
+    ASSERT_EQ(fetched.size(), 1);
+    EXPECT_EQ(fetched.at(make_digest(abc)), abc);
+}
+
 TEST_F(CasClientFixture, FetchCapabilities)
 {
     proto::CacheCapabilities cacheCapabilities;
@@ -345,6 +777,32 @@ TEST_F(CasClientFixture, FetchCapabilities)
     ASSERT_EQ(casClient.maxTotalBatchSizeBytes(), maxBatchSize);
 }
 
+TEST_F(CasClientFixture, CopyCapabilities)
+{
+    CASClient otherClient(casStub, byteStreamStub, capabilitiesStub,
+                          instanceName, &grpcContext);
+
+    // Nothing to copy until the capabilities were fetched:
+    otherClient.copyServerCapabilities(casClient);
+    ASSERT_FALSE(otherClient.serverCapabilitiesKnown());
+
+    proto::ServerCapabilities serverCapabilities;
+    auto cacheCapabilities = serverCapabilities.mutable_cache_capabilities();
+    cacheCapabilities->set_max_batch_total_size_bytes(123);
+    for (const auto &entry : DigestGenerator::stringToDigestFunctionMap()) {
+        cacheCapabilities->add_digest_function(entry.second);
+    }
+    EXPECT_CALL(*capabilitiesStub, GetCapabilities(_, _, _))
+        .WillOnce(DoAll(SetArgPointee<2>(serverCapabilities),
+                        Return(grpc::Status::OK)));
+    casClient.setUpFromServerCapabilities();
+    ASSERT_TRUE(casClient.serverCapabilitiesKnown());
+
+    otherClient.copyServerCapabilities(casClient);
+    ASSERT_TRUE(otherClient.serverCapabilitiesKnown());
+    ASSERT_EQ(otherClient.maxTotalBatchSizeBytes(), 123);
+}
+
 TEST_F(CasClientFixture, FetchCapabilitiesDigestFunctionNotSupportedThrows)
 {
     proto::CacheCapabilities cacheCapabilities;
@@ -379,6 +837,7 @@ TEST_F(CasClientFixture, FetchCapabilitiesFail)
 
     // A default limit is used:
     ASSERT_GT(casClient.maxTotalBatchSizeBytes(), 0);
+    ASSERT_FALSE(casClient.serverCapabilitiesKnown());
 }
 
 TEST_F(CasClientFixture, VerifyMetricsCollection)
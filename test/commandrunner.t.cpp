@@ -0,0 +1,225 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <casclient.h>
+#include <commandrunner.h>
+#include <env.h>
+#include <fileutils.h>
+#include <grpccontext.h>
+#include <remoteexecutionclient.h>
+
+#include <build/bazel/remote/execution/v2/remote_execution_mock.grpc.pb.h>
+#include <gmock/gmock.h>
+#include <google/bytestream/bytestream_mock.grpc.pb.h>
+#include <google/longrunning/operations_mock.grpc.pb.h>
+#include <grpcpp/test/mock_stream.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+
+using namespace BloombergLP::recc;
+using namespace testing;
+
+/*
+ * Runs commands against the stubs of the fixture below instead of real
+ * servers.
+ */
+class StubCommandRunner : public CommandRunner {
+  public:
+    std::shared_ptr<proto::MockExecutionStub> executionStub;
+    std::shared_ptr<proto::MockContentAddressableStorageStub> casStub;
+    std::shared_ptr<proto::MockCapabilitiesStub> capabilitiesStub;
+    std::shared_ptr<proto::MockActionCacheStub> actionCacheStub;
+    std::shared_ptr<google::longrunning::MockOperationsStub> operationsStub;
+    std::shared_ptr<google::bytestream::MockByteStreamStub> byteStreamStub;
+
+    StubCommandRunner()
+        : executionStub(std::make_shared<proto::MockExecutionStub>()),
+          casStub(
+              std::make_shared<proto::MockContentAddressableStorageStub>()),
+          capabilitiesStub(std::make_shared<proto::MockCapabilitiesStub>()),
+          actionCacheStub(std::make_shared<proto::MockActionCacheStub>()),
+          operationsStub(
+              std::make_shared<google::longrunning::MockOperationsStub>()),
+          byteStreamStub(
+              std::make_shared<google::bytestream::MockByteStreamStub>())
+    {
+    }
+
+  protected:
+    std::unique_ptr<RemoteExecutionClient>
+    remoteExecutionClient(GrpcChannels *, GrpcContext *grpcContext) override
+    {
+        return std::make_unique<RemoteExecutionClient>(
+            executionStub, casStub, capabilitiesStub, actionCacheStub,
+            operationsStub, byteStreamStub, "", grpcContext);
+    }
+
+    std::unique_ptr<CASClient> casClient(GrpcChannels *,
+                                         GrpcContext *grpcContext) override
+    {
+        return std::make_unique<CASClient>(casStub, byteStreamStub,
+                                           capabilitiesStub, "", grpcContext);
+    }
+};
+
+class SpeculativeUploadFixture : public ::testing::Test {
+  protected:
+    StubCommandRunner runner;
+    const std::string cwd;
+    char command[10] = "/bin/true";
+    char *argv[2] = {command, nullptr};
+
+    SpeculativeUploadFixture() : cwd(FileUtils::getCurrentWorkingDirectory())
+    {
+        RECC_SERVER = "http://127.0.0.1:1";
+        RECC_CAS_SERVER = RECC_SERVER;
+        RECC_ACTION_CACHE_SERVER = RECC_SERVER;
+        RECC_FORCE_REMOTE = true;
+        RECC_SPECULATIVE_UPLOAD = true;
+        RECC_CAS_GET_CAPABILITIES = false;
+        RECC_DONT_SAVE_OUTPUT = true;
+        RECC_RETRY_LIMIT = 0;
+    }
+
+    // Report every blob the server is asked about as missing.
+    void expectAllBlobsMissing()
+    {
+        EXPECT_CALL(*runner.casStub, FindMissingBlobs(_, _, _))
+            .WillRepeatedly(
+                Invoke([](grpc::ClientContext *,
+                          const proto::FindMissingBlobsRequest &request,
+                          proto::FindMissingBlobsResponse *response) {
+                    *response->mutable_missing_blob_digests() =
+                        request.blob_digests();
+                    return grpc::Status::OK;
+                }));
+    }
+
+    void expectActionCacheMiss()
+    {
+        EXPECT_CALL(*runner.actionCacheStub, GetActionResult(_, _, _))
+            .WillOnce(Return(grpc::Status(grpc::StatusCode::NOT_FOUND, "")));
+    }
+};
+
+TEST_F(SpeculativeUploadFixture, UploadIgnoredOnActionCacheHit)
+{
+    std::promise<void> cacheQueried;
+    proto::ActionResult cachedResult;
+    cachedResult.set_exit_code(42);
+    EXPECT_CALL(*runner.actionCacheStub, GetActionResult(_, _, _))
+        .WillOnce(Invoke([&](grpc::ClientContext *,
+                             const proto::GetActionResultRequest &,
+                             proto::ActionResult *result) {
+            *result = cachedResult;
+            cacheQueried.set_value();
+            return grpc::Status::OK;
+        }));
+
+    // The upload only gets going once the action cache has answered, and
+    // whatever it manages to send before it's cancelled fails, which must
+    // not matter.
+    std::shared_future<void> cacheQueriedFuture =
+        cacheQueried.get_future().share();
+    EXPECT_CALL(*runner.casStub, FindMissingBlobs(_, _, _))
+        .WillRepeatedly(
+            Invoke([cacheQueriedFuture](
+                       grpc::ClientContext *,
+                       const proto::FindMissingBlobsRequest &request,
+                       proto::FindMissingBlobsResponse *response) {
+                cacheQueriedFuture.wait();
+                *response->mutable_missing_blob_digests() =
+                    request.blob_digests();
+                return grpc::Status::OK;
+            }));
+    EXPECT_CALL(*runner.casStub, BatchUpdateBlobs(_, _, _))
+        .WillRepeatedly(
+            Return(grpc::Status(grpc::StatusCode::INTERNAL, "failed")));
+    EXPECT_CALL(*runner.executionStub, ExecuteRaw(_, _)).Times(0);
+
+    bool runLocally;
+    EXPECT_EQ(runner.run(argv, cwd, &runLocally), 42);
+    EXPECT_FALSE(runLocally);
+}
+
+TEST_F(SpeculativeUploadFixture, ExecuteWaitsForUploadOnActionCacheMiss)
+{
+    expectActionCacheMiss();
+    expectAllBlobsMissing();
+
+    std::atomic<bool> uploaded(false);
+    EXPECT_CALL(*runner.casStub, BatchUpdateBlobs(_, _, _))
+        .WillRepeatedly(Invoke([&](grpc::ClientContext *,
+                                   const proto::BatchUpdateBlobsRequest &,
+                                   proto::BatchUpdateBlobsResponse *) {
+            // Give `Execute()` a chance to jump the gun.
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            uploaded = true;
+            return grpc::Status::OK;
+        }));
+
+    proto::ExecuteResponse executeResponse;
+    executeResponse.mutable_result()->set_exit_code(7);
+    google::longrunning::Operation operation;
+    operation.set_done(true);
+    operation.mutable_response()->PackFrom(executeResponse);
+    auto operationReader =
+        new grpc::testing::MockClientReader<google::longrunning::Operation>();
+    EXPECT_CALL(*operationReader, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(operation), Return(true)));
+    EXPECT_CALL(*operationReader, Finish()).WillOnce(Return(grpc::Status::OK));
+    EXPECT_CALL(*runner.executionStub, ExecuteRaw(_, _))
+        .WillOnce(Invoke([&](grpc::ClientContext *,
+                             const proto::ExecuteRequest &) {
+            EXPECT_TRUE(uploaded);
+            return operationReader;
+        }));
+
+    bool runLocally;
+    EXPECT_EQ(runner.run(argv, cwd, &runLocally), 7);
+    EXPECT_FALSE(runLocally);
+}
+
+TEST_F(SpeculativeUploadFixture, UploadFailureReturnedOnActionCacheMiss)
+{
+    expectActionCacheMiss();
+    expectAllBlobsMissing();
+    EXPECT_CALL(*runner.casStub, BatchUpdateBlobs(_, _, _))
+        .WillRepeatedly(
+            Return(grpc::Status(grpc::StatusCode::INTERNAL, "failed")));
+    EXPECT_CALL(*runner.executionStub, ExecuteRaw(_, _)).Times(0);
+
+    bool runLocally;
+    EXPECT_EQ(runner.run(argv, cwd, &runLocally), RC_INVALID_SERVER_CAPABILITIES);
+    EXPECT_FALSE(runLocally);
+}
+
+TEST_F(SpeculativeUploadFixture, NegativeExitCodeIsNotRunLocally)
+{
+    RECC_SPECULATIVE_UPLOAD = false;
+    proto::ActionResult cachedResult;
+    cachedResult.set_exit_code(-1);
+    EXPECT_CALL(*runner.actionCacheStub, GetActionResult(_, _, _))
+        .WillOnce(DoAll(SetArgPointee<2>(cachedResult),
+                        Return(grpc::Status::OK)));
+
+    bool runLocally;
+    EXPECT_EQ(runner.run(argv, cwd, &runLocally), -1);
+    EXPECT_FALSE(runLocally);
+}
@@ -0,0 +1,263 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <daemonprotocol.h>
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace BloombergLP::recc;
+
+/*
+ * Connects a client and a daemon end over a socketpair, and provides pipes
+ * whose write ends can be passed as the client's descriptors.
+ */
+class DaemonProtocolFixture : public ::testing::Test {
+  protected:
+    int client;
+    int daemon;
+    int pipes[DaemonProtocol::s_fdCount][2];
+    int writeEnds[DaemonProtocol::s_fdCount];
+
+    DaemonProtocolFixture()
+    {
+        int sockets[2];
+        EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+        client = sockets[0];
+        daemon = sockets[1];
+        for (int i = 0; i < DaemonProtocol::s_fdCount; ++i) {
+            EXPECT_EQ(pipe(pipes[i]), 0);
+            writeEnds[i] = pipes[i][1];
+        }
+    }
+
+    ~DaemonProtocolFixture()
+    {
+        close(client);
+        close(daemon);
+        for (int i = 0; i < DaemonProtocol::s_fdCount; ++i) {
+            close(pipes[i][0]);
+            close(pipes[i][1]);
+        }
+    }
+
+    static void appendInteger(std::string *buffer, uint32_t value)
+    {
+        buffer->append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static DaemonProtocol::Request makeRequest()
+    {
+        DaemonProtocol::Request request;
+        request.d_argv = {"gcc", "-c", "hello.c", ""};
+        request.d_cwd = "/home/user/project";
+        request.d_environment = {"RECC_SERVER=localhost:8085", "EMPTY="};
+        return request;
+    }
+};
+
+TEST_F(DaemonProtocolFixture, RequestRoundTrip)
+{
+    const DaemonProtocol::Request sent = makeRequest();
+    ASSERT_TRUE(DaemonProtocol::sendWithFds(
+        client, DaemonProtocol::encodeRequest(sent), writeEnds));
+
+    DaemonProtocol::Request received;
+    int fds[DaemonProtocol::s_fdCount];
+    ASSERT_TRUE(DaemonProtocol::receiveRequest(daemon, &received, fds));
+    EXPECT_EQ(received.d_argv, sent.d_argv);
+    EXPECT_EQ(received.d_cwd, sent.d_cwd);
+    EXPECT_EQ(received.d_environment, sent.d_environment);
+
+    // The descriptors received are the pipes sent, in order.
+    for (int i = 0; i < DaemonProtocol::s_fdCount; ++i) {
+        const char data = static_cast<char>('a' + i);
+        ASSERT_EQ(write(fds[i], &data, 1), 1);
+        close(fds[i]);
+        char readBack = 0;
+        ASSERT_EQ(read(pipes[i][0], &readBack, 1), 1);
+        EXPECT_EQ(readBack, data);
+    }
+}
+
+TEST_F(DaemonProtocolFixture, LargeRequestRoundTrip)
+{
+    // Larger than a socket buffer, so it can't be sent in one go.
+    DaemonProtocol::Request sent = makeRequest();
+    sent.d_environment.push_back("LARGE=" + std::string(4 * 1024 * 1024, 'x'));
+    const std::string message = DaemonProtocol::encodeRequest(sent);
+
+    DaemonProtocol::Request received;
+    int fds[DaemonProtocol::s_fdCount];
+    bool receivedOk = false;
+    std::thread receiver([&]() {
+        receivedOk = DaemonProtocol::receiveRequest(daemon, &received, fds);
+    });
+    EXPECT_TRUE(DaemonProtocol::sendWithFds(client, message, writeEnds));
+    receiver.join();
+
+    ASSERT_TRUE(receivedOk);
+    EXPECT_EQ(received.d_environment, sent.d_environment);
+    for (int i = 0; i < DaemonProtocol::s_fdCount; ++i) {
+        close(fds[i]);
+    }
+}
+
+TEST_F(DaemonProtocolFixture, OversizedRequestRejected)
+{
+    std::string message;
+    appendInteger(&message, DaemonProtocol::s_version);
+    appendInteger(&message, DaemonProtocol::s_maxRequestSize + 1);
+    ASSERT_TRUE(DaemonProtocol::sendWithFds(client, message, writeEnds));
+
+    DaemonProtocol::Request received;
+    int fds[DaemonProtocol::s_fdCount];
+    EXPECT_FALSE(DaemonProtocol::receiveRequest(daemon, &received, fds));
+}
+
+TEST_F(DaemonProtocolFixture, OversizedRequestNotEncoded)
+{
+    DaemonProtocol::Request request = makeRequest();
+    request.d_cwd.assign(DaemonProtocol::s_maxRequestSize, 'x');
+    EXPECT_THROW(DaemonProtocol::encodeRequest(request), std::length_error);
+}
+
+TEST_F(DaemonProtocolFixture, TruncatedRequestRejected)
+{
+    const std::string message =
+        DaemonProtocol::encodeRequest(makeRequest());
+    ASSERT_TRUE(DaemonProtocol::sendWithFds(
+        client, message.substr(0, message.size() - 3), writeEnds));
+    shutdown(client, SHUT_WR);
+
+    DaemonProtocol::Request received;
+    int fds[DaemonProtocol::s_fdCount];
+    EXPECT_FALSE(DaemonProtocol::receiveRequest(daemon, &received, fds));
+}
+
+TEST_F(DaemonProtocolFixture, MalformedRequestRejected)
+{
+    // The size is right, but the strings claim more data than there is.
+    std::string body;
+    appendInteger(&body, 1);
+    appendInteger(&body, 100);
+    std::string message;
+    appendInteger(&message, DaemonProtocol::s_version);
+    appendInteger(&message, static_cast<uint32_t>(body.size()));
+    message += body;
+    ASSERT_TRUE(DaemonProtocol::sendWithFds(client, message, writeEnds));
+
+    DaemonProtocol::Request received;
+    int fds[DaemonProtocol::s_fdCount];
+    EXPECT_FALSE(DaemonProtocol::receiveRequest(daemon, &received, fds));
+}
+
+TEST_F(DaemonProtocolFixture, OtherVersionRejected)
+{
+    std::string message = DaemonProtocol::encodeRequest(makeRequest());
+    message[0] = static_cast<char>(message[0] + 1);
+    ASSERT_TRUE(DaemonProtocol::sendWithFds(client, message, writeEnds));
+
+    DaemonProtocol::Request received;
+    int fds[DaemonProtocol::s_fdCount];
+    EXPECT_FALSE(DaemonProtocol::receiveRequest(daemon, &received, fds));
+}
+
+TEST_F(DaemonProtocolFixture, RequestWithoutFdsRejected)
+{
+    const std::string message =
+        DaemonProtocol::encodeRequest(makeRequest());
+    ASSERT_EQ(write(client, message.data(), message.size()),
+              static_cast<ssize_t>(message.size()));
+
+    DaemonProtocol::Request received;
+    int fds[DaemonProtocol::s_fdCount];
+    EXPECT_FALSE(DaemonProtocol::receiveRequest(daemon, &received, fds));
+}
+
+TEST_F(DaemonProtocolFixture, AcceptanceRoundTrip)
+{
+    ASSERT_TRUE(DaemonProtocol::sendAcceptance(daemon));
+    EXPECT_TRUE(DaemonProtocol::receiveAcceptance(client));
+}
+
+TEST_F(DaemonProtocolFixture, MissingAcceptanceFails)
+{
+    close(daemon);
+    daemon = -1;
+    EXPECT_FALSE(DaemonProtocol::receiveAcceptance(client));
+}
+
+TEST_F(DaemonProtocolFixture, ReplyIsNotAcceptance)
+{
+    // A reply without an acceptance before it is a protocol error.
+    ASSERT_TRUE(DaemonProtocol::sendReply(daemon, false, 0));
+    EXPECT_FALSE(DaemonProtocol::receiveAcceptance(client));
+}
+
+TEST_F(DaemonProtocolFixture, ReplyRoundTrip)
+{
+    for (const int32_t exitCode : {0, 1, 255, -1}) {
+        ASSERT_TRUE(DaemonProtocol::sendReply(daemon, false, exitCode));
+        bool runLocally = true;
+        int32_t received = 12345;
+        ASSERT_TRUE(
+            DaemonProtocol::receiveReply(client, &runLocally, &received));
+        EXPECT_FALSE(runLocally);
+        EXPECT_EQ(received, exitCode);
+    }
+}
+
+TEST_F(DaemonProtocolFixture, RunLocallyReplyRoundTrip)
+{
+    ASSERT_TRUE(DaemonProtocol::sendReply(daemon, true, 0));
+    bool runLocally = false;
+    int32_t received = 12345;
+    ASSERT_TRUE(DaemonProtocol::receiveReply(client, &runLocally, &received));
+    EXPECT_TRUE(runLocally);
+    EXPECT_EQ(received, 0);
+}
+
+TEST_F(DaemonProtocolFixture, TruncatedReplyFails)
+{
+    const char tag = 0;
+    ASSERT_EQ(write(daemon, &tag, 1), 1);
+    close(daemon);
+    daemon = -1;
+    bool runLocally;
+    int32_t received;
+    EXPECT_FALSE(DaemonProtocol::receiveReply(client, &runLocally, &received));
+}
+
+TEST_F(DaemonProtocolFixture, MissingReplyFails)
+{
+    close(daemon);
+    daemon = -1;
+    bool runLocally;
+    int32_t received;
+    EXPECT_FALSE(DaemonProtocol::receiveReply(client, &runLocally, &received));
+}
+
+TEST_F(DaemonProtocolFixture, PeerIsSameUser)
+{
+    EXPECT_TRUE(DaemonProtocol::peerIsSameUser(daemon));
+    EXPECT_TRUE(DaemonProtocol::peerIsSameUser(client));
+}
@@ -13,14 +13,25 @@
 // limitations under the License.
 
 #include <deps.h>
+#include <depscache.h>
 #include <env.h>
 #include <fileutils.h>
 #include <parsedcommand.h>
 
 #include <buildboxcommon_fileutils.h>
+#include <buildboxcommon_temporaryfile.h>
 
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace BloombergLP::recc;
 
 std::set<std::string> normalize_all(const std::set<std::string> &paths)
@@ -32,6 +43,15 @@ std::set<std::string> normalize_all(const std::set<std::string> &paths)
     return result;
 }
 
+void setModificationTime(const std::string &path, time_t time)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    ASSERT_NE(-1, fd);
+    const struct timespec times[2] = {{time, 0}, {time, 0}};
+    EXPECT_EQ(0, futimens(fd, times));
+    close(fd);
+}
+
 // Set in the top-level CMakeLists.txt depending on the platform.
 #ifdef RECC_PLATFORM_COMPILER
 
@@ -201,6 +221,65 @@ TEST(DepsTest, GlobalPathsAllowed)
               normalize_all(Deps::get_file_info(command).d_dependencies));
 }
 
+TEST(DepsTest, CachedDependencies)
+{
+    Env::parse_config_variables();
+    RECC_DEPS_GLOBAL_PATHS = 1;
+    buildboxcommon::TemporaryDirectory cacheDirectory;
+    RECC_DEPS_CACHE_DIR = cacheDirectory.name();
+
+    // Work on copies of the inputs, whose timestamps the test controls.
+    buildboxcommon::TemporaryDirectory inputDirectory;
+    const std::string directory = inputDirectory.name();
+    std::set<std::string> inputs;
+    for (const std::string name :
+         {"includes_includes_empty.c", "includes_empty.h", "empty.h"}) {
+        const std::string input = directory + "/" + name;
+        buildboxcommon::FileUtils::writeFileAtomically(
+            input,
+            buildboxcommon::FileUtils::getFileContents(name.c_str()));
+        inputs.insert(input);
+    }
+    const auto command = ParsedCommandFactory::createParsedCommand(
+        {RECC_PLATFORM_COMPILER, "-c", "-I" + directory,
+         directory + "/includes_includes_empty.c"});
+    std::set<std::string> dependencies;
+    EXPECT_FALSE(DepsCache::lookup(command, &dependencies));
+
+    // The copies were just written, so the result isn't stored.
+    const auto computed = Deps::get_file_info(command).d_dependencies;
+    for (const auto &input : inputs) {
+        EXPECT_EQ(1, computed.count(input));
+    }
+    EXPECT_FALSE(DepsCache::lookup(command, &dependencies));
+
+    // Writing the modification times also updates the change times, which
+    // can't be set, so the dependencies command is taken to start a minute
+    // from now, when they are old enough.
+    const time_t commandStartTime = time(nullptr) + 60;
+    for (const auto &input : inputs) {
+        setModificationTime(input, commandStartTime - 3600);
+    }
+    inputs.insert(computed.cbegin(), computed.cend());
+
+    // An input modified as the command starts may not be the version the
+    // compiler saw.
+    setModificationTime(directory + "/empty.h", commandStartTime);
+    DepsCache::store(command, inputs, computed, commandStartTime);
+    EXPECT_FALSE(DepsCache::lookup(command, &dependencies));
+
+    setModificationTime(directory + "/empty.h", commandStartTime - 3600);
+    DepsCache::store(command, inputs, computed, commandStartTime);
+    ASSERT_TRUE(DepsCache::lookup(command, &dependencies));
+    EXPECT_EQ(computed, dependencies);
+    EXPECT_EQ(computed, Deps::get_file_info(command).d_dependencies);
+
+    // Results for other settings are cached separately.
+    RECC_DEPS_GLOBAL_PATHS = 0;
+    EXPECT_FALSE(DepsCache::lookup(command, &dependencies));
+    RECC_DEPS_CACHE_DIR = "";
+}
+
 TEST(DepsTest, ClangCrtbegin)
 {
     // clang-format off
@@ -326,6 +405,20 @@ TEST(DepsFromMakeRulesTest, GccStyleMakefile)
     EXPECT_EQ(expected, dependencies);
 }
 
+TEST(DepsFromMakeRulesTest, GccStyleMakefileWithEscapes)
+{
+    std::string makeRules =
+        "sample.o: sample.c dir\\ with\\ spaces/sample.h \\\n"
+        " \\/escaped/slash.h sample.h\n";
+    std::set<std::string> expected = {"sample.c", "dir with spaces/sample.h",
+                                      "/escaped/slash.h", "sample.h"};
+
+    auto dependencies =
+        normalize_all(Deps::dependencies_from_make_rules(makeRules));
+
+    EXPECT_EQ(expected, dependencies);
+}
+
 TEST(DepsFromMakeRulesTest, SunStyleMakefile)
 {
     std::string makeRules = "sample.o : ./sample.c\n"
@@ -355,3 +448,47 @@ TEST(DepsFromMakeRulesTest, LargeMakeOutput)
 
     EXPECT_EQ(expected, dependencies);
 }
+
+// Times the parsing of GCC-style rules listing 4000 headers, a third of them
+// under /usr/include. Run it with `--gtest_also_run_disabled_tests
+// --gtest_filter='*Benchmark*'` in an optimized build.
+TEST(DepsFromMakeRulesTest, DISABLED_Benchmark)
+{
+    const int headers = 4000;
+    const int iterations = 200;
+
+    std::string makeRules = "object.o: object.cpp";
+    for (int i = 0; i < headers; ++i) {
+        makeRules += " \\\n  ";
+        if (i % 3 == 0) {
+            makeRules += "/usr/include/c++/10/bits/";
+        }
+        else {
+            makeRules += "src/component" + std::to_string(i % 50) +
+                         "/include/";
+        }
+        makeRules += "header_" + std::to_string(i) + ".h";
+    }
+    makeRules += "\n";
+
+    for (const bool includeGlobalPaths : {false, true}) {
+        size_t dependencies = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            dependencies += Deps::dependencies_from_make_rules(
+                                makeRules, false, includeGlobalPaths)
+                                .size();
+        }
+        const auto elapsed =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start);
+
+        EXPECT_EQ(static_cast<size_t>(iterations) *
+                      (includeGlobalPaths ? headers + 1 : headers * 2 / 3 + 1),
+                  dependencies);
+        std::cout << makeRules.size() << " bytes, global paths "
+                  << (includeGlobalPaths ? "included" : "excluded") << ": "
+                  << elapsed.count() / iterations << " us per call"
+                  << std::endl;
+    }
+}
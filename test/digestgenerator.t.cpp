@@ -12,14 +12,18 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <buildboxcommon_temporaryfile.h>
 #include <buildboxcommonmetrics_testingutils.h>
 #include <buildboxcommonmetrics_totaldurationmetricvalue.h>
 #include <digestgenerator.h>
 #include <env.h>
 
+#include <algorithm>
 #include <string>
+#include <system_error>
 
 #include <gtest/gtest.h>
+#include <unistd.h>
 
 #define TIMER_NAME_CALCULATE_DIGESTS_TOTAL "recc.calculate_digests_total"
 
@@ -146,3 +150,64 @@ TEST(DigestGeneratorTest, TestStringSha512)
     EXPECT_EQ(d.hash_other(), expected_sha512_hash);
     EXPECT_EQ(d.size_bytes(), TEST_STRING.size());
 }
+
+TEST(DigestGeneratorTest, ContextFedInPiecesMatchesWholeBlob)
+{
+    for (const std::string function : {"SHA256", "BLAKE3ZCC"}) {
+        RECC_CAS_DIGEST_FUNCTION = function;
+        const std::string blob(3 * 1024 * 1024 + 7, 'x');
+
+        DigestContext context;
+        for (size_t i = 0; i < blob.size(); i += 4093) {
+            context.update(blob.data() + i,
+                           std::min<size_t>(4093, blob.size() - i));
+        }
+
+        EXPECT_EQ(context.finalize(), DigestGenerator::make_digest(blob))
+            << function;
+    }
+}
+
+TEST(DigestGeneratorTest, FileMatchesBlob)
+{
+    for (const std::string function : {"SHA256", "BLAKE3ZCC"}) {
+        RECC_CAS_DIGEST_FUNCTION = function;
+        for (const std::string &contents :
+             {std::string(), TEST_STRING, std::string(2 * 1024 * 1024, 'y'),
+              std::string(9 * 1024 * 1024 + 1, 'z')}) {
+            buildboxcommon::TemporaryFile file;
+            ASSERT_EQ(write(file.fd(), contents.data(), contents.size()),
+                      static_cast<ssize_t>(contents.size()));
+
+            // The descriptor's offset is now at the end of the file, which
+            // must not affect the result.
+            EXPECT_EQ(DigestGenerator::make_digest_from_fd(file.fd()),
+                      DigestGenerator::make_digest(contents))
+                << function;
+            EXPECT_EQ(DigestGenerator::make_digest_from_file(file.name()),
+                      DigestGenerator::make_digest(contents))
+                << function;
+        }
+    }
+}
+
+TEST(DigestGeneratorTest, PipeMatchesBlob)
+{
+    RECC_CAS_DIGEST_FUNCTION = "SHA256";
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    ASSERT_EQ(write(fds[1], TEST_STRING.data(), TEST_STRING.size()),
+              static_cast<ssize_t>(TEST_STRING.size()));
+    close(fds[1]);
+
+    EXPECT_EQ(DigestGenerator::make_digest_from_fd(fds[0]),
+              DigestGenerator::make_digest(TEST_STRING));
+    close(fds[0]);
+}
+
+TEST(DigestGeneratorTest, MissingFileThrows)
+{
+    EXPECT_THROW(
+        DigestGenerator::make_digest_from_file("/nonexistent/recc/file"),
+        std::system_error);
+}
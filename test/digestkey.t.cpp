@@ -0,0 +1,90 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <digestkey.h>
+#include <hashtohex.h>
+
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+
+#include <gtest/gtest.h>
+
+using namespace BloombergLP::recc;
+
+namespace {
+proto::Digest makeDigest(const std::string &hash, int64_t size)
+{
+    proto::Digest digest;
+    digest.set_hash_other(hash);
+    digest.set_size_bytes(size);
+    return digest;
+}
+} // namespace
+
+TEST(HashToHexTest, RoundTrip)
+{
+    const unsigned char hash[] = {0x00, 0x0f, 0xa5, 0xff};
+    const auto hex = hashToHex(hash, sizeof(hash));
+    EXPECT_EQ(hex, "000fa5ff");
+
+    uint8_t decoded[sizeof(hash)];
+    size_t length = 0;
+    ASSERT_TRUE(hexToHash(hex, decoded, sizeof(decoded), &length));
+    EXPECT_EQ(length, sizeof(hash));
+    EXPECT_EQ(hashToHex(decoded, sizeof(decoded)), hex);
+}
+
+TEST(HashToHexTest, RejectsInvalidHex)
+{
+    uint8_t decoded[4];
+    size_t length = 0;
+    EXPECT_FALSE(hexToHash("abc", decoded, sizeof(decoded), &length));
+    EXPECT_FALSE(hexToHash("ABCD", decoded, sizeof(decoded), &length));
+    EXPECT_FALSE(hexToHash("0g", decoded, sizeof(decoded), &length));
+    EXPECT_FALSE(hexToHash("0011223344", decoded, sizeof(decoded), &length));
+}
+
+TEST(DigestKeyTest, RoundTrip)
+{
+    const auto digest = makeDigest(
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        0);
+    EXPECT_EQ(DigestKey(digest).to_digest(), digest);
+
+    proto::Digest blake3Digest;
+    blake3Digest.set_hash_blake3zcc(std::string(32, '\x42'));
+    blake3Digest.set_size_bytes(3);
+    EXPECT_EQ(DigestKey(blake3Digest).to_digest(), blake3Digest);
+}
+
+TEST(DigestKeyTest, Equality)
+{
+    const auto digest = makeDigest("0123456789abcdef", 3);
+    std::unordered_set<DigestKey> keys = {digest};
+
+    EXPECT_EQ(keys.count(digest), 1);
+    EXPECT_EQ(keys.count(makeDigest("0123456789abcdef", 4)), 0);
+    EXPECT_EQ(keys.count(makeDigest("0123456789abcdee", 3)), 0);
+    EXPECT_EQ(keys.count(makeDigest("0123456789abcdef00", 3)), 0);
+}
+
+TEST(DigestKeyTest, InvalidHashThrows)
+{
+    EXPECT_THROW(DigestKey(makeDigest("not hex", 1)), std::invalid_argument);
+
+    proto::Digest blake3Digest;
+    blake3Digest.set_hash_blake3zcc("short");
+    EXPECT_THROW(DigestKey{blake3Digest}, std::invalid_argument);
+}
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <env.h>
+#include <reccdefaults.h>
 
 #include <gtest/gtest.h>
 
@@ -80,6 +81,23 @@ TEST_F(EnvTest, EnvSetTest2)
     EXPECT_EQ(expectedExcludePaths, RECC_DEPS_EXCLUDE_PATHS);
 }
 
+TEST_F(EnvTest, PathMatchersFollowConfiguration)
+{
+    const char *testEnviron[] = {"RECC_SERVER=http://server:1234",
+                                 "RECC_PREFIX_MAP=/usr/include=/include",
+                                 "RECC_DEPS_EXCLUDE_PATHS=/opt", nullptr};
+    Env::parse_config_variables(testEnviron);
+    Env::handle_special_defaults();
+    EXPECT_EQ(0u, RECC_PREFIX_REPLACEMENT_MATCHER.find("/usr/include/a.h"));
+    EXPECT_TRUE(RECC_DEPS_EXCLUDE_PATHS_MATCHER.matches("/opt/lib"));
+    EXPECT_FALSE(RECC_DEPS_EXCLUDE_PATHS_MATCHER.matches("/optional"));
+
+    // As between two commands run by reccd.
+    Env::reset_config_variables();
+    EXPECT_FALSE(RECC_PREFIX_REPLACEMENT_MATCHER.matches("/usr/include/a.h"));
+    EXPECT_FALSE(RECC_DEPS_EXCLUDE_PATHS_MATCHER.matches("/opt/lib"));
+}
+
 TEST_F(EnvTest, EnvSetTestWithCAS)
 {
     const char *testEnviron[] = {"RECC_SERVER=http://server:1234",
@@ -199,3 +217,28 @@ TEST_F(EnvTest, EnvTestCacheOnlyForceFalse)
 
     EXPECT_EQ(false, RECC_CACHE_ONLY);
 }
+
+TEST_F(EnvTest, ResetRestoresDefaults)
+{
+    const char *testEnviron[] = {"RECC_SERVER=http://server:1234",
+                                 "RECC_FORCE_REMOTE=1",
+                                 "RECC_DEPS_OVERRIDE=oneitem",
+                                 "RECC_REMOTE_ENV_key=val",
+                                 "RECC_MAX_THREADS=16",
+                                 "TMPDIR=/some/tmp/dir",
+                                 nullptr};
+    Env::parse_config_variables(testEnviron);
+    Env::handle_special_defaults();
+
+    Env::reset_config_variables();
+
+    EXPECT_TRUE(RECC_SERVER.empty());
+    EXPECT_TRUE(RECC_CAS_SERVER.empty());
+    EXPECT_TRUE(RECC_ACTION_CACHE_SERVER.empty());
+    EXPECT_FALSE(RECC_FORCE_REMOTE);
+    EXPECT_TRUE(RECC_DEPS_OVERRIDE.empty());
+    EXPECT_TRUE(RECC_REMOTE_ENV.empty());
+    EXPECT_EQ(DEFAULT_RECC_MAX_THREADS, RECC_MAX_THREADS);
+    EXPECT_EQ(DEFAULT_RECC_TMPDIR, TMPDIR);
+    EXPECT_EQ(DEFAULT_RECC_PROJECT_ROOT, RECC_PROJECT_ROOT);
+}
@@ -0,0 +1,263 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <digestgenerator.h>
+#include <env.h>
+#include <filedigestcache.h>
+
+#include <buildboxcommon_fileutils.h>
+#include <buildboxcommon_temporaryfile.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace BloombergLP::recc;
+
+namespace {
+
+// A `stat()` result for a file last changed long ago.
+struct stat fakeStat(ino_t inode, off_t size = 10)
+{
+    struct stat result;
+    memset(&result, 0, sizeof(result));
+    result.st_dev = 42;
+    result.st_ino = inode;
+    result.st_size = size;
+    result.st_mode = S_IFREG | 0644;
+    result.st_mtim.tv_sec = 1000000000;
+    result.st_mtim.tv_nsec = 123;
+    result.st_ctim = result.st_mtim;
+    return result;
+}
+
+proto::Digest digestFor(ino_t inode, off_t size = 10)
+{
+    return DigestGenerator::make_digest(std::to_string(inode) + "/" +
+                                        std::to_string(size));
+}
+
+// `make_digest()` sets the blob size; the cache must use the file's.
+proto::Digest withSize(proto::Digest digest, off_t size)
+{
+    digest.set_size_bytes(size);
+    return digest;
+}
+
+} // namespace
+
+class FileDigestCacheTest : public ::testing::Test {
+  protected:
+    void SetUp() override { RECC_CAS_DIGEST_FUNCTION = "SHA256"; }
+
+    buildboxcommon::TemporaryDirectory d_directory;
+};
+
+TEST_F(FileDigestCacheTest, StoreThenLookup)
+{
+    FileDigestCache cache(d_directory.name(), 64);
+    const struct stat file = fakeStat(7);
+    const proto::Digest digest = withSize(digestFor(7), file.st_size);
+
+    proto::Digest found;
+    EXPECT_FALSE(cache.lookup(file, &found));
+    cache.store(file, digest);
+    ASSERT_TRUE(cache.lookup(file, &found));
+    EXPECT_EQ(found, digest);
+}
+
+TEST_F(FileDigestCacheTest, Blake3)
+{
+    RECC_CAS_DIGEST_FUNCTION = "BLAKE3ZCC";
+    FileDigestCache cache(d_directory.name(), 64);
+    const struct stat file = fakeStat(7);
+    const proto::Digest digest = withSize(digestFor(7), file.st_size);
+    cache.store(file, digest);
+
+    proto::Digest found;
+    ASSERT_TRUE(cache.lookup(file, &found));
+    EXPECT_EQ(found, digest);
+}
+
+TEST_F(FileDigestCacheTest, ModifiedFileMisses)
+{
+    FileDigestCache cache(d_directory.name(), 64);
+    struct stat file = fakeStat(7);
+    cache.store(file, withSize(digestFor(7), file.st_size));
+
+    proto::Digest found;
+    file.st_mtim.tv_nsec++;
+    EXPECT_FALSE(cache.lookup(file, &found));
+    file = fakeStat(7);
+    file.st_ctim.tv_sec++;
+    EXPECT_FALSE(cache.lookup(file, &found));
+    file = fakeStat(7, 11);
+    EXPECT_FALSE(cache.lookup(file, &found));
+}
+
+TEST_F(FileDigestCacheTest, OtherDigestFunctionMisses)
+{
+    FileDigestCache cache(d_directory.name(), 64);
+    const struct stat file = fakeStat(7);
+    cache.store(file, withSize(digestFor(7), file.st_size));
+
+    RECC_CAS_DIGEST_FUNCTION = "SHA1";
+    proto::Digest found;
+    EXPECT_FALSE(cache.lookup(file, &found));
+}
+
+TEST_F(FileDigestCacheTest, RecentlyModifiedFileNotStored)
+{
+    FileDigestCache cache(d_directory.name(), 64);
+    struct stat file = fakeStat(7);
+    file.st_ctim.tv_sec = time(nullptr);
+    cache.store(file, withSize(digestFor(7), file.st_size));
+
+    proto::Digest found;
+    EXPECT_FALSE(cache.lookup(file, &found));
+}
+
+TEST_F(FileDigestCacheTest, SharedBetweenInstances)
+{
+    const struct stat file = fakeStat(7);
+    const proto::Digest digest = withSize(digestFor(7), file.st_size);
+    {
+        FileDigestCache writer(d_directory.name(), 64);
+        writer.store(file, digest);
+    }
+
+    FileDigestCache reader(d_directory.name(), 64);
+    proto::Digest found;
+    ASSERT_TRUE(reader.lookup(file, &found));
+    EXPECT_EQ(found, digest);
+
+    // A process configured with a different size uses the existing table
+    // rather than replacing it.
+    FileDigestCache otherSize(d_directory.name(), 128);
+    ASSERT_TRUE(otherSize.lookup(file, &found));
+    EXPECT_EQ(found, digest);
+}
+
+TEST_F(FileDigestCacheTest, OtherFormatReplaced)
+{
+    const std::string path =
+        std::string(d_directory.name()) + "/file-digests";
+    buildboxcommon::FileUtils::writeFileAtomically(path,
+                                                   std::string(4096, 'x'));
+
+    const struct stat file = fakeStat(7);
+    const proto::Digest digest = withSize(digestFor(7), file.st_size);
+    {
+        FileDigestCache cache(d_directory.name(), 64);
+        cache.store(file, digest);
+    }
+
+    FileDigestCache reader(d_directory.name(), 64);
+    proto::Digest found;
+    ASSERT_TRUE(reader.lookup(file, &found));
+    EXPECT_EQ(found, digest);
+}
+
+TEST_F(FileDigestCacheTest, ConcurrentlyCreatedTableIsShared)
+{
+    // Processes that find no table at the same time must end up sharing
+    // one, whatever size each of them asks for.
+    const int creators = 8;
+    std::vector<std::unique_ptr<FileDigestCache>> caches(creators);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < creators; ++i) {
+        threads.emplace_back([&, i] {
+            caches[i].reset(new FileDigestCache(
+                d_directory.name(), 64 * static_cast<size_t>(i + 1)));
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < creators; ++i) {
+        const ino_t inode = static_cast<ino_t>(i + 1);
+        caches[i]->store(fakeStat(inode), withSize(digestFor(inode), 10));
+    }
+    for (const auto &cache : caches) {
+        for (int i = 0; i < creators; ++i) {
+            const ino_t inode = static_cast<ino_t>(i + 1);
+            proto::Digest found;
+            ASSERT_TRUE(cache->lookup(fakeStat(inode), &found));
+            EXPECT_EQ(found, withSize(digestFor(inode), 10));
+        }
+    }
+}
+
+TEST_F(FileDigestCacheTest, FullTableEvicts)
+{
+    // A single bucket of eight entries.
+    FileDigestCache cache(d_directory.name(), 8);
+    for (ino_t inode = 1; inode <= 100; ++inode) {
+        cache.store(fakeStat(inode), withSize(digestFor(inode), 10));
+    }
+
+    int hits = 0;
+    for (ino_t inode = 1; inode <= 100; ++inode) {
+        proto::Digest found;
+        if (cache.lookup(fakeStat(inode), &found)) {
+            EXPECT_EQ(found, withSize(digestFor(inode), 10));
+            ++hits;
+        }
+    }
+    EXPECT_EQ(hits, 8);
+}
+
+TEST_F(FileDigestCacheTest, NewVersionReplacesOld)
+{
+    FileDigestCache cache(d_directory.name(), 8);
+    for (off_t size = 1; size <= 100; ++size) {
+        cache.store(fakeStat(7, size), withSize(digestFor(7, size), size));
+    }
+    cache.store(fakeStat(8), withSize(digestFor(8), 10));
+
+    proto::Digest found;
+    ASSERT_TRUE(cache.lookup(fakeStat(7, 100), &found));
+    EXPECT_EQ(found, withSize(digestFor(7, 100), 100));
+    EXPECT_TRUE(cache.lookup(fakeStat(8), &found));
+}
+
+TEST_F(FileDigestCacheTest, ConcurrentReadersSeeWholeEntries)
+{
+    FileDigestCache cache(d_directory.name(), 16);
+    const int threadCount = 4;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&cache, t]() {
+            for (int i = 0; i < 2000; ++i) {
+                const ino_t inode = static_cast<ino_t>((i * 7 + t) % 64);
+                const struct stat file = fakeStat(inode);
+                proto::Digest found;
+                if (cache.lookup(file, &found)) {
+                    EXPECT_EQ(found, withSize(digestFor(inode), 10));
+                }
+                else {
+                    cache.store(file, withSize(digestFor(inode), 10));
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
@@ -15,6 +15,7 @@
 #include <fileutils.h>
 
 #include <env.h>
+#include <pathprefixmatcher.h>
 #include <subprocess.h>
 
 #include <buildboxcommon_temporarydirectory.h>
@@ -111,6 +112,39 @@ TEST(HasPathPrefixesTest, PathTests)
                                            {"/some/dir,withcomma/"}));
 }
 
+TEST(PathPrefixMatcherTest, MatchesLikeHasPathPrefix)
+{
+    const std::vector<std::string> prefixes = {
+        "/a/b", "/a/b/", "a/b", "a", "/", "/a/boo/", "/c", "", "/a/b/c"};
+    const std::vector<std::string> paths = {
+        "/a/b",   "/a/b/",  "/a/b/c", "/a/bc",  "/a/boo", "/a/boo/x",
+        "a/b",    "a/b/c",  "a",      "ab",     "/",      "/c",
+        "/c/d/e", "/d",     "",       "/a/../b"};
+
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        const PathPrefixMatcher matcher(
+            std::vector<std::string>{prefixes[i]});
+        for (const auto &path : paths) {
+            EXPECT_EQ(FileUtils::hasPathPrefix(path, prefixes[i]),
+                      matcher.matches(path))
+                << "path \"" << path << "\", prefix \"" << prefixes[i]
+                << "\"";
+        }
+    }
+
+    const PathPrefixMatcher matcher(prefixes);
+    for (const auto &path : paths) {
+        size_t expected = PathPrefixMatcher::npos;
+        for (size_t i = 0; i < prefixes.size(); ++i) {
+            if (FileUtils::hasPathPrefix(path, prefixes[i])) {
+                expected = i;
+                break;
+            }
+        }
+        EXPECT_EQ(expected, matcher.find(path)) << "path \"" << path << "\"";
+    }
+}
+
 TEST(FileUtilsTest, GetCurrentWorkingDirectory)
 {
     const std::vector<std::string> command = {"pwd"};
@@ -187,6 +221,7 @@ TEST(PathRewriteTest, SimpleRewriting)
 {
     RECC_PREFIX_REPLACEMENT = {{"/hello/hi", "/hello"},
                                {"/usr/bin/system/bin/hello", "/usr/system"}};
+    Env::compile_path_matchers();
     std::string test_path = "/hello/hi/file.txt";
     ASSERT_EQ("/hello/file.txt",
               FileUtils::resolvePathFromPrefixMap(test_path));
@@ -205,6 +240,7 @@ TEST(PathRewriteTest, ComplicatedPathRewriting)
     RECC_PREFIX_REPLACEMENT = {{"/hello/hi", "/hello"},
                                {"/usr/bin/system/bin/hello", "/usr/system"},
                                {"/bin", "/"}};
+    Env::compile_path_matchers();
 
     auto test_path = "/usr/bin/system/bin/hello/world/";
     ASSERT_EQ("/usr/system/world",
@@ -0,0 +1,230 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <deps.h>
+#include <env.h>
+#include <includescanner.h>
+#include <parsedcommandfactory.h>
+
+#include <buildboxcommon_fileutils.h>
+
+#include <gtest/gtest.h>
+
+using namespace BloombergLP::recc;
+
+namespace {
+
+typedef IncludeDirective::Kind Kind;
+
+std::vector<std::string> names(const std::vector<IncludeDirective> &directives)
+{
+    std::vector<std::string> result;
+    for (const auto &directive : directives) {
+        result.push_back(directive.d_name);
+    }
+    return result;
+}
+
+} // namespace
+
+TEST(IncludeScannerTest, ParsesIncludeForms)
+{
+    const auto directives = IncludeScanner::parseDirectives(
+        "#include <a.h>\n"
+        "  #  include \"b.h\" // trailing comment\n"
+        "#include_next <c.h>\n"
+        "#import \"d.h\"\n"
+        "/* comment */ # /* comment */ include <e//f.h>\n"
+        "%:include <g.h>\n"
+        "#inc\\\nlude <h.h>\n"
+        "#include MACRO_HEADER\n");
+
+    ASSERT_EQ(8, directives.size());
+    EXPECT_EQ(std::vector<std::string>({"a.h", "b.h", "c.h", "d.h", "e//f.h",
+                                        "g.h", "h.h", "MACRO_HEADER"}),
+              names(directives));
+    EXPECT_TRUE(directives[0].d_angled);
+    EXPECT_FALSE(directives[1].d_angled);
+    EXPECT_EQ(Kind::INCLUDE_NEXT, directives[2].d_kind);
+    EXPECT_EQ(Kind::INCLUDE, directives[3].d_kind);
+    EXPECT_EQ(Kind::COMPUTED, directives[7].d_kind);
+    for (const auto &directive : directives) {
+        EXPECT_FALSE(directive.d_conditional);
+    }
+}
+
+TEST(IncludeScannerTest, IgnoresCommentsAndLiterals)
+{
+    const auto directives = IncludeScanner::parseDirectives(
+        "/*\n"
+        "#include <comment.h>\n"
+        "*/\n"
+        "const char *s = \"\\\"\n"
+        "#include <after_unterminated.h>\n"
+        "const char *r = R\"x(\n"
+        "#include <raw.h>\n"
+        ")x\";\n"
+        "int i = 1'000; char c = '\"';\n"
+        "#include <real.h>\n"
+        "int j; #include <not_at_line_start.h>\n"
+        "// comment \\\n"
+        "#include <spliced_comment.h>\n");
+
+    EXPECT_EQ(std::vector<std::string>({"after_unterminated.h", "real.h"}),
+              names(directives));
+}
+
+TEST(IncludeScannerTest, FollowsConditionals)
+{
+    const auto directives = IncludeScanner::parseDirectives(
+        "#ifndef GUARD\n"
+        "#define GUARD\n"
+        "#include <guarded.h>\n"
+        "#if 0\n"
+        "#include <if0.h>\n"
+        "#elif defined(X)\n"
+        "#include <elif.h>\n"
+        "#else\n"
+        "#include <else.h>\n"
+        "#endif\n"
+        "#if 1\n"
+        "#include <if1.h>\n"
+        "#else\n"
+        "#include <if1_else.h>\n"
+        "#endif\n"
+        "#ifdef Y\n"
+        "#if 0\n"
+        "#include <nested_if0.h>\n"
+        "#endif\n"
+        "#else\n"
+        "#include <ifdef_else.h>\n"
+        "#endif\n"
+        "#if __has_include(<optional.h>) && __has_include_next(\"next.h\")\n"
+        "#include <optional.h>\n"
+        "#endif\n"
+        "#endif\n");
+
+    EXPECT_EQ(std::vector<std::string>({"guarded.h", "elif.h", "else.h",
+                                        "if1.h", "ifdef_else.h", "optional.h",
+                                        "next.h", "optional.h"}),
+              names(directives));
+
+    EXPECT_FALSE(directives[0].d_conditional);
+    EXPECT_TRUE(directives[1].d_conditional);
+    EXPECT_TRUE(directives[2].d_conditional);
+    EXPECT_TRUE(directives[3].d_conditional);
+    EXPECT_TRUE(directives[4].d_conditional);
+    EXPECT_EQ(Kind::HAS_INCLUDE, directives[5].d_kind);
+    EXPECT_EQ(Kind::HAS_INCLUDE_NEXT, directives[6].d_kind);
+    EXPECT_EQ(Kind::INCLUDE, directives[7].d_kind);
+    EXPECT_TRUE(directives[7].d_conditional);
+}
+
+TEST(IncludeScannerTest, DefinedGuard)
+{
+    const auto directives = IncludeScanner::parseDirectives(
+        "#if !defined(GUARD)\n"
+        "#define GUARD 1\n"
+        "#include <guarded.h>\n"
+        "#endif\n"
+        "#ifndef NOT_A_GUARD\n"
+        "#define OTHER\n"
+        "#include <conditional.h>\n"
+        "#endif\n");
+
+    ASSERT_EQ(2, directives.size());
+    EXPECT_FALSE(directives[0].d_conditional);
+    EXPECT_TRUE(directives[1].d_conditional);
+}
+
+// Set in the top-level CMakeLists.txt depending on the platform.
+#ifdef RECC_PLATFORM_COMPILER
+
+namespace {
+
+std::set<std::string> normalize_all(const std::set<std::string> &paths)
+{
+    std::set<std::string> result;
+    for (const auto &path : paths) {
+        result.insert(buildboxcommon::FileUtils::normalizePath(path.c_str()));
+    }
+    return result;
+}
+
+} // namespace
+
+TEST(IncludeScannerTest, ScanMatchesCompiler)
+{
+    Env::parse_config_variables();
+    RECC_DEPS_SCAN = true;
+    for (const bool globalPaths : {false, true}) {
+        for (const std::string source :
+             {"empty.c", "includes_includes_empty.c", "edge_cases.c",
+              "ctype_include.c"}) {
+            RECC_DEPS_GLOBAL_PATHS = globalPaths;
+            const auto command = ParsedCommandFactory::createParsedCommand(
+                {RECC_PLATFORM_COMPILER, "-c", "-I.", "-Isubdirectory",
+                 source});
+            if (!IncludeScanner::enabled(command)) {
+                continue;
+            }
+
+            std::set<std::string> inputs;
+            std::string output;
+            ASSERT_TRUE(IncludeScanner::scan(command, &inputs, &output))
+                << source;
+
+            RECC_DEPS_SCAN = false;
+            const auto expected =
+                normalize_all(Deps::get_file_info(command).d_dependencies);
+            RECC_DEPS_SCAN = true;
+            const auto scanned =
+                normalize_all(Deps::get_file_info(command).d_dependencies);
+
+            // The scanner follows both branches of conditionals, so it may
+            // find more files than the compiler reads, but never fewer.
+            for (const auto &dependency : expected) {
+                EXPECT_EQ(1, scanned.count(dependency))
+                    << dependency << " included from " << source;
+            }
+            if (!globalPaths) {
+                EXPECT_EQ(expected, scanned);
+            }
+        }
+    }
+}
+
+TEST(IncludeScannerTest, FallsBackForUnsupportedCommands)
+{
+    Env::parse_config_variables();
+    RECC_DEPS_SCAN = true;
+    std::set<std::string> inputs;
+    std::string output;
+
+    EXPECT_FALSE(IncludeScanner::scan(
+        ParsedCommandFactory::createParsedCommand(
+            {RECC_PLATFORM_COMPILER, "-c", "-I.", "missing.c"}),
+        &inputs, &output));
+    EXPECT_FALSE(IncludeScanner::scan(
+        ParsedCommandFactory::createParsedCommand(
+            {RECC_PLATFORM_COMPILER, "-c", "-I-", "empty.c"}),
+        &inputs, &output));
+    // empty.h is only found through -I.
+    EXPECT_FALSE(IncludeScanner::scan(
+        ParsedCommandFactory::createParsedCommand(
+            {RECC_PLATFORM_COMPILER, "-c", "includes_empty.c"}),
+        &inputs, &output));
+}
+
+#endif
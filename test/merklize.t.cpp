@@ -13,9 +13,12 @@
 // limitations under the License.
 
 #include <buildboxcommon_fileutils.h>
+#include <digestgenerator.h>
+#include <directorysnapshot.h>
 #include <env.h>
 #include <fileutils.h>
 
+#include <algorithm>
 #include <gtest/gtest.h>
 #include <map>
 #include <merklize.h>
@@ -23,8 +26,20 @@
 #include <subprocess.h>
 #include <vector>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace BloombergLP::recc;
 
+namespace {
+// Read the file that `fileMap` records for the digest of `file`.
+std::string mappedContents(digest_string_umap *fileMap, const ReccFile &file)
+{
+    return buildboxcommon::FileUtils::getFileContents(
+        (*fileMap)[file.getDigest()].c_str());
+}
+} // namespace
+
 TEST(FileTest, TrivialFile)
 {
     const auto path = "abc.txt";
@@ -52,7 +67,7 @@ TEST(FileTest, ToFilenode)
     proto::Digest d;
     d.set_hash_other("HASH HERE");
     d.set_size_bytes(123);
-    ReccFile file("", "", "", d, true);
+    ReccFile file("", "", d, true);
 
     auto fileNode = file.getFileNode(std::string("file.name"));
 
@@ -79,7 +94,7 @@ TEST(NestedDirectoryTest, TrivialNestedDirectory)
 {
     proto::Digest d;
     d.set_hash_other("DIGESTHERE");
-    ReccFile file("", "", "", d, false);
+    ReccFile file("", "", d, false);
 
     NestedDirectory directory;
     directory.add(std::make_shared<ReccFile>(file), "sample");
@@ -101,11 +116,11 @@ TEST(NestedDirectoryTest, Subdirectories)
 {
     proto::Digest d;
     d.set_hash_other("HASH1");
-    ReccFile file("", "", "", d, true);
+    ReccFile file("", "", d, true);
 
     proto::Digest d2;
     d2.set_hash_other("HASH2");
-    ReccFile file2("", "", "", d2, true);
+    ReccFile file2("", "", d2, true);
 
     NestedDirectory directory;
     directory.add(std::make_shared<ReccFile>(file), "sample");
@@ -218,7 +233,7 @@ TEST(NestedDirectoryTest, AddDirsToExistingNestedDirectory)
 {
     proto::Digest d;
     d.set_hash_other("DIGESTHERE");
-    ReccFile file("", "", "", d, true);
+    ReccFile file("", "", d, true);
 
     NestedDirectory directory;
     directory.add(std::make_shared<ReccFile>(file), "directory/file");
@@ -253,12 +268,14 @@ TEST(NestedDirectoryTest, MakeNestedDirectory)
     EXPECT_EQ(3, nestedDirectory.d_subdirs->size());
     EXPECT_EQ(2, nestedDirectory.d_files.size());
 
-    EXPECT_EQ("abc", fileMap[nestedDirectory.d_files["abc.txt"]->getDigest()]);
+    EXPECT_EQ("abc",
+              mappedContents(&fileMap, *nestedDirectory.d_files["abc.txt"]));
 
     auto subdirectory = &(*nestedDirectory.d_subdirs)["subdir"];
     EXPECT_EQ(0, subdirectory->d_subdirs->size());
     EXPECT_EQ(1, subdirectory->d_files.size());
-    EXPECT_EQ("abc", fileMap[subdirectory->d_files["abc.txt"]->getDigest()]);
+    EXPECT_EQ("abc",
+              mappedContents(&fileMap, *subdirectory->d_files["abc.txt"]));
 }
 
 // Run the same test as above, but with a RECC_WORKING_DIR_PREFIX
@@ -280,12 +297,14 @@ TEST(NestedDirectoryTest, MakeNestedDirectoryWorkDirPrefix)
     EXPECT_EQ(3, subdirectory->d_subdirs->size());
     EXPECT_EQ(2, subdirectory->d_files.size());
 
-    EXPECT_EQ("abc", fileMap[subdirectory->d_files["abc.txt"]->getDigest()]);
+    EXPECT_EQ("abc",
+              mappedContents(&fileMap, *subdirectory->d_files["abc.txt"]));
 
     subdirectory = &(*subdirectory->d_subdirs)["subdir"];
     EXPECT_EQ(0, subdirectory->d_subdirs->size());
     EXPECT_EQ(1, subdirectory->d_files.size());
-    EXPECT_EQ("abc", fileMap[subdirectory->d_files["abc.txt"]->getDigest()]);
+    EXPECT_EQ("abc",
+              mappedContents(&fileMap, *subdirectory->d_files["abc.txt"]));
 
     RECC_WORKING_DIR_PREFIX = old_working_dir_prefix;
 }
@@ -305,7 +324,7 @@ TEST(NestedDirectoryTest, ConsistentDigestRegardlessOfFileOrder)
     std::vector<std::shared_ptr<ReccFile>> files;
     for (int i = 0; i < N; i++) {
         files.push_back(std::make_shared<ReccFile>(
-            ReccFile("", "", "", digests[i], false)));
+            ReccFile("", "", digests[i], false)));
     }
 
     // Create Nested Directory and add everything in-order
@@ -347,9 +366,9 @@ TEST(NestedDirectoryTest, NestedDirectoryDigestsReallyBasedOnFiles)
 
     for (int i = 0; i < N; i++) {
         files_dir1.push_back(std::make_shared<ReccFile>(
-            ReccFile("", "", "", digests1[i], false)));
+            ReccFile("", "", digests1[i], false)));
         files_dir2.push_back(std::make_shared<ReccFile>(
-            ReccFile("", "", "", digests2[i], false)));
+            ReccFile("", "", digests2[i], false)));
     }
 
     // Create Nested Directories and add everything in-order
@@ -371,6 +390,7 @@ TEST(NestedDirectoryTest, NestedDirectoryPathReplacement)
     // Get current working directory
     std::string cwd = FileUtils::getCurrentWorkingDirectory();
     RECC_PREFIX_REPLACEMENT = {{cwd + "/nestdir/nestdir2", cwd + "/hi"}};
+    Env::compile_path_matchers();
     digest_string_umap fileMap;
     auto make_nested_dir = cwd + "/nestdir";
     auto nestedDirectory =
@@ -393,6 +413,7 @@ TEST(NestedDirectoryTest, NestedDirectoryMultipleNestedDirPathReplacement)
     std::string cwd = FileUtils::getCurrentWorkingDirectory();
     RECC_PREFIX_REPLACEMENT = {
         {cwd + "/nestdir/nestdir2/nestdir3", cwd + "/nestdir"}};
+    Env::compile_path_matchers();
     digest_string_umap fileMap;
 
     auto dir_to_use = cwd + "/nestdir";
@@ -416,6 +437,7 @@ TEST(NestedDirectoryTest, NestedDirectoryNotAPrefix)
     std::string cwd = FileUtils::getCurrentWorkingDirectory();
     // not a prefix
     RECC_PREFIX_REPLACEMENT = {{cwd + "/nestdir/nestdir2", "/nestdir/hi"}};
+    Env::compile_path_matchers();
     digest_string_umap fileMap;
     auto nestedDirectory = make_nesteddirectory(cwd.c_str(), &fileMap);
 
@@ -436,6 +458,7 @@ TEST(NestedDirectoryTest, NestedDirectoryAddPrefixReplacement)
 {
     std::string cwd = FileUtils::getCurrentWorkingDirectory();
     RECC_PREFIX_REPLACEMENT = {{"/nestdir/nestdir2/nestdir3", "/nestdir"}};
+    Env::compile_path_matchers();
     digest_string_umap fileMap;
 
     NestedDirectory nestdir;
@@ -466,6 +489,7 @@ TEST(NestedDirectoryTest, TestPrefixOrder)
 
     RECC_PREFIX_REPLACEMENT =
         Env::vector_from_delimited_string(recc_prefix_string);
+    Env::compile_path_matchers();
     std::unordered_map<proto::Digest, std::string> fileMap;
 
     NestedDirectory nestdir;
@@ -495,6 +519,7 @@ TEST(NestedDirectoryTest, TestRootReplacement)
     const auto recc_prefix_string = "/=/hi";
     RECC_PREFIX_REPLACEMENT =
         Env::vector_from_delimited_string(recc_prefix_string);
+    Env::compile_path_matchers();
     const std::vector<std::pair<std::string, std::string>> test_vector = {
         {"/", "/hi"}};
     ASSERT_EQ(RECC_PREFIX_REPLACEMENT, test_vector);
@@ -525,6 +550,7 @@ TEST(NestedDirectoryTest, SymlinkTest)
 {
     // unset explicitly
     RECC_PREFIX_REPLACEMENT = {};
+    Env::compile_path_matchers();
     RECC_PROJECT_ROOT = "";
 
     const std::string cwd =
@@ -546,8 +572,9 @@ TEST(NestedDirectoryTest, SymlinkTest)
 
     ASSERT_EQ(1, subDirectory->d_subdirs->size());
     ASSERT_EQ(1, subDirectory->d_files.size());
-    ASSERT_EQ("regfile data\n",
-              fileMap[subDirectory->d_files["regular_file"]->getDigest()]);
+    ASSERT_EQ(
+        "regfile data\n",
+        mappedContents(&fileMap, *subDirectory->d_files["regular_file"]));
 
     auto subDirectory2 = &(*subDirectory->d_subdirs)[subDir];
     ASSERT_EQ(0, subDirectory2->d_subdirs->size());
@@ -616,3 +643,231 @@ TEST(NestedDirectoryTest, EmptyDirTest)
     const std::vector<std::string> rmCommand = {"rm", "-rf", dirPath};
     Subprocess::execute(rmCommand);
 }
+
+TEST(DirectoryTreeTest, EmptyDirectoryTree)
+{
+    EXPECT_EQ(NestedDirectory().to_digest(), DirectoryTree().to_digest());
+}
+
+TEST(DirectoryTreeTest, SameDigestsAsNestedDirectory)
+{
+    RECC_PREFIX_REPLACEMENT = {};
+    Env::compile_path_matchers();
+
+    std::vector<std::pair<std::string, std::shared_ptr<ReccFile>>> files;
+    const std::vector<std::string> paths = {
+        "b/c/file",  "a.b",       "a/b/file", "a/file",     "/abs/file",
+        "a//double", "a-b/file",  "a/b.c",    "b/c/file",   "a/b/file2",
+        "zz",        "a/b/c/d/e", "A/file",   "a/b/symlink"};
+    for (size_t i = 0; i < paths.size(); i++) {
+        proto::Digest d;
+        d.set_hash_other("HASH" + std::to_string(i));
+        d.set_size_bytes(static_cast<int64_t>(i));
+        const bool symlink = paths[i] == "a/b/symlink";
+        files.emplace_back(paths[i],
+                           std::make_shared<ReccFile>(
+                               "", "", d, i % 2 == 0, symlink, "../target"));
+    }
+    const std::vector<std::string> directories = {"a/b", "empty/dir",
+                                                  "/b/c", "a/b/file"};
+
+    NestedDirectory nestedDirectory;
+    DirectoryTree directoryTree;
+    for (const auto &file : files) {
+        nestedDirectory.add(file.second, file.first.c_str());
+        directoryTree.add(file.second, file.first);
+    }
+    for (const auto &directory : directories) {
+        nestedDirectory.addDirectory(directory.c_str());
+        directoryTree.addDirectory(directory);
+    }
+
+    digest_string_umap nestedDigestMap;
+    digest_string_umap treeDigestMap;
+    EXPECT_EQ(nestedDirectory.to_digest(&nestedDigestMap),
+              directoryTree.to_digest(&treeDigestMap));
+    EXPECT_EQ(nestedDigestMap, treeDigestMap);
+}
+
+TEST(DirectoryTreeTest, DigestMatchesSerializedMessage)
+{
+    proto::Digest fileDigest;
+    fileDigest.set_hash_other("HASH1");
+    fileDigest.set_size_bytes(300);
+    proto::Digest emptyDigest;
+
+    NestedDirectory directory;
+    directory.add(std::make_shared<ReccFile>("", "", fileDigest, true),
+                  "executable", true);
+    directory.add(std::make_shared<ReccFile>("", "", emptyDigest, false),
+                  "empty", true);
+    directory.addSymlink("../target", "link", true);
+    directory.addSymlink("", "dangling", true);
+    directory.addDirectory("subdir", true);
+
+    proto::Directory subdirMessage;
+    proto::Directory message;
+    auto file = message.add_files();
+    file->set_name("empty");
+    *file->mutable_digest() = emptyDigest;
+    file = message.add_files();
+    file->set_name("executable");
+    *file->mutable_digest() = fileDigest;
+    file->set_is_executable(true);
+    auto symlink = message.add_symlinks();
+    symlink->set_name("dangling");
+    symlink = message.add_symlinks();
+    symlink->set_name("link");
+    symlink->set_target("../target");
+    auto subdir = message.add_directories();
+    subdir->set_name("subdir");
+    *subdir->mutable_digest() = DigestGenerator::make_digest(subdirMessage);
+
+    digest_string_umap digestMap;
+    EXPECT_EQ(DigestGenerator::make_digest(message),
+              directory.to_digest(&digestMap));
+    EXPECT_EQ(message.SerializeAsString(),
+              digestMap[DigestGenerator::make_digest(message)]);
+}
+
+TEST(DirectoryTreeTest, ParallelDigestsMatchSerialOnes)
+{
+    DirectoryTree directoryTree;
+    for (int i = 0; i < 2000; i++) {
+        proto::Digest d;
+        d.set_hash_other("HASH" + std::to_string(i));
+        d.set_size_bytes(i);
+        directoryTree.add(std::make_shared<ReccFile>("", "", d, false),
+                          "dir" + std::to_string(i % 5) + "/sub" +
+                              std::to_string(i % 17) + "/file" +
+                              std::to_string(i));
+    }
+
+    const int previousMaxThreads = RECC_MAX_THREADS;
+    RECC_MAX_THREADS = 1;
+    digest_string_umap serialDigestMap;
+    const auto serialDigest = directoryTree.to_digest(&serialDigestMap);
+    RECC_MAX_THREADS = 4;
+    digest_string_umap parallelDigestMap;
+    const auto parallelDigest = directoryTree.to_digest(&parallelDigestMap);
+    RECC_MAX_THREADS = previousMaxThreads;
+
+    EXPECT_EQ(serialDigest, parallelDigest);
+    EXPECT_EQ(serialDigestMap, parallelDigestMap);
+    EXPECT_EQ(1 + 5 + 5 * 17, serialDigestMap.size());
+}
+
+TEST(NestedDirectoryTest, SymlinkLoopThrows)
+{
+    const std::string topDir = "symlinklooptmpdir";
+    buildboxcommon::FileUtils::createDirectory((topDir + "/subdir").c_str());
+    ASSERT_EQ(0, symlink("..", (topDir + "/subdir/parent").c_str()));
+
+    digest_string_umap fileMap;
+    EXPECT_THROW(make_nesteddirectory(topDir.c_str(), &fileMap, true),
+                 std::system_error);
+    // Not following symlinks, the loop is just a symlink.
+    EXPECT_NO_THROW(make_nesteddirectory(topDir.c_str(), &fileMap, false));
+
+    Subprocess::execute({"rm", "-rf", topDir});
+}
+
+TEST(NestedDirectoryTest, UnreadableFilesInManyDirectoriesThrow)
+{
+    // Permissions don't stop root from reading the files.
+    if (geteuid() == 0) {
+        return;
+    }
+
+    // Every directory has subdirectories queued for the pool when reading
+    // one of its files fails, which must not leave them waiting forever.
+    const std::string topDir = "unreadabletmpdir";
+    std::vector<std::string> directories = {topDir};
+    for (size_t i = 0; i < directories.size(); i++) {
+        const std::string directory = directories[i];
+        buildboxcommon::FileUtils::createDirectory(directory.c_str());
+        buildboxcommon::FileUtils::writeFileAtomically(directory + "/file.txt",
+                                                       "contents");
+        const std::string unreadable = directory + "/unreadable.txt";
+        buildboxcommon::FileUtils::writeFileAtomically(unreadable, "contents");
+        ASSERT_EQ(0, chmod(unreadable.c_str(), 0));
+        if (std::count(directory.cbegin(), directory.cend(), '/') < 3) {
+            for (int j = 0; j < 3; j++) {
+                directories.push_back(directory + "/" + std::to_string(j));
+            }
+        }
+    }
+
+    const int previousMaxThreads = RECC_MAX_THREADS;
+    RECC_MAX_THREADS = 4;
+    digest_string_umap fileMap;
+    EXPECT_THROW(make_nesteddirectory(topDir.c_str(), &fileMap, true),
+                 std::system_error);
+    RECC_MAX_THREADS = previousMaxThreads;
+
+    Subprocess::execute({"rm", "-rf", topDir});
+}
+
+TEST(NestedDirectoryTest, SnapshotWalksMatchFullWalks)
+{
+    const std::string topDir = "snapshottmpdir";
+    const std::string snapshotDir = "snapshottmpcache";
+    buildboxcommon::FileUtils::createDirectory((topDir + "/a/b").c_str());
+    buildboxcommon::FileUtils::createDirectory((topDir + "/empty").c_str());
+    buildboxcommon::FileUtils::writeFileAtomically(topDir + "/a/one.txt",
+                                                   "one");
+    buildboxcommon::FileUtils::writeFileAtomically(topDir + "/a/b/two.txt",
+                                                   "two");
+    ASSERT_EQ(0, symlink("one.txt", (topDir + "/a/link").c_str()));
+
+    const auto walk = [&](const std::string &snapshotDirectory,
+                          digest_string_umap *blobs) {
+        RECC_DIRECTORY_SNAPSHOT_DIR = snapshotDirectory;
+        digest_string_umap fileMap;
+        const auto digest =
+            make_nesteddirectory(topDir.c_str(), &fileMap, false)
+                .to_digest(blobs);
+        RECC_DIRECTORY_SNAPSHOT_DIR = "";
+        return digest;
+    };
+
+    digest_string_umap fullBlobs;
+    const auto fullDigest = walk("", &fullBlobs);
+    // The first walk records the snapshot that the second one uses.
+    for (int i = 0; i < 2; i++) {
+        digest_string_umap blobs;
+        EXPECT_EQ(fullDigest, walk(snapshotDir, &blobs));
+        EXPECT_EQ(fullBlobs, blobs);
+    }
+
+    buildboxcommon::FileUtils::writeFileAtomically(topDir + "/a/b/two.txt",
+                                                   "changed");
+    buildboxcommon::FileUtils::writeFileAtomically(topDir + "/a/three.txt",
+                                                   "three");
+    ASSERT_EQ(0, rmdir((topDir + "/empty").c_str()));
+
+    digest_string_umap changedFullBlobs;
+    const auto changedFullDigest = walk("", &changedFullBlobs);
+    EXPECT_NE(fullDigest, changedFullDigest);
+    digest_string_umap changedBlobs;
+    EXPECT_EQ(changedFullDigest, walk(snapshotDir, &changedBlobs));
+    EXPECT_EQ(changedFullBlobs, changedBlobs);
+
+    Subprocess::execute({"rm", "-rf", topDir, snapshotDir});
+}
+
+TEST(StatSignatureTest, RecentChangesAreNotTrusted)
+{
+    struct stat statResult = {};
+    statResult.st_mode = S_IFREG | 0644;
+    statResult.st_mtime = 1000;
+    statResult.st_ctime = 1000;
+    const StatSignature signature(statResult);
+    EXPECT_TRUE(signature.isRecent(1000));
+    EXPECT_TRUE(signature.isRecent(1002));
+    EXPECT_FALSE(signature.isRecent(1003));
+
+    // A change of permissions counts too.
+    statResult.st_ctime = 1010;
+    EXPECT_TRUE(StatSignature(statResult).isRecent(1011));
+}
@@ -391,6 +391,7 @@ TEST(RewriteAbsolutePathsTest, ComplexOptions)
 TEST(ReplacePathTest, SimpleRewrite)
 {
     RECC_PREFIX_REPLACEMENT = {{"/usr/bin/include", "/include"}};
+    Env::compile_path_matchers();
     RECC_PROJECT_ROOT = "/home/nobody/";
 
     const std::vector<std::string> command = {
@@ -421,6 +422,7 @@ TEST(ReplacePathTest, PathInProjectRoot)
     // Path replaced by path in PREFIX_MAP, then if still relative to
     // PROJECT_ROOT Replaced again to be made relative.
     RECC_PREFIX_REPLACEMENT = {{"/home/usr/bin", "/home/bin"}};
+    Env::compile_path_matchers();
     RECC_PROJECT_ROOT = "/home/";
 
     const std::vector<std::string> command = {
@@ -449,6 +451,7 @@ TEST(ReplacePathTest, PathInProjectRoot)
 TEST(ReplacePathTest, SimpleCompilePathReplacement)
 {
     RECC_PREFIX_REPLACEMENT = {{"/home/usr/bin", "/home/bin"}};
+    Env::compile_path_matchers();
     const std::vector<std::string> command = {"gcc", "-c",
                                               "/home/usr/bin/hello.c"};
 
@@ -472,6 +475,7 @@ TEST(ReplacePathTest, ReplaceCompilePathInProjectRoot)
     // Path replaced by path in PREFIX_MAP, then if still relative to
     // PROJECT_ROOT Replaced again to be made relative.
     RECC_PREFIX_REPLACEMENT = {{"/home/usr/bin", "/home/bin"}};
+    Env::compile_path_matchers();
     RECC_PROJECT_ROOT = "/home/";
 
     const std::vector<std::string> command = {
@@ -190,6 +190,7 @@ TEST(PathReplacement, modifyRemotePathUnmodified)
     // rules and can't be made relative, it's returned unmodified
     RECC_PROJECT_ROOT = "/home/nobody/";
     RECC_PREFIX_REPLACEMENT = {{"/home", "/hi"}};
+    Env::compile_path_matchers();
 
     const auto workingDir = "/home";
 
@@ -205,6 +206,7 @@ TEST(PathReplacement, modifyRemotePathPrefixMatch)
     // isn't eligable to be made relative, so it's returned absolute
     RECC_PROJECT_ROOT = "/home/nobody/";
     RECC_PREFIX_REPLACEMENT = {{"/home", "/hi"}};
+    Env::compile_path_matchers();
 
     const auto workingDir = "/home";
 
@@ -220,6 +222,7 @@ TEST(PathReplacement, modifyRemotePathMadeRelative)
     // but can be made relative to RECC_PROJECT_ROOT
     RECC_PROJECT_ROOT = "/other";
     RECC_PREFIX_REPLACEMENT = {{"/home", "/hi"}};
+    Env::compile_path_matchers();
 
     const auto workingDir = "/other";
 
@@ -235,6 +238,7 @@ TEST(PathReplacement, modifyRemotePathPrefixAndRelativeMatch)
     // path can be made relative to RECC_PROJECT_ROOT
     RECC_PROJECT_ROOT = "/home/";
     RECC_PREFIX_REPLACEMENT = {{"/home/nobody/", "/home"}};
+    Env::compile_path_matchers();
 
     const auto workingDir = "/home";
 
@@ -0,0 +1,117 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pathcanonicalizer.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace BloombergLP::recc;
+
+namespace {
+
+PathCanonicalizer makeCanonicalizer()
+{
+    return PathCanonicalizer("/proj/src/sub",
+                             {{"/opt/toolchain", "/proj/toolchain"},
+                              {"/opt/other/", "/usr/other"}},
+                             "/proj");
+}
+
+void expectCanonical(PathCanonicalizer *canonicalizer,
+                     const std::string &path, const std::string &expected,
+                     int expectedParentLevels)
+{
+    const CanonicalPath result = canonicalizer->canonicalize(path);
+    EXPECT_EQ(expected, result.d_path) << "for \"" << path << "\"";
+    EXPECT_EQ(expectedParentLevels, result.d_parentLevels)
+        << "for \"" << path << "\"";
+}
+
+} // namespace
+
+TEST(PathCanonicalizerTest, PathsWithinProjectRootAreMadeRelative)
+{
+    PathCanonicalizer canonicalizer = makeCanonicalizer();
+    expectCanonical(&canonicalizer, "/proj/src/sub/a.h", "a.h", 0);
+    expectCanonical(&canonicalizer, "/proj/src/sub/./dir//b.h", "dir/b.h", 0);
+    expectCanonical(&canonicalizer, "/proj/src/include/c.h", "../include/c.h",
+                    1);
+    expectCanonical(&canonicalizer, "/proj/src/sub/../../x/d.h", "../../x/d.h",
+                    2);
+    expectCanonical(&canonicalizer, "/proj/e.h", "../../e.h", 2);
+}
+
+TEST(PathCanonicalizerTest, PathsOutsideProjectRootStayAbsolute)
+{
+    PathCanonicalizer canonicalizer = makeCanonicalizer();
+    expectCanonical(&canonicalizer, "/usr/include/stdio.h",
+                    "/usr/include/stdio.h", 0);
+    expectCanonical(&canonicalizer, "/usr/include/../lib/x.h", "/usr/lib/x.h",
+                    0);
+    expectCanonical(&canonicalizer, "/projects/a.h", "/projects/a.h", 0);
+    expectCanonical(&canonicalizer, "/a.h", "/a.h", 0);
+}
+
+TEST(PathCanonicalizerTest, PrefixMapIsApplied)
+{
+    PathCanonicalizer canonicalizer = makeCanonicalizer();
+    expectCanonical(&canonicalizer, "/opt/toolchain/include/a.h",
+                    "../../toolchain/include/a.h", 2);
+    expectCanonical(&canonicalizer, "/opt/other/b.h", "/usr/other/b.h", 0);
+    expectCanonical(&canonicalizer, "/opt/toolchainx/c.h",
+                    "/opt/toolchainx/c.h", 0);
+}
+
+TEST(PathCanonicalizerTest, RelativePathsAreNormalized)
+{
+    PathCanonicalizer canonicalizer = makeCanonicalizer();
+    expectCanonical(&canonicalizer, "local/./a.h", "local/a.h", 0);
+    expectCanonical(&canonicalizer, "../b.h", "../b.h", 1);
+    expectCanonical(&canonicalizer, "x/../../../c.h", "../../c.h", 2);
+    expectCanonical(&canonicalizer, "d.h", "d.h", 0);
+}
+
+TEST(PathCanonicalizerTest, DirectoriesAreProcessedOnce)
+{
+    PathCanonicalizer canonicalizer = makeCanonicalizer();
+    for (const std::string name : {"a.h", "b.h", "c.h", "d.h"}) {
+        expectCanonical(&canonicalizer, "/proj/src/include/" + name,
+                        "../include/" + name, 1);
+    }
+    EXPECT_EQ(1, canonicalizer.directoriesProcessed());
+}
+
+TEST(PathCanonicalizerTest, EntriesMatchingWholePathsAreNotShortcut)
+{
+    // The entry itself is an ancestor of the working directory, the project
+    // root or a key of the prefix map.
+    PathCanonicalizer canonicalizer(
+        "/proj/src/sub", {{"/usr/include/special.h", "/usr/proj/s.h"}},
+        "/usr/proj");
+    expectCanonical(&canonicalizer, "/usr/include/stdio.h",
+                    "/usr/include/stdio.h", 0);
+    expectCanonical(&canonicalizer, "/usr/include/special.h",
+                    "../../../usr/proj/s.h", 3);
+    expectCanonical(&canonicalizer, "/usr/projx", "/usr/projx", 0);
+    expectCanonical(&canonicalizer, "/usr/proj", "../../../usr/proj", 3);
+
+    PathCanonicalizer withinRoot("/proj/src/sub", {}, "/");
+    expectCanonical(&withinRoot, "/proj/x", "../../x", 2);
+    expectCanonical(&withinRoot, "/proj/src", "..", 1);
+    expectCanonical(&withinRoot, "/proj/src/sub", ".", 0);
+}
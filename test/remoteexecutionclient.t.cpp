@@ -83,6 +83,7 @@ class RemoteExecutionClientTestFixture : public ::testing::Test {
         : executionStub(std::make_shared<proto::MockExecutionStub>()),
           casStub(
               std::make_shared<proto::MockContentAddressableStorageStub>()),
+          casCapabilitiesStub(std::make_shared<proto::MockCapabilitiesStub>()),
           actionCacheStub(std::make_shared<proto::MockActionCacheStub>()),
           operationsStub(
               std::make_shared<google::longrunning::MockOperationsStub>()),
@@ -160,6 +161,22 @@ class RemoteExecutionClientTestFixture : public ::testing::Test {
     }
 
     ~RemoteExecutionClientTestFixture() {}
+
+    // Let the client batch its reads by telling it the server's limits.
+    void setUpServerCapabilities()
+    {
+        proto::ServerCapabilities serverCapabilities;
+        auto cacheCapabilities =
+            serverCapabilities.mutable_cache_capabilities();
+        for (const auto &entry :
+             DigestGenerator::stringToDigestFunctionMap()) {
+            cacheCapabilities->add_digest_function(entry.second);
+        }
+        EXPECT_CALL(*casCapabilitiesStub, GetCapabilities(_, _, _))
+            .WillOnce(DoAll(SetArgPointee<2>(serverCapabilities),
+                            Return(grpc::Status::OK)));
+        client.setUpFromServerCapabilities();
+    }
 };
 
 MATCHER_P(MessageEq, expected, "")
@@ -259,26 +276,24 @@ TEST_F(RemoteExecutionClientTestFixture, WriteFilesToDisk)
     buildboxcommon::TemporaryDirectory tempDir;
 
     ActionResult testResult;
-    proto::Digest d;
-    d.set_hash_other("Test file hash");
-    d.set_size_bytes(18);
+    const proto::Digest d =
+        DigestGenerator::make_digest("Test file content!");
     auto testFile = OutputBlob(std::string(), d, true);
     testResult.d_outputFiles["test.txt"] = testFile;
 
-    // Allow the client to fetch the file from CAS.
-    google::bytestream::ReadRequest expectedByteStreamRequest;
-    expectedByteStreamRequest.set_resource_name(
-        "blobs/" + testFile.d_digest.hash_other() + "/" +
-        std::to_string(testFile.d_digest.size_bytes()));
-    google::bytestream::ReadResponse readResponse;
-    readResponse.set_data("Test file content!");
-    EXPECT_CALL(*byteStreamStub,
-                ReadRaw(_, MessageEq(expectedByteStreamRequest)))
-        .WillOnce(Return(reader));
-    EXPECT_CALL(*reader, Read(_))
-        .WillOnce(DoAll(SetArgPointee<0>(readResponse), Return(true)))
-        .WillOnce(Return(false));
-    EXPECT_CALL(*reader, Finish()).WillOnce(Return(grpc::Status::OK));
+    // Allow the client to fetch the file from CAS, in a batch since it's
+    // small.
+    setUpServerCapabilities();
+    proto::BatchReadBlobsRequest expectedBatchRequest;
+    *expectedBatchRequest.add_digests() = d;
+    proto::BatchReadBlobsResponse batchResponse;
+    auto blobResponse = batchResponse.add_responses();
+    *blobResponse->mutable_digest() = d;
+    blobResponse->set_data("Test file content!");
+    EXPECT_CALL(*casStub,
+                BatchReadBlobs(_, MessageEq(expectedBatchRequest), _))
+        .WillOnce(
+            DoAll(SetArgPointee<2>(batchResponse), Return(grpc::Status::OK)));
 
     client.write_files_to_disk(testResult, tempDir.name());
 
@@ -293,26 +308,24 @@ TEST_F(RemoteExecutionClientTestFixture, VerifyMetricsWriteFilesToDisk)
     buildboxcommon::TemporaryDirectory tempDir;
 
     ActionResult testResult;
-    proto::Digest d;
-    d.set_hash_other("Test file hash");
-    d.set_size_bytes(18);
+    const proto::Digest d =
+        DigestGenerator::make_digest("Test file content!");
     auto testFile = OutputBlob(std::string(), d, true);
     testResult.d_outputFiles["test.txt"] = testFile;
 
-    // Allow the client to fetch the file from CAS.
-    google::bytestream::ReadRequest expectedByteStreamRequest;
-    expectedByteStreamRequest.set_resource_name(
-        "blobs/" + testFile.d_digest.hash_other() + "/" +
-        std::to_string(testFile.d_digest.size_bytes()));
-    google::bytestream::ReadResponse readResponse;
-    readResponse.set_data("Test file content!");
-    EXPECT_CALL(*byteStreamStub,
-                ReadRaw(_, MessageEq(expectedByteStreamRequest)))
-        .WillOnce(Return(reader));
-    EXPECT_CALL(*reader, Read(_))
-        .WillOnce(DoAll(SetArgPointee<0>(readResponse), Return(true)))
-        .WillOnce(Return(false));
-    EXPECT_CALL(*reader, Finish()).WillOnce(Return(grpc::Status::OK));
+    // Allow the client to fetch the file from CAS, in a batch since it's
+    // small.
+    setUpServerCapabilities();
+    proto::BatchReadBlobsRequest expectedBatchRequest;
+    *expectedBatchRequest.add_digests() = d;
+    proto::BatchReadBlobsResponse batchResponse;
+    auto blobResponse = batchResponse.add_responses();
+    *blobResponse->mutable_digest() = d;
+    blobResponse->set_data("Test file content!");
+    EXPECT_CALL(*casStub,
+                BatchReadBlobs(_, MessageEq(expectedBatchRequest), _))
+        .WillOnce(
+            DoAll(SetArgPointee<2>(batchResponse), Return(grpc::Status::OK)));
 
     client.write_files_to_disk(testResult, tempDir.name());
     EXPECT_TRUE(
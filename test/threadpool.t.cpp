@@ -0,0 +1,165 @@
+// Copyright 2020 Bloomberg Finance L.P
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <env.h>
+#include <threadpool.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace BloombergLP::recc;
+
+TEST(ThreadPoolTest, SubmitReturnsResult)
+{
+    ThreadPool pool(2);
+    auto future = pool.submit([] { return 42; });
+    EXPECT_EQ(pool.wait(future), 42);
+}
+
+TEST(ThreadPoolTest, SubmitPropagatesException)
+{
+    ThreadPool pool(2);
+    auto future = pool.submit([]() -> int { throw std::runtime_error("x"); });
+    EXPECT_THROW(pool.wait(future), std::runtime_error);
+}
+
+TEST(ThreadPoolTest, NestedTasksDontExhaustPool)
+{
+    // Every task waits for another one, which only works if waiting threads
+    // run queued tasks themselves.
+    ThreadPool pool(1);
+    auto outer = pool.submit([&pool] {
+        auto inner = pool.submit([] { return 1; });
+        return pool.wait(inner) + 1;
+    });
+    EXPECT_EQ(pool.wait(outer), 2);
+}
+
+TEST(ThreadPoolTest, ParallelRunsEveryJobOnce)
+{
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> runs(1000);
+    for (auto &count : runs) {
+        count = 0;
+    }
+
+    pool.parallel(
+        runs.size(), [&runs](size_t i) { runs[i]++; }, 8);
+
+    for (const auto &count : runs) {
+        EXPECT_EQ(count, 1);
+    }
+}
+
+TEST(ThreadPoolTest, ParallelRethrowsAfterAllJobs)
+{
+    ThreadPool pool(4);
+    std::atomic<int> runs(0);
+
+    EXPECT_THROW(pool.parallel(
+                     100,
+                     [&runs](size_t i) {
+                         runs++;
+                         if (i == 3) {
+                             throw std::runtime_error("job failed");
+                         }
+                     },
+                     4),
+                 std::runtime_error);
+    EXPECT_EQ(runs, 100);
+}
+
+TEST(ThreadPoolTest, TaskGroupWaitsForAllTasks)
+{
+    ThreadPool pool(2);
+    std::atomic<int> runs(0);
+    {
+        TaskGroup group(&pool);
+        for (int i = 0; i < 50; ++i) {
+            group.submit([&runs] { runs++; });
+        }
+    }
+    EXPECT_EQ(runs, 50);
+    EXPECT_GT(pool.stats().d_tasksRun, 0);
+}
+
+TEST(ThreadPoolTest, InstanceFollowsMaxThreads)
+{
+    const int previousMaxThreads = RECC_MAX_THREADS;
+
+    RECC_MAX_THREADS = 2;
+    ThreadPool &pool = ThreadPool::instance();
+    EXPECT_EQ(pool.size(), 2u);
+    auto future = pool.submit([] { return 1; });
+    EXPECT_EQ(pool.wait(future), 1);
+
+    // As between two commands run by a reccd worker.
+    RECC_MAX_THREADS = 3;
+    EXPECT_EQ(ThreadPool::instance().size(), 3u);
+
+    RECC_MAX_THREADS = previousMaxThreads;
+}
+
+TEST(ThreadPoolTest, ReplacedInstanceCanBeUsedByItsTasks)
+{
+    const int previousMaxThreads = RECC_MAX_THREADS;
+
+    RECC_MAX_THREADS = 2;
+    ThreadPool &oldPool = ThreadPool::instance();
+    std::promise<void> replacing;
+    std::shared_future<void> replacingFuture = replacing.get_future().share();
+    std::atomic<bool> taskDone(false);
+    oldPool.submit([replacingFuture, &taskDone] {
+        replacingFuture.wait();
+        // Let the old pool start waiting for this task.
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ThreadPool::instance();
+        taskDone = true;
+    });
+
+    RECC_MAX_THREADS = 3;
+    replacing.set_value();
+    EXPECT_EQ(ThreadPool::instance().size(), 3u);
+    // The old pool is gone, so its task has finished.
+    EXPECT_TRUE(taskDone);
+
+    RECC_MAX_THREADS = previousMaxThreads;
+}
+
+TEST(ThreadPoolTest, UploadInstanceFollowsUploadLimits)
+{
+    const int previousMaxThreads = RECC_MAX_THREADS;
+    const int previousBatchUploads = RECC_MAX_CONCURRENT_BATCH_UPLOADS;
+    const int previousStreamUploads = RECC_MAX_CONCURRENT_STREAM_UPLOADS;
+
+    RECC_MAX_THREADS = 1;
+    RECC_MAX_CONCURRENT_BATCH_UPLOADS = 3;
+    RECC_MAX_CONCURRENT_STREAM_UPLOADS = 2;
+    EXPECT_EQ(ThreadPool::uploadInstance().size(), 5u);
+    EXPECT_EQ(ThreadPool::instance().size(), 1u);
+    EXPECT_NE(&ThreadPool::uploadInstance(), &ThreadPool::instance());
+
+    RECC_MAX_CONCURRENT_STREAM_UPLOADS = 4;
+    EXPECT_EQ(ThreadPool::uploadInstance().size(), 7u);
+
+    RECC_MAX_THREADS = previousMaxThreads;
+    RECC_MAX_CONCURRENT_BATCH_UPLOADS = previousBatchUploads;
+    RECC_MAX_CONCURRENT_STREAM_UPLOADS = previousStreamUploads;
+}